@@ -47,6 +47,7 @@
 #include "shared/cairo-util.h"
 #include "shared/config-parser.h"
 #include "shared/helpers.h"
+#include "shared/image-loader.h"
 #include "shared/xalloc.h"
 #include "shared/zalloc.h"
 
@@ -54,6 +55,9 @@
 
 #define DEFAULT_CLOCK_FORMAT CLOCK_FORMAT_MINUTES
 
+/* Room for a couple of 8K backgrounds. */
+#define IMAGE_CACHE_SIZE (256 * 1024 * 1024)
+
 extern char **environ; /* defined by libc */
 
 enum clock_format {
@@ -1417,6 +1421,10 @@ int main(int argc, char *argv[])
 	parse_panel_position(&desktop, s);
 	parse_clock_format(&desktop, s);
 
+	/* Every output draws the same background image, and draws it
+	 * again on each resize; decode it only once. */
+	image_loader_set_cache_size(IMAGE_CACHE_SIZE);
+
 	desktop.display = display_create(&argc, argv);
 	if (desktop.display == NULL) {
 		fprintf(stderr, "failed to create display: %m\n");
@@ -40,12 +40,17 @@
 #include <locale.h>
 #include <errno.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <linux/input.h>
 
 #include <wayland-client.h>
 
 #include "shared/config-parser.h"
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "shared/xalloc.h"
 #include "window.h"
 
@@ -55,6 +60,8 @@ static char *option_font;
 static int option_font_size;
 static char *option_term;
 static char *option_shell;
+static int option_scrollback_lines;
+static int option_benchmark;
 
 static struct wl_list terminal_list;
 
@@ -89,6 +96,11 @@ terminal_run(struct terminal *terminal, const char *path);
 #define MAX_RESPONSE		256
 #define MAX_ESCAPE		255
 
+/* Lines in the scrollback ring, including the visible ones. The ring
+ * starts small and doubles as it fills, up to scrollback-lines. */
+#define MIN_BUFFER_HEIGHT	256
+#define MAX_BUFFER_HEIGHT	(1 << 20)
+
 /* Terminal modes */
 #define MODE_SHOW_CURSOR	0x00000001
 #define MODE_INVERSE		0x00000002
@@ -430,6 +442,13 @@ enum {
 	SELECT_LINE
 };
 
+/* Per visible row state of the rendered grid, see terminal::dirty */
+enum {
+	ROW_CLEAN = 0,
+	ROW_MOVED,	/* moved by a scroll, needs damage but no painting */
+	ROW_DIRTY	/* needs painting */
+};
+
 struct terminal {
 	struct window *window;
 	struct widget *widget;
@@ -451,7 +470,7 @@ struct terminal {
 	keyboard_mode key_mode;
 	int data_pitch, attr_pitch;  /* The width in bytes of a line */
 	int width, height, row, column, max_width;
-	uint32_t buffer_height;
+	uint32_t buffer_height, max_buffer_height;
 	uint32_t start, end, saved_start, log_size;
 	wl_fixed_t smooth_scroll;
 	int saved_row, saved_column;
@@ -474,6 +493,15 @@ struct terminal {
 	uint32_t hide_cursor_serial;
 	int size_in_title;
 
+	/* The cell grid as last rendered, in buffer pixels. Only rows
+	 * marked in dirty are painted again; scrolls move the pixels. */
+	cairo_surface_t *cache;
+	char *dirty;
+	int scroll_top, scroll_bottom, scroll_pending;
+	int drawn_row, drawn_column, drawn_cursor, drawn_inverse;
+	int drawn_selection_start_row, drawn_selection_start_col;
+	int drawn_selection_end_row, drawn_selection_end_col;
+
 	struct wl_data_source *selection;
 	uint32_t click_time;
 	int dragging, click_count;
@@ -575,6 +603,61 @@ terminal_get_attr_row(struct terminal *terminal, int row)
 	return (void *) terminal->data_attr + index * terminal->attr_pitch;
 }
 
+/*
+ * Double the size of the scrollback ring. Lines live in the slot given
+ * by their line number modulo the ring size, so each of the old slots
+ * is copied to where its line belongs in the bigger ring.
+ */
+static void
+terminal_grow_buffer(struct terminal *terminal)
+{
+	uint32_t old_height = terminal->buffer_height;
+	uint32_t height = old_height * 2;
+	uint32_t bottom, line;
+	char *data, *data_attr;
+	char *old_data = (char *) terminal->data;
+	char *old_data_attr = (char *) terminal->data_attr;
+
+	data = xzalloc(terminal->data_pitch * height);
+	data_attr = xmalloc(terminal->attr_pitch * height);
+	attr_init((struct attr *) data_attr, terminal->curr_attr,
+		  terminal->max_width * height);
+
+	/* the old ring ends with the last row of the live screen */
+	bottom = terminal->start;
+	if (terminal->scrolling &&
+	    (int32_t) (terminal->saved_start - terminal->start) > 0)
+		bottom = terminal->saved_start;
+	bottom += terminal->height;
+
+	for (line = bottom - old_height; line != bottom; line++) {
+		memcpy(data + (line & (height - 1)) * terminal->data_pitch,
+		       old_data + (line & (old_height - 1)) * terminal->data_pitch,
+		       terminal->data_pitch);
+		memcpy(data_attr + (line & (height - 1)) * terminal->attr_pitch,
+		       old_data_attr +
+		       (line & (old_height - 1)) * terminal->attr_pitch,
+		       terminal->attr_pitch);
+	}
+
+	free(terminal->data);
+	free(terminal->data_attr);
+	terminal->data = (union utf8_char *) data;
+	terminal->data_attr = (struct attr *) data_attr;
+	terminal->buffer_height = height;
+}
+
+/* Extend the log up to the cursor row after writing to it. */
+static void
+terminal_update_log(struct terminal *terminal)
+{
+	if (terminal->row + terminal->start + 1 > terminal->end)
+		terminal->end = terminal->row + terminal->start + 1;
+	if (terminal->log_size < terminal->buffer_height)
+		terminal->log_size = MIN(terminal->end,
+					 terminal->buffer_height);
+}
+
 union decoded_attr {
 	struct attr attr;
 	uint32_t key;
@@ -629,13 +712,122 @@ terminal_decode_attr(struct terminal *terminal, int row, int col,
 	decoded->attr.a = attr.a;
 }
 
+static void
+terminal_damage_rows(struct terminal *terminal, int first, int last)
+{
+	if (first < 0)
+		first = 0;
+	if (last >= terminal->height)
+		last = terminal->height - 1;
+	if (first <= last)
+		memset(&terminal->dirty[first], ROW_DIRTY, last - first + 1);
+}
+
+static void
+terminal_damage_all(struct terminal *terminal)
+{
+	terminal_damage_rows(terminal, 0, terminal->height - 1);
+}
+
+/* Move the cached pixels of the pending scroll. */
+static void
+terminal_flush_scroll(struct terminal *terminal)
+{
+	int d = terminal->scroll_pending;
+	int top = terminal->scroll_top, bottom = terminal->scroll_bottom;
+	int n = bottom - top + 1;
+	int cell, stride, i;
+	unsigned char *data;
+
+	terminal->scroll_pending = 0;
+	if (!terminal->cache || d == 0 || d >= n || -d >= n)
+		return;
+
+	cairo_surface_flush(terminal->cache);
+	data = cairo_image_surface_get_data(terminal->cache);
+	stride = cairo_image_surface_get_stride(terminal->cache);
+	cell = cairo_image_surface_get_height(terminal->cache) /
+		terminal->height * stride;
+
+	if (d > 0)
+		memmove(data + top * cell, data + (top + d) * cell,
+			(n - d) * cell);
+	else
+		memmove(data + (top - d) * cell, data + top * cell,
+			(n + d) * cell);
+	cairo_surface_mark_dirty(terminal->cache);
+
+	for (i = top; i <= bottom; i++)
+		if (terminal->dirty[i] == ROW_CLEAN)
+			terminal->dirty[i] = ROW_MOVED;
+}
+
+/*
+ * Rows top to bottom moved up by d, or down if d is negative. The
+ * rendered rows are moved along on the next redraw, so a burst of
+ * scrolls costs a single copy and only the rows scrolled in are painted.
+ */
+static void
+terminal_damage_scroll(struct terminal *terminal, int top, int bottom, int d)
+{
+	int n = bottom - top + 1;
+	int start_row, end_row;
+
+	if (terminal->scroll_pending &&
+	    (terminal->scroll_top != top || terminal->scroll_bottom != bottom))
+		terminal_flush_scroll(terminal);
+
+	terminal->scroll_top = top;
+	terminal->scroll_bottom = bottom;
+	terminal->scroll_pending += d;
+
+	if (d >= n || -d >= n) {
+		terminal_damage_rows(terminal, top, bottom);
+	} else if (d > 0) {
+		memmove(&terminal->dirty[top], &terminal->dirty[top + d], n - d);
+		terminal_damage_rows(terminal, bottom - d + 1, bottom);
+	} else if (d < 0) {
+		memmove(&terminal->dirty[top - d], &terminal->dirty[top], n + d);
+		terminal_damage_rows(terminal, top, top - d - 1);
+	}
+
+	/* The cursor and selection drawn in the moved rows move too. */
+	if (terminal->drawn_row >= top && terminal->drawn_row <= bottom) {
+		terminal->drawn_row -= d;
+		if (terminal->drawn_row < top || terminal->drawn_row > bottom)
+			terminal->drawn_cursor = 0;
+	}
+
+	if (top == 0 && bottom == terminal->height - 1) {
+		/* the selection itself scrolls with the whole screen */
+		terminal->drawn_selection_start_row -= d;
+		terminal->drawn_selection_end_row -= d;
+	} else {
+		start_row = terminal->drawn_selection_start_row;
+		end_row = terminal->drawn_selection_end_row;
+		terminal_damage_rows(terminal, MAX(start_row, top),
+				     MIN(end_row, bottom));
+		terminal_damage_rows(terminal, MAX(start_row - d, top),
+				     MIN(end_row - d, bottom));
+	}
+}
+
 
 static void
 terminal_scroll_buffer(struct terminal *terminal, int d)
 {
 	int i;
 
+	/* Grow the ring rather than overwrite the oldest lines. */
+	while (d > 0 &&
+	       terminal->buffer_height < terminal->max_buffer_height &&
+	       (int32_t) (terminal->start + d + terminal->height -
+			  (terminal->end - terminal->log_size)) >
+	       (int32_t) terminal->buffer_height)
+		terminal_grow_buffer(terminal);
+
 	terminal->start += d;
+	terminal_damage_scroll(terminal, 0, terminal->height - 1, d);
 	if (d < 0) {
 		d = 0 - d;
 		for (i = 0; i < d; i++) {
@@ -665,6 +857,8 @@ terminal_scroll_window(struct terminal *terminal, int d)
 	// scrolling range is inclusive
 	window_height = terminal->margin_bottom - terminal->margin_top + 1;
 	d = d % (window_height + 1);
+	terminal_damage_scroll(terminal, terminal->margin_top,
+			       terminal->margin_bottom, d);
 	if (d < 0) {
 		d = 0 - d;
 		to_row = terminal->margin_bottom;
@@ -720,6 +914,7 @@ terminal_shift_line(struct terminal *terminal, int d)
 
 	row = terminal_get_row(terminal, terminal->row);
 	attr_row = terminal_get_attr_row(terminal, terminal->row);
+	terminal_damage_rows(terminal, terminal->row, terminal->row);
 
 	if ((terminal->width + d) <= terminal->column)
 		d = terminal->column + 1 - terminal->width;
@@ -758,6 +953,13 @@ terminal_resize_cells(struct terminal *terminal,
 	struct rectangle allocation;
 	struct winsize ws;
 
+	while (uheight > terminal->buffer_height &&
+	       terminal->buffer_height < terminal->max_buffer_height) {
+		if (terminal->data)
+			terminal_grow_buffer(terminal);
+		else
+			terminal->buffer_height *= 2;
+	}
 	if (uheight > terminal->buffer_height)
 		height = terminal->buffer_height;
 
@@ -816,6 +1018,11 @@ terminal_resize_cells(struct terminal *terminal,
 			free(terminal->data);
 			free(terminal->data_attr);
 			free(terminal->tab_ruler);
+
+			/* the scrollback is not carried over */
+			terminal->end = total_rows;
+			terminal->log_size = total_rows;
+			terminal->scrolling = 0;
 		}
 
 		terminal->data_pitch = data_pitch;
@@ -832,6 +1039,14 @@ terminal_resize_cells(struct terminal *terminal,
 	terminal->height = height;
 	terminal_init_tabs(terminal);
 
+	terminal->dirty = xrealloc(terminal->dirty, height);
+	if (terminal->cache) {
+		cairo_surface_destroy(terminal->cache);
+		terminal->cache = NULL;
+	}
+	terminal->scroll_pending = 0;
+	terminal_damage_all(terminal);
+
 	/* Update the window size */
 	ws.ws_row = terminal->height;
 	ws.ws_col = terminal->width;
@@ -1037,130 +1252,259 @@ glyph_run_add(struct glyph_run *run, int x, int y, union utf8_char *c)
 
 
 static void
-redraw_handler(struct widget *widget, void *data)
+terminal_draw_row(struct terminal *terminal, cairo_t *cr, int row)
 {
-	struct terminal *terminal = data;
-	struct rectangle allocation;
-	cairo_t *cr;
-	int top_margin, side_margin;
-	int row, col, cursor_x, cursor_y;
 	union utf8_char *p_row;
 	union decoded_attr attr;
+	struct glyph_run run;
+	double average_width = terminal->average_width;
+	double cell_height = terminal->extents.height;
+	int border = terminal->color_scheme->border;
+	int col, start, bg, span_bg, wide_bg;
 	int text_x, text_y;
-	cairo_surface_t *surface;
 	double d;
-	struct glyph_run run;
-	cairo_font_extents_t extents;
-	double average_width;
-	double unichar_width;
 
-	surface = window_get_surface(terminal->window);
-	widget_get_allocation(terminal->widget, &allocation);
-	cr = widget_cairo_create(terminal->widget);
-	cairo_rectangle(cr, allocation.x, allocation.y,
-			allocation.width, allocation.height);
+	p_row = terminal_get_row(terminal, row);
+
+	cairo_save(cr);
+	cairo_rectangle(cr, 0, row * cell_height,
+			terminal->width * average_width, cell_height);
 	cairo_clip(cr);
-	cairo_push_group(cr);
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-	terminal_set_color(terminal, cr, terminal->color_scheme->border);
+	terminal_set_color(terminal, cr, border);
 	cairo_paint(cr);
 
-	cairo_set_scaled_font(cr, terminal->font_normal);
-
-	extents = terminal->extents;
-	average_width = terminal->average_width;
-	side_margin = (allocation.width - terminal->width * average_width) / 2;
-	top_margin = (allocation.height - terminal->height * extents.height) / 2;
-
-	cairo_set_line_width(cr, 1.0);
-	cairo_translate(cr, allocation.x + side_margin,
-			allocation.y + top_margin);
-	/* paint the background */
-	for (row = 0; row < terminal->height; row++) {
-		p_row = terminal_get_row(terminal, row);
-		for (col = 0; col < terminal->width; col++) {
+	/* paint the background, one rectangle per run of equal color */
+	start = 0;
+	span_bg = border;
+	wide_bg = border;
+	for (col = 0; col <= terminal->width; col++) {
+		if (col < terminal->width) {
 			/* get the attributes for this character cell */
 			terminal_decode_attr(terminal, row, col, &attr);
+			bg = attr.attr.bg;
 
-			if (attr.attr.bg == terminal->color_scheme->border)
-				continue;
+			/* a wide character's background also covers the
+			 * placeholder cell after it */
+			if (bg == border)
+				bg = wide_bg;
+			wide_bg = is_wide(p_row[col]) ? bg : border;
+		} else {
+			bg = -1;
+		}
 
-			if (is_wide(p_row[col]))
-				unichar_width = 2 * average_width;
-			else
-				unichar_width = average_width;
-
-			terminal_set_color(terminal, cr, attr.attr.bg);
-			cairo_move_to(cr, col * average_width,
-				      row * extents.height);
-			cairo_rel_line_to(cr, unichar_width, 0);
-			cairo_rel_line_to(cr, 0, extents.height);
-			cairo_rel_line_to(cr, -unichar_width, 0);
-			cairo_close_path(cr);
+		if (bg == span_bg)
+			continue;
+
+		if (span_bg != border) {
+			terminal_set_color(terminal, cr, span_bg);
+			cairo_rectangle(cr, start * average_width,
+					row * cell_height,
+					(col - start) * average_width,
+					cell_height);
 			cairo_fill(cr);
 		}
+		start = col;
+		span_bg = bg;
 	}
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 
 	/* paint the foreground */
 	glyph_run_init(&run, terminal, cr);
-	for (row = 0; row < terminal->height; row++) {
-		p_row = terminal_get_row(terminal, row);
-		for (col = 0; col < terminal->width; col++) {
-			/* get the attributes for this character cell */
-			terminal_decode_attr(terminal, row, col, &attr);
-
-			glyph_run_flush(&run, attr);
-
-			text_x = col * average_width;
-			text_y = extents.ascent + row * extents.height;
-			if (attr.attr.a & ATTRMASK_UNDERLINE) {
-				terminal_set_color(terminal, cr, attr.attr.fg);
-				cairo_move_to(cr, text_x, (double)text_y + 1.5);
-				cairo_line_to(cr, text_x + average_width, (double) text_y + 1.5);
-				cairo_stroke(cr);
-			}
+	for (col = 0; col < terminal->width; col++) {
+		/* get the attributes for this character cell */
+		terminal_decode_attr(terminal, row, col, &attr);
+
+		glyph_run_flush(&run, attr);
+
+		text_x = col * average_width;
+		text_y = terminal->extents.ascent + row * cell_height;
+		if (attr.attr.a & ATTRMASK_UNDERLINE) {
+			terminal_set_color(terminal, cr, attr.attr.fg);
+			cairo_move_to(cr, text_x, (double)text_y + 1.5);
+			cairo_line_to(cr, text_x + average_width, (double) text_y + 1.5);
+			cairo_stroke(cr);
+		}
 
-                        /* skip space glyph (RLE) we use as a placeholder of
-                           the right half of a double-width character,
-                           because RLE is not available in every font. */
-			if (p_row[col].ch == 0x200B)
-				continue;
+		/* skip space glyph (RLE) we use as a placeholder of
+		   the right half of a double-width character,
+		   because RLE is not available in every font. */
+		if (p_row[col].ch == 0x200B)
+			continue;
 
-			glyph_run_add(&run, text_x, text_y, &p_row[col]);
-		}
+		glyph_run_add(&run, text_x, text_y, &p_row[col]);
 	}
 
 	attr.key = ~0;
 	glyph_run_flush(&run, attr);
 
-	if ((terminal->mode & MODE_SHOW_CURSOR) &&
-	    !window_has_focus(terminal->window)) {
+	if (terminal->drawn_cursor == 2 && terminal->drawn_row == row) {
 		d = 0.5;
 
 		cairo_set_line_width(cr, 1);
-		cairo_move_to(cr, terminal->column * average_width + d,
-			      terminal->row * extents.height + d);
+		cairo_move_to(cr, terminal->drawn_column * average_width + d,
+			      row * cell_height + d);
 		cairo_rel_line_to(cr, average_width - 2 * d, 0);
-		cairo_rel_line_to(cr, 0, extents.height - 2 * d);
+		cairo_rel_line_to(cr, 0, cell_height - 2 * d);
 		cairo_rel_line_to(cr, -average_width + 2 * d, 0);
 		cairo_close_path(cr);
 
 		cairo_stroke(cr);
 	}
 
-	cairo_pop_group_to_source(cr);
-	cairo_paint(cr);
+	cairo_restore(cr);
+}
+
+/* Mark the rows whose cursor or selection highlight changed. */
+static void
+terminal_damage_state(struct terminal *terminal)
+{
+	int cursor, inverse;
+
+	inverse = !!(terminal->mode & MODE_INVERSE);
+	if (inverse != terminal->drawn_inverse) {
+		terminal->drawn_inverse = inverse;
+		terminal_damage_all(terminal);
+	}
+
+	/* 1 is the inverted cell of the focused window, 2 the outline */
+	if (!(terminal->mode & MODE_SHOW_CURSOR) ||
+	    terminal->row < 0 || terminal->row >= terminal->height)
+		cursor = 0;
+	else if (window_has_focus(terminal->window))
+		cursor = 1;
+	else
+		cursor = 2;
+
+	if (cursor != terminal->drawn_cursor ||
+	    terminal->row != terminal->drawn_row ||
+	    terminal->column != terminal->drawn_column) {
+		if (terminal->drawn_cursor)
+			terminal_damage_rows(terminal, terminal->drawn_row,
+					     terminal->drawn_row);
+		if (cursor)
+			terminal_damage_rows(terminal, terminal->row,
+					     terminal->row);
+		terminal->drawn_cursor = cursor;
+		terminal->drawn_row = terminal->row;
+		terminal->drawn_column = terminal->column;
+	}
+
+	if (terminal->selection_start_row !=
+	    terminal->drawn_selection_start_row ||
+	    terminal->selection_start_col !=
+	    terminal->drawn_selection_start_col ||
+	    terminal->selection_end_row != terminal->drawn_selection_end_row ||
+	    terminal->selection_end_col != terminal->drawn_selection_end_col) {
+		terminal_damage_rows(terminal,
+				     terminal->drawn_selection_start_row,
+				     terminal->drawn_selection_end_row);
+		terminal_damage_rows(terminal,
+				     terminal->selection_start_row,
+				     terminal->selection_end_row);
+		terminal->drawn_selection_start_row =
+			terminal->selection_start_row;
+		terminal->drawn_selection_start_col =
+			terminal->selection_start_col;
+		terminal->drawn_selection_end_row =
+			terminal->selection_end_row;
+		terminal->drawn_selection_end_col =
+			terminal->selection_end_col;
+	}
+}
+
+static void
+redraw_handler(struct widget *widget, void *data)
+{
+	struct terminal *terminal = data;
+	struct rectangle allocation;
+	cairo_t *cr;
+	int top_margin, side_margin;
+	int row, end, cursor_x, cursor_y;
+	int32_t width, height, scale;
+	int new_cache = 0;
+
+	widget_get_allocation(terminal->widget, &allocation);
+	width = terminal->width * terminal->average_width;
+	height = terminal->height * terminal->extents.height;
+	side_margin = (allocation.width - width) / 2;
+	top_margin = (allocation.height - height) / 2;
+	scale = window_get_buffer_scale(terminal->window);
+
+	if (!terminal->cache ||
+	    cairo_image_surface_get_width(terminal->cache) != width * scale ||
+	    cairo_image_surface_get_height(terminal->cache) != height * scale) {
+		if (terminal->cache)
+			cairo_surface_destroy(terminal->cache);
+		terminal->cache =
+			cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+						   width * scale,
+						   height * scale);
+		terminal->scroll_pending = 0;
+		terminal_damage_all(terminal);
+		new_cache = 1;
+	}
+
+	terminal_damage_state(terminal);
+	terminal_flush_scroll(terminal);
+
+	cr = cairo_create(terminal->cache);
+	cairo_scale(cr, scale, scale);
+	cairo_set_line_width(cr, 1.0);
+	for (row = 0; row < terminal->height; row++)
+		if (terminal->dirty[row] == ROW_DIRTY)
+			terminal_draw_row(terminal, cr, row);
+	cairo_destroy(cr);
+
+	/* damage each run of changed rows */
+	for (row = 0; row < terminal->height; row = end + 1) {
+		for (end = row; end < terminal->height; end++) {
+			if (terminal->dirty[end] == ROW_CLEAN)
+				break;
+			terminal->dirty[end] = ROW_CLEAN;
+		}
+		if (end > row && !new_cache)
+			widget_damage(widget, allocation.x + side_margin,
+				      allocation.y + top_margin +
+				      row * terminal->extents.height,
+				      width,
+				      (end - row) * terminal->extents.height);
+	}
+	if (new_cache)
+		widget_damage(widget, allocation.x, allocation.y,
+			      allocation.width, allocation.height);
+
+	/* Copy the grid to the window and paint the border around it. */
+	cr = widget_cairo_create(terminal->widget);
+	cairo_rectangle(cr, allocation.x, allocation.y,
+			allocation.width, allocation.height);
+	cairo_clip(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+
+	cairo_rectangle(cr, allocation.x, allocation.y,
+			allocation.width, allocation.height);
+	cairo_rectangle(cr, allocation.x + side_margin,
+			allocation.y + top_margin, width, height);
+	cairo_set_fill_rule(cr, CAIRO_FILL_RULE_EVEN_ODD);
+	terminal_set_color(terminal, cr, terminal->color_scheme->border);
+	cairo_fill(cr);
+
+	cairo_translate(cr, allocation.x + side_margin,
+			allocation.y + top_margin);
+	cairo_scale(cr, 1.0 / scale, 1.0 / scale);
+	cairo_set_source_surface(cr, terminal->cache, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+	cairo_rectangle(cr, 0, 0, width * scale, height * scale);
+	cairo_fill(cr);
 	cairo_destroy(cr);
-	cairo_surface_destroy(surface);
 
 	if (terminal->send_cursor_position) {
 		cursor_x = side_margin + allocation.x +
-				terminal->column * average_width;
+				terminal->column * terminal->average_width;
 		cursor_y = top_margin + allocation.y +
-				terminal->row * extents.height;
+				terminal->row * terminal->extents.height;
 		window_set_text_cursor_position(terminal->window,
 						cursor_x, cursor_y);
 		terminal->send_cursor_position = 0;
@@ -1215,6 +1559,7 @@ handle_term_parameter(struct terminal *terminal, int code, int sr)
 				attr_init(terminal_get_attr_row(terminal, i),
 				    terminal->curr_attr, terminal->width);
 			}
+			terminal_damage_all(terminal);
 			break;
 		case 5:  /* DECSCNM */
 			if (sr)	terminal->mode |=  MODE_INVERSE;
@@ -1444,6 +1789,8 @@ handle_escape(struct terminal *terminal)
 				attr_init(terminal_get_attr_row(terminal, i),
 				    terminal->curr_attr, terminal->width);
 			}
+			terminal_damage_rows(terminal, terminal->row,
+					     terminal->height - 1);
 		} else if (args[0] == 1) {
 			memset(row, 0, (terminal->column+1) * sizeof(union utf8_char));
 			attr_init(attr_row, terminal->curr_attr, terminal->column+1);
@@ -1453,6 +1800,7 @@ handle_escape(struct terminal *terminal)
 				attr_init(terminal_get_attr_row(terminal, i),
 				    terminal->curr_attr, terminal->width);
 			}
+			terminal_damage_rows(terminal, 0, terminal->row);
 		} else if (args[0] == 2) {
 			/* Clear screen by scrolling contents out */
 			terminal_scroll_buffer(terminal,
@@ -1462,6 +1810,7 @@ handle_escape(struct terminal *terminal)
 	case 'K':    /* EL - Erase line */
 		row = terminal_get_row(terminal, terminal->row);
 		attr_row = terminal_get_attr_row(terminal, terminal->row);
+		terminal_damage_rows(terminal, terminal->row, terminal->row);
 		if (!set[0] || args[0] == 0 || args[0] > 2) {
 			memset(&row[terminal->column], 0,
 			    (terminal->width - terminal->column) * sizeof(union utf8_char));
@@ -1490,6 +1839,8 @@ handle_escape(struct terminal *terminal)
 			       0, terminal->data_pitch);
 			attr_init(terminal_get_attr_row(terminal, terminal->row),
 				terminal->curr_attr, terminal->width);
+			terminal_damage_rows(terminal, terminal->row,
+					     terminal->row);
 		}
 		break;
 	case 'M':    /* DL - Delete <count> lines */
@@ -1505,6 +1856,8 @@ handle_escape(struct terminal *terminal)
 		} else if (terminal->row == terminal->margin_bottom) {
 			memset(terminal_get_row(terminal, terminal->row),
 			       0, terminal->data_pitch);
+			terminal_damage_rows(terminal, terminal->row,
+					     terminal->row);
 		}
 		break;
 	case 'P':    /* DCH - Delete <count> characters on current line */
@@ -1527,6 +1880,7 @@ handle_escape(struct terminal *terminal)
 		attr_row = terminal_get_attr_row(terminal, terminal->row);
 		memset(&row[terminal->column], 0, count * sizeof(union utf8_char));
 		attr_init(&attr_row[terminal->column], terminal->curr_attr, count);
+		terminal_damage_rows(terminal, terminal->row, terminal->row);
 		break;
 	case 'Z':    /* CBT */
 		count = set[0] ? args[0] : 1;
@@ -1767,6 +2121,7 @@ handle_special_escape(struct terminal *terminal, char special, char code)
 			for (i = 0; i < numChars; i++) {
 				terminal->data[i].byte[0] = 'E';
 			}
+			terminal_damage_all(terminal);
 			break;
 		default:
 			fprintf(stderr, "Unknown HASH escape #%c\n", code);
@@ -1910,6 +2265,8 @@ handle_special_char(struct terminal *terminal, char c)
 				row[terminal->column].byte[0] = ' ';
 				row[terminal->column].byte[1] = '\0';
 				attr_row[terminal->column] = terminal->curr_attr;
+				terminal_damage_rows(terminal, terminal->row,
+						     terminal->row);
 			}
 
 			terminal->column++;
@@ -1997,13 +2354,8 @@ handle_char(struct terminal *terminal, union utf8_char utf8)
 		terminal_shift_line(terminal, +1);
 	row[terminal->column] = utf8;
 	attr_row[terminal->column++] = terminal->curr_attr;
-
-	if (terminal->row + terminal->start + 1 > terminal->end)
-		terminal->end = terminal->row + terminal->start + 1;
-	if (terminal->end == terminal->buffer_height)
-		terminal->log_size = terminal->buffer_height;
-	else if (terminal->log_size < terminal->buffer_height)
-		terminal->log_size = terminal->end;
+	terminal_damage_rows(terminal, terminal->row, terminal->row);
+	terminal_update_log(terminal);
 
 	/* cursor jump for wide character. */
 	if (is_wide(utf8))
@@ -2033,14 +2385,133 @@ escape_append_utf8(struct terminal *terminal, union utf8_char utf8)
 	}
 }
 
+/*
+ * Plain runs of printable ASCII don't need the UTF-8 decoder, escape
+ * parsing or character set translation, and are stored a row at a
+ * time. This is the bulk of log output.
+ */
+static bool
+terminal_can_put_ascii(struct terminal *terminal)
+{
+	enum utf8_state state = terminal->state_machine.state;
+
+	return terminal->state == escape_state_normal &&
+	       (state == utf8state_start ||
+		state == utf8state_accept ||
+		state == utf8state_reject) &&
+	       terminal->cs == CS_US &&
+	       !(terminal->mode & MODE_IRM);
+}
+
+/* The length of the run of printable ASCII data starts with. */
+static size_t
+ascii_run_length(const char *data, size_t length)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i del = _mm_set1_epi8(0x7f);
+	__m128i v;
+	int mask;
+
+	/* bytes from 0x80 on are negative, so less than ' ' as well */
+	for (; i + 16 <= length; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (data + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, space),
+						      _mm_cmpeq_epi8(v, del)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < length; i++)
+		if ((unsigned char) data[i] < ' ' ||
+		    (unsigned char) data[i] >= 0x7f)
+			break;
+
+	return i;
+}
+
+static void
+ascii_to_utf8_chars(union utf8_char *out, const char *data, int n)
+{
+	int i = 0;
+#if defined(__SSE2__)
+	/* x86 is little endian, byte[0] is the low byte of ch */
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v, lo, hi;
+
+	for (; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (data + i));
+		lo = _mm_unpacklo_epi8(v, zero);
+		hi = _mm_unpackhi_epi8(v, zero);
+		_mm_storeu_si128((__m128i *) &out[i],
+				 _mm_unpacklo_epi16(lo, zero));
+		_mm_storeu_si128((__m128i *) &out[i + 4],
+				 _mm_unpackhi_epi16(lo, zero));
+		_mm_storeu_si128((__m128i *) &out[i + 8],
+				 _mm_unpacklo_epi16(hi, zero));
+		_mm_storeu_si128((__m128i *) &out[i + 12],
+				 _mm_unpackhi_epi16(hi, zero));
+	}
+#endif
+	for (; i < n; i++) {
+		out[i].ch = 0;
+		out[i].byte[0] = data[i];
+	}
+}
+
+/* Same as handle_char() on each byte of a printable ASCII run. */
+static void
+terminal_put_ascii(struct terminal *terminal, const char *data, size_t length)
+{
+	union utf8_char utf8;
+	int n;
+
+	while (length > 0) {
+		if (terminal->column >= terminal->width) {
+			/* leave the right margin effects to handle_char() */
+			utf8.ch = 0;
+			utf8.byte[0] = *data;
+			handle_char(terminal, utf8);
+			data++;
+			length--;
+			continue;
+		}
+
+		n = MIN(length, (size_t) (terminal->width - terminal->column));
+		ascii_to_utf8_chars(terminal_get_row(terminal, terminal->row) +
+				    terminal->column, data, n);
+		attr_init(terminal_get_attr_row(terminal, terminal->row) +
+			  terminal->column, terminal->curr_attr, n);
+		terminal->column += n;
+		terminal_damage_rows(terminal, terminal->row, terminal->row);
+		terminal_update_log(terminal);
+
+		terminal->last_char.ch = 0;
+		terminal->last_char.byte[0] = data[n - 1];
+		data += n;
+		length -= n;
+	}
+}
+
 static void
 terminal_data(struct terminal *terminal, const char *data, size_t length)
 {
 	unsigned int i;
+	size_t n;
 	union utf8_char utf8;
 	enum utf8_state parser_state;
 
 	for (i = 0; i < length; i++) {
+		if (terminal_can_put_ascii(terminal)) {
+			n = ascii_run_length(data + i, length - i);
+			if (n > 0) {
+				terminal_put_ascii(terminal, data + i, n);
+				i += n - 1;
+				continue;
+			}
+		}
+
 		parser_state =
 			utf8_next_char(&terminal->state_machine, data[i]);
 		switch(parser_state) {
@@ -2180,7 +2651,7 @@ terminal_data(struct terminal *terminal, const char *data, size_t length)
 		} /* if */
 	} /* for */
 
-	window_schedule_redraw(terminal->window);
+	widget_schedule_partial_redraw(terminal->widget);
 }
 
 static void
@@ -2291,6 +2762,40 @@ terminal_new_instance(struct terminal *terminal)
 		terminal_destroy(new_terminal);
 }
 
+/*
+ * Move the view lines into the scrollback, up if lines is negative,
+ * stopping at the oldest line kept and at the live screen.
+ */
+static void
+terminal_scroll_view(struct terminal *terminal, int lines)
+{
+	uint32_t limit;
+
+	if (!terminal->scrolling)
+		terminal->saved_start = terminal->start;
+
+	if (lines > 0) {
+		limit = terminal->saved_start - terminal->start;
+		if ((uint32_t) lines > limit)
+			lines = limit;
+	} else if (lines < 0) {
+		limit = terminal->log_size + terminal->start - terminal->end;
+		if (-(int64_t) lines > limit)
+			lines = -(int64_t) limit;
+	}
+
+	if (lines == 0)
+		return;
+
+	terminal->scrolling = 1;
+	terminal->start += lines;
+	terminal->row -= lines;
+	terminal->selection_start_row -= lines;
+	terminal->selection_end_row -= lines;
+	terminal_damage_scroll(terminal, 0, terminal->height - 1, lines);
+	widget_schedule_partial_redraw(terminal->widget);
+}
+
 static int
 handle_bound_key(struct terminal *terminal,
 		 struct input *input, uint32_t sym, uint32_t time)
@@ -2310,32 +2815,27 @@ handle_bound_key(struct terminal *terminal,
 		return 1;
 
 	case XKB_KEY_Up:
-		if (!terminal->scrolling)
-			terminal->saved_start = terminal->start;
-		if (terminal->start == terminal->end - terminal->log_size)
-			return 1;
-
-		terminal->scrolling = 1;
-		terminal->start--;
-		terminal->row++;
-		terminal->selection_start_row++;
-		terminal->selection_end_row++;
-		widget_schedule_redraw(terminal->widget);
+		terminal_scroll_view(terminal, -1);
 		return 1;
 
 	case XKB_KEY_Down:
-		if (!terminal->scrolling)
-			terminal->saved_start = terminal->start;
-
-		if (terminal->start == terminal->saved_start)
-			return 1;
-
-		terminal->scrolling = 1;
-		terminal->start++;
-		terminal->row--;
-		terminal->selection_start_row--;
-		terminal->selection_end_row--;
-		widget_schedule_redraw(terminal->widget);
+		terminal_scroll_view(terminal, 1);
+		return 1;
+
+	case XKB_KEY_Prior:
+		terminal_scroll_view(terminal, 1 - terminal->height);
+		return 1;
+
+	case XKB_KEY_Next:
+		terminal_scroll_view(terminal, terminal->height - 1);
+		return 1;
+
+	case XKB_KEY_Home:
+		terminal_scroll_view(terminal, INT32_MIN);
+		return 1;
+
+	case XKB_KEY_End:
+		terminal_scroll_view(terminal, INT32_MAX);
 		return 1;
 
 	default:
@@ -2562,7 +3062,9 @@ key_handler(struct window *window, struct input *input, uint32_t time,
 			terminal->selection_end_row -= d;
 			terminal->start = terminal->saved_start;
 			terminal->scrolling = 0;
-			widget_schedule_redraw(terminal->widget);
+			terminal_damage_scroll(terminal, 0,
+					       terminal->height - 1, d);
+			widget_schedule_partial_redraw(terminal->widget);
 		}
 
 		terminal_write(terminal, ch, len);
@@ -2753,7 +3255,7 @@ click_handler(struct widget *widget, struct terminal *terminal,
 	terminal->selection_end_x = terminal->selection_start_x = x;
 	terminal->selection_end_y = terminal->selection_start_y = y;
 	if (recompute_selection(terminal))
-			widget_schedule_redraw(widget);
+			widget_schedule_partial_redraw(widget);
 }
 
 static void
@@ -2802,7 +3304,7 @@ motion_handler(struct widget *widget,
 				   &terminal->selection_end_y);
 
 		if (recompute_selection(terminal))
-			widget_schedule_redraw(widget);
+			widget_schedule_partial_redraw(widget);
 	}
 
 	return CURSOR_IBEAM;
@@ -2829,32 +3331,8 @@ axis_handler(struct widget *widget,
 	lines = terminal->smooth_scroll / AXIS_UNITS_PER_LINE;
 	terminal->smooth_scroll -= lines * AXIS_UNITS_PER_LINE;
 
-	if (lines > 0) {
-		if (terminal->scrolling) {
-			if ((uint32_t)lines > terminal->saved_start - terminal->start)
-				lines = terminal->saved_start - terminal->start;
-		} else {
-			lines = 0;
-		}
-	} else if (lines < 0) {
-		uint32_t neg_lines = -lines;
-
-		if (neg_lines > terminal->log_size + terminal->start - terminal->end)
-			lines = terminal->end - terminal->log_size - terminal->start;
-	}
-
-	if (lines) {
-		if (!terminal->scrolling)
-			terminal->saved_start = terminal->start;
-		terminal->scrolling = 1;
-
-		terminal->start += lines;
-		terminal->row -= lines;
-		terminal->selection_start_row -= lines;
-		terminal->selection_end_row -= lines;
-
-		widget_schedule_redraw(widget);
-	}
+	if (lines)
+		terminal_scroll_view(terminal, lines);
 }
 
 static void
@@ -2900,7 +3378,7 @@ touch_motion_handler(struct widget *widget, struct input *input,
 		terminal->selection_end_y = (int)y;
 
 		if (recompute_selection(terminal))
-			widget_schedule_redraw(widget);
+			widget_schedule_partial_redraw(widget);
 	}
 }
 
@@ -2932,7 +3410,11 @@ terminal_create(struct display *display)
 
 	terminal->display = display;
 	terminal->margin = 5;
-	terminal->buffer_height = 1024;
+	terminal->max_buffer_height = MIN_BUFFER_HEIGHT;
+	while ((int) terminal->max_buffer_height < option_scrollback_lines &&
+	       terminal->max_buffer_height < MAX_BUFFER_HEIGHT)
+		terminal->max_buffer_height *= 2;
+	terminal->buffer_height = MIN_BUFFER_HEIGHT;
 	terminal->end = 1;
 
 	window_set_user_data(terminal->window, terminal);
@@ -2973,6 +3455,8 @@ terminal_create(struct display *display)
 	cairo_scaled_font_reference(terminal->font_normal);
 
 	cairo_font_extents(cr, &terminal->extents);
+	/* whole pixel rows, so rows can be painted and moved separately */
+	terminal->extents.height = ceil(terminal->extents.height);
 
 	/* Compute the average ascii glyph width */
 	cairo_text_extents(cr, TERMINAL_DRAW_SINGLE_WIDE_CHARACTERS,
@@ -3004,6 +3488,9 @@ terminal_destroy(struct terminal *terminal)
 	if (wl_list_empty(&terminal_list))
 		display_exit(terminal->display);
 
+	if (terminal->cache)
+		cairo_surface_destroy(terminal->cache);
+	free(terminal->dirty);
 	free(terminal->title);
 	free(terminal);
 }
@@ -3090,12 +3577,54 @@ terminal_run(struct terminal *terminal, const char *path)
 	return 0;
 }
 
+/*
+ * Feed generated log output through the parser and report how fast it
+ * is consumed. Only parsing is measured, not rendering.
+ */
+static void
+terminal_benchmark(struct terminal *terminal)
+{
+	static const char * const levels[] = {
+		"info", "\033[1;33mwarn\033[0m", "debug", "\033[31merror\033[0m"
+	};
+	const size_t size = 1 << 20;
+	const int rounds = 256;
+	struct timespec begin, end;
+	char *buffer;
+	size_t length = 0;
+	double seconds;
+	int i;
+
+	buffer = xmalloc(size);
+	for (i = 0; length + 128 < size; i++)
+		length += snprintf(buffer + length, size - length,
+				   "%08d [%s] worker %d: handled request "
+				   "/api/v1/items/%d in %d us\r\n",
+				   i, levels[i % ARRAY_LENGTH(levels)], i % 13,
+				   i * 7919 % 100000, i * 31 % 5000);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < rounds; i++)
+		terminal_data(terminal, buffer, length);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	seconds = timespec_sub_to_nsec(&end, &begin) / 1e9;
+	printf("%.1f MB of log output in %.3f s, %.1f MB/s\n",
+	       length * rounds / 1e6, seconds,
+	       length * rounds / 1e6 / seconds);
+
+	free(buffer);
+}
+
 static const struct weston_option terminal_options[] = {
 	{ WESTON_OPTION_BOOLEAN, "fullscreen", 'f', &option_fullscreen },
 	{ WESTON_OPTION_BOOLEAN, "maximized", 'm', &option_maximize },
 	{ WESTON_OPTION_STRING, "font", 0, &option_font },
 	{ WESTON_OPTION_INTEGER, "font-size", 0, &option_font_size },
 	{ WESTON_OPTION_STRING, "shell", 0, &option_shell },
+	{ WESTON_OPTION_INTEGER, "scrollback-lines", 0,
+	  &option_scrollback_lines },
+	{ WESTON_OPTION_BOOLEAN, "benchmark", 'b', &option_benchmark },
 };
 
 int main(int argc, char *argv[])
@@ -3120,6 +3649,8 @@ int main(int argc, char *argv[])
 	weston_config_section_get_string(s, "font", &option_font, "mono");
 	weston_config_section_get_int(s, "font-size", &option_font_size, 14);
 	weston_config_section_get_string(s, "term", &option_term, "xterm");
+	weston_config_section_get_int(s, "scrollback-lines",
+				      &option_scrollback_lines, 1024);
 	weston_config_destroy(config);
 
 	if (parse_options(terminal_options,
@@ -3129,7 +3660,9 @@ int main(int argc, char *argv[])
 		       "  --maximized or -m\n"
 		       "  --font=NAME\n"
 		       "  --font-size=SIZE\n"
-		       "  --shell=NAME\n", argv[0]);
+		       "  --shell=NAME\n"
+		       "  --scrollback-lines=LINES\n"
+		       "  --benchmark or -b\n", argv[0]);
 		return 1;
 	}
 
@@ -3141,6 +3674,11 @@ int main(int argc, char *argv[])
 
 	wl_list_init(&terminal_list);
 	terminal = terminal_create(d);
+	if (option_benchmark) {
+		terminal_benchmark(terminal);
+		return 0;
+	}
+
 	if (terminal_run(terminal, option_shell))
 		exit(EXIT_FAILURE);
 
@@ -0,0 +1,390 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <wayland-client.h>
+#include "weston-perf-client-protocol.h"
+#include "shared/helpers.h"
+#include "shared/xalloc.h"
+#include "shared/zalloc.h"
+
+/* weston-perf subscribes to the per-frame performance counters of every
+ * output and periodically prints a summary with histograms of the repaint
+ * CPU time and the presentation latency.
+ */
+
+#define HISTOGRAM_BUCKETS 8
+#define HISTOGRAM_WIDTH 40
+
+struct histogram {
+	uint32_t count[HISTOGRAM_BUCKETS];
+	uint64_t sum;
+	uint32_t max;
+};
+
+struct perf_output {
+	struct wl_list link;
+	struct wl_output *output;
+	struct weston_perf_output *perf_output;
+	uint32_t id;
+	char *model;
+
+	uint32_t frames;
+	uint32_t missed;
+	uint64_t views, views_primary, views_planes;
+	uint64_t damage_area;
+	uint64_t upload_bytes;
+	struct histogram repaint;
+	struct histogram latency;
+};
+
+struct perf {
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct weston_perf *weston_perf;
+	struct wl_list output_list;
+	int interval;
+};
+
+/* Bucket upper bounds in microseconds; the last bucket is open ended. */
+static const uint32_t bucket_limit[HISTOGRAM_BUCKETS - 1] = {
+	500, 1000, 2000, 4000, 8000, 16000, 32000
+};
+
+static void
+histogram_add(struct histogram *h, uint32_t usec)
+{
+	int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++)
+		if (usec < bucket_limit[i])
+			break;
+
+	h->count[i]++;
+	h->sum += usec;
+	if (usec > h->max)
+		h->max = usec;
+}
+
+static void
+histogram_print(const char *name, const struct histogram *h, uint32_t total)
+{
+	uint32_t peak = 0;
+	int i, j, bar;
+
+	if (total == 0)
+		return;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+		if (h->count[i] > peak)
+			peak = h->count[i];
+
+	printf("  %s: avg %.2f ms, max %.2f ms\n", name,
+	       h->sum / (double)total / 1000.0, h->max / 1000.0);
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		if (i < HISTOGRAM_BUCKETS - 1)
+			printf("    < %5.1f ms %6u ",
+			       bucket_limit[i] / 1000.0, h->count[i]);
+		else
+			printf("    >=%5.1f ms %6u ",
+			       bucket_limit[i - 1] / 1000.0, h->count[i]);
+
+		bar = peak ? h->count[i] * HISTOGRAM_WIDTH / peak : 0;
+		for (j = 0; j < bar; j++)
+			putchar('#');
+		putchar('\n');
+	}
+}
+
+static void
+perf_output_print(struct perf_output *po)
+{
+	if (po->frames == 0)
+		return;
+
+	printf("output %u (%s): %u frames, %u missed vblanks\n",
+	       po->id, po->model ? po->model : "unknown",
+	       po->frames, po->missed);
+	printf("  views: %.1f per frame, %.1f composited, %.1f on planes\n",
+	       (double)po->views / po->frames,
+	       (double)po->views_primary / po->frames,
+	       (double)po->views_planes / po->frames);
+	printf("  damage: %.0f pixels per frame, "
+	       "uploads: %.1f KiB per frame\n",
+	       (double)po->damage_area / po->frames,
+	       po->upload_bytes / 1024.0 / po->frames);
+	histogram_print("repaint CPU time", &po->repaint, po->frames);
+	histogram_print("presentation latency", &po->latency, po->frames);
+}
+
+static void
+perf_output_reset(struct perf_output *po)
+{
+	po->frames = 0;
+	po->missed = 0;
+	po->views = 0;
+	po->views_primary = 0;
+	po->views_planes = 0;
+	po->damage_area = 0;
+	po->upload_bytes = 0;
+	memset(&po->repaint, 0, sizeof po->repaint);
+	memset(&po->latency, 0, sizeof po->latency);
+}
+
+static void
+perf_output_handle_frame(void *data,
+			 struct weston_perf_output *perf_output,
+			 uint32_t views,
+			 uint32_t views_primary,
+			 uint32_t views_planes,
+			 uint32_t damage_area,
+			 uint32_t upload_bytes,
+			 uint32_t repaint_usec,
+			 uint32_t latency_usec,
+			 uint32_t missed)
+{
+	struct perf_output *po = data;
+
+	po->frames++;
+	po->missed += missed;
+	po->views += views;
+	po->views_primary += views_primary;
+	po->views_planes += views_planes;
+	po->damage_area += damage_area;
+	po->upload_bytes += upload_bytes;
+	histogram_add(&po->repaint, repaint_usec);
+	histogram_add(&po->latency, latency_usec);
+}
+
+static void
+perf_output_handle_output_removed(void *data,
+				  struct weston_perf_output *perf_output)
+{
+	struct perf_output *po = data;
+
+	perf_output_print(po);
+	printf("output %u removed\n", po->id);
+
+	weston_perf_output_destroy(po->perf_output);
+	po->perf_output = NULL;
+}
+
+static const struct weston_perf_output_listener perf_output_listener = {
+	perf_output_handle_frame,
+	perf_output_handle_output_removed,
+};
+
+static void
+output_handle_geometry(void *data, struct wl_output *wl_output,
+		       int x, int y, int physical_width, int physical_height,
+		       int subpixel, const char *make, const char *model,
+		       int transform)
+{
+	struct perf_output *po = data;
+
+	free(po->model);
+	po->model = xstrdup(model);
+}
+
+static void
+output_handle_mode(void *data, struct wl_output *wl_output, uint32_t flags,
+		   int width, int height, int refresh)
+{
+}
+
+static const struct wl_output_listener output_listener = {
+	output_handle_geometry,
+	output_handle_mode,
+};
+
+static void
+perf_output_subscribe(struct perf *perf, struct perf_output *po)
+{
+	po->perf_output = weston_perf_subscribe(perf->weston_perf, po->output);
+	weston_perf_output_add_listener(po->perf_output,
+					&perf_output_listener, po);
+}
+
+static void
+registry_handle_global(void *data, struct wl_registry *registry,
+		       uint32_t id, const char *interface, uint32_t version)
+{
+	struct perf *perf = data;
+	struct perf_output *po;
+
+	if (strcmp(interface, "wl_output") == 0) {
+		po = xzalloc(sizeof *po);
+		po->id = id;
+		po->output = wl_registry_bind(registry, id,
+					      &wl_output_interface, 1);
+		wl_output_add_listener(po->output, &output_listener, po);
+		wl_list_insert(perf->output_list.prev, &po->link);
+
+		if (perf->weston_perf)
+			perf_output_subscribe(perf, po);
+	} else if (strcmp(interface, "weston_perf") == 0) {
+		perf->weston_perf = wl_registry_bind(registry, id,
+						     &weston_perf_interface,
+						     1);
+	}
+}
+
+static void
+registry_handle_global_remove(void *data, struct wl_registry *registry,
+			      uint32_t name)
+{
+	struct perf *perf = data;
+	struct perf_output *po;
+
+	wl_list_for_each(po, &perf->output_list, link) {
+		if (po->id != name)
+			continue;
+
+		if (po->perf_output)
+			weston_perf_output_destroy(po->perf_output);
+		wl_output_destroy(po->output);
+		wl_list_remove(&po->link);
+		free(po->model);
+		free(po);
+		break;
+	}
+}
+
+static const struct wl_registry_listener registry_listener = {
+	registry_handle_global,
+	registry_handle_global_remove,
+};
+
+static int64_t
+now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+usage(const char *name, int exit_code)
+{
+	fprintf(stderr, "usage: %s [-i seconds]\n\n"
+		"Prints the frame performance counters of all outputs.\n\n"
+		"  -i, --interval=SECONDS\tprint a summary every SECONDS "
+		"(default 1)\n"
+		"  -h, --help\t\tshow this help\n", name);
+	exit(exit_code);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "interval", required_argument, NULL, 'i' },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0, 0, NULL, 0 }
+	};
+	struct perf perf = { 0 };
+	struct perf_output *po, *tmp;
+	int64_t last_print;
+	int opt;
+
+	perf.interval = 1;
+
+	while ((opt = getopt_long(argc, argv, "i:h", options, NULL)) != -1) {
+		switch (opt) {
+		case 'i':
+			perf.interval = atoi(optarg);
+			if (perf.interval <= 0)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'h':
+			usage(argv[0], EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0], EXIT_FAILURE);
+			break;
+		}
+	}
+
+	perf.display = wl_display_connect(NULL);
+	if (perf.display == NULL) {
+		fprintf(stderr, "failed to create display: %m\n");
+		return EXIT_FAILURE;
+	}
+
+	wl_list_init(&perf.output_list);
+	perf.registry = wl_display_get_registry(perf.display);
+	wl_registry_add_listener(perf.registry, &registry_listener, &perf);
+	wl_display_roundtrip(perf.display);
+
+	if (perf.weston_perf == NULL) {
+		fprintf(stderr, "display doesn't support weston_perf, "
+			"is perf-protocol set in weston.ini?\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Outputs announced before weston_perf still need a subscription. */
+	wl_list_for_each(po, &perf.output_list, link) {
+		if (!po->perf_output)
+			perf_output_subscribe(&perf, po);
+	}
+
+	last_print = now_msec();
+
+	while (wl_display_dispatch(perf.display) != -1) {
+		if (now_msec() - last_print < perf.interval * 1000)
+			continue;
+
+		wl_list_for_each(po, &perf.output_list, link) {
+			perf_output_print(po);
+			perf_output_reset(po);
+		}
+		fflush(stdout);
+		last_print = now_msec();
+	}
+
+	wl_list_for_each_safe(po, tmp, &perf.output_list, link) {
+		if (po->perf_output)
+			weston_perf_output_destroy(po->perf_output);
+		wl_output_destroy(po->output);
+		free(po->model);
+		free(po);
+	}
+
+	weston_perf_destroy(perf.weston_perf);
+	wl_registry_destroy(perf.registry);
+	wl_display_disconnect(perf.display);
+
+	return EXIT_SUCCESS;
+}
@@ -102,6 +102,7 @@ struct display {
 	struct wl_display *display;
 	struct wl_registry *registry;
 	struct wl_compositor *compositor;
+	uint32_t compositor_version;
 	struct wl_subcompositor *subcompositor;
 	struct wl_shm *shm;
 	struct wl_data_device_manager *data_device_manager;
@@ -172,11 +173,14 @@ struct toysurface {
 
 	/*
 	 * Post the surface to the server, returning the server allocation
-	 * rectangle. The Cairo surface from prepare() must be destroyed
-	 * after calling this.
+	 * rectangle. damage holds n_damage rectangles in surface
+	 * coordinates that changed since the previous swap; if n_damage
+	 * is 0, the whole surface is damaged. The Cairo surface from
+	 * prepare() must be destroyed after calling this.
 	 */
 	void (*swap)(struct toysurface *base,
 		     enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		     const struct rectangle *damage, int n_damage,
 		     struct rectangle *server_allocation);
 
 	/*
@@ -198,6 +202,8 @@ struct toysurface {
 	void (*destroy)(struct toysurface *base);
 };
 
+#define MAX_SURFACE_DAMAGE 16
+
 struct surface {
 	struct window *window;
 
@@ -223,6 +229,13 @@ struct surface {
 
 	cairo_surface_t *cairo_surface;
 
+	/* Areas reported with widget_damage() since the last flush, in
+	 * surface coordinates. damage_all is set by anything that did
+	 * not report what it changed, and wins over the list. */
+	struct rectangle damage[MAX_SURFACE_DAMAGE];
+	int damage_count;
+	int damage_all;
+
 	struct wl_list link;
 };
 
@@ -546,6 +559,74 @@ buffer_to_surface_size (enum wl_output_transform buffer_transform, int32_t buffe
 	*height /= buffer_scale;
 }
 
+/* Convert a rectangle in surface coordinates to buffer coordinates for
+ * a surface of the given size. */
+static void
+surface_to_buffer_rect(enum wl_output_transform buffer_transform,
+		       int32_t buffer_scale, int32_t width, int32_t height,
+		       const struct rectangle *rect, struct rectangle *out)
+{
+	int32_t x1 = rect->x, y1 = rect->y;
+	int32_t x2 = rect->x + rect->width, y2 = rect->y + rect->height;
+
+	switch (buffer_transform) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+	default:
+		out->x = x1;
+		out->y = y1;
+		out->width = x2 - x1;
+		out->height = y2 - y1;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		out->x = width - x2;
+		out->y = y1;
+		out->width = x2 - x1;
+		out->height = y2 - y1;
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+		out->x = height - y2;
+		out->y = x1;
+		out->width = y2 - y1;
+		out->height = x2 - x1;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		out->x = height - y2;
+		out->y = width - x2;
+		out->width = y2 - y1;
+		out->height = x2 - x1;
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+		out->x = width - x2;
+		out->y = height - y2;
+		out->width = x2 - x1;
+		out->height = y2 - y1;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		out->x = x1;
+		out->y = height - y2;
+		out->width = x2 - x1;
+		out->height = y2 - y1;
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+		out->x = y1;
+		out->y = width - x2;
+		out->width = y2 - y1;
+		out->height = x2 - x1;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		out->x = y1;
+		out->y = x1;
+		out->width = y2 - y1;
+		out->height = x2 - x1;
+		break;
+	}
+
+	out->x *= buffer_scale;
+	out->y *= buffer_scale;
+	out->width *= buffer_scale;
+	out->height *= buffer_scale;
+}
+
 #ifdef HAVE_CAIRO_EGL
 
 struct egl_window_surface {
@@ -581,6 +662,7 @@ egl_window_surface_prepare(struct toysurface *base, int dx, int dy,
 static void
 egl_window_surface_swap(struct toysurface *base,
 			enum wl_output_transform buffer_transform, int32_t buffer_scale,
+			const struct rectangle *damage, int n_damage,
 			struct rectangle *server_allocation)
 {
 	struct egl_window_surface *surface = to_egl_window_surface(base);
@@ -1143,10 +1225,13 @@ out:
 static void
 shm_surface_swap(struct toysurface *base,
 		 enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		 const struct rectangle *damage, int n_damage,
 		 struct rectangle *server_allocation)
 {
 	struct shm_surface *surface = to_shm_surface(base);
 	struct shm_surface_leaf *leaf = surface->current;
+	struct rectangle rect;
+	int i;
 
 	server_allocation->width =
 		cairo_image_surface_get_width(leaf->cairo_surface);
@@ -1159,8 +1244,29 @@ shm_surface_swap(struct toysurface *base,
 
 	wl_surface_attach(surface->surface, leaf->data->buffer,
 			  surface->dx, surface->dy);
-	wl_surface_damage(surface->surface, 0, 0,
-			  server_allocation->width, server_allocation->height);
+
+	if (n_damage == 0) {
+		wl_surface_damage(surface->surface, 0, 0,
+				  server_allocation->width,
+				  server_allocation->height);
+	} else if (surface->display->compositor_version >=
+		   WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION) {
+		for (i = 0; i < n_damage; i++) {
+			surface_to_buffer_rect(buffer_transform, buffer_scale,
+					       server_allocation->width,
+					       server_allocation->height,
+					       &damage[i], &rect);
+			wl_surface_damage_buffer(surface->surface,
+						 rect.x, rect.y,
+						 rect.width, rect.height);
+		}
+	} else {
+		for (i = 0; i < n_damage; i++)
+			wl_surface_damage(surface->surface,
+					  damage[i].x, damage[i].y,
+					  damage[i].width, damage[i].height);
+	}
+
 	wl_surface_commit(surface->surface);
 
 	DBG_OBJ(surface->surface, "leaf %d busy\n",
@@ -1412,10 +1518,21 @@ surface_flush(struct surface *surface)
 		surface->input_region = NULL;
 	}
 
+	/* A new size needs the whole surface damaged whatever the
+	 * widgets reported. */
+	if (surface->allocation.width != surface->server_allocation.width ||
+	    surface->allocation.height != surface->server_allocation.height)
+		surface->damage_all = 1;
+
 	surface->toysurface->swap(surface->toysurface,
 				  surface->buffer_transform, surface->buffer_scale,
+				  surface->damage,
+				  surface->damage_all ? 0 : surface->damage_count,
 				  &surface->server_allocation);
 
+	surface->damage_count = 0;
+	surface->damage_all = 0;
+
 	cairo_surface_destroy(surface->cairo_surface);
 	surface->cairo_surface = NULL;
 }
@@ -2014,9 +2131,64 @@ widget_schedule_redraw(struct widget *widget)
 {
 	DBG_OBJ(widget->surface->surface, "widget %p\n", widget);
 	widget->surface->redraw_needed = 1;
+	widget->surface->damage_all = 1;
 	window_schedule_redraw_task(widget->window);
 }
 
+/*
+ * Like widget_schedule_redraw(), but the surface is not damaged as a
+ * whole: the redraw handler reports what it changed with widget_damage().
+ * Everything on the surface is still redrawn, so the other widgets must
+ * produce the same pixels as in the previous frame.
+ */
+void
+widget_schedule_partial_redraw(struct widget *widget)
+{
+	DBG_OBJ(widget->surface->surface, "widget %p\n", widget);
+	widget->surface->redraw_needed = 1;
+	window_schedule_redraw_task(widget->window);
+}
+
+/*
+ * Report an area changed by the redraw handler, in the same coordinates
+ * the handler draws in. Only meaningful from within the redraw handler.
+ */
+void
+widget_damage(struct widget *widget,
+	      int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct surface *surface = widget->surface;
+	struct rectangle *r;
+	int32_t x1, y1, x2, y2;
+	int i;
+
+	x1 = MAX(x - surface->allocation.x, 0);
+	y1 = MAX(y - surface->allocation.y, 0);
+	x2 = MIN(x - surface->allocation.x + width, surface->allocation.width);
+	y2 = MIN(y - surface->allocation.y + height,
+		 surface->allocation.height);
+	if (x1 >= x2 || y1 >= y2)
+		return;
+
+	/* Collapse into the bounding box when running out of slots. */
+	if (surface->damage_count == MAX_SURFACE_DAMAGE) {
+		for (i = 0; i < surface->damage_count; i++) {
+			r = &surface->damage[i];
+			x1 = MIN(x1, r->x);
+			y1 = MIN(y1, r->y);
+			x2 = MAX(x2, r->x + r->width);
+			y2 = MAX(y2, r->y + r->height);
+		}
+		surface->damage_count = 0;
+	}
+
+	r = &surface->damage[surface->damage_count++];
+	r->x = x1;
+	r->y = y1;
+	r->width = x2 - x1;
+	r->height = y2 - y1;
+}
+
 void
 widget_set_use_cairo(struct widget *widget,
 		     int use_cairo)
@@ -4620,8 +4792,10 @@ window_schedule_redraw(struct window *window)
 
 	DBG_OBJ(window->main_surface->surface, "window %p\n", window);
 
-	wl_list_for_each(surface, &window->subsurface_list, link)
+	wl_list_for_each(surface, &window->subsurface_list, link) {
 		surface->redraw_needed = 1;
+		surface->damage_all = 1;
+	}
 
 	window_schedule_redraw_task(window);
 }
@@ -5973,8 +6147,10 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t id,
 	wl_list_insert(d->global_list.prev, &global->link);
 
 	if (strcmp(interface, "wl_compositor") == 0) {
+		d->compositor_version = MIN(version, 4);
 		d->compositor = wl_registry_bind(registry, id,
-						 &wl_compositor_interface, 3);
+						 &wl_compositor_interface,
+						 d->compositor_version);
 	} else if (strcmp(interface, "wl_output") == 0) {
 		display_add_output(d, id);
 	} else if (strcmp(interface, "wl_seat") == 0) {
@@ -606,6 +606,11 @@ widget_set_axis_handlers(struct widget *widget,
 void
 widget_schedule_redraw(struct widget *widget);
 void
+widget_schedule_partial_redraw(struct widget *widget);
+void
+widget_damage(struct widget *widget,
+	      int32_t x, int32_t y, int32_t width, int32_t height);
+void
 widget_set_use_cairo(struct widget *widget, int use_cairo);
 
 struct widget *
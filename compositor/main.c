@@ -39,6 +39,7 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/inotify.h>
 #include <libinput.h>
 #include <sys/time.h>
 #include <linux/limits.h>
@@ -79,6 +80,8 @@ struct wet_compositor {
 	struct wet_output_config *parsed_options;
 	struct wl_listener pending_output_listener;
 	bool drm_use_current_mode;
+	struct wl_event_source *config_watch;
+	struct wl_signal config_reload_signal;
 };
 
 static FILE *weston_logfile = NULL;
@@ -477,6 +480,92 @@ wet_get_config(struct weston_compositor *ec)
 	return compositor->config;
 }
 
+WL_EXPORT void
+wet_add_config_reload_listener(struct weston_compositor *ec,
+			       struct wl_listener *listener)
+{
+	struct wet_compositor *compositor = to_wet_compositor(ec);
+
+	wl_signal_add(&compositor->config_reload_signal, listener);
+}
+
+static int
+on_config_changed(int fd, uint32_t mask, void *data)
+{
+	struct wet_compositor *compositor = data;
+	const char *path = weston_config_get_full_path(compositor->config);
+	const char *name = strrchr(path, '/') + 1;
+	const struct inotify_event *event;
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(fd, buf, sizeof buf)) > 0) {
+		for (p = buf; p < buf + len; p += sizeof *event + event->len) {
+			event = (const struct inotify_event *) p;
+			if (event->len && strcmp(event->name, name) == 0)
+				changed = true;
+		}
+	}
+
+	if (!changed)
+		return 0;
+
+	switch (weston_config_reload(compositor->config)) {
+	case -1:
+		weston_log("failed to reload config file '%s', "
+			   "keeping the previous configuration\n", path);
+		break;
+	case 1:
+		weston_log("Reloaded config file '%s'\n", path);
+		wl_signal_emit(&compositor->config_reload_signal,
+			       compositor->config);
+		break;
+	}
+
+	return 0;
+}
+
+/* Watch the directory rather than the file, so that editors replacing
+ * the file with a new one are noticed as well. */
+static int
+wet_watch_config(struct wet_compositor *compositor,
+		 struct wl_event_loop *loop)
+{
+	const char *path = weston_config_get_full_path(compositor->config);
+	char *dir, *slash;
+	int fd, wd;
+
+	dir = strdup(path);
+	if (dir == NULL)
+		return -1;
+
+	slash = strrchr(dir, '/');
+	slash[slash == dir ? 1 : 0] = '\0';
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		free(dir);
+		return -1;
+	}
+
+	wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+	free(dir);
+	if (wd < 0) {
+		close(fd);
+		return -1;
+	}
+
+	compositor->config_watch =
+		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
+				     on_config_changed, compositor);
+	close(fd);
+
+	return compositor->config_watch ? 0 : -1;
+}
+
 static const char xdg_error_message[] =
 	"fatal: environment variable XDG_RUNTIME_DIR is not set.\n";
 
@@ -585,6 +674,8 @@ usage(int error_code)
 		"  --transform=TR\tThe output transformation, TR is one of:\n"
 		"\tnormal 90 180 270 flipped flipped-90 flipped-180 flipped-270\n"
 		"  --use-pixman\t\tUse the pixman (CPU) renderer (default: no rendering)\n"
+		"  --refresh-rate=RATE\tVirtual refresh rate in mHz, 0 to repaint\n"
+		"\t\t\tas fast as possible (default: 60000)\n"
 		"  --no-outputs\t\tDo not create any virtual outputs\n"
 		"\n");
 #endif
@@ -878,6 +969,28 @@ load_modules(struct weston_compositor *ec, const char *modules,
 	return 0;
 }
 
+static void
+wet_set_keymap_cache_dir(struct weston_compositor *ec)
+{
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char *dir;
+	int ret;
+
+	if (cache_home && cache_home[0] == '/')
+		ret = asprintf(&dir, "%s/weston", cache_home);
+	else if (home)
+		ret = asprintf(&dir, "%s/.cache/weston", home);
+	else
+		return;
+
+	if (ret < 0)
+		return;
+
+	weston_compositor_set_xkb_cache_dir(ec, dir);
+	free(dir);
+}
+
 static int
 weston_compositor_init_config(struct weston_compositor *ec,
 			      struct weston_config *config)
@@ -885,7 +998,10 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	struct xkb_rule_names xkb_names;
 	struct weston_config_section *s;
 	int repaint_msec;
+	int adaptive_repaint;
+	int coalesce_motion;
 	int vt_switching;
+	int keymap_cache;
 
 	s = weston_config_get_section(config, "keyboard", NULL, NULL);
 	weston_config_section_get_string(s, "keymap_rules",
@@ -902,6 +1018,10 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	if (weston_compositor_set_xkb_rule_names(ec, &xkb_names) < 0)
 		return -1;
 
+	weston_config_section_get_bool(s, "keymap-cache", &keymap_cache, true);
+	if (keymap_cache)
+		wet_set_keymap_cache_dir(ec);
+
 	weston_config_section_get_int(s, "repeat-rate",
 				      &ec->kb_repeat_rate, 40);
 	weston_config_section_get_int(s, "repeat-delay",
@@ -923,6 +1043,19 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	weston_log("Output repaint window is %d ms maximum.\n",
 		   ec->repaint_msec);
 
+	weston_config_section_get_bool(s, "adaptive-repaint",
+				       &adaptive_repaint, false);
+	ec->adaptive_repaint = adaptive_repaint;
+	if (ec->adaptive_repaint)
+		weston_log("Output repaint window adapts to measured "
+			   "repaint times.\n");
+
+	weston_config_section_get_bool(s, "coalesce-pointer-motion",
+				       &coalesce_motion, false);
+	ec->coalesce_pointer_motion = coalesce_motion;
+	if (ec->coalesce_pointer_motion)
+		weston_log("Pointer motion is delivered once per repaint.\n");
+
 	return 0;
 }
 
@@ -1286,10 +1419,13 @@ load_headless_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_INTEGER, "width", 0, &parsed_options->width },
 		{ WESTON_OPTION_INTEGER, "height", 0, &parsed_options->height },
 		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &config.use_pixman },
+		{ WESTON_OPTION_INTEGER, "refresh-rate", 0, &config.refresh },
 		{ WESTON_OPTION_STRING, "transform", 0, &transform },
 		{ WESTON_OPTION_BOOLEAN, "no-outputs", 0, &no_outputs },
 	};
 
+	config.refresh = 60000;
+
 	parse_options(options, ARRAY_LENGTH(options), argc, argv);
 
 	if (transform) {
@@ -1300,6 +1436,11 @@ load_headless_backend(struct weston_compositor *c,
 		free(transform);
 	}
 
+	if (config.refresh < 0) {
+		weston_log("Invalid refresh rate %d\n", config.refresh);
+		return -1;
+	}
+
 	config.base.struct_version = WESTON_HEADLESS_BACKEND_CONFIG_VERSION;
 	config.base.struct_size = sizeof(struct weston_headless_backend_config);
 
@@ -1785,6 +1926,8 @@ int main(int argc, char *argv[])
 	struct weston_seat *seat;
 	struct wet_compositor user_data;
 	int require_input;
+	int perf_protocol;
+	int watch_config;
 
 	const struct weston_option core_options[] = {
 		{ WESTON_OPTION_STRING, "backend", 'B', &backend },
@@ -1856,6 +1999,8 @@ int main(int argc, char *argv[])
 		goto out_signals;
 	user_data.config = config;
 	user_data.parsed_options = NULL;
+	user_data.config_watch = NULL;
+	wl_signal_init(&user_data.config_reload_signal);
 
 	section = weston_config_get_section(config, "core", NULL, NULL);
 
@@ -1879,6 +2024,12 @@ int main(int argc, char *argv[])
 				       &require_input, true);
 	ec->require_input = require_input;
 
+	weston_config_section_get_bool(section, "watch-config",
+				       &watch_config, false);
+	if (config && watch_config && wet_watch_config(&user_data, loop) < 0)
+		weston_log("warning: failed to watch the config file "
+			   "for changes: %m\n");
+
 	if (load_backend(ec, backend, &argc, argv, config) < 0) {
 		weston_log("fatal: failed to create compositor backend\n");
 		goto out;
@@ -1900,6 +2051,16 @@ int main(int argc, char *argv[])
 
 	weston_compositor_log_capabilities(ec);
 
+	/* weston_perf hands every client the damage and timing of all
+	 * outputs, so it is only offered when weston.ini asks for it. */
+	weston_config_section_get_bool(section, "perf-protocol",
+				       &perf_protocol, false);
+	if (perf_protocol) {
+		weston_log("weston_perf enabled, any client can read "
+			   "the per-frame performance counters\n");
+		perf_create(ec);
+	}
+
 	server_socket = getenv("WAYLAND_SERVER_SOCKET");
 	if (server_socket) {
 		weston_log("Running with single client\n");
@@ -1980,6 +2141,9 @@ out:
 	/* free(NULL) is valid, and it won't be NULL if it's used */
 	free(user_data.parsed_options);
 
+	if (user_data.config_watch)
+		wl_event_source_remove(user_data.config_watch);
+
 	weston_compositor_destroy(ec);
 
 out_signals:
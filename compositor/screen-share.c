@@ -37,6 +37,7 @@
 #include <linux/input.h>
 #include <errno.h>
 #include <ctype.h>
+#include <time.h>
 
 #include <wayland-client.h>
 
@@ -44,8 +45,11 @@
 #include "weston.h"
 #include "shared/helpers.h"
 #include "shared/os-compatibility.h"
+#include "shared/timespec-util.h"
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
 
+#define SS_DEFAULT_BUFFERS 3
+
 struct shared_output {
 	struct weston_output *output;
 	struct wl_listener output_destroyed;
@@ -72,12 +76,32 @@ struct shared_output {
 
 		struct wl_list buffers;
 		struct wl_list free_buffers;
+		int count, max_buffers;
 	} shm;
 
+	/* The buffer the next frame goes to.  It is filled from the cache
+	 * after every repaint, while the parent is still busy with the
+	 * previous frame, so that little is left to copy when the frame
+	 * callback arrives. */
+	struct ss_shm_buffer *next_buffer;
+
+	/* Damage since the last commit, in output coordinates */
+	pixman_region32_t damage;
+
 	int cache_dirty;
 	pixman_image_t *cache_image;
 	uint32_t *tmp_data;
 	size_t tmp_data_size;
+
+	struct {
+		struct wl_event_source *timer;
+		int interval;
+		struct timespec start, last;
+		uint32_t frames, repaints, busy;
+		uint64_t bytes_read, bytes_copied;
+		uint32_t last_frames;
+		uint64_t last_bytes_read, last_bytes_copied;
+	} stats;
 };
 
 struct ss_seat {
@@ -111,8 +135,13 @@ struct ss_shm_buffer {
 struct screen_share {
 	struct weston_compositor *compositor;
 	char *command;
+	int32_t buffers;
+	int32_t stats_interval;
 };
 
+static void
+shared_output_update(struct shared_output *so);
+
 static void
 ss_seat_handle_pointer_enter(void *data, struct wl_pointer *pointer,
 			     uint32_t serial, struct wl_surface *surface,
@@ -400,6 +429,9 @@ buffer_release(void *data, struct wl_buffer *buffer)
 
 	if (sb->output) {
 		wl_list_insert(&sb->output->shm.free_buffers, &sb->free_link);
+
+		/* A frame may be waiting for this buffer */
+		shared_output_update(sb->output);
 	} else {
 		ss_shm_buffer_destroy(sb);
 	}
@@ -437,6 +469,10 @@ shared_output_get_shm_buffer(struct shared_output *so)
 
 		so->shm.width = width;
 		so->shm.height = height;
+		so->shm.count = 0;
+
+		pixman_region32_fini(&so->damage);
+		pixman_region32_init_rect(&so->damage, 0, 0, width, height);
 	}
 
 	if (!wl_list_empty(&so->shm.free_buffers)) {
@@ -448,6 +484,12 @@ shared_output_get_shm_buffer(struct shared_output *so)
 		return sb;
 	}
 
+	/* Every buffer is with the parent */
+	if (so->shm.count >= so->shm.max_buffers) {
+		errno = EBUSY;
+		return NULL;
+	}
+
 	fd = os_create_anonymous_file(height * stride);
 	if (fd < 0) {
 		weston_log("os_create_anonymous_file: %m\n");
@@ -467,6 +509,7 @@ shared_output_get_shm_buffer(struct shared_output *so)
 	sb->output = so;
 	wl_list_init(&sb->free_link);
 	wl_list_insert(&so->shm.buffers, &sb->link);
+	so->shm.count++;
 
 	pixman_region32_init_rect(&sb->damage, 0, 0, width, height);
 
@@ -612,24 +655,46 @@ static const struct wl_callback_listener shared_output_frame_listener = {
 	shared_output_frame_callback
 };
 
-static void
-shared_output_update(struct shared_output *so)
+static uint64_t
+region_area(pixman_region32_t *region)
 {
-	struct ss_shm_buffer *sb;
 	pixman_box32_t *r;
+	uint64_t area = 0;
 	int i, nrects;
+
+	r = pixman_region32_rectangles(region, &nrects);
+	for (i = 0; i < nrects; i++)
+		area += (uint64_t) (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+
+	return area;
+}
+
+/* Copies the damage the next buffer has accumulated from the cache.
+ * Returns -1 on errors; if all buffers are with the parent there is no
+ * next buffer until one is released. */
+static int
+shared_output_prepare(struct shared_output *so)
+{
+	struct ss_shm_buffer *sb = so->next_buffer;
 	pixman_transform_t transform;
 
-	/* Only update if we need to */
-	if (!so->cache_dirty || so->parent.frame_cb)
-		return;
+	/* The parent never had it, so it is not orphaned but dropped */
+	if (sb && (so->shm.width != so->output->width ||
+		   so->shm.height != so->output->height)) {
+		ss_shm_buffer_destroy(sb);
+		so->next_buffer = sb = NULL;
+	}
 
-	sb = shared_output_get_shm_buffer(so);
 	if (sb == NULL) {
-		shared_output_destroy(so);
-		return;
+		sb = shared_output_get_shm_buffer(so);
+		if (sb == NULL)
+			return errno == EBUSY ? 0 : -1;
+		so->next_buffer = sb;
 	}
 
+	if (!pixman_region32_not_empty(&sb->damage))
+		return 0;
+
 	output_compute_transform(so->output, &transform);
 	pixman_image_set_transform(so->cache_image, &transform);
 
@@ -656,7 +721,39 @@ shared_output_update(struct shared_output *so)
 	pixman_image_set_transform(sb->pm_image, NULL);
 	pixman_image_set_clip_region32(sb->pm_image, NULL);
 
-	r = pixman_region32_rectangles(&sb->damage, &nrects);
+	so->stats.bytes_copied += region_area(&sb->damage) * 4;
+
+	/* Clear the buffer damage */
+	pixman_region32_clear(&sb->damage);
+
+	return 0;
+}
+
+static void
+shared_output_update(struct shared_output *so)
+{
+	struct ss_shm_buffer *sb;
+	pixman_box32_t *r;
+	int i, nrects;
+
+	/* Only update if we need to */
+	if (!so->cache_dirty || so->parent.frame_cb)
+		return;
+
+	if (shared_output_prepare(so) < 0) {
+		shared_output_destroy(so);
+		return;
+	}
+
+	/* Picked up again when a buffer is released */
+	sb = so->next_buffer;
+	if (sb == NULL) {
+		so->stats.busy++;
+		return;
+	}
+	so->next_buffer = NULL;
+
+	r = pixman_region32_rectangles(&so->damage, &nrects);
 	for (i = 0; i < nrects; ++i)
 		wl_surface_damage(so->parent.surface, r[i].x1, r[i].y1,
 				  r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
@@ -671,9 +768,59 @@ shared_output_update(struct shared_output *so)
 	wl_callback_destroy(wl_display_sync(so->parent.display));
 	wl_display_flush(so->parent.display);
 
-	/* Clear the buffer damage */
-	pixman_region32_fini(&sb->damage);
-	pixman_region32_init(&sb->damage);
+	pixman_region32_clear(&so->damage);
+	so->cache_dirty = 0;
+	so->stats.frames++;
+}
+
+static double
+stats_mib(uint64_t bytes)
+{
+	return bytes / (1024.0 * 1024.0);
+}
+
+static void
+shared_output_log_stats(struct shared_output *so, const char *what,
+			const struct timespec *since, uint32_t frames,
+			uint64_t bytes_read, uint64_t bytes_copied)
+{
+	struct timespec now;
+	double secs;
+
+	weston_compositor_read_presentation_clock(so->output->compositor,
+						  &now);
+	secs = timespec_sub_to_nsec(&now, since) / 1e9;
+	if (secs <= 0)
+		return;
+
+	weston_log("screen share on %s%s: %.1f fps, read %.1f MiB/s, "
+		   "copied %.1f MiB/s\n", so->output->name, what,
+		   frames / secs, stats_mib(bytes_read) / secs,
+		   stats_mib(bytes_copied) / secs);
+}
+
+static int
+shared_output_stats_timer(void *data)
+{
+	struct shared_output *so = data;
+
+	shared_output_log_stats(so, "", &so->stats.last,
+				so->stats.frames - so->stats.last_frames,
+				so->stats.bytes_read -
+				so->stats.last_bytes_read,
+				so->stats.bytes_copied -
+				so->stats.last_bytes_copied);
+
+	weston_compositor_read_presentation_clock(so->output->compositor,
+						  &so->stats.last);
+	so->stats.last_frames = so->stats.frames;
+	so->stats.last_bytes_read = so->stats.bytes_read;
+	so->stats.last_bytes_copied = so->stats.bytes_copied;
+
+	wl_event_source_timer_update(so->stats.timer,
+				     so->stats.interval * 1000);
+
+	return 0;
 }
 
 static void
@@ -809,6 +956,8 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 	/* Apply damage to all buffers */
 	wl_list_for_each(sb, &so->shm.buffers, link)
 		pixman_region32_union(&sb->damage, &sb->damage, &damage);
+	pixman_region32_union(&so->damage, &so->damage, &damage);
+	so->stats.repaints++;
 
 	/* Transform to buffer coordinates */
 	weston_transformed_region(so->output->width, so->output->height,
@@ -854,6 +1003,8 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
+		so->stats.bytes_read += width * height * 4;
+
 		if (do_yflip) {
 			so->output->compositor->renderer->read_pixels(
 				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
@@ -862,6 +1013,11 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 
 			pixman_blt(so->tmp_data, cache_data, -width, stride,
 				   32, 32, 0, 1 - height, x, y, width, height);
+		} else if (x == 0 && width == stride) {
+			/* Whole rows can go straight to the cache */
+			so->output->compositor->renderer->read_pixels(
+				so->output, PIXMAN_a8r8g8b8,
+				cache_data + y * stride, x, y, width, height);
 		} else {
 			so->output->compositor->renderer->read_pixels(
 				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
@@ -876,11 +1032,20 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 
 	so->cache_dirty = 1;
 
+	/* While the parent shows the previous frame, copy into the next
+	 * buffer now instead of when its frame callback comes in. */
+	if (so->parent.frame_cb) {
+		if (shared_output_prepare(so) < 0)
+			shared_output_destroy(so);
+		return;
+	}
+
 	shared_output_update(so);
 }
 
 static struct shared_output *
-shared_output_create(struct weston_output *output, int parent_fd)
+shared_output_create(struct screen_share *ss, struct weston_output *output,
+		     int parent_fd)
 {
 	struct shared_output *so;
 	struct wl_event_loop *loop;
@@ -956,9 +1121,25 @@ shared_output_create(struct weston_output *output, int parent_fd)
 		goto err_display;
 	}
 
+	if (ss->stats_interval > 0) {
+		so->stats.timer =
+			wl_event_loop_add_timer(loop,
+						shared_output_stats_timer, so);
+		if (!so->stats.timer) {
+			weston_log("Screen share failed: %m\n");
+			wl_event_source_remove(so->event_source);
+			goto err_display;
+		}
+		so->stats.interval = ss->stats_interval;
+		wl_event_source_timer_update(so->stats.timer,
+					     so->stats.interval * 1000);
+	}
+
 	/* Ok, everything's created.  We should be good to go */
 	wl_list_init(&so->shm.buffers);
 	wl_list_init(&so->shm.free_buffers);
+	so->shm.max_buffers = ss->buffers;
+	pixman_region32_init(&so->damage);
 
 	so->output = output;
 	so->output_destroyed.notify = output_destroyed;
@@ -969,6 +1150,10 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	output->disable_planes++;
 	weston_output_damage(output);
 
+	weston_compositor_read_presentation_clock(output->compositor,
+						  &so->stats.start);
+	so->stats.last = so->stats.start;
+
 	return so;
 
 err_display:
@@ -987,6 +1172,13 @@ shared_output_destroy(struct shared_output *so)
 {
 	struct ss_shm_buffer *buffer, *bnext;
 
+	shared_output_log_stats(so, " stopped", &so->stats.start,
+				so->stats.frames, so->stats.bytes_read,
+				so->stats.bytes_copied);
+	weston_log("screen share on %s: %u frames for %u repaints, "
+		   "%u waits for a free buffer\n", so->output->name,
+		   so->stats.frames, so->stats.repaints, so->stats.busy);
+
 	so->output->disable_planes--;
 
 	wl_list_for_each_safe(buffer, bnext, &so->shm.buffers, link)
@@ -996,10 +1188,13 @@ shared_output_destroy(struct shared_output *so)
 
 	wl_display_disconnect(so->parent.display);
 	wl_event_source_remove(so->event_source);
+	if (so->stats.timer)
+		wl_event_source_remove(so->stats.timer);
 
 	wl_list_remove(&so->output_destroyed.link);
 	wl_list_remove(&so->frame_listener.link);
 
+	pixman_region32_fini(&so->damage);
 	pixman_image_unref(so->cache_image);
 	free(so->tmp_data);
 
@@ -1007,7 +1202,7 @@ shared_output_destroy(struct shared_output *so)
 }
 
 static struct shared_output *
-weston_output_share(struct weston_output *output, const char* command)
+weston_output_share(struct screen_share *ss, struct weston_output *output)
 {
 	int sv[2];
 	char str[32];
@@ -1016,7 +1211,7 @@ weston_output_share(struct weston_output *output, const char* command)
 	char *const argv[] = {
 	  "/bin/sh",
 	  "-c",
-	  (char*)command,
+	  ss->command,
 	  NULL
 	};
 
@@ -1060,7 +1255,7 @@ weston_output_share(struct weston_output *output, const char* command)
 		abort();
 	} else {
 		close(sv[1]);
-		return shared_output_create(output, sv[0]);
+		return shared_output_create(ss, output, sv[0]);
 	}
 
 	return NULL;
@@ -1103,7 +1298,7 @@ share_output_binding(struct weston_keyboard *keyboard, uint32_t time, uint32_t k
 		return;
 	}
 
-	weston_output_share(output, ss->command);
+	weston_output_share(ss, output);
 }
 
 WL_EXPORT int
@@ -1122,6 +1317,12 @@ wet_module_init(struct weston_compositor *compositor,
 	section = weston_config_get_section(config, "screen-share", NULL, NULL);
 
 	weston_config_section_get_string(section, "command", &ss->command, "");
+	weston_config_section_get_int(section, "buffers", &ss->buffers,
+				      SS_DEFAULT_BUFFERS);
+	if (ss->buffers < 2)
+		ss->buffers = 2;
+	weston_config_section_get_int(section, "stats-interval",
+				      &ss->stats_interval, 0);
 
 	weston_compositor_add_key_binding(compositor, KEY_S,
 				          MODIFIER_CTRL | MODIFIER_ALT,
@@ -0,0 +1,220 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "compositor.h"
+#include "weston.h"
+#include "weston-perf-server-protocol.h"
+#include "shared/helpers.h"
+#include "shared/zalloc.h"
+
+/*
+ * Exposes the per-frame counters of struct weston_perf_frame to clients
+ * through the private weston_perf protocol. The counters are always
+ * collected; this only forwards them to subscribers, and is only
+ * created when the core section of weston.ini sets perf-protocol.
+ */
+
+struct perf {
+	struct weston_compositor *compositor;
+	struct wl_global *global;
+	struct wl_listener destroy_listener;
+};
+
+struct perf_output {
+	struct wl_resource *resource;
+	struct weston_output *output;
+	struct wl_listener frame_listener;
+	struct wl_listener output_destroy_listener;
+};
+
+static uint32_t
+clamp_u32(int64_t value)
+{
+	if (value < 0)
+		return 0;
+	if (value > UINT32_MAX)
+		return UINT32_MAX;
+	return value;
+}
+
+static void
+perf_output_unlink(struct perf_output *po)
+{
+	if (!po->output)
+		return;
+
+	wl_list_remove(&po->frame_listener.link);
+	wl_list_remove(&po->output_destroy_listener.link);
+	po->output = NULL;
+}
+
+static void
+perf_output_frame(struct wl_listener *listener, void *data)
+{
+	struct perf_output *po =
+		container_of(listener, struct perf_output, frame_listener);
+	struct weston_perf_frame *frame = data;
+
+	weston_perf_output_send_frame(po->resource,
+				      frame->views,
+				      frame->views_primary,
+				      frame->views_planes,
+				      clamp_u32(frame->damage_area),
+				      clamp_u32(frame->upload_bytes),
+				      clamp_u32(frame->repaint_nsec / 1000),
+				      clamp_u32(frame->latency_nsec / 1000),
+				      frame->missed ? 1 : 0);
+}
+
+static void
+perf_output_output_destroyed(struct wl_listener *listener, void *data)
+{
+	struct perf_output *po =
+		container_of(listener, struct perf_output,
+			     output_destroy_listener);
+
+	perf_output_unlink(po);
+	weston_perf_output_send_output_removed(po->resource);
+}
+
+static void
+perf_output_destroy_request(struct wl_client *client,
+			    struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct weston_perf_output_interface perf_output_implementation = {
+	perf_output_destroy_request,
+};
+
+static void
+perf_output_resource_destroy(struct wl_resource *resource)
+{
+	struct perf_output *po = wl_resource_get_user_data(resource);
+
+	perf_output_unlink(po);
+	free(po);
+}
+
+static void
+perf_destroy_request(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+perf_subscribe(struct wl_client *client, struct wl_resource *resource,
+	       uint32_t id, struct wl_resource *output_resource)
+{
+	struct weston_output *output =
+		wl_resource_get_user_data(output_resource);
+	struct perf_output *po;
+
+	po = zalloc(sizeof *po);
+	if (po == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	po->resource = wl_resource_create(client, &weston_perf_output_interface,
+					  1, id);
+	if (po->resource == NULL) {
+		free(po);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(po->resource,
+				       &perf_output_implementation, po,
+				       perf_output_resource_destroy);
+
+	/* The output may already be gone, with only its resource left. */
+	if (!output || output->destroying) {
+		weston_perf_output_send_output_removed(po->resource);
+		return;
+	}
+
+	po->output = output;
+	po->frame_listener.notify = perf_output_frame;
+	wl_signal_add(&output->perf_signal, &po->frame_listener);
+	po->output_destroy_listener.notify = perf_output_output_destroyed;
+	wl_signal_add(&output->destroy_signal, &po->output_destroy_listener);
+}
+
+static const struct weston_perf_interface perf_implementation = {
+	perf_destroy_request,
+	perf_subscribe,
+};
+
+static void
+bind_perf(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client, &weston_perf_interface, 1, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &perf_implementation,
+				       data, NULL);
+}
+
+static void
+perf_compositor_destroy(struct wl_listener *listener, void *data)
+{
+	struct perf *perf =
+		container_of(listener, struct perf, destroy_listener);
+
+	wl_global_destroy(perf->global);
+	free(perf);
+}
+
+void
+perf_create(struct weston_compositor *ec)
+{
+	struct perf *perf;
+
+	perf = zalloc(sizeof *perf);
+	if (perf == NULL)
+		return;
+
+	perf->compositor = ec;
+	perf->global = wl_global_create(ec->wl_display,
+					&weston_perf_interface, 1,
+					perf, bind_perf);
+	if (perf->global == NULL) {
+		free(perf);
+		return;
+	}
+
+	perf->destroy_listener.notify = perf_compositor_destroy;
+	wl_signal_add(&ec->destroy_signal, &perf->destroy_listener);
+}
@@ -35,6 +35,9 @@ extern "C" {
 void
 screenshooter_create(struct weston_compositor *ec);
 
+void
+perf_create(struct weston_compositor *ec);
+
 struct weston_process;
 typedef void (*weston_process_cleanup_func_t)(struct weston_process *process,
 					    int status);
@@ -60,6 +63,10 @@ weston_watch_process(struct weston_process *process);
 struct weston_config *
 wet_get_config(struct weston_compositor *compositor);
 
+void
+wet_add_config_reload_listener(struct weston_compositor *compositor,
+			       struct wl_listener *listener);
+
 void *
 wet_load_module_entrypoint(const char *name, const char *entrypoint);
 
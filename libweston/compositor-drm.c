@@ -1482,9 +1482,10 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 {
 	struct drm_backend *b = to_drm_backend(output_base->compositor);
 	struct drm_output *output = to_drm_output(output_base);
-	struct weston_view *ev, *next;
+	struct weston_view **views, *ev;
 	pixman_region32_t overlap, surface_overlap;
 	struct weston_plane *primary, *next_plane;
+	size_t i, n_views;
 
 	/*
 	 * Find a surface for each sprite in the output using some heuristics:
@@ -1506,8 +1507,14 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 	output->cursor_plane.x = INT32_MIN;
 	output->cursor_plane.y = INT32_MIN;
 
-	wl_list_for_each_safe(ev, next, &output_base->compositor->view_list, link) {
-		struct weston_surface *es = ev->surface;
+	views = output_base->view_list.data;
+	n_views = output_base->view_list.size / sizeof *views;
+
+	for (i = 0; i < n_views; i++) {
+		struct weston_surface *es;
+
+		ev = views[i];
+		es = ev->surface;
 
 		/* Test whether this buffer can ever go into a plane:
 		 * non-shm, or small enough to be a cursor.
@@ -36,6 +36,7 @@
 #include "compositor.h"
 #include "compositor-headless.h"
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "pixman-renderer.h"
 #include "presentation-time-server-protocol.h"
 #include "windowed-output-api.h"
@@ -46,6 +47,7 @@ struct headless_backend {
 
 	struct weston_seat fake_seat;
 	bool use_pixman;
+	int refresh;
 };
 
 struct headless_output {
@@ -53,8 +55,17 @@ struct headless_output {
 
 	struct weston_mode mode;
 	struct wl_event_source *finish_frame_timer;
+	struct wl_event_source *finish_frame_idle;
 	uint32_t *image_buf;
 	pixman_image_t *image;
+
+	/* Virtual vblank clock: vblank n happens at vblank_base +
+	 * n * frame_nsec, and n is the MSC. Zero frame_nsec means
+	 * unthrottled. */
+	int64_t frame_nsec;
+	struct timespec vblank_base;
+	struct timespec pending_vblank;
+	uint64_t pending_msc;
 };
 
 static inline struct headless_output *
@@ -69,13 +80,39 @@ to_headless_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct headless_backend, base);
 }
 
+/* Returns the number of the last virtual vblank at or before now. */
+static uint64_t
+headless_output_last_vblank(struct headless_output *output,
+			    const struct timespec *now,
+			    struct timespec *vblank)
+{
+	int64_t elapsed;
+	uint64_t msc;
+
+	elapsed = timespec_sub_to_nsec(now, &output->vblank_base);
+	msc = elapsed > 0 ? elapsed / output->frame_nsec : 0;
+	timespec_add_nsec(vblank, &output->vblank_base,
+			  msc * output->frame_nsec);
+
+	return msc;
+}
+
 static void
-headless_output_start_repaint_loop(struct weston_output *output)
+headless_output_start_repaint_loop(struct weston_output *output_base)
 {
-	struct timespec ts;
+	struct headless_output *output = to_headless_output(output_base);
+	struct timespec ts, vblank;
 
-	weston_compositor_read_presentation_clock(output->compositor, &ts);
-	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
+	weston_compositor_read_presentation_clock(output_base->compositor, &ts);
+
+	if (output->frame_nsec) {
+		output_base->msc = headless_output_last_vblank(output, &ts,
+							       &vblank);
+		ts = vblank;
+	}
+
+	weston_output_finish_frame(output_base, &ts,
+				   WP_PRESENTATION_FEEDBACK_INVALID);
 }
 
 static int
@@ -84,12 +121,63 @@ finish_frame_handler(void *data)
 	struct headless_output *output = data;
 	struct timespec ts;
 
-	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
-	weston_output_finish_frame(&output->base, &ts, 0);
+	if (output->frame_nsec) {
+		output->base.msc = output->pending_msc;
+		weston_output_finish_frame(&output->base,
+					   &output->pending_vblank,
+					   WP_PRESENTATION_FEEDBACK_KIND_VSYNC);
+	} else {
+		weston_compositor_read_presentation_clock(output->base.compositor,
+							  &ts);
+		output->base.msc++;
+		weston_output_finish_frame(&output->base, &ts, 0);
+	}
 
 	return 1;
 }
 
+static void
+finish_frame_idle_handler(void *data)
+{
+	struct headless_output *output = data;
+
+	output->finish_frame_idle = NULL;
+	finish_frame_handler(output);
+}
+
+/* Completes the frame on the next virtual vblank, or right away when
+ * unthrottled. */
+static void
+headless_output_schedule_finish_frame(struct headless_output *output)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	struct wl_event_loop *loop;
+	struct timespec now;
+	int64_t delay_nsec;
+	int delay_msec;
+
+	if (!output->frame_nsec) {
+		loop = wl_display_get_event_loop(ec->wl_display);
+		output->finish_frame_idle =
+			wl_event_loop_add_idle(loop, finish_frame_idle_handler,
+					       output);
+		return;
+	}
+
+	weston_compositor_read_presentation_clock(ec, &now);
+	output->pending_msc = headless_output_last_vblank(output, &now,
+							  &output->pending_vblank) + 1;
+	timespec_add_nsec(&output->pending_vblank, &output->pending_vblank,
+			  output->frame_nsec);
+
+	delay_nsec = timespec_sub_to_nsec(&output->pending_vblank, &now);
+	delay_msec = (delay_nsec + 999999) / 1000000;
+	if (delay_msec < 1)
+		delay_msec = 1;
+
+	wl_event_source_timer_update(output->finish_frame_timer, delay_msec);
+}
+
 static int
 headless_output_repaint(struct weston_output *output_base,
 		       pixman_region32_t *damage,
@@ -103,7 +191,7 @@ headless_output_repaint(struct weston_output *output_base,
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	headless_output_schedule_finish_frame(output);
 
 	return 0;
 }
@@ -118,6 +206,10 @@ headless_output_disable(struct weston_output *base)
 		return 0;
 
 	wl_event_source_remove(output->finish_frame_timer);
+	if (output->finish_frame_idle) {
+		wl_event_source_remove(output->finish_frame_idle);
+		output->finish_frame_idle = NULL;
+	}
 
 	if (b->use_pixman) {
 		pixman_renderer_output_destroy(&output->base);
@@ -150,6 +242,9 @@ headless_output_enable(struct weston_output *base)
 	output->finish_frame_timer =
 		wl_event_loop_add_timer(loop, finish_frame_handler, output);
 
+	weston_compositor_read_presentation_clock(b->compositor,
+						  &output->vblank_base);
+
 	if (b->use_pixman) {
 		output->image_buf = malloc(output->base.current_mode->width *
 					   output->base.current_mode->height * 4);
@@ -185,6 +280,7 @@ headless_output_set_size(struct weston_output *base,
 			 int width, int height)
 {
 	struct headless_output *output = to_headless_output(base);
+	struct headless_backend *b = to_headless_backend(base->compositor);
 	int output_width, output_height;
 
 	/* We can only be called once. */
@@ -200,7 +296,8 @@ headless_output_set_size(struct weston_output *base,
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	output->mode.width = output_width;
 	output->mode.height = output_height;
-	output->mode.refresh = 60000;
+	output->mode.refresh = b->refresh;
+	output->frame_nsec = b->refresh ? millihz_to_nsec(b->refresh) : 0;
 	wl_list_init(&output->base.mode_list);
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
@@ -285,6 +382,7 @@ headless_backend_create(struct weston_compositor *compositor,
 	b->base.restore = headless_restore;
 
 	b->use_pixman = config->use_pixman;
+	b->refresh = config->refresh;
 	if (b->use_pixman) {
 		pixman_renderer_init(compositor);
 	}
@@ -314,6 +412,7 @@ err_free:
 static void
 config_init_to_defaults(struct weston_headless_backend_config *config)
 {
+	config->refresh = 60000;
 }
 
 WL_EXPORT int
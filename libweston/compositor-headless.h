@@ -34,13 +34,17 @@ extern "C" {
 
 #include "compositor.h"
 
-#define WESTON_HEADLESS_BACKEND_CONFIG_VERSION 2
+#define WESTON_HEADLESS_BACKEND_CONFIG_VERSION 3
 
 struct weston_headless_backend_config {
 	struct weston_backend_config base;
 
 	/** Whether to use the pixman renderer instead of the OpenGL ES renderer. */
 	int use_pixman;
+
+	/** Refresh rate of the virtual outputs in mHz. Zero repaints as fast
+	 *  as possible, without any vblank throttling. */
+	int refresh;
 };
 
 #ifdef  __cplusplus
@@ -30,6 +30,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <linux/input.h>
 
 #if HAVE_FREERDP_VERSION_H
@@ -80,6 +83,7 @@
 #include "compositor.h"
 #include "compositor-rdp.h"
 #include "pixman-renderer.h"
+#include "rdp-raw.h"
 
 #define MAX_FREERDP_FDS 32
 #define DEFAULT_AXIS_STEP_DISTANCE 10
@@ -95,8 +99,40 @@
 #	define DEFAULT_PIXEL_FORMAT RDP_PIXEL_FORMAT_B8G8R8A8
 #endif
 
+/* Upper limit of encoding threads */
+#define RDP_MAX_ENCODE_THREADS 16
+
+/* Upper limit of tiles an NSCodec frame is split into, each encoded on
+ * its own */
+#define RDP_MAX_TILES 4
+
+/* Frames smaller than this many pixels are encoded as one tile */
+#define RDP_MIN_TILED_AREA (256 * 256)
+
+/* Tile borders lie on a grid of this many output rows */
+#define RDP_TILE_ALIGN 64
+
 struct rdp_output;
 
+/* Worker threads encoding the tiles of all peers. Finished frames are
+ * sent from the compositor thread, woken up through done_fd.
+ */
+struct rdp_encoder {
+	int n_threads;
+	pthread_t *threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t queue_cond;
+	pthread_cond_t done_cond;
+	struct wl_list queue; /* rdp_encode_tile::link */
+	struct wl_list done; /* rdp_peer_context::done_link */
+	bool quit;
+
+	int done_fd;
+	struct wl_event_source *done_source;
+	/* errno of a failed done_fd write, logged by the compositor thread */
+	int signal_error;
+};
+
 struct rdp_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
@@ -110,6 +146,8 @@ struct rdp_backend {
 	char *rdp_key;
 	int tls_enabled;
 	int no_clients_resize;
+
+	struct rdp_encoder encoder;
 };
 
 enum peer_item_flags {
@@ -133,15 +171,53 @@ struct rdp_output {
 	struct wl_list peers;
 };
 
+/* A surface bits command, its data is a slice of the tile's stream */
+struct rdp_encode_command {
+	pixman_box32_t box;
+	UINT16 codec_id;
+	size_t offset;
+	size_t length;
+};
+
+/* A part of a frame that is encoded on its own. NSCodec contexts are not
+ * thread safe, so every tile has its own.
+ */
+struct rdp_encode_tile {
+	struct rdp_peer_context *peer;
+	struct wl_list link; /* rdp_encoder::queue */
+
+	pixman_region32_t damage;
+	NSC_CONTEXT *nsc_context;
+	RFX_RECT *rfx_rects;
+	wStream *encode_stream;
+	struct wl_array commands; /* struct rdp_encode_command */
+};
+
 struct rdp_peer_context {
 	rdpContext _p;
 
 	struct rdp_backend *rdpBackend;
 	struct wl_event_source *events[MAX_FREERDP_FDS];
+
+	/* Encoding of the current frame, see rdp_peer_queue_frame(). Workers
+	 * only read frame_image, a copy of the damaged output contents. */
+	struct rdp_encode_tile tiles[RDP_MAX_TILES];
+	int n_tiles;
+	/* Every RemoteFX message carries the stream headers and frame index
+	 * of its context, so a peer gets a single context and RemoteFX
+	 * frames are never split into tiles. */
 	RFX_CONTEXT *rfx_context;
-	wStream *encode_stream;
-	RFX_RECT *rfx_rects;
-	NSC_CONTEXT *nsc_context;
+	int tiles_left; /* protected by rdp_encoder::mutex */
+	bool encoding;
+	struct wl_list done_link;
+	pixman_image_t *frame_image;
+	pixman_region32_t pending_damage;
+	uint32_t frames_dropped;
+
+	/* Staging buffer and merged rectangles of the raw path */
+	BYTE *raw_buffer;
+	size_t raw_buffer_size;
+	struct wl_array raw_rects;
 
 	struct rdp_peers_item item;
 };
@@ -160,132 +236,509 @@ to_rdp_backend(struct weston_compositor *base)
 }
 
 static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_encode_tile_add_command(struct rdp_encode_tile *tile,
+			    const pixman_box32_t *box, UINT16 codec_id,
+			    size_t offset)
 {
+	struct rdp_encode_command *command;
+
+	command = wl_array_add(&tile->commands, sizeof *command);
+	if (!command)
+		return;
+
+	command->box = *box;
+	command->codec_id = codec_id;
+	command->offset = offset;
+	command->length = Stream_GetPosition(tile->encode_stream) - offset;
+}
+
+static void
+rdp_encode_tile_rfx(struct rdp_encode_tile *tile, pixman_image_t *image,
+		    UINT16 codec_id)
+{
+	pixman_box32_t *extents = &tile->damage.extents;
 	int width, height, nrects, i;
 	pixman_box32_t *region, *rects;
 	uint32_t *ptr;
 	RFX_RECT *rfxRect;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
-
-	width = (damage->extents.x2 - damage->extents.x1);
-	height = (damage->extents.y2 - damage->extents.y1);
-
-#ifdef HAVE_SKIP_COMPRESSION
-	cmd->skipCompression = TRUE;
-#else
-	memset(cmd, 0, sizeof(*cmd));
-#endif
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->RemoteFxCodecId;
-	cmd->width = width;
-	cmd->height = height;
+	width = (extents->x2 - extents->x1);
+	height = (extents->y2 - extents->y1);
 
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+	ptr = pixman_image_get_data(image) + extents->x1 +
+				extents->y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
-	rects = pixman_region32_rectangles(damage, &nrects);
-	context->rfx_rects = realloc(context->rfx_rects, nrects * sizeof *rfxRect);
+	rects = pixman_region32_rectangles(&tile->damage, &nrects);
+	rfxRect = realloc(tile->rfx_rects, nrects * sizeof *rfxRect);
+	if (!rfxRect)
+		return;
+	tile->rfx_rects = rfxRect;
 
 	for (i = 0; i < nrects; i++) {
 		region = &rects[i];
-		rfxRect = &context->rfx_rects[i];
+		rfxRect = &tile->rfx_rects[i];
 
-		rfxRect->x = (region->x1 - damage->extents.x1);
-		rfxRect->y = (region->y1 - damage->extents.y1);
+		rfxRect->x = (region->x1 - extents->x1);
+		rfxRect->y = (region->y1 - extents->y1);
 		rfxRect->width = (region->x2 - region->x1);
 		rfxRect->height = (region->y2 - region->y1);
 	}
 
-	rfx_compose_message(context->rfx_context, context->encode_stream, context->rfx_rects, nrects,
+	rfx_compose_message(tile->peer->rfx_context, tile->encode_stream, tile->rfx_rects, nrects,
 			(BYTE *)ptr, width, height,
 			pixman_image_get_stride(image)
 	);
 
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
+	rdp_encode_tile_add_command(tile, extents, codec_id, 0);
+}
+
+/* Unlike RemoteFX, an NSCodec message covers one rectangle, so every
+ * damage rectangle is sent on its own instead of the damage extents. */
+static void
+rdp_encode_tile_nsc(struct rdp_encode_tile *tile, pixman_image_t *image,
+		    UINT16 codec_id)
+{
+	pixman_box32_t *rects;
+	int nrects, i;
+	uint32_t *ptr;
+	size_t offset;
+
+	rects = pixman_region32_rectangles(&tile->damage, &nrects);
+
+	for (i = 0; i < nrects; i++) {
+		ptr = pixman_image_get_data(image) + rects[i].x1 +
+			rects[i].y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+
+		offset = Stream_GetPosition(tile->encode_stream);
+		nsc_compose_message(tile->nsc_context, tile->encode_stream, (BYTE *)ptr,
+				rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1,
+				pixman_image_get_stride(image));
+
+		rdp_encode_tile_add_command(tile, &rects[i], codec_id, offset);
+	}
+}
+
+/* Runs on an encoder thread */
+static void
+rdp_encode_tile(struct rdp_encode_tile *tile)
+{
+	RdpPeerContext *context = tile->peer;
+	rdpSettings *settings = context->item.peer->settings;
+
+	Stream_Clear(tile->encode_stream);
+	Stream_SetPosition(tile->encode_stream, 0);
+	tile->commands.size = 0;
 
-	update->SurfaceBits(update->context, cmd);
+	if (settings->RemoteFxCodec)
+		rdp_encode_tile_rfx(tile, context->frame_image,
+				    settings->RemoteFxCodecId);
+	else
+		rdp_encode_tile_nsc(tile, context->frame_image,
+				    settings->NSCodecId);
 }
 
+static void *
+rdp_encoder_thread(void *data)
+{
+	struct rdp_encoder *encoder = data;
+	struct rdp_encode_tile *tile;
+	RdpPeerContext *context;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&encoder->mutex);
 
+	for (;;) {
+		while (!encoder->quit && wl_list_empty(&encoder->queue))
+			pthread_cond_wait(&encoder->queue_cond,
+					  &encoder->mutex);
+
+		if (encoder->quit)
+			break;
+
+		tile = container_of(encoder->queue.next,
+				    struct rdp_encode_tile, link);
+		wl_list_remove(&tile->link);
+		wl_list_init(&tile->link);
+
+		pthread_mutex_unlock(&encoder->mutex);
+		rdp_encode_tile(tile);
+		pthread_mutex_lock(&encoder->mutex);
+
+		context = tile->peer;
+		if (--context->tiles_left == 0) {
+			wl_list_insert(encoder->done.prev, &context->done_link);
+			pthread_cond_broadcast(&encoder->done_cond);
+			if (write(encoder->done_fd, &one, sizeof one) < 0)
+				encoder->signal_error = errno;
+		}
+	}
+
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return NULL;
+}
+
+/* Forget the frame being encoded for a peer, waiting for the tiles that
+ * a worker already picked up. */
 static void
-rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_cancel_frame(RdpPeerContext *context)
 {
-	int width, height;
-	uint32_t *ptr;
+	struct rdp_encoder *encoder = &context->rdpBackend->encoder;
+	int i;
+
+	if (!context->encoding)
+		return;
+
+	pthread_mutex_lock(&encoder->mutex);
+
+	for (i = 0; i < context->n_tiles; i++) {
+		if (wl_list_empty(&context->tiles[i].link))
+			continue;
+
+		wl_list_remove(&context->tiles[i].link);
+		wl_list_init(&context->tiles[i].link);
+		context->tiles_left--;
+	}
+
+	while (context->tiles_left > 0)
+		pthread_cond_wait(&encoder->done_cond, &encoder->mutex);
+
+	wl_list_remove(&context->done_link);
+	wl_list_init(&context->done_link);
+
+	pthread_mutex_unlock(&encoder->mutex);
+
+	context->encoding = false;
+}
+
+static int
+rdp_peer_ensure_frame_image(RdpPeerContext *context, pixman_image_t *shadow)
+{
+	int width = pixman_image_get_width(shadow);
+	int height = pixman_image_get_height(shadow);
+
+	if (context->frame_image &&
+	    pixman_image_get_width(context->frame_image) == width &&
+	    pixman_image_get_height(context->frame_image) == height)
+		return 0;
+
+	if (context->frame_image)
+		pixman_image_unref(context->frame_image);
+
+	context->frame_image =
+		pixman_image_create_bits_no_clear(PIXMAN_x8r8g8b8,
+						  width, height, NULL, 0);
+
+	return context->frame_image ? 0 : -1;
+}
+
+/* Split the pending damage into horizontal bands and hand them to the
+ * encoder threads. */
+static void
+rdp_peer_start_frame(RdpPeerContext *context)
+{
+	struct rdp_encoder *encoder = &context->rdpBackend->encoder;
+	rdpSettings *settings = context->item.peer->settings;
+	pixman_image_t *shadow = context->rdpBackend->output->shadow_surface;
+	pixman_region32_t *damage = &context->pending_damage;
+	pixman_box32_t *extents = &damage->extents;
+	pixman_box32_t *rects;
+	struct rdp_encode_tile *tile;
+	int nrects, n_tiles, band, top, y, i;
+
+	if (rdp_peer_ensure_frame_image(context, shadow) < 0) {
+		pixman_region32_clear(damage);
+		return;
+	}
+
+	rects = pixman_region32_rectangles(damage, &nrects);
+	for (i = 0; i < nrects; i++)
+		pixman_image_composite32(PIXMAN_OP_SRC,
+					 shadow, NULL, context->frame_image,
+					 rects[i].x1, rects[i].y1, 0, 0,
+					 rects[i].x1, rects[i].y1,
+					 rects[i].x2 - rects[i].x1,
+					 rects[i].y2 - rects[i].y1);
+
+	n_tiles = MIN(context->n_tiles, encoder->n_threads);
+	if (settings->RemoteFxCodec ||
+	    (extents->x2 - extents->x1) * (extents->y2 - extents->y1) <
+	    RDP_MIN_TILED_AREA)
+		n_tiles = 1;
+
+	top = extents->y1 & ~(RDP_TILE_ALIGN - 1);
+	band = (extents->y2 - top + n_tiles - 1) / n_tiles;
+	band = (band + RDP_TILE_ALIGN - 1) / RDP_TILE_ALIGN * RDP_TILE_ALIGN;
+
+	pthread_mutex_lock(&encoder->mutex);
+
+	context->tiles_left = 0;
+	for (i = 0, y = top; y < extents->y2; i++, y += band) {
+		tile = &context->tiles[i];
+		pixman_region32_intersect_rect(&tile->damage, damage,
+					       extents->x1, y,
+					       extents->x2 - extents->x1,
+					       band);
+		if (!pixman_region32_not_empty(&tile->damage))
+			continue;
+
+		wl_list_insert(encoder->queue.prev, &tile->link);
+		context->tiles_left++;
+	}
+
+	/* Empty tiles of this frame must not send their old commands */
+	for (; i < context->n_tiles; i++)
+		pixman_region32_clear(&context->tiles[i].damage);
+
+	if (context->tiles_left > 0) {
+		context->encoding = true;
+		pthread_cond_broadcast(&encoder->queue_cond);
+	}
+
+	pthread_mutex_unlock(&encoder->mutex);
+
+	pixman_region32_clear(damage);
+}
+
+static void
+rdp_peer_send_frame(RdpPeerContext *context)
+{
+	freerdp_peer *peer = context->item.peer;
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
+	struct rdp_encode_tile *tile;
+	struct rdp_encode_command *command;
+	int i;
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
+	marker->frameId++;
+	marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
+	update->SurfaceFrameMarker(peer->context, marker);
 
-	width = (damage->extents.x2 - damage->extents.x1);
-	height = (damage->extents.y2 - damage->extents.y1);
+	for (i = 0; i < context->n_tiles; i++) {
+		tile = &context->tiles[i];
+		if (!pixman_region32_not_empty(&tile->damage))
+			continue;
 
+		wl_array_for_each(command, &tile->commands) {
 #ifdef HAVE_SKIP_COMPRESSION
-	cmd->skipCompression = TRUE;
+			cmd->skipCompression = TRUE;
 #else
-	memset(cmd, 0, sizeof(*cmd));
+			memset(cmd, 0, sizeof(*cmd));
 #endif
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->NSCodecId;
-	cmd->width = width;
-	cmd->height = height;
-
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
-
-	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
-			cmd->width,	cmd->height,
-			pixman_image_get_stride(image));
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
-	update->SurfaceBits(update->context, cmd);
+			cmd->destLeft = command->box.x1;
+			cmd->destTop = command->box.y1;
+			cmd->destRight = command->box.x2;
+			cmd->destBottom = command->box.y2;
+			cmd->bpp = 32;
+			cmd->codecID = command->codec_id;
+			cmd->width = command->box.x2 - command->box.x1;
+			cmd->height = command->box.y2 - command->box.y1;
+			cmd->bitmapDataLength = command->length;
+			cmd->bitmapData =
+				Stream_Buffer(tile->encode_stream) + command->offset;
+
+			update->SurfaceBits(update->context, cmd);
+		}
+	}
+
+	marker->frameAction = SURFACECMD_FRAMEACTION_END;
+	update->SurfaceFrameMarker(peer->context, marker);
+}
+
+static int
+rdp_encoder_done(int fd, uint32_t mask, void *data)
+{
+	struct rdp_encoder *encoder = data;
+	RdpPeerContext *context, *next;
+	struct wl_list done;
+	uint64_t count;
+	int error;
+
+	if (read(fd, &count, sizeof count) < 0)
+		return 0;
+
+	wl_list_init(&done);
+
+	pthread_mutex_lock(&encoder->mutex);
+	wl_list_insert_list(&done, &encoder->done);
+	wl_list_init(&encoder->done);
+	error = encoder->signal_error;
+	encoder->signal_error = 0;
+	pthread_mutex_unlock(&encoder->mutex);
+
+	if (error)
+		weston_log("failed to signal RDP encoding: %s\n",
+			   strerror(error));
+
+	wl_list_for_each_safe(context, next, &done, done_link) {
+		wl_list_remove(&context->done_link);
+		wl_list_init(&context->done_link);
+		context->encoding = false;
+
+		rdp_peer_send_frame(context);
+
+		/* Damage that arrived meanwhile, possibly of several frames,
+		 * is encoded as one. */
+		if (pixman_region32_not_empty(&context->pending_damage))
+			rdp_peer_start_frame(context);
+	}
+
+	return 0;
+}
+
+/* Queue output damage for encoding. A peer has at most one frame being
+ * encoded; if it falls behind, its damage accumulates and the frames in
+ * between are dropped, so that a slow peer never stalls the compositor.
+ */
+static void
+rdp_peer_queue_frame(pixman_region32_t *damage, freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+
+	if (context->encoding &&
+	    pixman_region32_not_empty(&context->pending_damage))
+		context->frames_dropped++;
+
+	pixman_region32_union(&context->pending_damage,
+			      &context->pending_damage, damage);
+
+	if (!context->encoding)
+		rdp_peer_start_frame(context);
+}
+
+static int
+rdp_encoder_thread_count(void)
+{
+	const char *env = getenv("WESTON_RDP_THREADS");
+	long n;
+
+	if (env)
+		n = strtol(env, NULL, 10);
+	else
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		n = 1;
+	if (n > RDP_MAX_ENCODE_THREADS)
+		n = RDP_MAX_ENCODE_THREADS;
+
+	return n;
 }
 
 static void
-pixman_image_flipped_subrect(const pixman_box32_t *rect, pixman_image_t *img, BYTE *dest)
+rdp_encoder_stop(struct rdp_encoder *encoder)
+{
+	int i;
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->quit = true;
+	pthread_cond_broadcast(&encoder->queue_cond);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	for (i = 0; i < encoder->n_threads; i++)
+		pthread_join(encoder->threads[i], NULL);
+
+	free(encoder->threads);
+	wl_event_source_remove(encoder->done_source);
+	close(encoder->done_fd);
+
+	pthread_cond_destroy(&encoder->done_cond);
+	pthread_cond_destroy(&encoder->queue_cond);
+	pthread_mutex_destroy(&encoder->mutex);
+}
+
+static int
+rdp_encoder_start(struct rdp_encoder *encoder, struct wl_event_loop *loop)
+{
+	int i, n = rdp_encoder_thread_count();
+
+	encoder->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (encoder->done_fd < 0)
+		return -1;
+
+	encoder->done_source = wl_event_loop_add_fd(loop, encoder->done_fd,
+						    WL_EVENT_READABLE,
+						    rdp_encoder_done, encoder);
+	if (!encoder->done_source)
+		goto err_fd;
+
+	encoder->threads = calloc(n, sizeof *encoder->threads);
+	if (!encoder->threads)
+		goto err_source;
+
+	pthread_mutex_init(&encoder->mutex, NULL);
+	pthread_cond_init(&encoder->queue_cond, NULL);
+	pthread_cond_init(&encoder->done_cond, NULL);
+	wl_list_init(&encoder->queue);
+	wl_list_init(&encoder->done);
+
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&encoder->threads[i], NULL,
+				   rdp_encoder_thread, encoder) != 0)
+			break;
+		encoder->n_threads++;
+	}
+
+	if (encoder->n_threads == 0) {
+		rdp_encoder_stop(encoder);
+		return -1;
+	}
+
+	weston_log("RDP encoding uses %d threads\n", encoder->n_threads);
+
+	return 0;
+
+err_source:
+	wl_event_source_remove(encoder->done_source);
+err_fd:
+	close(encoder->done_fd);
+	return -1;
+}
+
+static int
+rdp_peer_ensure_raw_buffer(RdpPeerContext *context, size_t size)
 {
-	int stride = pixman_image_get_stride(img);
-	int h;
-	int toCopy = (rect->x2 - rect->x1) * 4;
-	int height = (rect->y2 - rect->y1);
-	const BYTE *src = (const BYTE *)pixman_image_get_data(img);
-	src += ((rect->y2-1) * stride) + (rect->x1 * 4);
-
-	for (h = 0; h < height; h++, src -= stride, dest += toCopy)
-		   memcpy(dest, src, toCopy);
+	BYTE *buffer;
+
+	if (size <= context->raw_buffer_size)
+		return 0;
+
+	buffer = realloc(context->raw_buffer, size);
+	if (!buffer)
+		return -1;
+
+	context->raw_buffer = buffer;
+	context->raw_buffer_size = size;
+
+	return 0;
 }
 
 static void
 rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_peer *peer)
 {
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
 	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
-	pixman_box32_t *rect, subrect;
+	uint32_t max_request_size = peer->settings->MultifragMaxRequestSize;
+	pixman_box32_t *rects, *rect, subrect;
 	int nrects, i;
-	int heightIncrement, remainingHeight, top;
+	int heightIncrement, top;
 
-	rect = pixman_region32_rectangles(region, &nrects);
+	rects = pixman_region32_rectangles(region, &nrects);
 	if (!nrects)
 		return;
 
+	/* Both buffers only grow, so steady updates allocate nothing. */
+	context->raw_rects.size = 0;
+	rect = wl_array_add(&context->raw_rects, nrects * sizeof *rect);
+	if (!rect ||
+	    rdp_peer_ensure_raw_buffer(context, max_request_size) < 0)
+		return;
+
+	nrects = rdp_raw_merge_rects(rects, nrects, rect);
+
 	marker->frameId++;
 	marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
 	update->SurfaceFrameMarker(peer->context, marker);
@@ -293,6 +746,7 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 	memset(cmd, 0, sizeof(*cmd));
 	cmd->bpp = 32;
 	cmd->codecID = 0;
+	cmd->bitmapData = context->raw_buffer;
 
 	for (i = 0; i < nrects; i++, rect++) {
 		/*weston_log("rect(%d,%d, %d,%d)\n", rect->x1, rect->y1, rect->x2, rect->y2);*/
@@ -300,29 +754,28 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 		cmd->destRight = rect->x2;
 		cmd->width = rect->x2 - rect->x1;
 
-		heightIncrement = peer->settings->MultifragMaxRequestSize / (16 + cmd->width * 4);
-		remainingHeight = rect->y2 - rect->y1;
-		top = rect->y1;
+		heightIncrement = rdp_raw_strip_height(cmd->width, max_request_size);
+
+		/* A single row wider than a request still goes out whole. */
+		if (rdp_peer_ensure_raw_buffer(context, cmd->width * 4) < 0)
+			break;
+		cmd->bitmapData = context->raw_buffer;
 
 		subrect.x1 = rect->x1;
 		subrect.x2 = rect->x2;
 
-		while (remainingHeight) {
-			   cmd->height = (remainingHeight > heightIncrement) ? heightIncrement : remainingHeight;
-			   cmd->destTop = top;
-			   cmd->destBottom = top + cmd->height;
-			   cmd->bitmapDataLength = cmd->width * cmd->height * 4;
-			   cmd->bitmapData = (BYTE *)realloc(cmd->bitmapData, cmd->bitmapDataLength);
+		for (top = rect->y1; top < rect->y2; top += cmd->height) {
+			cmd->height = MIN(heightIncrement, rect->y2 - top);
+			cmd->destTop = top;
+			cmd->destBottom = top + cmd->height;
+			cmd->bitmapDataLength = cmd->width * cmd->height * 4;
 
-			   subrect.y1 = top;
-			   subrect.y2 = top + cmd->height;
-			   pixman_image_flipped_subrect(&subrect, image, cmd->bitmapData);
+			subrect.y1 = top;
+			subrect.y2 = top + cmd->height;
+			rdp_raw_copy_flipped(image, &subrect, cmd->bitmapData);
 
-			   /*weston_log("*  sending (%d,%d, %d,%d)\n", subrect.x1, subrect.y1, subrect.x2, subrect.y2); */
-			   update->SurfaceBits(peer->context, cmd);
-
-			   remainingHeight -= cmd->height;
-			   top += cmd->height;
+			/*weston_log("*  sending (%d,%d, %d,%d)\n", subrect.x1, subrect.y1, subrect.x2, subrect.y2); */
+			update->SurfaceBits(peer->context, cmd);
 		}
 	}
 
@@ -337,10 +790,8 @@ rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
 	struct rdp_output *output = context->rdpBackend->output;
 	rdpSettings *settings = peer->settings;
 
-	if (settings->RemoteFxCodec)
-		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
-	else if (settings->NSCodec)
-		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
+	if (settings->RemoteFxCodec || settings->NSCodec)
+		rdp_peer_queue_frame(region, peer);
 	else
 		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
 }
@@ -603,6 +1054,7 @@ rdp_destroy(struct weston_compositor *ec)
 	struct rdp_backend *b = to_rdp_backend(ec);
 	int i;
 
+	rdp_encoder_stop(&b->encoder);
 	weston_compositor_shutdown(ec);
 	for (i = 0; i < MAX_FREERDP_FDS; i++)
 		if (b->listener_events[i])
@@ -656,42 +1108,79 @@ int rdp_implant_listener(struct rdp_backend *b, freerdp_listener* instance)
 }
 
 
+static void
+rdp_encode_tile_fini(struct rdp_encode_tile *tile)
+{
+	if (tile->encode_stream)
+		Stream_Free(tile->encode_stream, TRUE);
+	if (tile->nsc_context)
+		nsc_context_free(tile->nsc_context);
+	free(tile->rfx_rects);
+	wl_array_release(&tile->commands);
+	pixman_region32_fini(&tile->damage);
+}
+
+static bool
+rdp_encode_tile_init(struct rdp_encode_tile *tile, RdpPeerContext *context)
+{
+	tile->peer = context;
+	wl_list_init(&tile->link);
+	pixman_region32_init(&tile->damage);
+	wl_array_init(&tile->commands);
+
+	tile->nsc_context = nsc_context_new();
+	if (!tile->nsc_context)
+		return false;
+
+	nsc_context_set_pixel_format(tile->nsc_context, DEFAULT_PIXEL_FORMAT);
+
+	tile->encode_stream = Stream_New(NULL, 65536);
+	if (!tile->encode_stream)
+		return false;
+
+	return true;
+}
+
 static FREERDP_CB_RET_TYPE
 rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 {
+	int i;
+
 	context->item.peer = client;
 	context->item.flags = RDP_PEER_OUTPUT_ENABLED;
 
+	wl_list_init(&context->done_link);
+	pixman_region32_init(&context->pending_damage);
+	wl_array_init(&context->raw_rects);
+
 #if FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1
 	context->rfx_context = rfx_context_new();
 #else
 	context->rfx_context = rfx_context_new(TRUE);
 #endif
-	if (!context->rfx_context) {
-		FREERDP_CB_RETURN(FALSE);
-	}
+	if (!context->rfx_context)
+		goto out_error_rfx;
 
 	context->rfx_context->mode = RLGR3;
 	context->rfx_context->width = client->settings->DesktopWidth;
 	context->rfx_context->height = client->settings->DesktopHeight;
 	rfx_context_set_pixel_format(context->rfx_context, DEFAULT_PIXEL_FORMAT);
 
-	context->nsc_context = nsc_context_new();
-	if (!context->nsc_context)
-		goto out_error_nsc;
-
-	nsc_context_set_pixel_format(context->nsc_context, DEFAULT_PIXEL_FORMAT);
-
-	context->encode_stream = Stream_New(NULL, 65536);
-	if (!context->encode_stream)
-		goto out_error_stream;
+	for (i = 0; i < RDP_MAX_TILES; i++) {
+		context->n_tiles++;
+		if (!rdp_encode_tile_init(&context->tiles[i], context))
+			goto out_error_tiles;
+	}
 
 	FREERDP_CB_RETURN(TRUE);
 
-out_error_nsc:
+out_error_tiles:
+	for (i = 0; i < context->n_tiles; i++)
+		rdp_encode_tile_fini(&context->tiles[i]);
+	context->n_tiles = 0;
 	rfx_context_free(context->rfx_context);
-out_error_stream:
-	nsc_context_free(context->nsc_context);
+out_error_rfx:
+	pixman_region32_fini(&context->pending_damage);
 	FREERDP_CB_RETURN(FALSE);
 }
 
@@ -715,10 +1204,20 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		 * but it would crash on reconnect */
 	}
 
-	Stream_Free(context->encode_stream, TRUE);
-	nsc_context_free(context->nsc_context);
+	rdp_peer_cancel_frame(context);
+	if (context->frames_dropped)
+		weston_log("RDP peer %p dropped %u frames\n",
+			   client, context->frames_dropped);
+
+	for (i = 0; i < context->n_tiles; i++)
+		rdp_encode_tile_fini(&context->tiles[i]);
 	rfx_context_free(context->rfx_context);
-	free(context->rfx_rects);
+	if (context->frame_image)
+		pixman_image_unref(context->frame_image);
+	pixman_region32_fini(&context->pending_damage);
+
+	free(context->raw_buffer);
+	wl_array_release(&context->raw_rects);
 }
 
 
@@ -941,8 +1440,13 @@ xf_peer_activate(freerdp_peer* client)
 	}
 
 	weston_output = &output->base;
+	/* A frame of the old size is of no use anymore, and the codec
+	 * contexts must not be reset while a worker uses them. */
+	rdp_peer_cancel_frame(peerCtx);
+	pixman_region32_clear(&peerCtx->pending_damage);
 	RFX_RESET(peerCtx->rfx_context, weston_output->width, weston_output->height);
-	NSC_RESET(peerCtx->nsc_context, weston_output->width, weston_output->height);
+	for (i = 0; i < peerCtx->n_tiles; i++)
+		NSC_RESET(peerCtx->tiles[i].nsc_context, weston_output->width, weston_output->height);
 
 	if (peersItem->flags & RDP_PEER_ACTIVATED)
 		return TRUE;
@@ -1311,8 +1815,14 @@ rdp_backend_create(struct weston_compositor *compositor,
 	if (pixman_renderer_init(compositor) < 0)
 		goto err_compositor;
 
-	if (rdp_backend_create_output(compositor) < 0)
+	if (rdp_encoder_start(&b->encoder,
+			      wl_display_get_event_loop(compositor->wl_display)) < 0) {
+		weston_log("Failed to start RDP encoder threads.\n");
 		goto err_compositor;
+	}
+
+	if (rdp_backend_create_output(compositor) < 0)
+		goto err_encoder;
 
 	compositor->capabilities |= WESTON_CAP_ARBITRARY_MODES;
 
@@ -1326,7 +1836,7 @@ rdp_backend_create(struct weston_compositor *compositor,
 		}
 
 		if (rdp_implant_listener(b, b->listener) < 0)
-			goto err_compositor;
+			goto err_listener;
 	} else {
 		/* get the socket from RDP_FD var */
 		fd_str = getenv("RDP_FD");
@@ -1357,6 +1867,8 @@ err_listener:
 	freerdp_listener_free(b->listener);
 err_output:
 	weston_output_destroy(&b->output->base);
+err_encoder:
+	rdp_encoder_stop(&b->encoder);
 err_compositor:
 	weston_compositor_shutdown(compositor);
 err_free_strings:
@@ -41,6 +41,7 @@
 #include <sys/socket.h>
 #include <sys/utsname.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <math.h>
 #include <linux/input.h>
@@ -66,6 +67,10 @@
 
 #define DEFAULT_REPAINT_WINDOW 7 /* milliseconds */
 
+/* Adaptive repaint window tuning, in nanoseconds */
+#define ADAPTIVE_REPAINT_SLACK 1000000
+#define ADAPTIVE_REPAINT_MISS_PENALTY 1000000
+
 static void
 weston_output_transform_scale_init(struct weston_output *output,
 				   uint32_t transform, uint32_t scale);
@@ -73,6 +78,18 @@ weston_output_transform_scale_init(struct weston_output *output,
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor);
 
+static inline void
+weston_compositor_view_list_dirty(struct weston_compositor *compositor)
+{
+	compositor->view_list_needs_rebuild = true;
+}
+
+static inline void
+weston_compositor_pick_index_dirty(struct weston_compositor *compositor)
+{
+	compositor->pick_index_dirty = true;
+}
+
 static void weston_mode_switch_finish(struct weston_output *output,
 				      int mode_changed,
 				      int scale_changed)
@@ -1237,6 +1254,7 @@ weston_view_update_transform(struct weston_view *view)
 		weston_view_update_transform(parent);
 
 	view->transform.dirty = 0;
+	weston_compositor_pick_index_dirty(view->surface->compositor);
 
 	weston_view_damage_below(view);
 
@@ -1701,38 +1719,113 @@ weston_compositor_get_time(void)
        return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
-WL_EXPORT struct weston_view *
-weston_compositor_pick_view(struct weston_compositor *compositor,
-			    wl_fixed_t x, wl_fixed_t y,
-			    wl_fixed_t *vx, wl_fixed_t *vy)
+static void
+weston_compositor_build_pick_index(struct weston_compositor *compositor)
 {
+	struct weston_output *output;
 	struct weston_view *view;
+	pixman_box32_t bounds = { 0, 0, 0, 0 }, *box;
+	struct weston_view **viewp;
+	bool first = true;
+	int n = 0;
+
+	compositor->pick_index_dirty = false;
+	compositor->pick_boxes.size = 0;
+	compositor->pick_views.size = 0;
+
+	/* Input can only happen on outputs, so only that area is indexed. */
+	wl_list_for_each(output, &compositor->output_list, link) {
+		if (first) {
+			bounds.x1 = output->x;
+			bounds.y1 = output->y;
+			bounds.x2 = output->x + output->width;
+			bounds.y2 = output->y + output->height;
+			first = false;
+			continue;
+		}
+
+		bounds.x1 = MIN(bounds.x1, output->x);
+		bounds.y1 = MIN(bounds.y1, output->y);
+		bounds.x2 = MAX(bounds.x2, output->x + output->width);
+		bounds.y2 = MAX(bounds.y2, output->y + output->height);
+	}
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		box = wl_array_add(&compositor->pick_boxes, sizeof *box);
+		viewp = wl_array_add(&compositor->pick_views, sizeof *viewp);
+		if (!box || !viewp)
+			goto fail;
+
+		*box = *pixman_region32_extents(&view->transform.boundingbox);
+		*viewp = view;
+		n++;
+	}
+
+	if (weston_pick_index_build(&compositor->pick_index, &bounds,
+				    compositor->pick_boxes.data,
+				    compositor->pick_views.data, n) < 0)
+		goto fail;
+
+	return;
+
+fail:
+	/* Picking falls back to walking view_list. */
+	compositor->pick_index.valid = 0;
+}
+
+static bool
+view_accepts_input(struct weston_view *view, wl_fixed_t x, wl_fixed_t y,
+		   wl_fixed_t *vx, wl_fixed_t *vy)
+{
 	wl_fixed_t view_x, view_y;
 	int view_ix, view_iy;
-	int ix = wl_fixed_to_int(x);
-	int iy = wl_fixed_to_int(y);
 
-	wl_list_for_each(view, &compositor->view_list, link) {
-		if (!pixman_region32_contains_point(
-				&view->transform.boundingbox, ix, iy, NULL))
-			continue;
+	if (!pixman_region32_contains_point(&view->transform.boundingbox,
+					    wl_fixed_to_int(x),
+					    wl_fixed_to_int(y), NULL))
+		return false;
 
-		weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
-		view_ix = wl_fixed_to_int(view_x);
-		view_iy = wl_fixed_to_int(view_y);
+	weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
+	view_ix = wl_fixed_to_int(view_x);
+	view_iy = wl_fixed_to_int(view_y);
 
-		if (!pixman_region32_contains_point(&view->surface->input,
-						    view_ix, view_iy, NULL))
-			continue;
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    view_ix, view_iy, NULL))
+		return false;
 
-		if (view->geometry.scissor_enabled &&
-		    !pixman_region32_contains_point(&view->geometry.scissor,
-						    view_ix, view_iy, NULL))
-			continue;
+	if (view->geometry.scissor_enabled &&
+	    !pixman_region32_contains_point(&view->geometry.scissor,
+					    view_ix, view_iy, NULL))
+		return false;
 
-		*vx = view_x;
-		*vy = view_y;
-		return view;
+	*vx = view_x;
+	*vy = view_y;
+	return true;
+}
+
+WL_EXPORT struct weston_view *
+weston_compositor_pick_view(struct weston_compositor *compositor,
+			    wl_fixed_t x, wl_fixed_t y,
+			    wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	struct weston_view *view, **candidates;
+	int i, n;
+
+	if (compositor->pick_index_dirty)
+		weston_compositor_build_pick_index(compositor);
+
+	candidates = (struct weston_view **)
+		weston_pick_index_lookup(&compositor->pick_index,
+					 wl_fixed_to_int(x),
+					 wl_fixed_to_int(y), &n);
+	if (candidates) {
+		for (i = 0; i < n; i++)
+			if (view_accepts_input(candidates[i], x, y, vx, vy))
+				return candidates[i];
+	} else {
+		wl_list_for_each(view, &compositor->view_list, link)
+			if (view_accepts_input(view, x, y, vx, vy))
+				return view;
 	}
 
 	*vx = wl_fixed_from_int(-1000000);
@@ -1767,6 +1860,8 @@ weston_view_unmap(struct weston_view *view)
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
+	weston_compositor_view_list_dirty(view->surface->compositor);
+	weston_compositor_pick_index_dirty(view->surface->compositor);
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
 
@@ -1794,6 +1889,7 @@ weston_surface_unmap(struct weston_surface *surface)
 	struct weston_view *view;
 
 	surface->is_mapped = false;
+	weston_compositor_view_list_dirty(surface->compositor);
 	wl_list_for_each(view, &surface->views, surface_link)
 		weston_view_unmap(view);
 	surface->output = NULL;
@@ -1822,6 +1918,7 @@ weston_view_destroy(struct weston_view *view)
 	}
 
 	wl_list_remove(&view->link);
+	weston_compositor_pick_index_dirty(view->surface->compositor);
 	weston_layer_entry_remove(&view->layer_link);
 
 	pixman_region32_fini(&view->clip);
@@ -2025,6 +2122,14 @@ view_accumulate_damage(struct weston_view *view,
 {
 	pixman_region32_t damage;
 
+	/* Geometry changes are damaged directly by
+	 * weston_view_update_transform() and weston_view_damage_below(), so
+	 * a view without pending surface damage adds nothing to the plane
+	 * damage and only the occlusion bookkeeping below is needed.
+	 */
+	if (!pixman_region32_not_empty(&view->surface->damage))
+		goto clip;
+
 	pixman_region32_init(&damage);
 	if (view->transform.enabled) {
 		pixman_box32_t *extents;
@@ -2043,16 +2148,74 @@ view_accumulate_damage(struct weston_view *view,
 	pixman_region32_union(&view->plane->damage,
 			      &view->plane->damage, &damage);
 	pixman_region32_fini(&damage);
+
+clip:
 	pixman_region32_copy(&view->clip, opaque);
-	pixman_region32_union(opaque, opaque, &view->transform.opaque);
+	if (pixman_region32_not_empty(&view->transform.opaque))
+		pixman_region32_union(opaque, opaque,
+				      &view->transform.opaque);
+}
+
+/* Records the surface damage of views that are on none of the outputs in
+ * repainted_mask, before the surface damage gets flushed. What occludes
+ * these views on their own outputs is not known here, so the damage is not
+ * clipped at all: those outputs may repaint more than needed, never less.
+ * The clip of these views is recomputed when their outputs are repainted.
+ */
+static void
+surface_accumulate_damage_other_outputs(struct weston_surface *surface,
+					uint32_t repainted_mask)
+{
+	struct weston_view *view;
+	pixman_region32_t opaque;
+
+	if (!pixman_region32_not_empty(&surface->damage))
+		return;
+
+	pixman_region32_init(&opaque);
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		if (view->output_mask == 0 ||
+		    (view->output_mask & repainted_mask) ||
+		    !view->plane)
+			continue;
+
+		pixman_region32_clear(&opaque);
+		view_accumulate_damage(view, &opaque);
+	}
+
+	pixman_region32_fini(&opaque);
+}
+
+static void
+surface_flush_damage_and_buffer(struct weston_surface *surface,
+				uint32_t repainted_mask)
+{
+	surface_accumulate_damage_other_outputs(surface, repainted_mask);
+	surface_flush_damage(surface);
+
+	/* Both the renderer and the backend have seen the buffer
+	 * by now. If renderer needs the buffer, it has its own
+	 * reference set. If the backend wants to keep the buffer
+	 * around for migrating the surface into a non-primary plane
+	 * later, keep_buffer is true. Otherwise, drop the core
+	 * reference now, and allow early buffer release. This enables
+	 * clients to use single-buffering.
+	 */
+	if (!surface->keep_buffer)
+		weston_buffer_reference(&surface->buffer_ref, NULL);
 }
 
 static void
-compositor_accumulate_damage(struct weston_compositor *ec)
+output_accumulate_damage(struct weston_output *output)
 {
+	struct weston_compositor *ec = output->compositor;
+	struct weston_view **views = output->view_list.data;
+	size_t n_views = output->view_list.size / sizeof *views;
 	struct weston_plane *plane;
 	struct weston_view *ev;
 	pixman_region32_t opaque, clip;
+	size_t i;
 
 	pixman_region32_init(&clip);
 
@@ -2061,11 +2224,11 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 
 		pixman_region32_init(&opaque);
 
-		wl_list_for_each(ev, &ec->view_list, link) {
-			if (ev->plane != plane)
+		for (i = 0; i < n_views; i++) {
+			if (views[i]->plane != plane)
 				continue;
 
-			view_accumulate_damage(ev, &opaque);
+			view_accumulate_damage(views[i], &opaque);
 		}
 
 		pixman_region32_union(&clip, &clip, &opaque);
@@ -2074,26 +2237,36 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 
 	pixman_region32_fini(&clip);
 
-	wl_list_for_each(ev, &ec->view_list, link)
-		ev->surface->touched = false;
+	for (i = 0; i < n_views; i++)
+		views[i]->surface->touched = false;
+
+	/* Surfaces that are not visible on this output keep their damage
+	 * until an output showing them is repainted.
+	 */
+	for (i = 0; i < n_views; i++) {
+		ev = views[i];
 
-	wl_list_for_each(ev, &ec->view_list, link) {
 		if (ev->surface->touched)
 			continue;
 		ev->surface->touched = true;
 
-		surface_flush_damage(ev->surface);
+		surface_flush_damage_and_buffer(ev->surface,
+						1u << output->id);
+	}
+}
 
-		/* Both the renderer and the backend have seen the buffer
-		 * by now. If renderer needs the buffer, it has its own
-		 * reference set. If the backend wants to keep the buffer
-		 * around for migrating the surface into a non-primary plane
-		 * later, keep_buffer is true. Otherwise, drop the core
-		 * reference now, and allow early buffer release. This enables
-		 * clients to use single-buffering.
-		 */
-		if (!ev->surface->keep_buffer)
-			weston_buffer_reference(&ev->surface->buffer_ref, NULL);
+/* Views that are on no output are in no output's view list, but their
+ * surfaces still get their damage flushed and their buffer released once
+ * per repaint cycle, like those of repainted views.
+ */
+static void
+compositor_flush_offscreen_views(struct weston_compositor *ec)
+{
+	struct weston_view *ev;
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (ev->output_mask == 0)
+			surface_flush_damage_and_buffer(ev->surface, 0);
 	}
 }
 
@@ -2206,12 +2379,23 @@ view_list_add(struct weston_compositor *compositor,
 	}
 }
 
+/* Rebuilds compositor->view_list from the layers, if anything in the scene
+ * graph changed since the last rebuild. Otherwise the existing list is kept
+ * and only the view transforms are brought up to date, so repainting several
+ * outputs in one cycle walks the layers and sub-surface trees only once.
+ */
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor)
 {
 	struct weston_view *view;
 	struct weston_layer *layer;
 
+	if (!compositor->view_list_needs_rebuild) {
+		wl_list_for_each(view, &compositor->view_list, link)
+			weston_view_update_transform(view);
+		return;
+	}
+
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_stash_subsurface_views(view->surface);
@@ -2226,6 +2410,37 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	compositor->view_list_needs_rebuild = false;
+	compositor->view_list_generation++;
+	weston_compositor_pick_index_dirty(compositor);
+}
+
+/* Collects the views of compositor->view_list that overlap this output, as
+ * computed by weston_view_assign_output() from the view bounding boxes.
+ * Everything in the repaint path below works on this culled list, so views
+ * shown only on other outputs cost nothing here.
+ */
+static int
+weston_output_build_view_list(struct weston_output *output)
+{
+	struct weston_view *view, **slot;
+	uint32_t output_bit = 1u << output->id;
+
+	output->view_list.size = 0;
+
+	wl_list_for_each(view, &output->compositor->view_list, link) {
+		if (!(view->output_mask & output_bit))
+			continue;
+
+		slot = wl_array_add(&output->view_list, sizeof *slot);
+		if (!slot)
+			return -1;
+
+		*slot = view;
+	}
+
+	return 0;
 }
 
 static void
@@ -2253,15 +2468,32 @@ weston_output_take_feedback_list(struct weston_output *output,
 	wl_list_init(&surface->feedback_list);
 }
 
+static uint64_t
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *rects;
+	uint64_t area = 0;
+	int i, n;
+
+	rects = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++)
+		area += (uint64_t)(rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	return area;
+}
+
 static int
 weston_output_repaint(struct weston_output *output, void *repaint_data)
 {
 	struct weston_compositor *ec = output->compositor;
-	struct weston_view *ev;
+	struct weston_view *ev, **views;
 	struct weston_animation *animation, *next;
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
 	pixman_region32_t output_damage;
+	struct timespec cpu_start, cpu_end;
+	size_t i, n_views;
 	int r;
 
 	if (output->destroying)
@@ -2269,20 +2501,41 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 
 	TL_POINT("core_repaint_begin", TLP_OUTPUT(output), TLP_END);
 
+	memset(&output->perf, 0, sizeof output->perf);
+	weston_compositor_read_presentation_clock(ec,
+						  &output->perf_repaint_start);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+
 	/* Rebuild the surface list and update surface transforms up front. */
 	weston_compositor_build_view_list(ec);
 
+	if (weston_output_build_view_list(output) < 0)
+		return -1;
+
+	views = output->view_list.data;
+	n_views = output->view_list.size / sizeof *views;
+
 	if (output->assign_planes && !output->disable_planes) {
 		output->assign_planes(output, repaint_data);
 	} else {
-		wl_list_for_each(ev, &ec->view_list, link) {
-			weston_view_move_to_plane(ev, &ec->primary_plane);
-			ev->psf_flags = 0;
+		for (i = 0; i < n_views; i++) {
+			weston_view_move_to_plane(views[i], &ec->primary_plane);
+			views[i]->psf_flags = 0;
 		}
 	}
 
+	output->perf.views = n_views;
+	for (i = 0; i < n_views; i++) {
+		if (views[i]->plane == &ec->primary_plane)
+			output->perf.views_primary++;
+		else
+			output->perf.views_planes++;
+	}
+
 	wl_list_init(&frame_callback_list);
-	wl_list_for_each(ev, &ec->view_list, link) {
+	for (i = 0; i < n_views; i++) {
+		ev = views[i];
+
 		/* Note: This operation is safe to do multiple times on the
 		 * same surface.
 		 */
@@ -2295,7 +2548,7 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 		}
 	}
 
-	compositor_accumulate_damage(ec);
+	output_accumulate_damage(output);
 
 	pixman_region32_init(&output_damage);
 	pixman_region32_intersect(&output_damage,
@@ -2306,10 +2559,15 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 	if (output->dirty)
 		weston_output_update_matrix(output);
 
+	output->perf.damage_area = region_area(&output_damage);
+
 	r = output->repaint(output, &output_damage, repaint_data);
 
 	pixman_region32_fini(&output_damage);
 
+	/* Do not keep view pointers around past the repaint. */
+	output->view_list.size = 0;
+
 	output->repaint_needed = false;
 	if (r == 0)
 		output->repaint_status = REPAINT_AWAITING_COMPLETION;
@@ -2326,11 +2584,85 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 		animation->frame(animation, output, output->frame_time);
 	}
 
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+	output->perf.repaint_nsec = timespec_sub_to_nsec(&cpu_end, &cpu_start);
+
 	TL_POINT("core_repaint_posted", TLP_OUTPUT(output), TLP_END);
 
 	return r;
 }
 
+static void
+weston_output_repaint_timing_sample(struct weston_output *output,
+				    const struct timespec *done)
+{
+	struct weston_repaint_timing *timing = &output->repaint_timing;
+	int64_t duration;
+
+	duration = timespec_sub_to_nsec(done, &output->next_repaint);
+	if (duration < 0)
+		duration = 0;
+
+	timing->samples[timing->next_sample] = duration;
+	timing->next_sample = (timing->next_sample + 1) %
+			      WESTON_REPAINT_TIMING_SAMPLES;
+	if (timing->sample_count < WESTON_REPAINT_TIMING_SAMPLES)
+		timing->sample_count++;
+
+	timespec_add_nsec(&timing->target, &output->next_repaint,
+			  timing->window);
+}
+
+/* Checks whether the repaint in flight made it to the vblank it was
+ * scheduled for. A late frame also covers the GPU time we cannot measure
+ * directly, so each miss widens the repaint window for a while.
+ */
+static void
+weston_output_repaint_timing_present(struct weston_output *output,
+				     const struct timespec *stamp,
+				     int32_t refresh_nsec)
+{
+	struct weston_repaint_timing *timing = &output->repaint_timing;
+
+	if (timing->target.tv_sec == 0 && timing->target.tv_nsec == 0)
+		return;
+
+	timing->frames++;
+	if (timespec_sub_to_nsec(stamp, &timing->target) > refresh_nsec / 2) {
+		timing->missed++;
+		output->perf.missed = true;
+		timing->margin += ADAPTIVE_REPAINT_MISS_PENALTY;
+		if (timing->margin > refresh_nsec)
+			timing->margin = refresh_nsec;
+	} else {
+		timing->margin -= timing->margin / 32;
+	}
+
+	timing->target.tv_sec = 0;
+	timing->target.tv_nsec = 0;
+}
+
+static void
+weston_output_repaint_timing_update_window(struct weston_output *output)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_repaint_timing *timing = &output->repaint_timing;
+	int64_t max_window = (int64_t)compositor->repaint_msec * 1000000;
+	int64_t window = 0;
+	unsigned int i;
+
+	if (!compositor->adaptive_repaint || timing->sample_count == 0) {
+		timing->window = max_window;
+		return;
+	}
+
+	for (i = 0; i < timing->sample_count; i++)
+		window = MAX(window, timing->samples[i]);
+
+	window += ADAPTIVE_REPAINT_SLACK + timing->margin;
+	timing->window = MIN(window, max_window);
+}
+
 static void
 weston_output_schedule_repaint_reset(struct weston_output *output)
 {
@@ -2375,6 +2707,8 @@ weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
 	if (ret != 0)
 		goto err;
 
+	weston_output_repaint_timing_sample(output, now);
+
 	return ret;
 
 err:
@@ -2382,11 +2716,27 @@ err:
 	return ret;
 }
 
+static int
+output_repaint_timer_handler(void *data);
+
+static int
+output_repaint_now_handler(int fd, uint32_t mask, void *data)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) != sizeof count)
+		return 0;
+
+	return output_repaint_timer_handler(data);
+}
+
 static void
 output_repaint_timer_arm(struct weston_compositor *compositor)
 {
 	struct weston_output *output;
 	bool any_should_repaint = false;
+	bool unthrottled_due = false;
+	uint64_t one = 1;
 	struct timespec now;
 	int64_t msec_to_next = INT64_MAX;
 
@@ -2403,12 +2753,24 @@ output_repaint_timer_arm(struct weston_compositor *compositor)
 		if (!any_should_repaint || msec_to_this < msec_to_next)
 			msec_to_next = msec_to_this;
 
+		if (output->current_mode->refresh == 0 && msec_to_this < 1)
+			unthrottled_due = true;
+
 		any_should_repaint = true;
 	}
 
 	if (!any_should_repaint)
 		return;
 
+	/* An output without a refresh rate repaints as fast as it can, and
+	 * the 1 ms minimum below would cap it at 1000 frames per second.
+	 * The eventfd is only dispatched on the next pass through the
+	 * event loop, so repaints still coalesce, and unlike an idle
+	 * source it lets clients be serviced between frames. */
+	if (unthrottled_due && compositor->repaint_now_source &&
+	    write(compositor->repaint_now_fd, &one, sizeof one) == sizeof one)
+		return;
+
 	/* Even if we should repaint immediately, add the minimum 1 ms delay.
 	 * This is a workaround to allow coalescing multiple output repaints
 	 * particularly from weston_output_finish_frame()
@@ -2430,6 +2792,10 @@ output_repaint_timer_handler(void *data)
 	void *repaint_data = NULL;
 	int ret;
 
+	/* Moves the cursor and may damage or schedule outputs, so it has to
+	 * come before deciding what to repaint. */
+	weston_compositor_flush_pointer_motion(compositor);
+
 	weston_compositor_read_presentation_clock(compositor, &now);
 
 	if (compositor->backend->repaint_begin)
@@ -2441,6 +2807,8 @@ output_repaint_timer_handler(void *data)
 			break;
 	}
 
+	compositor_flush_offscreen_views(compositor);
+
 	if (ret == 0) {
 	    if (compositor->backend->repaint_flush)
 		    compositor->backend->repaint_flush(compositor,
@@ -2482,7 +2850,12 @@ weston_output_finish_frame(struct weston_output *output,
 		goto out;
 	}
 
-	refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+	/* A zero refresh rate means the output is not throttled to any
+	 * vblank, so repaint again as soon as possible. */
+	if (output->current_mode->refresh > 0)
+		refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+	else
+		refresh_nsec = 0;
 	weston_presentation_feedback_present_list(&output->feedback_list,
 						  output, refresh_nsec, stamp,
 						  output->msc,
@@ -2490,9 +2863,23 @@ weston_output_finish_frame(struct weston_output *output,
 
 	output->frame_time = timespec_to_msec(stamp);
 
+	if (presented_flags & WP_PRESENTATION_FEEDBACK_KIND_VSYNC)
+		weston_output_repaint_timing_present(output, stamp,
+						     refresh_nsec);
+	weston_output_repaint_timing_update_window(output);
+
+	if (output->perf_repaint_start.tv_sec != 0 ||
+	    output->perf_repaint_start.tv_nsec != 0) {
+		output->perf.latency_nsec =
+			timespec_sub_to_nsec(stamp, &output->perf_repaint_start);
+		wl_signal_emit(&output->perf_signal, &output->perf);
+		output->perf_repaint_start.tv_sec = 0;
+		output->perf_repaint_start.tv_nsec = 0;
+	}
+
 	timespec_add_nsec(&output->next_repaint, stamp, refresh_nsec);
-	timespec_add_msec(&output->next_repaint, &output->next_repaint,
-			  -compositor->repaint_msec);
+	timespec_add_nsec(&output->next_repaint, &output->next_repaint,
+			  -output->repaint_timing.window);
 	msec_rel = timespec_sub_to_msec(&output->next_repaint, &now);
 
 	if (msec_rel < -1000 || msec_rel > 1000) {
@@ -2519,6 +2906,51 @@ out:
 	output_repaint_timer_arm(compositor);
 }
 
+static int
+compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/** Summarize the repaint times measured on an output
+ *
+ * \param output The output to query.
+ * \param stats Filled with percentiles of the recent repaint durations,
+ * the repaint window in use and the number of presented and missed frames.
+ *
+ * Durations are measured from the scheduled start of a repaint until the
+ * backend has submitted it. Missed frames are only detected on outputs
+ * that report vsync'd presentation.
+ */
+WL_EXPORT void
+weston_output_get_repaint_stats(struct weston_output *output,
+				struct weston_repaint_stats *stats)
+{
+	struct weston_repaint_timing *timing = &output->repaint_timing;
+	int64_t sorted[WESTON_REPAINT_TIMING_SAMPLES];
+	unsigned int n = timing->sample_count;
+
+	memset(stats, 0, sizeof *stats);
+	stats->window = timing->window;
+	stats->samples = n;
+	stats->frames = timing->frames;
+	stats->missed = timing->missed;
+
+	if (n == 0)
+		return;
+
+	memcpy(sorted, timing->samples, n * sizeof sorted[0]);
+	qsort(sorted, n, sizeof sorted[0], compare_int64);
+
+	stats->p50 = sorted[(n - 1) * 50 / 100];
+	stats->p90 = sorted[(n - 1) * 90 / 100];
+	stats->p99 = sorted[(n - 1) * 99 / 100];
+	stats->max = sorted[n - 1];
+}
+
 static void
 idle_repaint(void *data)
 {
@@ -2535,11 +2967,15 @@ weston_layer_entry_insert(struct weston_layer_entry *list,
 {
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+	weston_compositor_view_list_dirty(list->layer->compositor);
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	if (entry->layer)
+		weston_compositor_view_list_dirty(entry->layer->compositor);
+
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -2576,6 +3012,7 @@ weston_layer_set_position(struct weston_layer *layer,
 {
 	struct weston_layer *below;
 
+	weston_compositor_view_list_dirty(layer->compositor);
 	wl_list_remove(&layer->link);
 
 	/* layer_list is ordered from top to bottom, the last layer being the
@@ -2599,6 +3036,7 @@ weston_layer_set_position(struct weston_layer *layer,
 WL_EXPORT void
 weston_layer_unset_position(struct weston_layer *layer)
 {
+	weston_compositor_view_list_dirty(layer->compositor);
 	wl_list_remove(&layer->link);
 	wl_list_init(&layer->link);
 }
@@ -2823,8 +3261,10 @@ weston_surface_commit_subsurface_order(struct weston_surface *surface)
 		wl_list_remove(&sub->parent_link);
 		wl_list_insert(&surface->subsurface_list, &sub->parent_link);
 
-		if (sub->reordered)
+		if (sub->reordered) {
+			weston_compositor_view_list_dirty(surface->compositor);
 			weston_surface_damage_subsurfaces(sub);
+		}
 	}
 }
 
@@ -3491,6 +3931,7 @@ subsurface_committed(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 	if (!weston_surface_is_mapped(surface)) {
 		surface->is_mapped = true;
+		weston_compositor_view_list_dirty(surface->compositor);
 
 		/* Cannot call weston_view_update_transform(),
 		 * because that would call it also for the parent surface,
@@ -3828,6 +4269,7 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	weston_compositor_view_list_dirty(sub->surface->compositor);
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -3891,6 +4333,7 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_signal_add(&parent->destroy_signal,
 		      &sub->parent_destroy_listener);
 
+	weston_compositor_view_list_dirty(parent->compositor);
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
@@ -4511,6 +4954,7 @@ weston_output_enable_undo(struct weston_output *output)
 
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
+	wl_array_release(&output->view_list);
 	output->compositor->output_id_pool &= ~(1u << output->id);
 
 	output->enabled = false;
@@ -4723,10 +5167,15 @@ weston_output_enable(struct weston_output *output)
 
 	wl_signal_init(&output->frame_signal);
 	wl_signal_init(&output->destroy_signal);
+	wl_signal_init(&output->perf_signal);
 	wl_list_init(&output->animation_list);
 	wl_list_init(&output->resource_list);
 	wl_list_init(&output->feedback_list);
 	wl_list_init(&output->link);
+	wl_array_init(&output->view_list);
+
+	memset(&output->repaint_timing, 0, sizeof output->repaint_timing);
+	output->repaint_timing.window = (int64_t)c->repaint_msec * 1000000;
 
 	/* Invert the output id pool and look for the lowest numbered
 	 * switch (the least significant bit).  Take that bit's position
@@ -5131,6 +5580,25 @@ weston_environment_get_fd(const char *env)
 	return fd;
 }
 
+static void
+repaint_stats_key_binding_handler(struct weston_keyboard *keyboard,
+				  uint32_t time, uint32_t key, void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_output *output;
+	struct weston_repaint_stats stats;
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		weston_output_get_repaint_stats(output, &stats);
+		weston_log("%s: repaint time p50 %.2f ms, p90 %.2f ms, "
+			   "p99 %.2f ms, max %.2f ms over %u repaints; "
+			   "window %.2f ms, %u of %u frames missed\n",
+			   output->name, stats.p50 / 1e6, stats.p90 / 1e6,
+			   stats.p99 / 1e6, stats.max / 1e6, stats.samples,
+			   stats.window / 1e6, stats.missed, stats.frames);
+	}
+}
+
 static void
 timeline_key_binding_handler(struct weston_keyboard *keyboard, uint32_t time,
 			     uint32_t key, void *data)
@@ -5208,6 +5676,11 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 		goto fail;
 
 	wl_list_init(&ec->view_list);
+	ec->view_list_needs_rebuild = true;
+	weston_pick_index_init(&ec->pick_index);
+	wl_array_init(&ec->pick_boxes);
+	wl_array_init(&ec->pick_views);
+	ec->pick_index_dirty = true;
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -5234,6 +5707,12 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 	ec->repaint_timer =
 		wl_event_loop_add_timer(loop, output_repaint_timer_handler,
 					ec);
+	ec->repaint_now_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ec->repaint_now_fd >= 0)
+		ec->repaint_now_source =
+			wl_event_loop_add_fd(loop, ec->repaint_now_fd,
+					     WL_EVENT_READABLE,
+					     output_repaint_now_handler, ec);
 
 	weston_layer_init(&ec->fade_layer, ec);
 	weston_layer_init(&ec->cursor_layer, ec);
@@ -5244,6 +5723,9 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 
 	weston_compositor_add_debug_binding(ec, KEY_T,
 					    timeline_key_binding_handler, ec);
+	weston_compositor_add_debug_binding(ec, KEY_P,
+					    repaint_stats_key_binding_handler,
+					    ec);
 
 	return ec;
 
@@ -5488,8 +5970,17 @@ weston_compositor_destroy(struct weston_compositor *compositor)
 	if (compositor->backend)
 		compositor->backend->destroy(compositor);
 
+	if (compositor->repaint_now_source)
+		wl_event_source_remove(compositor->repaint_now_source);
+	if (compositor->repaint_now_fd >= 0)
+		close(compositor->repaint_now_fd);
+
 	weston_plugin_api_destroy_list(compositor);
 
+	weston_pick_index_release(&compositor->pick_index);
+	wl_array_release(&compositor->pick_boxes);
+	wl_array_release(&compositor->pick_views);
+
 	free(compositor);
 }
 
@@ -44,6 +44,7 @@ extern "C" {
 #include "config-parser.h"
 #include "zalloc.h"
 #include "timeline-object.h"
+#include "pick-index.h"
 
 struct weston_geometry {
 	int32_t x, y;
@@ -138,6 +139,62 @@ struct weston_output_zoom {
 	struct wl_listener motion_listener;
 };
 
+#define WESTON_REPAINT_TIMING_SAMPLES 64
+
+/** Repaint durations measured on an output, in nanoseconds.
+ *
+ * A sample is the time from the scheduled start of a repaint until the
+ * output has submitted it, see weston_compositor::adaptive_repaint.
+ */
+struct weston_repaint_timing {
+	int64_t samples[WESTON_REPAINT_TIMING_SAMPLES];
+	unsigned int sample_count;
+	unsigned int next_sample;
+
+	/** Repaint window used to schedule the next repaint */
+	int64_t window;
+	/** Extra slack added after missed vblanks, decays over time */
+	int64_t margin;
+	/** Vblank the repaint in flight was scheduled for, zero if none */
+	struct timespec target;
+
+	uint32_t frames;
+	uint32_t missed;
+};
+
+/** Summary of struct weston_repaint_timing, in nanoseconds. */
+struct weston_repaint_stats {
+	int64_t p50, p90, p99, max;
+	int64_t window;
+	uint32_t samples;
+	uint32_t frames;
+	uint32_t missed;
+};
+
+/** Performance counters for one repainted frame of an output.
+ *
+ * Filled in while the frame is repainted and presented, then passed to
+ * weston_output::perf_signal listeners from weston_output_finish_frame().
+ */
+struct weston_perf_frame {
+	/** Views considered for this output */
+	uint32_t views;
+	/** Views composited by the renderer on the primary plane */
+	uint32_t views_primary;
+	/** Views assigned to other planes by the backend */
+	uint32_t views_planes;
+	/** Repainted area of the output, in pixels */
+	uint64_t damage_area;
+	/** Bytes of SHM buffer contents uploaded by the renderer */
+	uint64_t upload_bytes;
+	/** CPU time spent in weston_output_repaint(), in nanoseconds */
+	int64_t repaint_nsec;
+	/** From the start of the repaint to presentation, in nanoseconds */
+	int64_t latency_nsec;
+	/** True if the frame missed the vblank it was scheduled for */
+	bool missed;
+};
+
 /* bit compatible with drm definitions. */
 enum dpms_enum {
 	WESTON_DPMS_ON,
@@ -169,6 +226,10 @@ struct weston_output {
 	/** Output area in global coordinates, simple rect */
 	pixman_region32_t region;
 
+	/** Views visible on this output, top to bottom (struct weston_view *).
+	 *  Only valid while the output is being repainted. */
+	struct wl_array view_list;
+
 	pixman_region32_t previous_damage;
 
 	/** True if damage has occurred since the last repaint for this output;
@@ -187,6 +248,15 @@ struct weston_output {
 	 *  next repaint should be run */
 	struct timespec next_repaint;
 
+	struct weston_repaint_timing repaint_timing;
+
+	/** Counters of the frame being repainted */
+	struct weston_perf_frame perf;
+	/** Presentation clock time the current repaint started */
+	struct timespec perf_repaint_start;
+	/** Emitted with the struct weston_perf_frame of each presented frame */
+	struct wl_signal perf_signal;
+
 	struct weston_output_zoom zoom;
 	int dirty;
 	struct wl_signal frame_signal;
@@ -388,6 +458,13 @@ struct weston_pointer {
 	uint32_t button_count;
 
 	struct wl_listener output_destroy_listener;
+
+	/* Motion not yet passed to the grab, see
+	 * weston_compositor::coalesce_pointer_motion. An empty mask means
+	 * none is pending. */
+	struct weston_pointer_motion_event pending_motion;
+	uint32_t pending_motion_time;
+	bool pending_frame;
 };
 
 
@@ -882,6 +959,21 @@ struct weston_compositor {
 	struct wl_list layer_list;	/* struct weston_layer::link */
 	struct wl_list view_list;	/* struct weston_view::link */
 	struct wl_list plane_list;
+
+	/* Set whenever layers, layer entries or the sub-surface stacking
+	 * change; view_list is only rebuilt while this is true. The
+	 * generation counts the rebuilds actually performed.
+	 */
+	bool view_list_needs_rebuild;
+	uint32_t view_list_generation;
+
+	/* Grid of view_list used by weston_compositor_pick_view(); rebuilt
+	 * on the next pick after views move or view_list changes. */
+	struct weston_pick_index pick_index;
+	struct wl_array pick_boxes;	/* pixman_box32_t */
+	struct wl_array pick_views;	/* struct weston_view * */
+	bool pick_index_dirty;
+
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
 	struct wl_list button_binding_list;
@@ -894,6 +986,8 @@ struct weston_compositor {
 	uint32_t idle_inhibit;
 	int idle_time;			/* timeout, s */
 	struct wl_event_source *repaint_timer;
+	int repaint_now_fd;
+	struct wl_event_source *repaint_now_source;
 
 	const struct weston_pointer_grab_interface *default_pointer_grab;
 
@@ -916,6 +1010,7 @@ struct weston_compositor {
 	struct xkb_rule_names xkb_names;
 	struct xkb_context *xkb_context;
 	struct weston_xkb_info *xkb_info;
+	char *xkb_cache_dir;
 
 	/* Raw keyboard processing (no libxkbcommon initialization or handling) */
 	int use_xkbcommon;
@@ -928,6 +1023,14 @@ struct weston_compositor {
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
 
+	/* Derive each output's repaint window from its measured repaint
+	 * times instead of using repaint_msec, which then is the maximum. */
+	bool adaptive_repaint;
+
+	/* Accumulate pointer motion and pass it to the grabs once per
+	 * repaint instead of once per input event. */
+	bool coalesce_pointer_motion;
+
 	unsigned int activate_serial;
 
 	struct wl_global *pointer_constraints;
@@ -1375,6 +1478,9 @@ notify_axis_source(struct weston_seat *seat, uint32_t source);
 void
 notify_pointer_frame(struct weston_seat *seat);
 
+void
+weston_compositor_flush_pointer_motion(struct weston_compositor *compositor);
+
 void
 notify_key(struct weston_seat *seat, uint32_t time, uint32_t key,
 	   enum wl_keyboard_key_state state,
@@ -1445,6 +1551,9 @@ weston_output_schedule_repaint(struct weston_output *output);
 void
 weston_output_damage(struct weston_output *output);
 void
+weston_output_get_repaint_stats(struct weston_output *output,
+				struct weston_repaint_stats *stats);
+void
 weston_compositor_schedule_repaint(struct weston_compositor *compositor);
 void
 weston_compositor_fade(struct weston_compositor *compositor, float tint);
@@ -1750,6 +1859,9 @@ int
 weston_compositor_set_xkb_rule_names(struct weston_compositor *ec,
 				     struct xkb_rule_names *names);
 void
+weston_compositor_set_xkb_cache_dir(struct weston_compositor *ec,
+				    const char *dir);
+void
 weston_compositor_xkb_destroy(struct weston_compositor *ec);
 
 /* String literal of spaces, the same width as the timestamp. */
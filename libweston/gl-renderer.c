@@ -32,6 +32,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -61,6 +62,15 @@ struct gl_shader {
 
 #define BUFFER_DAMAGE_COUNT 2
 
+/* Damage rectangles of SHM surfaces are merged into one texture upload when
+ * that uploads at most this many undamaged pixels more; a glTexSubImage2D()
+ * call costs roughly as much as copying that many extra pixels.
+ */
+#define UPLOAD_MERGE_MAX_WASTE 4096
+
+/* Beyond this many upload rectangles the damage extents are uploaded. */
+#define UPLOAD_MAX_RECTS 32
+
 enum gl_border_status {
 	BORDER_STATUS_CLEAN = 0,
 	BORDER_TOP_DIRTY = 1 << GL_RENDERER_BORDER_TOP,
@@ -178,6 +188,12 @@ struct gl_renderer {
 	int fan_debug;
 	struct weston_binding *fragment_binding;
 	struct weston_binding *fan_binding;
+	struct weston_binding *upload_stats_binding;
+
+	/* SHM texture uploads done for the output being repainted */
+	int upload_stats_debug;
+	uint32_t upload_calls;
+	uint64_t upload_bytes;
 
 	EGLDisplay egl_display;
 	EGLContext egl_context;
@@ -839,11 +855,12 @@ static void
 repaint_views(struct weston_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
-	struct weston_view *view;
+	struct weston_view **views = output->view_list.data;
+	int i, n_views = output->view_list.size / sizeof *views;
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+	for (i = n_views - 1; i >= 0; i--)
+		if (views[i]->plane == &compositor->primary_plane)
+			draw_view(views[i], output, damage);
 }
 
 static void
@@ -1193,6 +1210,13 @@ gl_renderer_repaint_output(struct weston_output *output,
 	}
 
 	go->border_status = BORDER_STATUS_CLEAN;
+
+	if (gr->upload_stats_debug && gr->upload_calls > 0)
+		weston_log("%s: %u texture uploads, %" PRIu64 " bytes\n",
+			   output->name, gr->upload_calls, gr->upload_bytes);
+	output->perf.upload_bytes += gr->upload_bytes;
+	gr->upload_calls = 0;
+	gr->upload_bytes = 0;
 }
 
 static int
@@ -1228,6 +1252,82 @@ gl_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+static int64_t
+box_area(const pixman_box32_t *box)
+{
+	return (int64_t)(box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+/* Turns the texture damage into at most UPLOAD_MAX_RECTS upload boxes.
+ * pixman keeps the rectangles sorted in y-x bands, so greedily merging each
+ * rectangle into the previous box first joins the spans of a band and then
+ * neighbouring bands, as long as little undamaged area gets uploaded.
+ */
+static int
+coalesce_upload_damage(pixman_region32_t *damage, pixman_box32_t *boxes)
+{
+	pixman_box32_t *rects, *extents, merged;
+	int64_t covered[UPLOAD_MAX_RECTS];
+	int64_t area, total = 0;
+	int i, n, n_boxes = 0;
+
+	rects = pixman_region32_rectangles(damage, &n);
+	extents = pixman_region32_extents(damage);
+
+	for (i = 0; i < n; i++)
+		total += box_area(&rects[i]);
+
+	if (n > UPLOAD_MAX_RECTS ||
+	    box_area(extents) - total <= UPLOAD_MERGE_MAX_WASTE) {
+		boxes[0] = *extents;
+		return 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		area = box_area(&rects[i]);
+
+		if (n_boxes > 0) {
+			pixman_box32_t *prev = &boxes[n_boxes - 1];
+
+			merged.x1 = MIN(prev->x1, rects[i].x1);
+			merged.y1 = MIN(prev->y1, rects[i].y1);
+			merged.x2 = MAX(prev->x2, rects[i].x2);
+			merged.y2 = MAX(prev->y2, rects[i].y2);
+
+			if (box_area(&merged) - covered[n_boxes - 1] - area <=
+			    UPLOAD_MERGE_MAX_WASTE) {
+				*prev = merged;
+				covered[n_boxes - 1] += area;
+				continue;
+			}
+		}
+
+		boxes[n_boxes] = rects[i];
+		covered[n_boxes] = area;
+		n_boxes++;
+	}
+
+	return n_boxes;
+}
+
+static int
+gl_format_bytes_per_pixel(GLenum format, GLenum type)
+{
+	if (type == GL_UNSIGNED_SHORT_5_6_5)
+		return 2;
+
+	switch (format) {
+	case GL_LUMINANCE:
+	case GL_R8_EXT:
+		return 1;
+	case GL_LUMINANCE_ALPHA:
+	case GL_RG8_EXT:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
 static void
 gl_renderer_flush_damage(struct weston_surface *surface)
 {
@@ -1236,9 +1336,9 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	struct weston_buffer *buffer = gs->buffer_ref.buffer;
 	struct weston_view *view;
 	bool texture_used;
-	pixman_box32_t *rectangles;
+	pixman_box32_t rectangles[UPLOAD_MAX_RECTS];
 	uint8_t *data;
-	int i, j, n;
+	int i, j, n, bpp, width, x1, y1, x2, y2;
 
 	pixman_region32_union(&gs->texture_damage,
 			      &gs->texture_damage, &surface->damage);
@@ -1267,31 +1367,16 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 
 	data = wl_shm_buffer_get_data(buffer->shm_buffer);
 
-	if (!gr->has_unpack_subimage) {
-		wl_shm_buffer_begin_access(buffer->shm_buffer);
-		for (j = 0; j < gs->num_textures; j++) {
-			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
-			glTexImage2D(GL_TEXTURE_2D, 0,
-				     gs->gl_format[j],
-				     gs->pitch / gs->hsub[j],
-				     buffer->height / gs->vsub[j],
-				     0,
-				     gs->gl_format[j],
-				     gs->gl_pixel_type,
-				     data + gs->offset[j]);
-		}
-		wl_shm_buffer_end_access(buffer->shm_buffer);
-
-		goto done;
-	}
-
-	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
-
 	if (gs->needs_full_upload) {
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+		if (gr->has_unpack_subimage) {
+			glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+			glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+			glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+		}
 		wl_shm_buffer_begin_access(buffer->shm_buffer);
 		for (j = 0; j < gs->num_textures; j++) {
+			bpp = gl_format_bytes_per_pixel(gs->gl_format[j],
+							gs->gl_pixel_type);
 			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
 			glTexImage2D(GL_TEXTURE_2D, 0,
 				     gs->gl_format[j],
@@ -1301,30 +1386,65 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 				     gs->gl_format[j],
 				     gs->gl_pixel_type,
 				     data + gs->offset[j]);
+			gr->upload_calls++;
+			gr->upload_bytes += (uint64_t)bpp *
+				(gs->pitch / gs->hsub[j]) *
+				(buffer->height / gs->vsub[j]);
 		}
 		wl_shm_buffer_end_access(buffer->shm_buffer);
 		goto done;
 	}
 
-	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
-	wl_shm_buffer_begin_access(buffer->shm_buffer);
-	for (i = 0; i < n; i++) {
-		pixman_box32_t r;
+	n = coalesce_upload_damage(&gs->texture_damage, rectangles);
+	for (i = 0; i < n; i++)
+		rectangles[i] = weston_surface_to_buffer_rect(surface,
+							      rectangles[i]);
 
-		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
+	/* Upload all boxes of one plane before binding the next texture.
+	 * Without GL_EXT_unpack_subimage only whole rows can be addressed
+	 * in the client buffer, so full-width bands are uploaded instead.
+	 */
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	for (j = 0; j < gs->num_textures; j++) {
+		bpp = gl_format_bytes_per_pixel(gs->gl_format[j],
+						gs->gl_pixel_type);
+		width = gs->pitch / gs->hsub[j];
+
+		glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
+		if (gr->has_unpack_subimage)
+			glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, width);
+
+		for (i = 0; i < n; i++) {
+			y1 = rectangles[i].y1 / gs->vsub[j];
+			y2 = (rectangles[i].y2 + gs->vsub[j] - 1) / gs->vsub[j];
+
+			if (gr->has_unpack_subimage) {
+				x1 = rectangles[i].x1 / gs->hsub[j];
+				x2 = (rectangles[i].x2 + gs->hsub[j] - 1) /
+				     gs->hsub[j];
+
+				glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, x1);
+				glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, y1);
+				glTexSubImage2D(GL_TEXTURE_2D, 0,
+						x1, y1, x2 - x1, y2 - y1,
+						gs->gl_format[j],
+						gs->gl_pixel_type,
+						data + gs->offset[j]);
+			} else {
+				x1 = 0;
+				x2 = width;
+
+				glTexSubImage2D(GL_TEXTURE_2D, 0,
+						x1, y1, x2 - x1, y2 - y1,
+						gs->gl_format[j],
+						gs->gl_pixel_type,
+						data + gs->offset[j] +
+						y1 * width * bpp);
+			}
 
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, r.x1);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, r.y1);
-		for (j = 0; j < gs->num_textures; j++) {
-			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
-			glTexSubImage2D(GL_TEXTURE_2D, 0,
-					r.x1 / gs->hsub[j],
-					r.y1 / gs->vsub[j],
-					(r.x2 - r.x1) / gs->hsub[j],
-					(r.y2 - r.y1) / gs->vsub[j],
-					gs->gl_format[j],
-					gs->gl_pixel_type,
-					data + gs->offset[j]);
+			gr->upload_calls++;
+			gr->upload_bytes += (uint64_t)bpp *
+					    (x2 - x1) * (y2 - y1);
 		}
 	}
 	wl_shm_buffer_end_access(buffer->shm_buffer);
@@ -2811,6 +2931,8 @@ gl_renderer_destroy(struct weston_compositor *ec)
 		weston_binding_destroy(gr->fragment_binding);
 	if (gr->fan_binding)
 		weston_binding_destroy(gr->fan_binding);
+	if (gr->upload_stats_binding)
+		weston_binding_destroy(gr->upload_stats_binding);
 
 	free(gr);
 }
@@ -3260,6 +3382,16 @@ fan_debug_repaint_binding(struct weston_keyboard *keyboard, uint32_t time,
 	weston_compositor_damage_all(compositor);
 }
 
+static void
+upload_stats_debug_binding(struct weston_keyboard *keyboard, uint32_t time,
+			   uint32_t key, void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct gl_renderer *gr = get_renderer(compositor);
+
+	gr->upload_stats_debug = !gr->upload_stats_debug;
+}
+
 static int
 gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 {
@@ -3340,6 +3472,10 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		weston_compositor_add_debug_binding(ec, KEY_F,
 						    fan_debug_repaint_binding,
 						    ec);
+	gr->upload_stats_binding =
+		weston_compositor_add_debug_binding(ec, KEY_U,
+						    upload_stats_debug_binding,
+						    ec);
 
 	gr->output_destroy_listener.notify = output_handle_destroy;
 	wl_signal_add(&ec->output_destroyed_signal,
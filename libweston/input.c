@@ -39,6 +39,7 @@
 #include "shared/helpers.h"
 #include "shared/os-compatibility.h"
 #include "compositor.h"
+#include "keymap-cache.h"
 #include "relative-pointer-unstable-v1-server-protocol.h"
 #include "pointer-constraints-unstable-v1-server-protocol.h"
 
@@ -1553,6 +1554,139 @@ weston_pointer_handle_output_destroy(struct wl_listener *listener, void *data)
 	weston_pointer_move_to(pointer, fx, fy);
 }
 
+/** Pass pending coalesced motion to the pointer grab
+ *
+ * \param pointer The pointer.
+ *
+ * A pointer frame that arrived while the motion was held back is sent
+ * right after it.
+ */
+static void
+pointer_flush_motion(struct weston_pointer *pointer)
+{
+	struct weston_pointer_motion_event event;
+
+	if (!pointer->pending_motion.mask)
+		return;
+
+	event = pointer->pending_motion;
+	pointer->pending_motion.mask = 0;
+
+	pointer->grab->interface->motion(pointer->grab,
+					 pointer->pending_motion_time, &event);
+
+	if (pointer->pending_frame) {
+		pointer->pending_frame = false;
+		pointer->grab->interface->frame(pointer->grab);
+	}
+}
+
+/* Make sure a repaint, and with it a flush, follows the first held back
+ * motion. The output under the pointer is the one whose cursor moves. */
+static void
+pointer_schedule_motion_flush(struct weston_pointer *pointer)
+{
+	struct weston_compositor *ec = pointer->seat->compositor;
+	struct weston_output *output;
+	int x = wl_fixed_to_int(pointer->x);
+	int y = wl_fixed_to_int(pointer->y);
+
+	wl_list_for_each(output, &ec->output_list, link) {
+		if (pixman_region32_contains_point(&output->region,
+						   x, y, NULL)) {
+			weston_output_schedule_repaint(output);
+			return;
+		}
+	}
+
+	weston_compositor_schedule_repaint(ec);
+}
+
+/** Add a motion event to the pending motion of a pointer
+ *
+ * \param pointer The pointer.
+ * \param time The event time.
+ * \param event The motion event.
+ * \return false if the event has to be delivered right away.
+ *
+ * Relative motions are summed up, including their unaccelerated deltas,
+ * so that relative pointer clients still see the whole movement. An
+ * absolute motion replaces a pending absolute one. Mixing the two flushes
+ * the pending motion first.
+ */
+static bool
+pointer_coalesce_motion(struct weston_pointer *pointer, uint32_t time,
+			struct weston_pointer_motion_event *event)
+{
+	struct weston_compositor *ec = pointer->seat->compositor;
+	struct weston_pointer_motion_event *pending = &pointer->pending_motion;
+	uint32_t kind = WESTON_POINTER_MOTION_ABS | WESTON_POINTER_MOTION_REL;
+	bool first;
+
+	if (!ec->coalesce_pointer_motion ||
+	    ec->state != WESTON_COMPOSITOR_ACTIVE ||
+	    wl_list_empty(&ec->output_list))
+		return false;
+
+	if (pending->mask && (pending->mask & kind) != (event->mask & kind))
+		pointer_flush_motion(pointer);
+
+	first = !pending->mask;
+
+	if (event->mask & WESTON_POINTER_MOTION_REL) {
+		if (first) {
+			pending->dx = pending->dy = 0;
+			pending->dx_unaccel = pending->dy_unaccel = 0;
+		}
+
+		pending->dx += event->dx;
+		pending->dy += event->dy;
+		if (event->mask & WESTON_POINTER_MOTION_REL_UNACCEL) {
+			pending->dx_unaccel += event->dx_unaccel;
+			pending->dy_unaccel += event->dy_unaccel;
+		} else {
+			pending->dx_unaccel += event->dx;
+			pending->dy_unaccel += event->dy;
+		}
+		pending->mask = WESTON_POINTER_MOTION_REL |
+				WESTON_POINTER_MOTION_REL_UNACCEL;
+	} else {
+		pending->x = event->x;
+		pending->y = event->y;
+		pending->mask = event->mask;
+	}
+
+	pending->time_usec = event->time_usec;
+	pointer->pending_motion_time = time;
+
+	if (first)
+		pointer_schedule_motion_flush(pointer);
+
+	return true;
+}
+
+/** Deliver all coalesced pointer motion
+ *
+ * \param compositor The compositor.
+ *
+ * Called before each repaint, so that the cursor and the clients see the
+ * latest pointer position once per frame.
+ */
+WL_EXPORT void
+weston_compositor_flush_pointer_motion(struct weston_compositor *compositor)
+{
+	struct weston_seat *seat;
+	struct weston_pointer *pointer;
+
+	/* Not weston_seat_get_pointer(), motion that arrived before the
+	 * last device went away is still delivered. */
+	wl_list_for_each(seat, &compositor->seat_list, link) {
+		pointer = seat->pointer_state;
+		if (pointer)
+			pointer_flush_motion(pointer);
+	}
+}
+
 WL_EXPORT void
 notify_motion(struct weston_seat *seat,
 	      uint32_t time,
@@ -1562,6 +1696,11 @@ notify_motion(struct weston_seat *seat,
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
 	weston_compositor_wake(ec);
+
+	if (pointer_coalesce_motion(pointer, time, event))
+		return;
+
+	pointer_flush_motion(pointer);
 	pointer->grab->interface->motion(pointer->grab, time, event);
 }
 
@@ -1617,6 +1756,10 @@ notify_motion_absolute(struct weston_seat *seat,
 		.y = y,
 	};
 
+	if (pointer_coalesce_motion(pointer, time, &event))
+		return;
+
+	pointer_flush_motion(pointer);
 	pointer->grab->interface->motion(pointer->grab, time, &event);
 }
 
@@ -1656,6 +1799,8 @@ notify_button(struct weston_seat *seat, uint32_t time, int32_t button,
 	struct weston_compositor *compositor = seat->compositor;
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
+	pointer_flush_motion(pointer);
+
 	if (state == WL_POINTER_BUTTON_STATE_PRESSED) {
 		weston_compositor_idle_inhibit(compositor);
 		if (pointer->button_count == 0) {
@@ -1688,6 +1833,7 @@ notify_axis(struct weston_seat *seat, uint32_t time,
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
 	weston_compositor_wake(compositor);
+	pointer_flush_motion(pointer);
 
 	if (weston_compositor_run_axis_binding(compositor, pointer,
 					       time, event))
@@ -1703,6 +1849,7 @@ notify_axis_source(struct weston_seat *seat, uint32_t source)
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
 	weston_compositor_wake(compositor);
+	pointer_flush_motion(pointer);
 
 	pointer->grab->interface->axis_source(pointer->grab, source);
 }
@@ -1715,6 +1862,12 @@ notify_pointer_frame(struct weston_seat *seat)
 
 	weston_compositor_wake(compositor);
 
+	/* Ends the frame of the held back motion, send it along with it. */
+	if (pointer->pending_motion.mask) {
+		pointer->pending_frame = true;
+		return;
+	}
+
 	pointer->grab->interface->frame(pointer->grab);
 }
 
@@ -1885,7 +2038,7 @@ send_modifiers(struct wl_resource *resource, uint32_t serial, struct weston_keyb
 }
 
 static struct weston_xkb_info *
-weston_xkb_info_create(struct xkb_keymap *keymap);
+weston_xkb_info_get(struct weston_compositor *ec, struct xkb_keymap *keymap);
 
 static void
 update_keymap(struct weston_seat *seat)
@@ -1897,7 +2050,8 @@ update_keymap(struct weston_seat *seat)
 	xkb_mod_mask_t latched_mods;
 	xkb_mod_mask_t locked_mods;
 
-	xkb_info = weston_xkb_info_create(keyboard->pending_keymap);
+	xkb_info = weston_xkb_info_get(seat->compositor,
+				       keyboard->pending_keymap);
 
 	xkb_keymap_unref(keyboard->pending_keymap);
 	keyboard->pending_keymap = NULL;
@@ -2727,9 +2881,30 @@ weston_xkb_info_destroy(struct weston_xkb_info *xkb_info)
 	free(xkb_info);
 }
 
+/** Cache compiled keymaps in a directory
+ *
+ * \param ec The compositor
+ * \param dir The cache directory, created if needed, or NULL to
+ * disable the cache.
+ *
+ * The keymap built from the rule names is stored in serialized form,
+ * keyed by the names and by the modification times of xkeyboard-config,
+ * so later starts parse it instead of compiling it from the rules.
+ */
+WL_EXPORT void
+weston_compositor_set_xkb_cache_dir(struct weston_compositor *ec,
+				    const char *dir)
+{
+	free(ec->xkb_cache_dir);
+	ec->xkb_cache_dir = dir ? strdup(dir) : NULL;
+}
+
 void
 weston_compositor_xkb_destroy(struct weston_compositor *ec)
 {
+	free(ec->xkb_cache_dir);
+	ec->xkb_cache_dir = NULL;
+
 	/*
 	 * If we're operating in raw keyboard mode, we never initialized
 	 * libxkbcommon so there's no cleanup to do either.
@@ -2748,18 +2923,19 @@ weston_compositor_xkb_destroy(struct weston_compositor *ec)
 	xkb_context_unref(ec->xkb_context);
 }
 
+/* keymap_str is the serialized keymap if the caller has it already. */
 static struct weston_xkb_info *
-weston_xkb_info_create(struct xkb_keymap *keymap)
+weston_xkb_info_create(struct xkb_keymap *keymap, const char *keymap_str)
 {
 	struct weston_xkb_info *xkb_info = zalloc(sizeof *xkb_info);
+	char *str = NULL;
+
 	if (xkb_info == NULL)
 		return NULL;
 
 	xkb_info->keymap = xkb_keymap_ref(keymap);
 	xkb_info->ref_count = 1;
 
-	char *keymap_str;
-
 	xkb_info->shift_mod = xkb_keymap_mod_get_index(xkb_info->keymap,
 						       XKB_MOD_NAME_SHIFT);
 	xkb_info->caps_mod = xkb_keymap_mod_get_index(xkb_info->keymap,
@@ -2784,67 +2960,133 @@ weston_xkb_info_create(struct xkb_keymap *keymap)
 	xkb_info->scroll_led = xkb_keymap_led_get_index(xkb_info->keymap,
 							XKB_LED_NAME_SCROLL);
 
-	keymap_str = xkb_keymap_get_as_string(xkb_info->keymap,
-					      XKB_KEYMAP_FORMAT_TEXT_V1);
 	if (keymap_str == NULL) {
-		weston_log("failed to get string version of keymap\n");
-		goto err_keymap;
+		str = xkb_keymap_get_as_string(xkb_info->keymap,
+					       XKB_KEYMAP_FORMAT_TEXT_V1);
+		if (str == NULL) {
+			weston_log("failed to get string version of keymap\n");
+			goto err_keymap;
+		}
+		keymap_str = str;
 	}
 	xkb_info->keymap_size = strlen(keymap_str) + 1;
 
-	xkb_info->keymap_fd = os_create_anonymous_file(xkb_info->keymap_size);
+	/* One sealed file for every client of every seat using this
+	 * keymap; clients can't modify what the others read. */
+	xkb_info->keymap_fd = os_create_sealed_file(keymap_str,
+						    xkb_info->keymap_size);
 	if (xkb_info->keymap_fd < 0) {
 		weston_log("creating a keymap file for %lu bytes failed: %m\n",
 			(unsigned long) xkb_info->keymap_size);
 		goto err_keymap_str;
 	}
-
-	xkb_info->keymap_area = mmap(NULL, xkb_info->keymap_size,
-				     PROT_READ | PROT_WRITE,
-				     MAP_SHARED, xkb_info->keymap_fd, 0);
-	if (xkb_info->keymap_area == MAP_FAILED) {
-		weston_log("failed to mmap() %lu bytes\n",
-			(unsigned long) xkb_info->keymap_size);
-		goto err_dev_zero;
-	}
-	strcpy(xkb_info->keymap_area, keymap_str);
-	free(keymap_str);
+	free(str);
 
 	return xkb_info;
 
-err_dev_zero:
-	close(xkb_info->keymap_fd);
 err_keymap_str:
-	free(keymap_str);
+	free(str);
 err_keymap:
 	xkb_keymap_unref(xkb_info->keymap);
 	free(xkb_info);
 	return NULL;
 }
 
+/* Seats given the same keymap share its info and keymap file. */
+static struct weston_xkb_info *
+weston_xkb_info_get(struct weston_compositor *ec, struct xkb_keymap *keymap)
+{
+	struct weston_xkb_info *xkb_info = NULL;
+	struct weston_seat *seat;
+
+	if (ec->xkb_info && ec->xkb_info->keymap == keymap) {
+		xkb_info = ec->xkb_info;
+	} else {
+		wl_list_for_each(seat, &ec->seat_list, link) {
+			if (seat->keyboard_state &&
+			    seat->keyboard_state->xkb_info &&
+			    seat->keyboard_state->xkb_info->keymap == keymap) {
+				xkb_info = seat->keyboard_state->xkb_info;
+				break;
+			}
+		}
+	}
+
+	if (xkb_info == NULL)
+		return weston_xkb_info_create(keymap, NULL);
+
+	xkb_info->ref_count++;
+
+	return xkb_info;
+}
+
+static struct xkb_keymap *
+load_cached_keymap(struct weston_compositor *ec, const char *key,
+		   char **keymap_str)
+{
+	struct xkb_keymap *keymap;
+	size_t size;
+	char *str;
+
+	str = keymap_cache_load(ec->xkb_cache_dir, key, &size);
+	if (str == NULL)
+		return NULL;
+
+	keymap = xkb_keymap_new_from_string(ec->xkb_context, str,
+					    XKB_KEYMAP_FORMAT_TEXT_V1, 0);
+	if (keymap == NULL) {
+		free(str);
+		return NULL;
+	}
+
+	*keymap_str = str;
+
+	return keymap;
+}
+
 static int
 weston_compositor_build_global_keymap(struct weston_compositor *ec)
 {
-	struct xkb_keymap *keymap;
+	struct xkb_keymap *keymap = NULL;
+	char *key = NULL, *keymap_str = NULL;
 
 	if (ec->xkb_info != NULL)
 		return 0;
 
-	keymap = xkb_keymap_new_from_names(ec->xkb_context,
-					   &ec->xkb_names,
-					   0);
+	if (ec->xkb_cache_dir) {
+		key = keymap_cache_key(ec->xkb_context, &ec->xkb_names);
+		if (key)
+			keymap = load_cached_keymap(ec, key, &keymap_str);
+	}
+
 	if (keymap == NULL) {
-		weston_log("failed to compile global XKB keymap\n");
-		weston_log("  tried rules %s, model %s, layout %s, variant %s, "
-			"options %s\n",
-			ec->xkb_names.rules, ec->xkb_names.model,
-			ec->xkb_names.layout, ec->xkb_names.variant,
-			ec->xkb_names.options);
-		return -1;
+		keymap = xkb_keymap_new_from_names(ec->xkb_context,
+						   &ec->xkb_names,
+						   0);
+		if (keymap == NULL) {
+			weston_log("failed to compile global XKB keymap\n");
+			weston_log("  tried rules %s, model %s, layout %s, "
+				"variant %s, options %s\n",
+				ec->xkb_names.rules, ec->xkb_names.model,
+				ec->xkb_names.layout, ec->xkb_names.variant,
+				ec->xkb_names.options);
+			free(key);
+			return -1;
+		}
+
+		keymap_str = xkb_keymap_get_as_string(keymap,
+						XKB_KEYMAP_FORMAT_TEXT_V1);
+		if (key && keymap_str &&
+		    keymap_cache_store(ec->xkb_cache_dir, key, keymap_str,
+				       strlen(keymap_str) + 1) < 0)
+			weston_log("failed to store the XKB keymap in '%s': "
+				   "%m\n", ec->xkb_cache_dir);
 	}
 
-	ec->xkb_info = weston_xkb_info_create(keymap);
+	ec->xkb_info = weston_xkb_info_create(keymap, keymap_str);
 	xkb_keymap_unref(keymap);
+	free(keymap_str);
+	free(key);
 	if (ec->xkb_info == NULL)
 		return -1;
 
@@ -2858,6 +3100,12 @@ weston_compositor_set_xkb_rule_names(struct weston_compositor *ec,
 	return 0;
 }
 
+WL_EXPORT void
+weston_compositor_set_xkb_cache_dir(struct weston_compositor *ec,
+				    const char *dir)
+{
+}
+
 void
 weston_compositor_xkb_destroy(struct weston_compositor *ec)
 {
@@ -2905,7 +3153,8 @@ weston_seat_init_keyboard(struct weston_seat *seat, struct xkb_keymap *keymap)
 #ifdef ENABLE_XKBCOMMON
 	if (seat->compositor->use_xkbcommon) {
 		if (keymap != NULL) {
-			keyboard->xkb_info = weston_xkb_info_create(keymap);
+			keyboard->xkb_info = weston_xkb_info_get(seat->compositor,
+								 keymap);
 			if (keyboard->xkb_info == NULL)
 				goto err;
 		} else {
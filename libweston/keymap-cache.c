@@ -0,0 +1,301 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#ifdef ENABLE_XKBCOMMON
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "keymap-cache.h"
+#include "shared/helpers.h"
+
+/* Besides the rule names, the key records the modification times of
+ * the xkeyboard-config directories the keymap was compiled from.
+ * Package updates replace files, which changes the times of the
+ * directories containing them, so the cache follows upgrades.  Editing
+ * a file in place doesn't, and needs the cache to be removed. */
+static const char *const keymap_dirs[] = {
+	"rules", "keycodes", "types", "compat", "symbols"
+};
+
+static void
+key_add_file(FILE *fp, const char *dir, const char *name)
+{
+	char *path;
+	struct stat st;
+
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		return;
+
+	if (stat(path, &st) < 0)
+		fprintf(fp, "%s -\n", path);
+	else
+		fprintf(fp, "%s %lld.%09ld %lld\n", path,
+			(long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+			(long long) st.st_size);
+
+	free(path);
+}
+
+static const char *
+name_or_default(const char *name, const char *env)
+{
+	if (name && name[0])
+		return name;
+
+	name = getenv(env);
+
+	return name ? name : "";
+}
+
+char *
+keymap_cache_key(struct xkb_context *context,
+		 const struct xkb_rule_names *names)
+{
+	const char *rules, *dir;
+	char *key = NULL, *name;
+	size_t size;
+	unsigned int i, j;
+	FILE *fp;
+
+	fp = open_memstream(&key, &size);
+	if (fp == NULL)
+		return NULL;
+
+	rules = name_or_default(names->rules, "XKB_DEFAULT_RULES");
+	fprintf(fp, "weston keymap cache 1\n");
+	fprintf(fp, "rules=%s\n", rules);
+	fprintf(fp, "model=%s\n",
+		name_or_default(names->model, "XKB_DEFAULT_MODEL"));
+	fprintf(fp, "layout=%s\n",
+		name_or_default(names->layout, "XKB_DEFAULT_LAYOUT"));
+	fprintf(fp, "variant=%s\n",
+		name_or_default(names->variant, "XKB_DEFAULT_VARIANT"));
+	fprintf(fp, "options=%s\n",
+		name_or_default(names->options, "XKB_DEFAULT_OPTIONS"));
+
+	for (i = 0; i < xkb_context_num_include_paths(context); i++) {
+		dir = xkb_context_include_path_get(context, i);
+		key_add_file(fp, dir, ".");
+		for (j = 0; j < ARRAY_LENGTH(keymap_dirs); j++)
+			key_add_file(fp, dir, keymap_dirs[j]);
+		if (asprintf(&name, "rules/%s", rules) >= 0) {
+			key_add_file(fp, dir, name);
+			free(name);
+		}
+	}
+
+	if (fclose(fp) != 0) {
+		free(key);
+		return NULL;
+	}
+
+	return key;
+}
+
+/* FNV-1a, only used to name the file: the whole key is stored in it
+ * and compared on load. */
+static char *
+cache_file_path(const char *dir, const char *key)
+{
+	uint64_t hash = 14695981039346656037ull;
+	char *path;
+
+	for (; *key; key++) {
+		hash ^= (unsigned char) *key;
+		hash *= 1099511628211ull;
+	}
+
+	if (asprintf(&path, "%s/keymap-%016" PRIx64, dir, hash) < 0)
+		return NULL;
+
+	return path;
+}
+
+static int
+write_all(int fd, const char *data, size_t size)
+{
+	ssize_t len;
+
+	while (size > 0) {
+		len = write(fd, data, size);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			return -1;
+		data += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+/* Returns the keymap stored for key, or NULL if there is none or the
+ * file doesn't look like one we wrote. */
+char *
+keymap_cache_load(const char *dir, const char *key, size_t *size)
+{
+	size_t key_size = strlen(key) + 1, len = 0;
+	struct stat st;
+	char *path, *data = NULL;
+	ssize_t n;
+	int fd;
+
+	path = cache_file_path(dir, key);
+	if (path == NULL)
+		return NULL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    (size_t) st.st_size <= key_size + 1)
+		goto err;
+
+	data = malloc(st.st_size);
+	if (data == NULL)
+		goto err;
+
+	while (len < (size_t) st.st_size) {
+		n = read(fd, data + len, st.st_size - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			goto err;
+		len += n;
+	}
+
+	/* The key, then the keymap, each with its NUL. */
+	if (memcmp(data, key, key_size) != 0 || data[len - 1] != '\0' ||
+	    strlen(data + key_size) + 1 != len - key_size)
+		goto err;
+
+	close(fd);
+
+	*size = len - key_size;
+	memmove(data, data + key_size, *size);
+
+	return data;
+
+err:
+	free(data);
+	close(fd);
+
+	return NULL;
+}
+
+static int
+ensure_dir(const char *dir)
+{
+	char *parent, *slash;
+	int ret;
+
+	if (mkdir(dir, 0700) == 0 || errno == EEXIST)
+		return 0;
+	if (errno != ENOENT)
+		return -1;
+
+	/* Typically ~/.cache on a fresh system. */
+	parent = strdup(dir);
+	if (parent == NULL)
+		return -1;
+	slash = strrchr(parent, '/');
+	if (slash == NULL || slash == parent) {
+		free(parent);
+		return -1;
+	}
+	*slash = '\0';
+	ret = mkdir(parent, 0700);
+	free(parent);
+	if (ret < 0 && errno != EEXIST)
+		return -1;
+
+	return mkdir(dir, 0700) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+/* The file is written under a temporary name and renamed into place,
+ * so concurrent compositors never see a partial one. */
+int
+keymap_cache_store(const char *dir, const char *key,
+		   const char *keymap, size_t size)
+{
+	char *path, *tmp;
+	int fd;
+
+	if (ensure_dir(dir) < 0)
+		return -1;
+
+	path = cache_file_path(dir, key);
+	if (path == NULL)
+		return -1;
+
+	if (asprintf(&tmp, "%s/.keymap-XXXXXX", dir) < 0) {
+		free(path);
+		return -1;
+	}
+
+#ifdef HAVE_MKOSTEMP
+	fd = mkostemp(tmp, O_CLOEXEC);
+#else
+	fd = mkstemp(tmp);
+#endif
+	if (fd < 0)
+		goto err;
+
+	if (write_all(fd, key, strlen(key) + 1) < 0 ||
+	    write_all(fd, keymap, size) < 0) {
+		close(fd);
+		unlink(tmp);
+		goto err;
+	}
+	close(fd);
+
+	if (rename(tmp, path) < 0) {
+		unlink(tmp);
+		goto err;
+	}
+
+	free(tmp);
+	free(path);
+
+	return 0;
+
+err:
+	free(tmp);
+	free(path);
+
+	return -1;
+}
+
+#endif /* ENABLE_XKBCOMMON */
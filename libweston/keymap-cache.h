@@ -0,0 +1,46 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_KEYMAP_CACHE_H
+#define WESTON_KEYMAP_CACHE_H
+
+#include <stddef.h>
+#include <xkbcommon/xkbcommon.h>
+
+/* An on-disk cache of serialized keymaps, so that the keymap for a set
+ * of rule names only has to be compiled from xkeyboard-config once.
+ * Sizes include the terminating NUL, like weston_xkb_info::keymap_size.
+ */
+
+char *
+keymap_cache_key(struct xkb_context *context,
+		 const struct xkb_rule_names *names);
+
+char *
+keymap_cache_load(const char *dir, const char *key, size_t *size);
+
+int
+keymap_cache_store(const char *dir, const char *key,
+		   const char *keymap, size_t size);
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pick-index.h"
+
+/* The grid uses at most this many cells in either direction, but cells
+ * are never smaller than PICK_INDEX_MIN_CELL_SIZE pixels. */
+#define PICK_INDEX_MAX_CELLS 64
+#define PICK_INDEX_MIN_CELL_SIZE 128
+
+void
+weston_pick_index_init(struct weston_pick_index *index)
+{
+	memset(index, 0, sizeof *index);
+}
+
+void
+weston_pick_index_release(struct weston_pick_index *index)
+{
+	free(index->cells);
+	free(index->entries);
+	weston_pick_index_init(index);
+}
+
+static int
+ensure_size(void **data, uint32_t *alloc, uint32_t count, size_t size)
+{
+	void *p;
+
+	if (count <= *alloc)
+		return 0;
+
+	p = realloc(*data, count * size);
+	if (!p)
+		return -1;
+
+	*data = p;
+	*alloc = count;
+
+	return 0;
+}
+
+/* Clamps a box to the cells it covers; returns 0 if it covers none. */
+static int
+box_to_cells(const struct weston_pick_index *index, const pixman_box32_t *box,
+	     int32_t *c1, int32_t *r1, int32_t *c2, int32_t *r2)
+{
+	int32_t x1 = box->x1 > index->bounds.x1 ? box->x1 : index->bounds.x1;
+	int32_t y1 = box->y1 > index->bounds.y1 ? box->y1 : index->bounds.y1;
+	int32_t x2 = box->x2 < index->bounds.x2 ? box->x2 : index->bounds.x2;
+	int32_t y2 = box->y2 < index->bounds.y2 ? box->y2 : index->bounds.y2;
+
+	if (x1 >= x2 || y1 >= y2)
+		return 0;
+
+	*c1 = (x1 - index->bounds.x1) / index->cell_size;
+	*r1 = (y1 - index->bounds.y1) / index->cell_size;
+	*c2 = (x2 - 1 - index->bounds.x1) / index->cell_size;
+	*r2 = (y2 - 1 - index->bounds.y1) / index->cell_size;
+
+	return 1;
+}
+
+/** Fill the index with items
+ *
+ * \param index The index to rebuild.
+ * \param bounds The area to index, usually the extents of all outputs.
+ * \param boxes Bounding box of each item.
+ * \param items The items, in the order lookups should return them.
+ * \param n_items Number of items.
+ * \return 0 on success, -1 if out of memory; the index is then empty.
+ */
+int
+weston_pick_index_build(struct weston_pick_index *index,
+			const pixman_box32_t *bounds,
+			const pixman_box32_t *boxes, void **items, int n_items)
+{
+	int32_t width = bounds->x2 - bounds->x1;
+	int32_t height = bounds->y2 - bounds->y1;
+	int32_t size, c, r, c1, r1, c2, r2;
+	uint32_t n_cells, total, pos, tmp;
+	int i;
+
+	index->valid = 0;
+
+	if (width <= 0 || height <= 0)
+		return 0;
+
+	size = (width > height ? width : height) / PICK_INDEX_MAX_CELLS + 1;
+	if (size < PICK_INDEX_MIN_CELL_SIZE)
+		size = PICK_INDEX_MIN_CELL_SIZE;
+
+	index->bounds = *bounds;
+	index->cell_size = size;
+	index->columns = (width + size - 1) / size;
+	index->rows = (height + size - 1) / size;
+	n_cells = index->columns * index->rows;
+
+	if (ensure_size((void **)&index->cells, &index->cells_alloc,
+			n_cells + 1, sizeof *index->cells) < 0)
+		return -1;
+
+	/* Count the items of each cell, then turn the counts into offsets
+	 * and place the items, keeping their order within each cell. */
+	memset(index->cells, 0, (n_cells + 1) * sizeof *index->cells);
+
+	for (i = 0; i < n_items; i++) {
+		if (!box_to_cells(index, &boxes[i], &c1, &r1, &c2, &r2))
+			continue;
+
+		for (r = r1; r <= r2; r++)
+			for (c = c1; c <= c2; c++)
+				index->cells[r * index->columns + c]++;
+	}
+
+	total = 0;
+	for (pos = 0; pos < n_cells; pos++) {
+		tmp = index->cells[pos];
+		index->cells[pos] = total;
+		total += tmp;
+	}
+	index->cells[n_cells] = total;
+
+	/* Keep entries allocated even when empty, so that lookups never
+	 * return NULL for a covered point. */
+	if (ensure_size((void **)&index->entries, &index->entries_alloc,
+			total ? total : 1, sizeof *index->entries) < 0)
+		return -1;
+
+	/* cells[c] is advanced while placing, ending at the start of
+	 * cell c + 1; shift back afterwards. */
+	for (i = 0; i < n_items; i++) {
+		if (!box_to_cells(index, &boxes[i], &c1, &r1, &c2, &r2))
+			continue;
+
+		for (r = r1; r <= r2; r++) {
+			for (c = c1; c <= c2; c++) {
+				pos = r * index->columns + c;
+				index->entries[index->cells[pos]++] = items[i];
+			}
+		}
+	}
+
+	memmove(index->cells + 1, index->cells, n_cells * sizeof *index->cells);
+	index->cells[0] = 0;
+
+	index->valid = 1;
+
+	return 0;
+}
+
+/** Find the items whose boxes may contain a point
+ *
+ * \param index The index.
+ * \param x X coordinate of the point.
+ * \param y Y coordinate of the point.
+ * \param n_items Returns the number of candidates.
+ * \return The candidates in insertion order, or NULL if the point is not
+ * covered by the index. The array is valid until the next build.
+ *
+ * Candidates overlap the point's cell, so their boxes still need to be
+ * checked against the point itself.
+ */
+void **
+weston_pick_index_lookup(const struct weston_pick_index *index,
+			 int32_t x, int32_t y, int *n_items)
+{
+	int32_t c, r;
+	uint32_t cell;
+
+	if (!index->valid ||
+	    x < index->bounds.x1 || x >= index->bounds.x2 ||
+	    y < index->bounds.y1 || y >= index->bounds.y2)
+		return NULL;
+
+	c = (x - index->bounds.x1) / index->cell_size;
+	r = (y - index->bounds.y1) / index->cell_size;
+	cell = r * index->columns + c;
+
+	*n_items = index->cells[cell + 1] - index->cells[cell];
+
+	return index->entries + index->cells[cell];
+}
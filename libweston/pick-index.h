@@ -0,0 +1,64 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_PICK_INDEX_H
+#define WESTON_PICK_INDEX_H
+
+#include <stdint.h>
+#include <pixman.h>
+
+/* Uniform grid over a bounded area, mapping each cell to the items whose
+ * boxes overlap it. Items keep the order they were added in, so a lookup
+ * returns the candidates for a point in stacking order. Points outside the
+ * grid bounds are not indexed; the caller has to search those itself.
+ */
+struct weston_pick_index {
+	pixman_box32_t bounds;
+	int32_t cell_size;
+	int32_t columns, rows;
+
+	/* cells[c] .. cells[c + 1] delimit cell c's items in entries */
+	uint32_t *cells;
+	uint32_t cells_alloc;
+	void **entries;
+	uint32_t entries_alloc;
+
+	int valid;
+};
+
+void
+weston_pick_index_init(struct weston_pick_index *index);
+
+void
+weston_pick_index_release(struct weston_pick_index *index);
+
+int
+weston_pick_index_build(struct weston_pick_index *index,
+			const pixman_box32_t *bounds,
+			const pixman_box32_t *boxes, void **items, int n_items);
+
+void **
+weston_pick_index_lookup(const struct weston_pick_index *index,
+			 int32_t x, int32_t y, int *n_items);
+
+#endif
@@ -31,6 +31,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "pixman-renderer.h"
 #include "shared/helpers.h"
@@ -47,6 +49,8 @@ struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	/* Color of a solid fill image set with surface_set_color */
+	pixman_color_t color;
 	struct weston_buffer_reference buffer_ref;
 
 	struct wl_listener buffer_destroy_listener;
@@ -54,13 +58,46 @@ struct pixman_surface_state {
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* Upper limit of compositing threads, including the compositor thread */
+#define PIXMAN_RENDERER_MAX_THREADS 16
+
+/* Damage smaller than this many pixels is not worth splitting into tiles */
+#define PIXMAN_RENDERER_MIN_TILED_AREA (256 * 256)
+
+/* A part of the output damage that is composited on its own. Every tile
+ * has its own destination image on the shadow buffer, so that clip regions
+ * set while painting do not affect other tiles.
+ */
+struct pixman_renderer_tile {
+	pixman_region32_t damage; /* in global coordinates */
+	pixman_image_t *target;
+};
+
+struct pixman_renderer_job {
+	struct weston_output *output;
+	struct pixman_renderer_tile *tiles;
+	int n_tiles;
+	int next_tile;
+	int tiles_done;
+};
+
 struct pixman_renderer {
 	struct weston_renderer base;
 
 	int repaint_debug;
-	pixman_image_t *debug_color;
 	struct weston_binding *debug_binding;
 
+	/* Worker threads compositing tiles together with the compositor
+	 * thread; n_threads counts the compositor thread too. */
+	int n_threads;
+	pthread_t *threads;
+	pthread_mutex_t job_mutex;
+	pthread_cond_t job_cond;
+	pthread_cond_t done_cond;
+	struct pixman_renderer_job *job;
+	uint32_t job_serial;
+	bool threads_quit;
+
 	struct wl_signal destroy_signal;
 };
 
@@ -245,6 +282,9 @@ composite_whole(pixman_op_t op,
 				 dest_width, dest_height);
 }
 
+/* Box count of the last composite_clipped() that overdrew. */
+static int overdraw_boxes;
+
 static void
 composite_clipped(pixman_image_t *src,
 		  pixman_image_t *mask,
@@ -306,20 +346,36 @@ composite_clipped(pixman_image_t *src,
 		pixman_image_unref(boximg);
 	}
 
-	if (n_box > 1) {
-		static bool warned = false;
+	/* This may run on a worker thread, so repaint_surfaces() does
+	 * the logging. */
+	if (n_box > 1)
+		__atomic_store_n(&overdraw_boxes, n_box, __ATOMIC_RELAXED);
+}
 
-		if (!warned)
-			weston_log("Pixman-renderer warning: %dx overdraw\n",
-				   n_box);
-		warned = true;
-	}
+/* Tiles may be painted concurrently, and pixman images are not safe to
+ * modify from several threads. Each paint operation therefore uses its
+ * own image referencing the surface contents.
+ */
+static pixman_image_t *
+surface_state_create_source(struct pixman_surface_state *ps)
+{
+	void *data = pixman_image_get_data(ps->image);
+
+	if (!data)
+		return pixman_image_create_solid_fill(&ps->color);
+
+	return pixman_image_create_bits_no_clear(
+			pixman_image_get_format(ps->image),
+			pixman_image_get_width(ps->image),
+			pixman_image_get_height(ps->image),
+			data, pixman_image_get_stride(ps->image));
 }
 
 /** Paint an intersected region
  *
  * \param ev The view to be painted.
  * \param output The output being painted.
+ * \param tile The tile being painted.
  * \param repaint_output The region to be painted in output coordinates.
  * \param source_clip The region of the source image to use, in source image
  *                    coordinates. If NULL, use the whole source image.
@@ -327,6 +383,7 @@ composite_clipped(pixman_image_t *src,
  */
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
+	       struct pixman_renderer_tile *tile,
 	       pixman_region32_t *repaint_output,
 	       pixman_region32_t *source_clip,
 	       pixman_op_t pixman_op)
@@ -334,15 +391,17 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	struct pixman_renderer *pr =
 		(struct pixman_renderer *) output->compositor->renderer;
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
-	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
 	pixman_transform_t transform;
 	pixman_filter_t filter;
+	pixman_image_t *src_image;
 	pixman_image_t *mask_image;
+	pixman_image_t *debug_image;
 	pixman_color_t mask = { 0, };
+	pixman_color_t debug_red = { 0x3fff, 0x0000, 0x0000, 0x3fff };
 
 	/* Clip rendering to the damaged output region */
-	pixman_image_set_clip_region32(po->shadow_image, repaint_output);
+	pixman_image_set_clip_region32(tile->target, repaint_output);
 
 	pixman_renderer_compute_transform(&transform, ev, output);
 
@@ -361,12 +420,16 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 		mask_image = NULL;
 	}
 
+	src_image = surface_state_create_source(ps);
+
 	if (source_clip)
-		composite_clipped(ps->image, mask_image, po->shadow_image,
+		composite_clipped(src_image, mask_image, tile->target,
 				  &transform, filter, source_clip);
 	else
-		composite_whole(pixman_op, ps->image, mask_image,
-				po->shadow_image, &transform, filter);
+		composite_whole(pixman_op, src_image, mask_image,
+				tile->target, &transform, filter);
+
+	pixman_image_unref(src_image);
 
 	if (mask_image)
 		pixman_image_unref(mask_image);
@@ -374,22 +437,26 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
 
-	if (pr->repaint_debug)
+	if (pr->repaint_debug) {
+		debug_image = pixman_image_create_solid_fill(&debug_red);
 		pixman_image_composite32(PIXMAN_OP_OVER,
-					 pr->debug_color, /* src */
+					 debug_image, /* src */
 					 NULL /* mask */,
-					 po->shadow_image, /* dest */
+					 tile->target, /* dest */
 					 0, 0, /* src_x, src_y */
 					 0, 0, /* mask_x, mask_y */
 					 0, 0, /* dest_x, dest_y */
-					 pixman_image_get_width (po->shadow_image), /* width */
-					 pixman_image_get_height (po->shadow_image) /* height */);
+					 pixman_image_get_width (tile->target), /* width */
+					 pixman_image_get_height (tile->target) /* height */);
+		pixman_image_unref(debug_image);
+	}
 
-	pixman_image_set_clip_region32 (po->shadow_image, NULL);
+	pixman_image_set_clip_region32 (tile->target, NULL);
 }
 
 static void
 draw_view_translated(struct weston_view *view, struct weston_output *output,
+		     struct pixman_renderer_tile *tile,
 		     pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -417,8 +484,8 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 							  view);
 			region_global_to_output(output, &repaint_output);
 
-			repaint_region(view, output, &repaint_output, NULL,
-				       PIXMAN_OP_SRC);
+			repaint_region(view, output, tile, &repaint_output,
+				       NULL, PIXMAN_OP_SRC);
 		}
 	}
 
@@ -428,7 +495,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 						  &surface_blend, view);
 		region_global_to_output(output, &repaint_output);
 
-		repaint_region(view, output, &repaint_output, NULL,
+		repaint_region(view, output, tile, &repaint_output, NULL,
 			       PIXMAN_OP_OVER);
 	}
 
@@ -439,6 +506,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 static void
 draw_view_source_clipped(struct weston_view *view,
 			 struct weston_output *output,
+			 struct pixman_renderer_tile *tile,
 			 pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -464,7 +532,7 @@ draw_view_source_clipped(struct weston_view *view,
 	pixman_region32_copy(&repaint_output, repaint_global);
 	region_global_to_output(output, &repaint_output);
 
-	repaint_region(view, output, &repaint_output, &buffer_region,
+	repaint_region(view, output, tile, &repaint_output, &buffer_region,
 		       PIXMAN_OP_OVER);
 
 	pixman_region32_fini(&repaint_output);
@@ -474,7 +542,7 @@ draw_view_source_clipped(struct weston_view *view,
 
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
-	  pixman_region32_t *damage) /* in global coordinates */
+	  struct pixman_renderer_tile *tile)
 {
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
 	/* repaint bounding region in global coordinates: */
@@ -486,7 +554,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 
 	pixman_region32_init(&repaint);
 	pixman_region32_intersect(&repaint,
-				  &ev->transform.boundingbox, damage);
+				  &ev->transform.boundingbox, &tile->damage);
 	pixman_region32_subtract(&repaint, &repaint, &ev->clip);
 
 	if (!pixman_region32_not_empty(&repaint))
@@ -500,7 +568,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * Also the boundingbox is accurate rather than an
 		 * approximation.
 		 */
-		draw_view_translated(ev, output, &repaint);
+		draw_view_translated(ev, output, tile, &repaint);
 	} else {
 		/* The complex case: the view transformation does not allow
 		 * converting opaque etc. regions into global coordinate space.
@@ -509,21 +577,168 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * to be used whole. Source clipping does not work with
 		 * PIXMAN_OP_SRC.
 		 */
-		draw_view_source_clipped(ev, output, &repaint);
+		draw_view_source_clipped(ev, output, tile, &repaint);
 	}
 
 out:
 	pixman_region32_fini(&repaint);
 }
 static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+repaint_tile(struct weston_output *output, struct pixman_renderer_tile *tile)
 {
 	struct weston_compositor *compositor = output->compositor;
-	struct weston_view *view;
+	struct weston_view **views = output->view_list.data;
+	int i, n_views = output->view_list.size / sizeof *views;
+
+	for (i = n_views - 1; i >= 0; i--)
+		if (views[i]->plane == &compositor->primary_plane)
+			draw_view(views[i], output, tile);
+}
+
+/* Paints tiles of the current job until none are left. Called with
+ * job_mutex held; the mutex is dropped while painting. */
+static void
+pixman_renderer_run_job(struct pixman_renderer *pr)
+{
+	struct pixman_renderer_job *job = pr->job;
+	int tile;
+
+	while (job->next_tile < job->n_tiles) {
+		tile = job->next_tile++;
+
+		pthread_mutex_unlock(&pr->job_mutex);
+		repaint_tile(job->output, &job->tiles[tile]);
+		pthread_mutex_lock(&pr->job_mutex);
+
+		if (++job->tiles_done == job->n_tiles)
+			pthread_cond_signal(&pr->done_cond);
+	}
+}
+
+static void *
+pixman_renderer_thread(void *data)
+{
+	struct pixman_renderer *pr = data;
+	uint32_t serial = 0;
+
+	pthread_mutex_lock(&pr->job_mutex);
+
+	while (true) {
+		while (!pr->threads_quit && pr->job_serial == serial)
+			pthread_cond_wait(&pr->job_cond, &pr->job_mutex);
+
+		if (pr->threads_quit)
+			break;
+
+		serial = pr->job_serial;
+		if (pr->job)
+			pixman_renderer_run_job(pr);
+	}
+
+	pthread_mutex_unlock(&pr->job_mutex);
+
+	return NULL;
+}
+
+/* Splits the damage into horizontal bands, one or two per thread. Bands
+ * keep the shadow buffer rows of a tile together, which is friendlier to
+ * the caches than square tiles. */
+static int
+split_damage(struct pixman_renderer *pr, struct weston_output *output,
+	     pixman_region32_t *damage, struct pixman_renderer_tile *tiles)
+{
+	pixman_box32_t *extents = pixman_region32_extents(damage);
+	int32_t width = extents->x2 - extents->x1;
+	int32_t height = extents->y2 - extents->y1;
+	int32_t band, y;
+	int max_tiles, n_tiles = 0;
+
+	/* Zoomed output regions are bounding boxes that may overlap, and
+	 * tiles must not touch the same pixels. */
+	if (pr->n_threads < 2 || output->zoom.active ||
+	    (int64_t)width * height < PIXMAN_RENDERER_MIN_TILED_AREA) {
+		pixman_region32_init(&tiles[0].damage);
+		pixman_region32_copy(&tiles[0].damage, damage);
+		return 1;
+	}
+
+	max_tiles = pr->n_threads * 2;
+	band = (height + max_tiles - 1) / max_tiles;
+
+	for (y = extents->y1; y < extents->y2; y += band) {
+		pixman_region32_init_rect(&tiles[n_tiles].damage,
+					  extents->x1, y, width, band);
+		pixman_region32_intersect(&tiles[n_tiles].damage,
+					  &tiles[n_tiles].damage, damage);
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+		if (pixman_region32_not_empty(&tiles[n_tiles].damage))
+			n_tiles++;
+		else
+			pixman_region32_fini(&tiles[n_tiles].damage);
+	}
+
+	return n_tiles;
+}
+
+static void
+repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_renderer_tile tiles[PIXMAN_RENDERER_MAX_THREADS * 2];
+	struct pixman_renderer_job job;
+	struct weston_view **views = output->view_list.data;
+	int i, n_views = output->view_list.size / sizeof *views;
+	int n_tiles, n_box;
+	static bool overdraw_warned = false;
+
+	/* Surface state is created on demand, which must not happen from
+	 * the worker threads. */
+	for (i = 0; i < n_views; i++)
+		get_surface_state(views[i]->surface);
+
+	n_tiles = split_damage(pr, output, damage, tiles);
+
+	for (i = 0; i < n_tiles; i++)
+		tiles[i].target = pixman_image_create_bits_no_clear(
+				pixman_image_get_format(po->shadow_image),
+				pixman_image_get_width(po->shadow_image),
+				pixman_image_get_height(po->shadow_image),
+				po->shadow_buffer,
+				pixman_image_get_stride(po->shadow_image));
+
+	if (n_tiles == 1) {
+		repaint_tile(output, &tiles[0]);
+	} else {
+		job.output = output;
+		job.tiles = tiles;
+		job.n_tiles = n_tiles;
+		job.next_tile = 0;
+		job.tiles_done = 0;
+
+		pthread_mutex_lock(&pr->job_mutex);
+		pr->job = &job;
+		pr->job_serial++;
+		pthread_cond_broadcast(&pr->job_cond);
+
+		pixman_renderer_run_job(pr);
+		while (job.tiles_done < job.n_tiles)
+			pthread_cond_wait(&pr->done_cond, &pr->job_mutex);
+
+		pr->job = NULL;
+		pthread_mutex_unlock(&pr->job_mutex);
+	}
+
+	for (i = 0; i < n_tiles; i++) {
+		pixman_image_unref(tiles[i].target);
+		pixman_region32_fini(&tiles[i].damage);
+	}
+
+	n_box = __atomic_exchange_n(&overdraw_boxes, 0, __ATOMIC_RELAXED);
+	if (n_box > 1 && !overdraw_warned) {
+		weston_log("Pixman-renderer warning: %dx overdraw\n", n_box);
+		overdraw_warned = true;
+	}
 }
 
 static void
@@ -741,14 +956,85 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 		ps->image = NULL;
 	}
 
+	ps->color = color;
 	ps->image = pixman_image_create_solid_fill(&color);
 }
 
+static int
+pixman_renderer_thread_count(void)
+{
+	const char *env = getenv("WESTON_PIXMAN_THREADS");
+	long n;
+
+	if (env)
+		n = strtol(env, NULL, 10);
+	else
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		n = 1;
+	if (n > PIXMAN_RENDERER_MAX_THREADS)
+		n = PIXMAN_RENDERER_MAX_THREADS;
+
+	return n;
+}
+
+static void
+pixman_renderer_stop_threads(struct pixman_renderer *pr)
+{
+	int i;
+
+	pthread_mutex_lock(&pr->job_mutex);
+	pr->threads_quit = true;
+	pthread_cond_broadcast(&pr->job_cond);
+	pthread_mutex_unlock(&pr->job_mutex);
+
+	for (i = 0; i < pr->n_threads - 1; i++)
+		pthread_join(pr->threads[i], NULL);
+
+	free(pr->threads);
+	pr->threads = NULL;
+	pr->n_threads = 1;
+}
+
+static void
+pixman_renderer_start_threads(struct pixman_renderer *pr)
+{
+	int i, n = pixman_renderer_thread_count();
+
+	pthread_mutex_init(&pr->job_mutex, NULL);
+	pthread_cond_init(&pr->job_cond, NULL);
+	pthread_cond_init(&pr->done_cond, NULL);
+	pr->n_threads = 1;
+
+	if (n < 2)
+		return;
+
+	pr->threads = calloc(n - 1, sizeof *pr->threads);
+	if (!pr->threads)
+		return;
+
+	for (i = 0; i < n - 1; i++) {
+		if (pthread_create(&pr->threads[i], NULL,
+				   pixman_renderer_thread, pr) != 0)
+			break;
+		pr->n_threads++;
+	}
+
+	weston_log("Pixman renderer compositing with %d threads\n",
+		   pr->n_threads);
+}
+
 static void
 pixman_renderer_destroy(struct weston_compositor *ec)
 {
 	struct pixman_renderer *pr = get_renderer(ec);
 
+	pixman_renderer_stop_threads(pr);
+	pthread_cond_destroy(&pr->done_cond);
+	pthread_cond_destroy(&pr->job_cond);
+	pthread_mutex_destroy(&pr->job_mutex);
+
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
 	free(pr);
@@ -812,16 +1098,8 @@ debug_binding(struct weston_keyboard *keyboard, uint32_t time, uint32_t key,
 
 	pr->repaint_debug ^= 1;
 
-	if (pr->repaint_debug) {
-		pixman_color_t red = {
-			0x3fff, 0x0000, 0x0000, 0x3fff
-		};
-
-		pr->debug_color = pixman_image_create_solid_fill(&red);
-	} else {
-		pixman_image_unref(pr->debug_color);
+	if (!pr->repaint_debug)
 		weston_compositor_damage_all(ec);
-	}
 }
 
 WL_EXPORT int
@@ -834,7 +1112,6 @@ pixman_renderer_init(struct weston_compositor *ec)
 		return -1;
 
 	renderer->repaint_debug = 0;
-	renderer->debug_color = NULL;
 	renderer->base.read_pixels = pixman_renderer_read_pixels;
 	renderer->base.repaint_output = pixman_renderer_repaint_output;
 	renderer->base.flush_damage = pixman_renderer_flush_damage;
@@ -858,6 +1135,8 @@ pixman_renderer_init(struct weston_compositor *ec)
 
 	wl_signal_init(&renderer->destroy_signal);
 
+	pixman_renderer_start_threads(renderer);
+
 	return 0;
 }
 
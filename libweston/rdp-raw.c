@@ -0,0 +1,129 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "rdp-raw.h"
+
+/* Rectangles are merged when this many pixels or fewer, or an eighth of
+ * the merged rectangle, would be sent needlessly. Each surface bits
+ * command costs a PDU header and a round through the client decoder,
+ * which outweighs a few extra pixels. */
+#define RDP_RAW_MERGE_SLACK 1024
+#define RDP_RAW_MERGE_RATIO 8
+
+/* Per row overhead assumed when fitting a strip into a request */
+#define RDP_RAW_ROW_OVERHEAD 16
+
+static int64_t
+box_area(const pixman_box32_t *box)
+{
+	return (int64_t)(box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+/** Merge damage rectangles into fewer, larger ones
+ *
+ * \param rects The rectangles of a region, in pixman's band order.
+ * \param nrects Number of rectangles.
+ * \param merged Returns the merged rectangles, room for nrects of them.
+ * \return The number of merged rectangles.
+ *
+ * Neighbouring rectangles are merged greedily into their bounding box as
+ * long as few pixels outside the damage are added. The result covers all
+ * of the damage, but its rectangles may overlap.
+ */
+int
+rdp_raw_merge_rects(const pixman_box32_t *rects, int nrects,
+		    pixman_box32_t *merged)
+{
+	pixman_box32_t cur, box;
+	int64_t covered, waste;
+	int i, n = 0;
+
+	if (nrects == 0)
+		return 0;
+
+	cur = rects[0];
+	covered = box_area(&cur);
+
+	for (i = 1; i < nrects; i++) {
+		box.x1 = cur.x1 < rects[i].x1 ? cur.x1 : rects[i].x1;
+		box.y1 = cur.y1 < rects[i].y1 ? cur.y1 : rects[i].y1;
+		box.x2 = cur.x2 > rects[i].x2 ? cur.x2 : rects[i].x2;
+		box.y2 = cur.y2 > rects[i].y2 ? cur.y2 : rects[i].y2;
+
+		waste = box_area(&box) - covered - box_area(&rects[i]);
+		if (waste <= RDP_RAW_MERGE_SLACK ||
+		    waste * RDP_RAW_MERGE_RATIO <= box_area(&box)) {
+			cur = box;
+			covered += box_area(&rects[i]);
+			continue;
+		}
+
+		merged[n++] = cur;
+		cur = rects[i];
+		covered = box_area(&cur);
+	}
+
+	merged[n++] = cur;
+
+	return n;
+}
+
+/** Number of rows of a rectangle that fit into one request
+ *
+ * \param width Width of the rectangle.
+ * \param max_request_size The peer's MultifragMaxRequestSize.
+ * \return The strip height, at least 1.
+ */
+int
+rdp_raw_strip_height(int width, uint32_t max_request_size)
+{
+	int height = max_request_size / (RDP_RAW_ROW_OVERHEAD + width * 4);
+
+	return height > 0 ? height : 1;
+}
+
+/** Copy a rectangle of a 32 bpp image bottom-up, as raw bitmaps expect
+ *
+ * \param image The source image.
+ * \param rect The rectangle to copy.
+ * \param dest Destination of (x2 - x1) * (y2 - y1) * 4 bytes.
+ */
+void
+rdp_raw_copy_flipped(pixman_image_t *image, const pixman_box32_t *rect,
+		     uint8_t *dest)
+{
+	int stride = pixman_image_get_stride(image);
+	int row = (rect->x2 - rect->x1) * 4;
+	int height = rect->y2 - rect->y1;
+	const uint8_t *src = (const uint8_t *)pixman_image_get_data(image);
+	int h;
+
+	src += (rect->y2 - 1) * stride + rect->x1 * 4;
+
+	for (h = 0; h < height; h++, src -= stride, dest += row)
+		memcpy(dest, src, row);
+}
@@ -0,0 +1,45 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_RDP_RAW_H
+#define WESTON_RDP_RAW_H
+
+#include <stdint.h>
+#include <pixman.h>
+
+/* Helpers for sending uncompressed surface bits, kept free of FreeRDP so
+ * that they can be tested and measured on their own.
+ */
+
+int
+rdp_raw_merge_rects(const pixman_box32_t *rects, int nrects,
+		    pixman_box32_t *merged);
+
+int
+rdp_raw_strip_height(int width, uint32_t max_request_size);
+
+void
+rdp_raw_copy_flipped(pixman_image_t *image, const pixman_box32_t *rect,
+		     uint8_t *dest);
+
+#endif
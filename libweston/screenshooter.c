@@ -32,8 +32,16 @@
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/uio.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "compositor.h"
 #include "shared/helpers.h"
 
@@ -208,14 +216,53 @@ weston_screenshooter_shoot(struct weston_output *output,
 	return 0;
 }
 
+/* Frames queued for encoding at most; further frames are dropped and
+ * their damage is recorded with the next frame that fits. */
+#define RECORDER_QUEUE_LENGTH 4
+
+/* Milliseconds between keyframes, which seeking decoders start from */
+#define RECORDER_KEYFRAME_INTERVAL 2000
+
+/* The damaged pixels of one output frame, read back by the compositor
+ * thread and encoded by the recorder thread.
+ */
+struct weston_recorder_frame {
+	struct wl_list link;
+	uint32_t msecs;
+	bool keyframe;
+	int nrects;
+	pixman_box32_t *rects;
+	int rects_alloc;
+	uint32_t *pixels;
+	size_t pixels_alloc;
+};
+
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
-	uint32_t total;
+	int width, height;
+	int do_yflip;
 	int fd;
 	struct wl_listener frame_listener;
-	int count, destroying;
+	int count, dropped, destroying;
+	pixman_region32_t dropped_damage;
+	uint32_t keyframe_msecs;
+
+	/* Owned by the recorder thread until it is joined */
+	uint32_t *frame;
+	uint32_t *delta, *outbuf;
+	uint32_t total;
+	uint64_t encoded_pixels;
+	uint64_t encode_nsec;
+	uint64_t offset;
+	struct wl_array index;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct wl_list queue;
+	struct wl_list free_frames;
+	bool quit;
+	struct weston_recorder_frame frames[RECORDER_QUEUE_LENGTH];
 };
 
 static uint32_t *
@@ -249,115 +296,370 @@ component_delta(uint32_t next, uint32_t prev)
 	return (dr << 16) | (dg << 8) | (db << 0);
 }
 
+/* Computes the deltas of a row against the previous frame and stores the
+ * new pixels in it. The per component delta is a bytewise subtraction, so
+ * four pixels are handled at once where SIMD is available. */
 static void
-weston_recorder_destroy(struct weston_recorder *recorder);
+delta_row(uint32_t *delta, const uint32_t *s, uint32_t *d, int width)
+{
+	int k = 0;
+
+#if defined(__SSE2__)
+	const __m128i mask = _mm_set1_epi32(0x00ffffff);
+	__m128i next, prev;
+
+	for (; k + 4 <= width; k += 4) {
+		next = _mm_loadu_si128((const __m128i *) (s + k));
+		prev = _mm_loadu_si128((const __m128i *) (d + k));
+		_mm_storeu_si128((__m128i *) (delta + k),
+				 _mm_and_si128(_mm_sub_epi8(next, prev), mask));
+		_mm_storeu_si128((__m128i *) (d + k), next);
+	}
+#elif defined(__ARM_NEON)
+	const uint32x4_t mask = vdupq_n_u32(0x00ffffff);
+	uint8x16_t next, prev;
+
+	for (; k + 4 <= width; k += 4) {
+		next = vld1q_u8((const uint8_t *) (s + k));
+		prev = vld1q_u8((const uint8_t *) (d + k));
+		vst1q_u32(delta + k,
+			  vandq_u32(vreinterpretq_u32_u8(vsubq_u8(next, prev)),
+				    mask));
+		vst1q_u8((uint8_t *) (d + k), next);
+	}
+#endif
+
+	for (; k < width; k++) {
+		delta[k] = component_delta(s[k], d[k]);
+		d[k] = s[k];
+	}
+}
+
+/* Returns how many of the first n deltas equal value. */
+static int
+equal_span(const uint32_t *delta, int n, uint32_t value)
+{
+	int k = 0;
+
+#if defined(__SSE2__)
+	const __m128i v = _mm_set1_epi32(value);
+	__m128i eq;
+
+	for (; k + 4 <= n; k += 4) {
+		eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (delta + k)), v);
+		if (_mm_movemask_epi8(eq) != 0xffff)
+			break;
+	}
+#elif defined(__ARM_NEON)
+	const uint32x4_t v = vdupq_n_u32(value);
+	uint64x2_t eq;
+
+	for (; k + 4 <= n; k += 4) {
+		eq = vreinterpretq_u64_u32(vceqq_u32(vld1q_u32(delta + k), v));
+		if ((vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) != ~0ULL)
+			break;
+	}
+#endif
+
+	while (k < n && delta[k] == value)
+		k++;
+
+	return k;
+}
+
+/* Run-length encodes a row of deltas. Runs continue across rows. */
+static uint32_t *
+rle_row(uint32_t *p, const uint32_t *delta, int width,
+	uint32_t *prev, int *run)
+{
+	int k, n;
+
+	for (k = 0; k < width; k++) {
+		if (*run > 0 && delta[k] != *prev) {
+			p = output_run(p, *prev, *run);
+			*run = 0;
+		}
+
+		*prev = delta[k];
+		n = 1 + equal_span(delta + k + 1, width - k - 1, *prev);
+		*run += n;
+		k += n - 1;
+	}
+
+	return p;
+}
 
 static void
-weston_recorder_frame_notify(struct wl_listener *listener, void *data)
+weston_recorder_encode_frame(struct weston_recorder *recorder,
+			     struct weston_recorder_frame *frame)
 {
-	struct weston_recorder *recorder =
-		container_of(listener, struct weston_recorder, frame_listener);
-	struct weston_output *output = data;
-	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = output->frame_time;
-	pixman_box32_t *r;
-	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
+	pixman_box32_t *r = frame->rects;
+	int i, j, width, height, run, y;
+	uint32_t prev, *d, *s, *p, *pixels = frame->pixels;
+	struct wcap_frame_header_v2 header;
+	struct wcap_index_entry *entry;
+	struct iovec v[3];
+	struct timespec begin, end;
+	ssize_t len;
+
+	/* Keyframes are encoded against black so that decoding can
+	 * start at them. */
+	if (frame->keyframe)
+		memset(recorder->frame, 0,
+		       recorder->width * recorder->height * 4);
+
+	/* The rectangles do not overlap, so the runs of all of them fit
+	 * in outbuf. */
+	p = recorder->outbuf;
+	for (i = 0; i < frame->nrects; i++) {
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
 
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
 
-	pixman_region32_init(&damage);
-	pixman_region32_init(&transformed_damage);
-	pixman_region32_intersect(&damage, &output->region,
-				  &output->previous_damage);
-	pixman_region32_translate(&damage, -output->x, -output->y);
-	weston_transformed_region(output->width, output->height,
-				 output->transform, output->current_scale,
-				 &damage, &transformed_damage);
-	pixman_region32_fini(&damage);
+		run = prev = 0;
+		for (j = 0; j < height; j++) {
+			if (recorder->do_yflip)
+				s = pixels + width * j;
+			else
+				s = pixels + width * (height - j - 1);
+			y = r[i].y2 - j - 1;
+			d = recorder->frame + recorder->width * y + r[i].x1;
 
-	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
+			delta_row(recorder->delta, s, d, width);
+			p = rle_row(p, recorder->delta, width, &prev, &run);
+		}
+
+		p = output_run(p, prev, run);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		recorder->encode_nsec += (end.tv_sec - begin.tv_sec) *
+			1000000000ULL + end.tv_nsec - begin.tv_nsec;
+		recorder->encoded_pixels += width * height;
+
+		pixels += width * height;
 	}
 
-	header.msecs = msecs;
-	header.nrects = n;
+	header.msecs = frame->msecs;
+	header.nrects = frame->nrects;
+	header.flags = frame->keyframe ? WCAP_FRAME_KEYFRAME : 0;
+	header.size = frame->nrects * sizeof *r + (p - recorder->outbuf) * 4;
 	v[0].iov_base = &header;
 	v[0].iov_len = sizeof header;
 	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
+	v[1].iov_len = frame->nrects * sizeof *r;
+	v[2].iov_base = recorder->outbuf;
+	v[2].iov_len = (p - recorder->outbuf) * 4;
+
+	entry = wl_array_add(&recorder->index, sizeof *entry);
+	if (entry) {
+		entry->offset = recorder->offset;
+		entry->msecs = header.msecs;
+		entry->flags = header.flags;
+	}
+
+	len = writev(recorder->fd, v, 3);
+	if (len > 0) {
+		recorder->total += len;
+		recorder->offset += len;
+	}
+}
+
+/* The index goes after the last frame, behind a frame header that
+ * tells streaming decoders to stop, and is followed by a trailer that
+ * locates it at the end of the file. */
+static void
+weston_recorder_write_index(struct weston_recorder *recorder)
+{
+	struct wcap_frame_header_v2 header;
+	struct wcap_index_trailer trailer;
+	struct iovec v[3];
+	ssize_t len;
+
+	header.msecs = 0;
+	header.nrects = 0;
+	header.flags = WCAP_FRAME_INDEX;
+	header.size = recorder->index.size;
+	trailer.offset = recorder->offset + sizeof header;
+	trailer.count = recorder->index.size /
+		sizeof(struct wcap_index_entry);
+	trailer.magic = WCAP_INDEX_MAGIC;
+	v[0].iov_base = &header;
+	v[0].iov_len = sizeof header;
+	v[1].iov_base = recorder->index.data;
+	v[1].iov_len = recorder->index.size;
+	v[2].iov_base = &trailer;
+	v[2].iov_len = sizeof trailer;
+
+	len = writev(recorder->fd, v, 3);
+	if (len > 0)
+		recorder->total += len;
+}
 
+static void *
+weston_recorder_thread(void *data)
+{
+	struct weston_recorder *recorder = data;
+	struct weston_recorder_frame *frame;
+
+	pthread_mutex_lock(&recorder->mutex);
+
+	for (;;) {
+		while (!recorder->quit && wl_list_empty(&recorder->queue))
+			pthread_cond_wait(&recorder->cond, &recorder->mutex);
+
+		/* Queued frames are still written when stopping. */
+		if (wl_list_empty(&recorder->queue))
+			break;
+
+		frame = container_of(recorder->queue.next,
+				     struct weston_recorder_frame, link);
+		wl_list_remove(&frame->link);
+
+		pthread_mutex_unlock(&recorder->mutex);
+		weston_recorder_encode_frame(recorder, frame);
+		pthread_mutex_lock(&recorder->mutex);
+
+		wl_list_insert(&recorder->free_frames, &frame->link);
+	}
+
+	pthread_mutex_unlock(&recorder->mutex);
+
+	return NULL;
+}
+
+/* Reads the damaged pixels into a free frame; returns -1 if there is
+ * none or it cannot hold them. */
+static int
+weston_recorder_read_frame(struct weston_recorder *recorder,
+			   pixman_region32_t *damage, bool keyframe)
+{
+	struct weston_output *output = recorder->output;
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_recorder_frame *frame = NULL;
+	pixman_box32_t *r, *rects;
+	uint32_t *pixels;
+	size_t size = 0;
+	int i, n, width, height, y_orig;
+
+	pthread_mutex_lock(&recorder->mutex);
+	if (!wl_list_empty(&recorder->free_frames)) {
+		frame = container_of(recorder->free_frames.next,
+				     struct weston_recorder_frame, link);
+		wl_list_remove(&frame->link);
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+
+	if (!frame)
+		return -1;
+
+	r = pixman_region32_rectangles(damage, &n);
+	for (i = 0; i < n; i++)
+		size += (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+
+	if (n > frame->rects_alloc) {
+		rects = realloc(frame->rects, n * sizeof *rects);
+		if (!rects)
+			goto err;
+		frame->rects = rects;
+		frame->rects_alloc = n;
+	}
+
+	if (size > frame->pixels_alloc) {
+		pixels = realloc(frame->pixels, size * 4);
+		if (!pixels)
+			goto err;
+		frame->pixels = pixels;
+		frame->pixels_alloc = size;
+	}
+
+	frame->msecs = output->frame_time;
+	frame->keyframe = keyframe;
+	frame->nrects = n;
+	memcpy(frame->rects, r, n * sizeof *r);
+
+	pixels = frame->pixels;
 	for (i = 0; i < n; i++) {
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
-		if (do_yflip)
+		if (recorder->do_yflip)
 			y_orig = output->current_mode->height - r[i].y2;
 		else
 			y_orig = r[i].y1;
 
 		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
+				compositor->read_format, pixels,
 				r[i].x1, y_orig, width, height);
 
-		p = outbuf;
-		run = prev = 0; /* quiet gcc */
-		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				s = recorder->rect + width * j;
-			else
-				s = recorder->rect + width * (height - j - 1);
-			y_orig = r[i].y2 - j - 1;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
-		}
+		pixels += width * height;
+	}
 
-		p = output_run(p, prev, run);
+	pthread_mutex_lock(&recorder->mutex);
+	wl_list_insert(recorder->queue.prev, &frame->link);
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
 
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
+	return 0;
 
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
-#endif
+err:
+	pthread_mutex_lock(&recorder->mutex);
+	wl_list_insert(&recorder->free_frames, &frame->link);
+	pthread_mutex_unlock(&recorder->mutex);
+
+	return -1;
+}
+
+static void
+weston_recorder_destroy(struct weston_recorder *recorder);
+
+static void
+weston_recorder_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct weston_recorder *recorder =
+		container_of(listener, struct weston_recorder, frame_listener);
+	struct weston_output *output = data;
+	pixman_region32_t damage, transformed_damage;
+	bool keyframe;
+
+	pixman_region32_init(&damage);
+	pixman_region32_init(&transformed_damage);
+	pixman_region32_intersect(&damage, &output->region,
+				  &output->previous_damage);
+	pixman_region32_translate(&damage, -output->x, -output->y);
+	weston_transformed_region(output->width, output->height,
+				 output->transform, output->current_scale,
+				 &damage, &transformed_damage);
+	pixman_region32_fini(&damage);
+
+	/* Areas that changed in dropped frames have to be recorded
+	 * with this one, as the encoder only sees damaged pixels. */
+	pixman_region32_union(&transformed_damage, &transformed_damage,
+			      &recorder->dropped_damage);
+
+	keyframe = recorder->count == 0 ||
+		output->frame_time - recorder->keyframe_msecs >=
+		RECORDER_KEYFRAME_INTERVAL;
+	if (keyframe && pixman_region32_not_empty(&transformed_damage))
+		pixman_region32_union_rect(&transformed_damage,
+					   &transformed_damage, 0, 0,
+					   recorder->width, recorder->height);
+
+	if (pixman_region32_not_empty(&transformed_damage)) {
+		if (weston_recorder_read_frame(recorder, &transformed_damage,
+					       keyframe) == 0) {
+			pixman_region32_clear(&recorder->dropped_damage);
+			if (keyframe)
+				recorder->keyframe_msecs = output->frame_time;
+			recorder->count++;
+		} else {
+			pixman_region32_copy(&recorder->dropped_damage,
+					     &transformed_damage);
+			recorder->dropped++;
+		}
 	}
 
 	pixman_region32_fini(&transformed_damage);
-	recorder->count++;
 
 	if (recorder->destroying)
 		weston_recorder_destroy(recorder);
@@ -366,11 +668,20 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 static void
 weston_recorder_free(struct weston_recorder *recorder)
 {
+	int i;
+
 	if (recorder == NULL)
 		return;
 
-	free(recorder->tmpbuf);
-	free(recorder->rect);
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++) {
+		free(recorder->frames[i].rects);
+		free(recorder->frames[i].pixels);
+	}
+
+	pixman_region32_fini(&recorder->dropped_damage);
+	wl_array_release(&recorder->index);
+	free(recorder->outbuf);
+	free(recorder->delta);
 	free(recorder->frame);
 	free(recorder);
 }
@@ -380,11 +691,11 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_recorder *recorder;
-	int stride, size;
-	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	int stride, size, i;
+	struct wcap_header header;
+	struct wcap_header_v2 header_v2;
+	struct iovec v[2];
+	ssize_t len;
 
 	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
@@ -392,26 +703,27 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		return NULL;
 	}
 
+	pixman_region32_init(&recorder->dropped_damage);
+	wl_array_init(&recorder->index);
+	recorder->do_yflip =
+		!!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	recorder->width = output->current_mode->width;
+	recorder->height = output->current_mode->height;
+
 	stride = output->current_mode->width;
 	size = stride * 4 * output->current_mode->height;
 	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
+	recorder->outbuf = malloc(size);
+	recorder->delta = malloc(stride * 4);
 	recorder->output = output;
 
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	if ((recorder->frame == NULL) || (recorder->outbuf == NULL) ||
+	    (recorder->delta == NULL)) {
 		weston_log("%s: out of memory\n", __func__);
 		goto err_recorder;
 	}
 
-	if (!do_yflip) {
-		recorder->tmpbuf = malloc(size);
-		if (recorder->tmpbuf == NULL) {
-			weston_log("%s: out of memory\n", __func__);
-			goto err_recorder;
-		}
-	}
-
-	header.magic = WCAP_HEADER_MAGIC;
+	header.magic = WCAP_HEADER_MAGIC_V2;
 
 	switch (compositor->read_format) {
 	case PIXMAN_x8r8g8b8:
@@ -436,7 +748,32 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 
 	header.width = output->current_mode->width;
 	header.height = output->current_mode->height;
-	recorder->total += write(recorder->fd, &header, sizeof header);
+	header_v2.keyframe_interval = RECORDER_KEYFRAME_INTERVAL;
+	header_v2.reserved = 0;
+	v[0].iov_base = &header;
+	v[0].iov_len = sizeof header;
+	v[1].iov_base = &header_v2;
+	v[1].iov_len = sizeof header_v2;
+	len = writev(recorder->fd, v, 2);
+	if (len > 0)
+		recorder->total = recorder->offset = len;
+
+	wl_list_init(&recorder->queue);
+	wl_list_init(&recorder->free_frames);
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++)
+		wl_list_insert(&recorder->free_frames,
+			       &recorder->frames[i].link);
+
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->cond, NULL);
+	if (pthread_create(&recorder->thread, NULL,
+			   weston_recorder_thread, recorder) != 0) {
+		weston_log("%s: failed to start recorder thread\n", __func__);
+		pthread_cond_destroy(&recorder->cond);
+		pthread_mutex_destroy(&recorder->mutex);
+		close(recorder->fd);
+		goto err_recorder;
+	}
 
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
@@ -454,8 +791,28 @@ static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
 	wl_list_remove(&recorder->frame_listener.link);
-	close(recorder->fd);
 	recorder->output->disable_planes--;
+
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->quit = true;
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
+	pthread_join(recorder->thread, NULL);
+
+	weston_recorder_write_index(recorder);
+
+	pthread_cond_destroy(&recorder->cond);
+	pthread_mutex_destroy(&recorder->mutex);
+	close(recorder->fd);
+
+	weston_log("recorder stopped, total file size %dM, %d frames, "
+		   "%d dropped, encoding at %.1f Mpixels/s\n",
+		   recorder->total / (1024 * 1024), recorder->count,
+		   recorder->dropped,
+		   recorder->encode_nsec ?
+		   recorder->encoded_pixels * 1000.0 / recorder->encode_nsec :
+		   0.0);
+
 	weston_recorder_free(recorder);
 }
 
@@ -480,8 +837,7 @@ weston_recorder_start(struct weston_output *output, const char *filename)
 WL_EXPORT void
 weston_recorder_stop(struct weston_recorder *recorder)
 {
-	weston_log("stopping recorder, total file size %dM, %d frames\n",
-		   recorder->total / (1024 * 1024), recorder->count);
+	weston_log("stopping recorder\n");
 
 	recorder->destroying = 1;
 	weston_output_schedule_repaint(recorder->output);
@@ -0,0 +1,94 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_TIMELINE_BINARY_H
+#define WESTON_TIMELINE_BINARY_H
+
+#include <stdint.h>
+
+/*
+ * Binary timeline log format, written when the compositor runs with
+ * WESTON_TIMELINE_FORMAT=binary. The file starts with a
+ * struct weston_timeline_binary_header followed by records of
+ * header.record_size bytes each. All values are in host byte order.
+ *
+ * The records carry the same information as the JSON timeline log;
+ * weston-timeline-convert turns them back into that format.
+ */
+
+#define WESTON_TIMELINE_BINARY_MAGIC 0x4c545357 /* "WSTL" */
+#define WESTON_TIMELINE_BINARY_VERSION 1
+
+struct weston_timeline_binary_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t reserved;
+};
+
+enum weston_timeline_record_type {
+	/* A TL_POINT() event */
+	WESTON_TIMELINE_RECORD_POINT = 1,
+	/* Description of a weston_output, id and desc (the name) are set */
+	WESTON_TIMELINE_RECORD_OUTPUT,
+	/* Description of a weston_surface, id, desc and main_surface set */
+	WESTON_TIMELINE_RECORD_SURFACE,
+	/* The ring was full; id holds the number of records lost */
+	WESTON_TIMELINE_RECORD_DROPPED,
+};
+
+/* Which optional fields of a point record are valid */
+enum weston_timeline_point_flags {
+	WESTON_TIMELINE_POINT_OUTPUT = 1 << 0,
+	WESTON_TIMELINE_POINT_SURFACE = 1 << 1,
+	WESTON_TIMELINE_POINT_VBLANK = 1 << 2,
+};
+
+#define WESTON_TIMELINE_NAME_SIZE 64
+#define WESTON_TIMELINE_DESC_SIZE 96
+
+struct weston_timeline_record {
+	uint16_t type;		/* enum weston_timeline_record_type */
+	uint16_t flags;		/* enum weston_timeline_point_flags */
+	uint32_t id;
+	int64_t tv_sec;
+	int64_t tv_nsec;
+
+	union {
+		struct {
+			uint32_t output;
+			uint32_t surface;
+			int64_t vblank_sec;
+			int64_t vblank_nsec;
+			char name[WESTON_TIMELINE_NAME_SIZE];
+		} point;
+
+		struct {
+			uint32_t main_surface;	/* 0 if none */
+			uint32_t reserved;
+			char desc[WESTON_TIMELINE_DESC_SIZE];
+		} object;
+	};
+};
+
+#endif /* WESTON_TIMELINE_BINARY_H */
@@ -0,0 +1,171 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "timeline-binary.h"
+
+/*
+ * Converts a binary timeline log, as written with
+ * WESTON_TIMELINE_FORMAT=binary, to the JSON timeline format understood
+ * by existing timeline analysis tools.
+ */
+
+static void
+print_quoted_string(FILE *fp, const char *str, size_t size)
+{
+	if (str[0] == '\0') {
+		fprintf(fp, "null");
+		return;
+	}
+
+	fprintf(fp, "\"%.*s\"", (int)size, str);
+}
+
+static void
+print_record(FILE *out, const struct weston_timeline_record *rec)
+{
+	switch (rec->type) {
+	case WESTON_TIMELINE_RECORD_OUTPUT:
+		fprintf(out, "{ \"id\":%u, "
+			"\"type\":\"weston_output\", \"name\":", rec->id);
+		print_quoted_string(out, rec->object.desc,
+				    sizeof rec->object.desc);
+		fprintf(out, " }\n");
+		break;
+	case WESTON_TIMELINE_RECORD_SURFACE:
+		fprintf(out, "{ \"id\":%u, "
+			"\"type\":\"weston_surface\", \"desc\":", rec->id);
+		print_quoted_string(out, rec->object.desc,
+				    sizeof rec->object.desc);
+		if (rec->object.main_surface)
+			fprintf(out, ", \"main_surface\":%u",
+				rec->object.main_surface);
+		fprintf(out, " }\n");
+		break;
+	case WESTON_TIMELINE_RECORD_POINT:
+		fprintf(out, "{ \"T\":[%" PRId64 ", %" PRId64 "], \"N\":\"%.*s\"",
+			rec->tv_sec, rec->tv_nsec,
+			(int)sizeof rec->point.name, rec->point.name);
+		if (rec->flags & WESTON_TIMELINE_POINT_OUTPUT)
+			fprintf(out, ", \"wo\":%u", rec->point.output);
+		if (rec->flags & WESTON_TIMELINE_POINT_SURFACE)
+			fprintf(out, ", \"ws\":%u", rec->point.surface);
+		if (rec->flags & WESTON_TIMELINE_POINT_VBLANK)
+			fprintf(out, ", \"vblank\":[%" PRId64 ", %" PRId64 "]",
+				rec->point.vblank_sec, rec->point.vblank_nsec);
+		fprintf(out, " }\n");
+		break;
+	case WESTON_TIMELINE_RECORD_DROPPED:
+		fprintf(stderr, "warning: %u timeline records were lost\n",
+			rec->id);
+		break;
+	default:
+		fprintf(stderr, "warning: unknown record type %u\n",
+			rec->type);
+		break;
+	}
+}
+
+static int
+convert(FILE *in, FILE *out)
+{
+	struct weston_timeline_binary_header header;
+	struct weston_timeline_record rec;
+
+	if (fread(&header, sizeof header, 1, in) != 1) {
+		fprintf(stderr, "error: cannot read timeline header\n");
+		return -1;
+	}
+
+	if (header.magic != WESTON_TIMELINE_BINARY_MAGIC) {
+		fprintf(stderr, "error: not a binary timeline log\n");
+		return -1;
+	}
+
+	if (header.version != WESTON_TIMELINE_BINARY_VERSION ||
+	    header.record_size != sizeof rec) {
+		fprintf(stderr, "error: unsupported timeline version %u "
+			"(record size %u)\n", header.version,
+			header.record_size);
+		return -1;
+	}
+
+	while (fread(&rec, sizeof rec, 1, in) == 1)
+		print_record(out, &rec);
+
+	if (ferror(in)) {
+		fprintf(stderr, "error: reading timeline failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s <weston-timeline.bin> [output.log]\n",
+		name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE *in, *out = stdout;
+	int ret;
+
+	if (argc < 2 || argc > 3) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	in = fopen(argv[1], "rb");
+	if (!in) {
+		fprintf(stderr, "error: cannot open '%s': %m\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	if (argc == 3) {
+		out = fopen(argv[2], "w");
+		if (!out) {
+			fprintf(stderr, "error: cannot create '%s': %m\n",
+				argv[2]);
+			fclose(in);
+			return EXIT_FAILURE;
+		}
+	}
+
+	ret = convert(in, out);
+
+	fclose(in);
+	if (out != stdout)
+		fclose(out);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -27,32 +27,206 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "timeline.h"
+#include "timeline-binary.h"
 #include "compositor.h"
 #include "file-util.h"
 
+/* Number of records in the binary timeline ring, a power of two */
+#define TIMELINE_RING_RECORDS 16384
+
+/* How long the writer thread sleeps when the ring is empty */
+#define TIMELINE_WRITER_PERIOD_NSEC 10000000
+
+enum timeline_format {
+	TIMELINE_FORMAT_JSON,
+	TIMELINE_FORMAT_BINARY,
+};
+
+/*
+ * Single-producer single-consumer ring of binary records. The compositor
+ * thread only advances head and the writer thread only advances tail, so
+ * emitting a timeline point never takes a lock or makes a system call.
+ * When the ring is full, records are dropped and counted instead.
+ */
+struct timeline_ring {
+	struct weston_timeline_record *records;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t dropped;
+	int running;
+	pthread_t writer;
+};
+
 struct timeline_log {
 	clock_t clk_id;
 	FILE *file;
 	unsigned series;
+	enum timeline_format format;
+	struct timeline_ring ring;
 	struct wl_listener compositor_destroy_listener;
 };
 
 WL_EXPORT int weston_timeline_enabled_;
 static struct timeline_log timeline_ = { CLOCK_MONOTONIC, NULL, 0 };
 
+static void *
+timeline_writer_thread(void *data)
+{
+	struct timeline_ring *ring = data;
+	struct timespec period = { 0, TIMELINE_WRITER_PERIOD_NSEC };
+	uint32_t head, tail, n;
+	int running;
+
+	tail = ring->tail;
+
+	while (1) {
+		running = __atomic_load_n(&ring->running, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+		while (tail != head) {
+			n = TIMELINE_RING_RECORDS - tail % TIMELINE_RING_RECORDS;
+			if (n > head - tail)
+				n = head - tail;
+
+			fwrite(&ring->records[tail % TIMELINE_RING_RECORDS],
+			       sizeof(struct weston_timeline_record), n,
+			       timeline_.file);
+
+			tail += n;
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		}
+
+		if (!running)
+			break;
+
+		nanosleep(&period, NULL);
+	}
+
+	fflush(timeline_.file);
+
+	return NULL;
+}
+
+static int
+timeline_ring_start(struct timeline_ring *ring)
+{
+	struct weston_timeline_binary_header header = {
+		.magic = WESTON_TIMELINE_BINARY_MAGIC,
+		.version = WESTON_TIMELINE_BINARY_VERSION,
+		.record_size = sizeof(struct weston_timeline_record),
+	};
+
+	if (fwrite(&header, sizeof header, 1, timeline_.file) != 1)
+		return -1;
+
+	ring->records = mmap(NULL, TIMELINE_RING_RECORDS *
+					sizeof(struct weston_timeline_record),
+			     PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->records == MAP_FAILED)
+		return -1;
+
+	ring->head = 0;
+	ring->tail = 0;
+	ring->dropped = 0;
+	ring->running = 1;
+
+	if (pthread_create(&ring->writer, NULL,
+			   timeline_writer_thread, ring) != 0) {
+		munmap(ring->records, TIMELINE_RING_RECORDS *
+				      sizeof(struct weston_timeline_record));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+timeline_ring_stop(struct timeline_ring *ring)
+{
+	__atomic_store_n(&ring->running, 0, __ATOMIC_RELEASE);
+	pthread_join(ring->writer, NULL);
+
+	if (ring->dropped)
+		weston_log("Timeline ring overflowed, %u records lost.\n",
+			   ring->dropped);
+
+	munmap(ring->records,
+	       TIMELINE_RING_RECORDS * sizeof(struct weston_timeline_record));
+	ring->records = NULL;
+}
+
+/* Returns a zeroed record to fill in and pass to timeline_ring_commit(),
+ * or NULL if the ring is full. After an overflow, a record with the number
+ * of lost records is inserted first.
+ */
+static struct weston_timeline_record *
+timeline_ring_next(struct timeline_ring *ring)
+{
+	struct weston_timeline_record *rec;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint32_t needed = ring->dropped ? 2 : 1;
+
+	if (ring->head - tail + needed > TIMELINE_RING_RECORDS) {
+		ring->dropped++;
+		return NULL;
+	}
+
+	if (ring->dropped) {
+		rec = &ring->records[ring->head % TIMELINE_RING_RECORDS];
+		memset(rec, 0, sizeof *rec);
+		rec->type = WESTON_TIMELINE_RECORD_DROPPED;
+		rec->id = ring->dropped;
+		ring->dropped = 0;
+		__atomic_store_n(&ring->head, ring->head + 1,
+				 __ATOMIC_RELEASE);
+	}
+
+	rec = &ring->records[ring->head % TIMELINE_RING_RECORDS];
+	memset(rec, 0, sizeof *rec);
+
+	return rec;
+}
+
+static void
+timeline_ring_commit(struct timeline_ring *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static enum timeline_format
+timeline_format_from_env(void)
+{
+	const char *format = getenv("WESTON_TIMELINE_FORMAT");
+
+	if (format && strcmp(format, "binary") == 0)
+		return TIMELINE_FORMAT_BINARY;
+
+	return TIMELINE_FORMAT_JSON;
+}
+
 static int
 weston_timeline_do_open(void)
 {
 	const char *prefix = "weston-timeline-";
-	const char *suffix = ".log";
+	const char *suffix;
 	char fname[1000];
 
+	timeline_.format = timeline_format_from_env();
+	if (timeline_.format == TIMELINE_FORMAT_BINARY)
+		suffix = ".bin";
+	else
+		suffix = ".log";
+
 	timeline_.file = file_create_dated(prefix, suffix,
 					   fname, sizeof(fname));
 	if (!timeline_.file) {
@@ -71,6 +245,14 @@ weston_timeline_do_open(void)
 		return -1;
 	}
 
+	if (timeline_.format == TIMELINE_FORMAT_BINARY &&
+	    timeline_ring_start(&timeline_.ring) < 0) {
+		weston_log("Cannot set up binary timeline for '%s'\n", fname);
+		fclose(timeline_.file);
+		timeline_.file = NULL;
+		return -1;
+	}
+
 	weston_log("Opened timeline file '%s'\n", fname);
 
 	return 0;
@@ -111,6 +293,9 @@ weston_timeline_close(void)
 
 	wl_list_remove(&timeline_.compositor_destroy_listener.link);
 
+	if (timeline_.format == TIMELINE_FORMAT_BINARY)
+		timeline_ring_stop(&timeline_.ring);
+
 	fclose(timeline_.file);
 	timeline_.file = NULL;
 	weston_log("Timeline log file closed.\n");
@@ -232,6 +417,128 @@ emit_vblank_timestamp(struct timeline_emit_context *ctx, void *obj)
 	return 1;
 }
 
+static void
+copy_string(char *dst, const char *src, size_t size)
+{
+	if (!src) {
+		dst[0] = '\0';
+		return;
+	}
+
+	strncpy(dst, src, size - 1);
+	dst[size - 1] = '\0';
+}
+
+/* Binary counterparts of the emit functions above. Object descriptions are
+ * their own records; if one cannot be stored, it is re-sent next time.
+ */
+static void
+record_weston_output(struct timeline_emit_context *ctx,
+		     struct weston_timeline_record *point,
+		     struct weston_output *o)
+{
+	struct weston_timeline_record *rec;
+
+	if (check_series(ctx, &o->timeline)) {
+		rec = timeline_ring_next(&timeline_.ring);
+		if (rec) {
+			rec->type = WESTON_TIMELINE_RECORD_OUTPUT;
+			rec->id = o->timeline.id;
+			copy_string(rec->object.desc, o->name,
+				    sizeof rec->object.desc);
+			timeline_ring_commit(&timeline_.ring);
+		} else {
+			o->timeline.force_refresh = 1;
+		}
+	}
+
+	point->flags |= WESTON_TIMELINE_POINT_OUTPUT;
+	point->point.output = o->timeline.id;
+}
+
+static void
+record_weston_surface_description(struct timeline_emit_context *ctx,
+				  struct weston_surface *s)
+{
+	struct weston_timeline_record *rec;
+	struct weston_surface *mains;
+	char d[512];
+
+	if (!check_series(ctx, &s->timeline))
+		return;
+
+	mains = weston_surface_get_main_surface(s);
+	if (mains != s)
+		record_weston_surface_description(ctx, mains);
+
+	if (!s->get_label || s->get_label(s, d, sizeof(d)) < 0)
+		d[0] = '\0';
+
+	rec = timeline_ring_next(&timeline_.ring);
+	if (!rec) {
+		s->timeline.force_refresh = 1;
+		return;
+	}
+
+	rec->type = WESTON_TIMELINE_RECORD_SURFACE;
+	rec->id = s->timeline.id;
+	if (mains != s)
+		rec->object.main_surface = mains->timeline.id;
+	copy_string(rec->object.desc, d, sizeof rec->object.desc);
+	timeline_ring_commit(&timeline_.ring);
+}
+
+static void
+timeline_point_binary(const char *name, const struct timespec *ts,
+		      va_list argp)
+{
+	struct weston_timeline_record point = { 0 };
+	struct weston_timeline_record *rec;
+	struct timeline_emit_context ctx = { .series = timeline_.series };
+	enum timeline_type otype;
+	struct timespec *vblank;
+	void *obj;
+
+	point.type = WESTON_TIMELINE_RECORD_POINT;
+	point.tv_sec = ts->tv_sec;
+	point.tv_nsec = ts->tv_nsec;
+	copy_string(point.point.name, name, sizeof point.point.name);
+
+	while (1) {
+		otype = va_arg(argp, enum timeline_type);
+		if (otype == TLT_END)
+			break;
+
+		obj = va_arg(argp, void *);
+		switch (otype) {
+		case TLT_OUTPUT:
+			record_weston_output(&ctx, &point, obj);
+			break;
+		case TLT_SURFACE:
+			record_weston_surface_description(&ctx, obj);
+			point.flags |= WESTON_TIMELINE_POINT_SURFACE;
+			point.point.surface =
+				((struct weston_surface *)obj)->timeline.id;
+			break;
+		case TLT_VBLANK:
+			vblank = obj;
+			point.flags |= WESTON_TIMELINE_POINT_VBLANK;
+			point.point.vblank_sec = vblank->tv_sec;
+			point.point.vblank_nsec = vblank->tv_nsec;
+			break;
+		default:
+			break;
+		}
+	}
+
+	rec = timeline_ring_next(&timeline_.ring);
+	if (!rec)
+		return;
+
+	*rec = point;
+	timeline_ring_commit(&timeline_.ring);
+}
+
 typedef int (*type_func)(struct timeline_emit_context *ctx, void *obj);
 
 static const type_func type_dispatch[] = {
@@ -252,6 +559,13 @@ weston_timeline_point(const char *name, ...)
 
 	clock_gettime(timeline_.clk_id, &ts);
 
+	if (timeline_.format == TIMELINE_FORMAT_BINARY) {
+		va_start(argp, name);
+		timeline_point_binary(name, &ts, argp);
+		va_end(argp);
+		return;
+	}
+
 	ctx.out = timeline_.file;
 	ctx.cur = fmemopen(buf, sizeof(buf), "w");
 	ctx.series = timeline_.series;
@@ -340,10 +340,19 @@ rounded_rect(cairo_t *cr, int x0, int y0, int x1, int y1, int radius)
 	cairo_close_path(cr);
 }
 
+static const cairo_user_data_key_t pixman_image_key;
+
+static void
+surface_image_destroy(void *data)
+{
+	pixman_image_unref(data);
+}
+
 cairo_surface_t *
 load_cairo_surface(const char *filename)
 {
 	pixman_image_t *image;
+	cairo_surface_t *surface;
 	int width, height, stride;
 	void *data;
 
@@ -357,8 +366,18 @@ load_cairo_surface(const char *filename)
 	height = pixman_image_get_height(image);
 	stride = pixman_image_get_stride(image);
 
-	return cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32,
-						   width, height, stride);
+	surface = cairo_image_surface_create_for_data(data,
+						      CAIRO_FORMAT_ARGB32,
+						      width, height, stride);
+
+	/* The surface only borrows the pixels, keep the image alive for
+	 * as long as it exists. */
+	if (cairo_surface_set_user_data(surface, &pixman_image_key, image,
+					surface_image_destroy) !=
+	    CAIRO_STATUS_SUCCESS)
+		pixman_image_unref(image);
+
+	return surface;
 }
 
 void
@@ -26,6 +26,7 @@
 #include "config.h"
 
 #include <string.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -42,24 +43,292 @@
 #include "config-parser.h"
 #include "helpers.h"
 #include "string-helpers.h"
+#include "zalloc.h"
+
+#define CONFIG_HASH_INIT	2166136261u
+#define CONFIG_HASH_MIN_SIZE	64
+
+/* Sections and entries stay on their lists in file order, the hash
+ * tables only index them.  Each table keeps the first section or entry
+ * for a given name, which is what the lists used to be searched for. */
+struct config_hash_node {
+	uint32_t hash;
+	struct config_hash_node *next;
+};
+
+struct config_hash {
+	struct config_hash_node **buckets;
+	uint32_t size;
+	uint32_t count;
+};
 
 struct weston_config_entry {
 	char *key;
 	char *value;
+	struct weston_config_section *section;
+	struct config_hash_node key_node;	/* weston_config::entries */
+	struct config_hash_node value_node;	/* weston_config::matches */
 	struct wl_list link;
 };
 
 struct weston_config_section {
 	char *name;
+	struct weston_config *config;
+	uint32_t serial;
+	bool stale;
+	struct config_hash_node node;		/* weston_config::sections */
+	struct config_hash_node content_node;	/* weston_config_reload() */
 	struct wl_list entry_list;
 	struct wl_list link;
 };
 
 struct weston_config {
 	struct wl_list section_list;
+	struct wl_list stale_list;
+	struct config_hash sections;
+	struct config_hash entries;
+	struct config_hash matches;
+	uint32_t next_serial;
+	struct stat stat;
 	char path[PATH_MAX];
 };
 
+/* FNV-1a.  The terminating NUL is hashed as well so that chained
+ * strings like "ab" "c" and "a" "bc" don't collide. */
+static uint32_t
+hash_string(uint32_t hash, const char *s)
+{
+	do {
+		hash ^= (unsigned char) *s;
+		hash *= 16777619u;
+	} while (*s++);
+
+	return hash;
+}
+
+static uint32_t
+hash_entry_key(const struct weston_config_section *section, const char *key)
+{
+	return hash_string(CONFIG_HASH_INIT ^ (section->serial * 2654435761u),
+			   key);
+}
+
+static uint32_t
+hash_match(const char *name, const char *key, const char *value)
+{
+	uint32_t hash;
+
+	hash = hash_string(CONFIG_HASH_INIT, name);
+	hash = hash_string(hash, key);
+
+	return hash_string(hash, value);
+}
+
+static int
+config_hash_init(struct config_hash *table, uint32_t size)
+{
+	table->buckets = calloc(size, sizeof *table->buckets);
+	if (table->buckets == NULL)
+		return -1;
+
+	table->size = size;
+	table->count = 0;
+
+	return 0;
+}
+
+static void
+config_hash_release(struct config_hash *table)
+{
+	free(table->buckets);
+	table->buckets = NULL;
+	table->size = 0;
+	table->count = 0;
+}
+
+static void
+config_hash_grow(struct config_hash *table)
+{
+	struct config_hash_node **buckets, *node, *next;
+	uint32_t i, size = table->size * 2;
+
+	/* On failure we just keep the longer chains. */
+	buckets = calloc(size, sizeof *buckets);
+	if (buckets == NULL)
+		return;
+
+	for (i = 0; i < table->size; i++) {
+		for (node = table->buckets[i]; node; node = next) {
+			next = node->next;
+			node->next = buckets[node->hash & (size - 1)];
+			buckets[node->hash & (size - 1)] = node;
+		}
+	}
+
+	free(table->buckets);
+	table->buckets = buckets;
+	table->size = size;
+}
+
+static void
+config_hash_insert(struct config_hash *table, struct config_hash_node *node)
+{
+	struct config_hash_node **bucket;
+
+	if (table->count >= table->size)
+		config_hash_grow(table);
+
+	bucket = &table->buckets[node->hash & (table->size - 1)];
+	node->next = *bucket;
+	*bucket = node;
+	table->count++;
+}
+
+static void
+config_hash_remove(struct config_hash *table, struct config_hash_node *node)
+{
+	struct config_hash_node **p;
+
+	p = &table->buckets[node->hash & (table->size - 1)];
+	while (*p != node)
+		p = &(*p)->next;
+
+	*p = node->next;
+	table->count--;
+}
+
+static struct config_hash_node *
+config_hash_bucket(const struct config_hash *table, uint32_t hash)
+{
+	if (table->buckets == NULL)
+		return NULL;
+
+	return table->buckets[hash & (table->size - 1)];
+}
+
+static struct weston_config_section *
+config_find_section(struct weston_config *config, const char *name)
+{
+	struct weston_config_section *s;
+	struct config_hash_node *node;
+	uint32_t hash;
+
+	hash = hash_string(CONFIG_HASH_INIT, name);
+	for (node = config_hash_bucket(&config->sections, hash);
+	     node; node = node->next) {
+		if (node->hash != hash)
+			continue;
+		s = container_of(node, struct weston_config_section, node);
+		if (strcmp(s->name, name) == 0)
+			return s;
+	}
+
+	return NULL;
+}
+
+static struct weston_config_entry *
+config_find_entry(struct weston_config *config,
+		  struct weston_config_section *section, const char *key)
+{
+	struct weston_config_entry *e;
+	struct config_hash_node *node;
+	uint32_t hash;
+
+	hash = hash_entry_key(section, key);
+	for (node = config_hash_bucket(&config->entries, hash);
+	     node; node = node->next) {
+		if (node->hash != hash)
+			continue;
+		e = container_of(node, struct weston_config_entry, key_node);
+		if (e->section == section && strcmp(e->key, key) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+static struct weston_config_entry *
+config_find_match(struct weston_config *config, const char *name,
+		  const char *key, const char *value)
+{
+	struct weston_config_entry *e;
+	struct config_hash_node *node;
+	uint32_t hash;
+
+	hash = hash_match(name, key, value);
+	for (node = config_hash_bucket(&config->matches, hash);
+	     node; node = node->next) {
+		if (node->hash != hash)
+			continue;
+		e = container_of(node, struct weston_config_entry, value_node);
+		if (strcmp(e->key, key) == 0 &&
+		    strcmp(e->value, value) == 0 &&
+		    strcmp(e->section->name, name) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+/* Allocate the sections, entries and matches tables for config_index().
+ * This is the only part of indexing that can fail. */
+static int
+config_index_alloc(struct config_hash tables[3])
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (config_hash_init(&tables[i], CONFIG_HASH_MIN_SIZE) < 0) {
+			while (i--)
+				config_hash_release(&tables[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Rebuild all lookup tables from the section list, using the tables
+ * from config_index_alloc().  Only the first section with a given name
+ * is indexed by name, only the first entry for a key in each section
+ * is indexed by key, and only those entries can make their section
+ * match in weston_config_get_section(). */
+static void
+config_index(struct weston_config *config, struct config_hash tables[3])
+{
+	struct weston_config_section *s;
+	struct weston_config_entry *e;
+
+	config_hash_release(&config->sections);
+	config_hash_release(&config->entries);
+	config_hash_release(&config->matches);
+
+	config->sections = tables[0];
+	config->entries = tables[1];
+	config->matches = tables[2];
+
+	wl_list_for_each(s, &config->section_list, link) {
+		if (!config_find_section(config, s->name)) {
+			s->node.hash = hash_string(CONFIG_HASH_INIT, s->name);
+			config_hash_insert(&config->sections, &s->node);
+		}
+
+		wl_list_for_each(e, &s->entry_list, link) {
+			if (config_find_entry(config, s, e->key))
+				continue;
+			e->key_node.hash = hash_entry_key(s, e->key);
+			config_hash_insert(&config->entries, &e->key_node);
+
+			if (config_find_match(config, s->name,
+					      e->key, e->value))
+				continue;
+			e->value_node.hash = hash_match(s->name,
+							e->key, e->value);
+			config_hash_insert(&config->matches, &e->value_node);
+		}
+	}
+}
+
 static int
 open_config_file(struct weston_config *c, const char *name)
 {
@@ -125,11 +394,16 @@ config_section_get_entry(struct weston_config_section *section,
 
 	if (section == NULL)
 		return NULL;
-	wl_list_for_each(e, &section->entry_list, link)
-		if (strcmp(e->key, key) == 0)
-			return e;
 
-	return NULL;
+	/* Sections replaced by a reload are no longer indexed. */
+	if (section->stale) {
+		wl_list_for_each(e, &section->entry_list, link)
+			if (strcmp(e->key, key) == 0)
+				return e;
+		return NULL;
+	}
+
+	return config_find_entry(section->config, section, key);
 }
 
 WL_EXPORT
@@ -137,22 +411,16 @@ struct weston_config_section *
 weston_config_get_section(struct weston_config *config, const char *section,
 			  const char *key, const char *value)
 {
-	struct weston_config_section *s;
 	struct weston_config_entry *e;
 
 	if (config == NULL)
 		return NULL;
-	wl_list_for_each(s, &config->section_list, link) {
-		if (strcmp(s->name, section) != 0)
-			continue;
-		if (key == NULL)
-			return s;
-		e = config_section_get_entry(s, key);
-		if (e && strcmp(e->value, value) == 0)
-			return s;
-	}
+	if (key == NULL)
+		return config_find_section(config, section);
 
-	return NULL;
+	e = config_find_match(config, section, key, value);
+
+	return e ? e->section : NULL;
 }
 
 WL_EXPORT
@@ -359,7 +627,7 @@ config_add_section(struct weston_config *config, const char *name)
 {
 	struct weston_config_section *section;
 
-	section = malloc(sizeof *section);
+	section = zalloc(sizeof *section);
 	if (section == NULL)
 		return NULL;
 
@@ -369,6 +637,8 @@ config_add_section(struct weston_config *config, const char *name)
 		return NULL;
 	}
 
+	section->config = config;
+	section->serial = config->next_serial++;
 	wl_list_init(&section->entry_list);
 	wl_list_insert(config->section_list.prev, &section->link);
 
@@ -381,7 +651,7 @@ section_add_entry(struct weston_config_section *section,
 {
 	struct weston_config_entry *entry;
 
-	entry = malloc(sizeof *entry);
+	entry = zalloc(sizeof *entry);
 	if (entry == NULL)
 		return NULL;
 
@@ -398,71 +668,108 @@ section_add_entry(struct weston_config_section *section,
 		return NULL;
 	}
 
+	entry->section = section;
 	wl_list_insert(section->entry_list.prev, &entry->link);
 
 	return entry;
 }
 
-struct weston_config *
-weston_config_parse(const char *name)
+static void
+config_section_destroy(struct weston_config_section *section)
 {
-	FILE *fp;
-	char line[512], *p;
-	struct stat filestat;
-	struct weston_config *config;
-	struct weston_config_section *section = NULL;
-	int i, fd;
+	struct weston_config_entry *e, *next;
 
-	config = malloc(sizeof *config);
-	if (config == NULL)
-		return NULL;
+	wl_list_for_each_safe(e, next, &section->entry_list, link) {
+		free(e->key);
+		free(e->value);
+		free(e);
+	}
+	free(section->name);
+	free(section);
+}
 
-	wl_list_init(&config->section_list);
+static char *
+read_config_file(int fd, size_t *size)
+{
+	char *data;
+	size_t len = 0;
+	ssize_t n;
 
-	fd = open_config_file(config, name);
-	if (fd == -1) {
-		free(config);
+	data = malloc(*size + 1);
+	if (data == NULL)
 		return NULL;
-	}
 
-	if (fstat(fd, &filestat) < 0 ||
-	    !S_ISREG(filestat.st_mode)) {
-		close(fd);
-		free(config);
-		return NULL;
+	while (len < *size) {
+		n = read(fd, data + len, *size - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			free(data);
+			return NULL;
+		}
+		if (n == 0)
+			break;
+		len += n;
 	}
 
-	fp = fdopen(fd, "r");
-	if (fp == NULL) {
-		free(config);
-		return NULL;
-	}
+	data[len] = '\0';
+	*size = len;
+
+	return data;
+}
+
+static int
+config_parse_fd(struct weston_config *config, int fd)
+{
+	struct weston_config_section *section = NULL;
+	struct config_hash tables[3];
+	char *data, *line, *end, *next, *p;
+	size_t size;
+	bool newline;
+	int i, ret = -1;
+
+	if (fstat(fd, &config->stat) < 0 ||
+	    !S_ISREG(config->stat.st_mode))
+		return -1;
+
+	/* The file is read in one go rather than mapped: an editor
+	 * truncating it while we parse would get us a SIGBUS, and the
+	 * lines are split and trimmed in place. */
+	size = config->stat.st_size;
+	data = read_config_file(fd, &size);
+	if (data == NULL)
+		return -1;
+
+	for (line = data, end = data + size; line < end; line = next) {
+		next = memchr(line, '\n', end - line);
+		newline = next != NULL;
+		if (next)
+			*next++ = '\0';
+		else
+			next = end;
 
-	while (fgets(line, sizeof line, fp)) {
 		switch (line[0]) {
 		case '#':
-		case '\n':
+		case '\0':
 			continue;
 		case '[':
 			p = strchr(&line[1], ']');
-			if (!p || p[1] != '\n') {
+			if (!p || p[1] != '\0' || !newline) {
 				fprintf(stderr, "malformed "
 					"section header: %s\n", line);
-				fclose(fp);
-				weston_config_destroy(config);
-				return NULL;
+				goto out;
 			}
 			p[0] = '\0';
 			section = config_add_section(config, &line[1]);
+			if (section == NULL)
+				goto out;
 			continue;
 		default:
 			p = strchr(line, '=');
 			if (!p || p == line || !section) {
 				fprintf(stderr, "malformed "
 					"config line: %s\n", line);
-				fclose(fp);
-				weston_config_destroy(config);
-				return NULL;
+				goto out;
 			}
 
 			p[0] = '\0';
@@ -474,16 +781,243 @@ weston_config_parse(const char *name)
 				p[i - 1] = '\0';
 				i--;
 			}
-			section_add_entry(section, line, p);
+			if (!section_add_entry(section, line, p))
+				goto out;
 			continue;
 		}
 	}
 
-	fclose(fp);
+	if (config_index_alloc(tables) < 0)
+		goto out;
+
+	config_index(config, tables);
+	ret = 0;
+
+out:
+	free(data);
+
+	return ret;
+}
+
+static struct weston_config *
+config_create(void)
+{
+	struct weston_config *config;
+
+	config = zalloc(sizeof *config);
+	if (config == NULL)
+		return NULL;
+
+	wl_list_init(&config->section_list);
+	wl_list_init(&config->stale_list);
 
 	return config;
 }
 
+struct weston_config *
+weston_config_parse(const char *name)
+{
+	struct weston_config *config;
+	int fd;
+
+	config = config_create();
+	if (config == NULL)
+		return NULL;
+
+	fd = open_config_file(config, name);
+	if (fd == -1) {
+		free(config);
+		return NULL;
+	}
+
+	if (config_parse_fd(config, fd) < 0) {
+		close(fd);
+		weston_config_destroy(config);
+		return NULL;
+	}
+
+	close(fd);
+
+	return config;
+}
+
+static uint32_t
+hash_section_content(struct weston_config_section *section)
+{
+	struct weston_config_entry *e;
+	uint32_t hash;
+
+	hash = hash_string(CONFIG_HASH_INIT, section->name);
+	wl_list_for_each(e, &section->entry_list, link) {
+		hash = hash_string(hash, e->key);
+		hash = hash_string(hash, e->value);
+	}
+
+	return hash;
+}
+
+static bool
+section_content_equal(struct weston_config_section *a,
+		      struct weston_config_section *b)
+{
+	struct wl_list *la, *lb;
+	struct weston_config_entry *ea, *eb;
+
+	if (strcmp(a->name, b->name) != 0)
+		return false;
+
+	for (la = a->entry_list.next, lb = b->entry_list.next;
+	     la != &a->entry_list && lb != &b->entry_list;
+	     la = la->next, lb = lb->next) {
+		ea = container_of(la, struct weston_config_entry, link);
+		eb = container_of(lb, struct weston_config_entry, link);
+		if (strcmp(ea->key, eb->key) != 0 ||
+		    strcmp(ea->value, eb->value) != 0)
+			return false;
+	}
+
+	return la == &a->entry_list && lb == &b->entry_list;
+}
+
+static struct weston_config_section *
+take_equal_section(struct config_hash *content,
+		   struct weston_config_section *section)
+{
+	struct weston_config_section *s;
+	struct config_hash_node *node;
+	uint32_t hash;
+
+	hash = hash_section_content(section);
+	for (node = config_hash_bucket(content, hash);
+	     node; node = node->next) {
+		if (node->hash != hash)
+			continue;
+		s = container_of(node, struct weston_config_section,
+				 content_node);
+		if (section_content_equal(s, section)) {
+			config_hash_remove(content, node);
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+/* Re-read the file the config was loaded from.  Sections that didn't
+ * change are kept, so pointers to them stay valid and keep returning
+ * the same values.  Sections that were edited or removed are replaced;
+ * the old ones stay readable until the config is destroyed, but are no
+ * longer returned by weston_config_get_section() or
+ * weston_config_next_section().
+ *
+ * Returns 1 if the config changed, 0 if it didn't and -1 if the file
+ * couldn't be read or parsed, or memory ran out, in which case the
+ * config is untouched. */
+WL_EXPORT
+int
+weston_config_reload(struct weston_config *config)
+{
+	struct weston_config *fresh;
+	struct weston_config_section *s, *next, *old;
+	struct config_hash content, tables[3];
+	struct wl_list section_list;
+	struct stat st;
+	bool changed = false;
+	int fd, i;
+
+	if (config == NULL)
+		return -1;
+
+	fd = open(config->path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_dev == config->stat.st_dev &&
+	    st.st_ino == config->stat.st_ino &&
+	    st.st_size == config->stat.st_size &&
+	    st.st_mtim.tv_sec == config->stat.st_mtim.tv_sec &&
+	    st.st_mtim.tv_nsec == config->stat.st_mtim.tv_nsec) {
+		close(fd);
+		return 0;
+	}
+
+	fresh = config_create();
+	if (fresh == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	if (config_parse_fd(fresh, fd) < 0 ||
+	    config_hash_init(&content, CONFIG_HASH_MIN_SIZE) < 0) {
+		close(fd);
+		weston_config_destroy(fresh);
+		return -1;
+	}
+	close(fd);
+
+	/* Everything that can fail happens before the config is touched. */
+	if (config_index_alloc(tables) < 0) {
+		config_hash_release(&content);
+		weston_config_destroy(fresh);
+		return -1;
+	}
+
+	wl_list_for_each(s, &config->section_list, link) {
+		s->content_node.hash = hash_section_content(s);
+		config_hash_insert(&content, &s->content_node);
+	}
+
+	/* Build the new section list in file order, reusing the old
+	 * section wherever one with the same contents is left. */
+	wl_list_init(&section_list);
+	wl_list_for_each_safe(s, next, &fresh->section_list, link) {
+		wl_list_remove(&s->link);
+
+		old = take_equal_section(&content, s);
+		if (old) {
+			/* Anything before it was removed or moved. */
+			if (&old->link != config->section_list.next)
+				changed = true;
+			wl_list_remove(&old->link);
+			wl_list_insert(section_list.prev, &old->link);
+			config_section_destroy(s);
+		} else {
+			s->config = config;
+			s->serial = config->next_serial++;
+			wl_list_insert(section_list.prev, &s->link);
+			changed = true;
+		}
+	}
+
+	wl_list_for_each_safe(s, next, &config->section_list, link) {
+		wl_list_remove(&s->link);
+		s->stale = true;
+		wl_list_insert(&config->stale_list, &s->link);
+		changed = true;
+	}
+
+	wl_list_insert_list(&config->section_list, &section_list);
+	config->stat = fresh->stat;
+
+	config_hash_release(&content);
+	weston_config_destroy(fresh);
+
+	if (!changed) {
+		for (i = 0; i < 3; i++)
+			config_hash_release(&tables[i]);
+		return 0;
+	}
+
+	config_index(config, tables);
+
+	return 1;
+}
+
 const char *
 weston_config_get_full_path(struct weston_config *config)
 {
@@ -499,6 +1033,10 @@ weston_config_next_section(struct weston_config *config,
 	if (config == NULL)
 		return 0;
 
+	/* A stale section is no longer on the section list. */
+	if (*section && (*section)->stale)
+		return 0;
+
 	if (*section == NULL)
 		*section = container_of(config->section_list.next,
 					struct weston_config_section, link);
@@ -518,20 +1056,18 @@ void
 weston_config_destroy(struct weston_config *config)
 {
 	struct weston_config_section *s, *next_s;
-	struct weston_config_entry *e, *next_e;
 
 	if (config == NULL)
 		return;
 
-	wl_list_for_each_safe(s, next_s, &config->section_list, link) {
-		wl_list_for_each_safe(e, next_e, &s->entry_list, link) {
-			free(e->key);
-			free(e->value);
-			free(e);
-		}
-		free(s->name);
-		free(s);
-	}
+	wl_list_for_each_safe(s, next_s, &config->section_list, link)
+		config_section_destroy(s);
+	wl_list_for_each_safe(s, next_s, &config->stale_list, link)
+		config_section_destroy(s);
+
+	config_hash_release(&config->sections);
+	config_hash_release(&config->entries);
+	config_hash_release(&config->matches);
 
 	free(config);
 }
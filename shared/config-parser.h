@@ -115,6 +115,9 @@ weston_config_parse(const char *name);
 const char *
 weston_config_get_full_path(struct weston_config *config);
 
+int
+weston_config_reload(struct weston_config *config);
+
 void
 weston_config_destroy(struct weston_config *config);
 
@@ -27,14 +27,22 @@
 #include "config.h"
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <png.h>
 #include <pixman.h>
+#include <wayland-util.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "shared/helpers.h"
+#include "shared/zalloc.h"
 #include "image-loader.h"
 
 #ifdef HAVE_JPEG
@@ -59,6 +67,16 @@ pixman_image_destroy_func(pixman_image_t *image, void *data)
 
 #ifdef HAVE_JPEG
 
+/* libjpeg-turbo can write a8r8g8b8 directly, with the alpha byte set to
+ * 0xff, which saves swizzling every row after decoding. */
+#if defined(JCS_ALPHA_EXTENSIONS) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define JPEG_OUTPUT_COLOR_SPACE JCS_EXT_ARGB
+#elif defined(JCS_ALPHA_EXTENSIONS)
+#define JPEG_OUTPUT_COLOR_SPACE JCS_EXT_BGRA
+#else
+#define JPEG_OUTPUT_COLOR_SPACE JCS_RGB
+#endif
+
 static void
 swizzle_row(JSAMPLE *row, JDIMENSION width)
 {
@@ -103,7 +121,7 @@ load_jpeg(FILE *fp)
 
 	jpeg_read_header(&cinfo, TRUE);
 
-	cinfo.out_color_space = JCS_RGB;
+	cinfo.out_color_space = JPEG_OUTPUT_COLOR_SPACE;
 	jpeg_start_decompress(&cinfo);
 
 	stride = cinfo.output_width * 4;
@@ -119,6 +137,8 @@ load_jpeg(FILE *fp)
 			rows[i] = data + (first + i) * stride;
 
 		jpeg_read_scanlines(&cinfo, rows, ARRAY_LENGTH(rows));
+		if (cinfo.output_components == 4)
+			continue;
 		for (i = 0; first + i < cinfo.output_scanline; i++)
 			swizzle_row(rows[i], cinfo.output_width);
 	}
@@ -157,15 +177,60 @@ multiply_alpha(int alpha, int color)
     return ((temp + (temp >> 8)) >> 8);
 }
 
+#if defined(__SSE2__)
+
+/* Premultiplies two pixels unpacked to 16 bits per channel, rounding
+ * like multiply_alpha().  Alpha itself is multiplied by 255, which
+ * leaves it unchanged. */
+static inline __m128i
+premultiply_2(__m128i p)
+{
+	const __m128i color_mask = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+	const __m128i alpha_one = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+	__m128i a;
+
+	a = _mm_shufflelo_epi16(p, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_or_si128(_mm_and_si128(a, color_mask), alpha_one);
+
+	p = _mm_add_epi16(_mm_mullo_epi16(p, a), _mm_set1_epi16(0x80));
+
+	return _mm_srli_epi16(_mm_add_epi16(p, _mm_srli_epi16(p, 8)), 8);
+}
+
+/* Four RGBA pixels as read by libpng to premultiplied a8r8g8b8. */
+static inline __m128i
+premultiply_4(__m128i rgba)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i rb, p;
+
+	/* Swap red and blue: BGRA is a8r8g8b8 on little endian. */
+	rb = _mm_and_si128(rgba, _mm_set1_epi32(0x00ff00ff));
+	p = _mm_or_si128(_mm_srli_epi32(rb, 16), _mm_slli_epi32(rb, 16));
+	p = _mm_or_si128(p, _mm_and_si128(rgba, _mm_set1_epi32(0xff00ff00)));
+
+	return _mm_packus_epi16(premultiply_2(_mm_unpacklo_epi8(p, zero)),
+				premultiply_2(_mm_unpackhi_epi8(p, zero)));
+}
+
+#endif
+
 static void
 premultiply_data(png_structp   png,
 		 png_row_infop row_info,
 		 png_bytep     data)
 {
-    unsigned int i;
-    png_bytep p;
+    unsigned int i = 0;
+    png_bytep p = data;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= row_info->rowbytes; i += 16, p += 16)
+	_mm_storeu_si128((__m128i *) p,
+			 premultiply_4(_mm_loadu_si128((__m128i *) p)));
+#endif
 
-    for (i = 0, p = data; i < row_info->rowbytes; i += 4, p += 4) {
+    for (; i < row_info->rowbytes; i += 4, p += 4) {
 	png_byte  alpha = p[3];
 	uint32_t w;
 
@@ -309,6 +374,7 @@ static pixman_image_t *
 load_webp(FILE *fp)
 {
 	WebPDecoderConfig config;
+	pixman_image_t *pixman_image;
 	uint8_t buffer[16 * 1024];
 	int len;
 	VP8StatusCode status;
@@ -329,7 +395,7 @@ load_webp(FILE *fp)
 		return NULL;
 	}
 
-	config.output.colorspace = MODE_BGRA;
+	config.output.colorspace = MODE_bgrA;
 	config.output.u.RGBA.stride = stride_for_width(config.input.width);
 	config.output.u.RGBA.size =
 		config.output.u.RGBA.stride * config.input.height;
@@ -362,11 +428,17 @@ load_webp(FILE *fp)
 	WebPIDelete(idec);
 	WebPFreeDecBuffer(&config.output);
 
-	return pixman_image_create_bits(PIXMAN_a8r8g8b8,
+	pixman_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
 					config.input.width,
 					config.input.height,
 					(uint32_t *) config.output.u.RGBA.rgba,
 					config.output.u.RGBA.stride);
+
+	pixman_image_set_destroy_function(pixman_image,
+				pixman_image_destroy_func,
+				config.output.u.RGBA.rgba);
+
+	return pixman_image;
 }
 
 #else
@@ -393,11 +465,125 @@ static const struct image_loader loaders[] = {
 	{ { 'R', 'I', 'F', 'F' }, 4, load_webp }
 };
 
+/* Decoded images, keyed by path and the identity and modification
+ * time of the file.  Each entry holds a reference to its image. */
+struct image_cache_entry {
+	char *filename;
+	struct stat stat;
+	pixman_image_t *image;
+	size_t size;
+	struct wl_list link;
+};
+
+static struct {
+	struct wl_list entry_list;	/* most recently used first */
+	size_t size;
+	size_t max_size;
+} image_cache;
+
+static void
+image_cache_entry_destroy(struct image_cache_entry *entry)
+{
+	image_cache.size -= entry->size;
+	wl_list_remove(&entry->link);
+	pixman_image_unref(entry->image);
+	free(entry->filename);
+	free(entry);
+}
+
+static void
+image_cache_trim(size_t max_size)
+{
+	struct image_cache_entry *entry;
+
+	while (image_cache.size > max_size) {
+		entry = container_of(image_cache.entry_list.prev,
+				     struct image_cache_entry, link);
+		image_cache_entry_destroy(entry);
+	}
+}
+
+static bool
+same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev &&
+	       a->st_ino == b->st_ino &&
+	       a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	       a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static pixman_image_t *
+image_cache_lookup(const char *filename, const struct stat *st)
+{
+	struct image_cache_entry *entry, *next;
+
+	wl_list_for_each_safe(entry, next, &image_cache.entry_list, link) {
+		if (strcmp(entry->filename, filename) != 0)
+			continue;
+
+		if (!same_file(&entry->stat, st)) {
+			image_cache_entry_destroy(entry);
+			return NULL;
+		}
+
+		wl_list_remove(&entry->link);
+		wl_list_insert(&image_cache.entry_list, &entry->link);
+
+		return pixman_image_ref(entry->image);
+	}
+
+	return NULL;
+}
+
+static void
+image_cache_add(const char *filename, const struct stat *st,
+		pixman_image_t *image)
+{
+	struct image_cache_entry *entry;
+	size_t size;
+
+	size = (size_t) pixman_image_get_stride(image) *
+		pixman_image_get_height(image);
+	if (size > image_cache.max_size)
+		return;
+
+	entry = zalloc(sizeof *entry);
+	if (entry == NULL)
+		return;
+
+	entry->filename = strdup(filename);
+	if (entry->filename == NULL) {
+		free(entry);
+		return;
+	}
+
+	image_cache_trim(image_cache.max_size - size);
+
+	entry->stat = *st;
+	entry->image = pixman_image_ref(image);
+	entry->size = size;
+	wl_list_insert(&image_cache.entry_list, &entry->link);
+	image_cache.size += size;
+}
+
+void
+image_loader_set_cache_size(size_t max_size)
+{
+	if (image_cache.entry_list.next == NULL)
+		wl_list_init(&image_cache.entry_list);
+
+	image_cache.max_size = max_size;
+	image_cache_trim(max_size);
+}
+
 pixman_image_t *
 load_image(const char *filename)
 {
 	pixman_image_t *image = NULL;
 	unsigned char header[4];
+	struct stat st;
+	bool cache;
 	FILE *fp;
 	unsigned int i;
 
@@ -410,6 +596,15 @@ load_image(const char *filename)
 		return NULL;
 	}
 
+	cache = image_cache.max_size > 0 && fstat(fileno(fp), &st) == 0;
+	if (cache) {
+		image = image_cache_lookup(filename, &st);
+		if (image) {
+			fclose(fp);
+			return image;
+		}
+	}
+
 	if (fread(header, sizeof header, 1, fp) != 1) {
 		fclose(fp);
 		fprintf(stderr, "%s: unable to read file header\n", filename);
@@ -434,6 +629,8 @@ load_image(const char *filename)
 	} else if (!image) {
 		/* load probably printed something, but just in case */
 		fprintf(stderr, "%s: error reading image\n", filename);
+	} else if (cache) {
+		image_cache_add(filename, &st, image);
 	}
 
 	return image;
@@ -26,9 +26,17 @@
 #ifndef _IMAGE_LOADER_H
 #define _IMAGE_LOADER_H
 
+#include <stddef.h>
 #include <pixman.h>
 
 pixman_image_t *
 load_image(const char *filename);
 
+/* Keep up to max_size bytes of decoded images, and return another
+ * reference to the same image when an unmodified file is loaded again.
+ * Cached images are shared, so they must not be written to.  A size of
+ * 0, the default, disables the cache and empties it. */
+void
+image_loader_set_cache_size(size_t max_size);
+
 #endif
@@ -31,8 +31,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 #include "os-compatibility.h"
 
@@ -199,6 +201,72 @@ os_create_anonymous_file(off_t size)
 	return fd;
 }
 
+static int
+write_all(int fd, const void *data, size_t size)
+{
+	const char *p = data;
+	ssize_t len;
+
+	while (size > 0) {
+		len = write(fd, p, size);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			return -1;
+		p += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+/*
+ * Create an anonymous file holding a copy of data, for handing the
+ * same contents to any number of clients.  The file descriptor is set
+ * CLOEXEC and the receivers can map it, shared or private, but not
+ * change what other receivers see.
+ *
+ * With memfd_create() the file is sealed against writes and resizing.
+ * Otherwise it is created with os_create_anonymous_file() and reopened
+ * read-only, which stops writes through this descriptor but not
+ * through the file in XDG_RUNTIME_DIR.
+ */
+int
+os_create_sealed_file(const void *data, size_t size)
+{
+	char path[64];
+	int fd, ro_fd;
+
+#if defined(HAVE_MEMFD_CREATE) && defined(F_ADD_SEALS)
+	fd = memfd_create("weston-shared", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd >= 0) {
+		if (write_all(fd, data, size) == 0 &&
+		    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+			  F_SEAL_WRITE | F_SEAL_SEAL) == 0)
+			return fd;
+		close(fd);
+	}
+#endif
+
+	fd = os_create_anonymous_file(size);
+	if (fd < 0)
+		return -1;
+
+	if (write_all(fd, data, size) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+	ro_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (ro_fd < 0)
+		return fd;
+
+	close(fd);
+
+	return ro_fd;
+}
+
 #ifndef HAVE_STRCHRNUL
 char *
 strchrnul(const char *s, int c)
@@ -132,6 +132,20 @@ timespec_sub_to_msec(const struct timespec *a, const struct timespec *b)
 	return timespec_sub_to_nsec(a, b) / 1000000;
 }
 
+/* Subtract timespecs and return result in seconds
+ *
+ * \param a[in] operand
+ * \param b[in] operand
+ * \return to_seconds(a - b)
+ *
+ * For measuring elapsed times; the result is not rounded.
+ */
+static inline double
+timespec_sub_to_sec(const struct timespec *a, const struct timespec *b)
+{
+	return timespec_sub_to_nsec(a, b) / 1e9;
+}
+
 /* Convert milli-Hertz to nanoseconds
  *
  * \param mhz frequency in mHz, not zero
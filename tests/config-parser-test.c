@@ -639,3 +639,249 @@ ZUC_TEST(config_test, section_from_null)
 	section = weston_config_get_section(NULL, "bucket", NULL, NULL);
 	ZUC_ASSERT_NULL(section);
 }
+
+ZUC_TEST_F(config_test_t1, duplicate_section_first_wins, data)
+{
+	char *s;
+	int r;
+	struct weston_config_section *section;
+	struct weston_config *config = data;
+
+	section = weston_config_get_section(config, "bucket", NULL, NULL);
+	r = weston_config_section_get_string(section, "color", &s, NULL);
+
+	ZUC_ASSERTG_EQ(0, r, out_free);
+	ZUC_ASSERTG_STREQ("blue", s, out_free);
+
+out_free:
+	free(s);
+}
+
+ZUC_TEST_F(config_test_t1, match_later_section, data)
+{
+	char *s;
+	int r;
+	struct weston_config_section *section;
+	struct weston_config *config = data;
+
+	section = weston_config_get_section(config, "bucket", "color", "red");
+	ZUC_ASSERT_NOT_NULL(section);
+
+	r = weston_config_section_get_string(section, "contents", &s, NULL);
+
+	ZUC_ASSERTG_EQ(0, r, out_free);
+	ZUC_ASSERTG_STREQ("sand", s, out_free);
+
+out_free:
+	free(s);
+}
+
+static struct zuc_fixture config_test_t5 = {
+	.data =
+	"[output]\n"
+	"name=A\n"
+	"name=B\n"
+	"mode=off\n"
+	"\n"
+	"[output]\n"
+	"name=B\n"
+	"mode=preferred\n",
+	.set_up = setup_test_config,
+	.tear_down = cleanup_test_config
+};
+
+ZUC_TEST_F(config_test_t5, duplicate_key_first_wins, data)
+{
+	char *s;
+	int r;
+	struct weston_config_section *section;
+	struct weston_config *config = data;
+
+	section = weston_config_get_section(config, "output", "name", "B");
+	ZUC_ASSERT_NOT_NULL(section);
+
+	r = weston_config_section_get_string(section, "mode", &s, NULL);
+
+	ZUC_ASSERTG_EQ(0, r, out_free);
+	ZUC_ASSERTG_STREQ("preferred", s, out_free);
+
+out_free:
+	free(s);
+}
+
+static char *
+make_large_config(int count)
+{
+	char *text, *p;
+	int i;
+
+	text = malloc(count * 64 + 1);
+	if (text == NULL)
+		return NULL;
+
+	p = text;
+	for (i = 0; i < count; i++)
+		p += sprintf(p, "[output]\nname=OUT-%d\nscale=%d\n\n",
+			     i, i % 3 + 1);
+
+	return text;
+}
+
+ZUC_TEST(config_test, large_config)
+{
+	char name[32];
+	char *text;
+	int i;
+	int32_t scale;
+	struct weston_config_section *section;
+	struct weston_config *config;
+	const char *section_name;
+
+	text = make_large_config(5000);
+	ZUC_ASSERT_NOT_NULL(text);
+	config = load_config(text);
+	free(text);
+	ZUC_ASSERT_NOT_NULL(config);
+
+	for (i = 0; i < 5000; i += 7) {
+		snprintf(name, sizeof name, "OUT-%d", i);
+		section = weston_config_get_section(config, "output",
+						    "name", name);
+		ZUC_ASSERTG_NOT_NULL(section, out);
+		weston_config_section_get_int(section, "scale", &scale, 0);
+		ZUC_ASSERTG_EQ(i % 3 + 1, scale, out);
+	}
+
+	section = weston_config_get_section(config, "output", "name", "OUT");
+	ZUC_ASSERTG_NULL(section, out);
+
+	section = NULL;
+	i = 0;
+	while (weston_config_next_section(config, &section, &section_name))
+		i++;
+	ZUC_ASSERTG_EQ(5000, i, out);
+
+out:
+	weston_config_destroy(config);
+}
+
+ZUC_TEST(config_test, long_line)
+{
+	char *text, *s = NULL;
+	int r;
+	struct weston_config_section *section;
+	struct weston_config *config;
+
+	text = malloc(4096);
+	ZUC_ASSERT_NOT_NULL(text);
+	strcpy(text, "[launcher]\npath=");
+	memset(text + strlen(text), 'x', 2000);
+	strcpy(text + strlen("[launcher]\npath=") + 2000, "\n");
+
+	config = load_config(text);
+	free(text);
+	ZUC_ASSERT_NOT_NULL(config);
+
+	section = weston_config_get_section(config, "launcher", NULL, NULL);
+	r = weston_config_section_get_string(section, "path", &s, NULL);
+	ZUC_ASSERTG_EQ(0, r, out);
+	ZUC_ASSERTG_EQ(2000, (int)strlen(s), out);
+
+out:
+	free(s);
+	weston_config_destroy(config);
+}
+
+static void
+rewrite_config(const char *file, const char *text)
+{
+	FILE *fp;
+
+	/* A new file, like editors do, so the inode changes and the
+	 * reload doesn't depend on mtime granularity. */
+	ZUC_ASSERT_EQ(0, unlink(file));
+	fp = fopen(file, "w");
+	ZUC_ASSERT_NOT_NULL(fp);
+	fputs(text, fp);
+	fclose(fp);
+}
+
+ZUC_TEST(config_test, reload)
+{
+	char file[] = "/tmp/weston-config-parser-test-XXXXXX";
+	const char *text =
+		"[core]\n"
+		"idle-time=10\n"
+		"\n"
+		"[output]\n"
+		"name=A\n"
+		"scale=1\n"
+		"\n"
+		"[output]\n"
+		"name=B\n"
+		"scale=2\n";
+	struct weston_config *config;
+	struct weston_config_section *core, *a, *b, *section;
+	int32_t n;
+	int fd;
+
+	fd = mkstemp(file);
+	ZUC_ASSERT_NE(-1, fd);
+	ZUC_ASSERT_EQ((int)strlen(text), write(fd, text, strlen(text)));
+	close(fd);
+
+	config = weston_config_parse(file);
+	ZUC_ASSERTG_NOT_NULL(config, out_unlink);
+
+	core = weston_config_get_section(config, "core", NULL, NULL);
+	a = weston_config_get_section(config, "output", "name", "A");
+	b = weston_config_get_section(config, "output", "name", "B");
+	ZUC_ASSERTG_NOT_NULL(b, out);
+
+	ZUC_ASSERTG_EQ(0, weston_config_reload(config), out);
+
+	rewrite_config(file,
+		       "[core]\n"
+		       "idle-time=10\n"
+		       "\n"
+		       "[output]\n"
+		       "name=B\n"
+		       "scale=3\n"
+		       "\n"
+		       "[output]\n"
+		       "name=C\n"
+		       "scale=1\n");
+
+	ZUC_ASSERTG_EQ(1, weston_config_reload(config), out);
+
+	/* Unchanged sections are kept. */
+	section = weston_config_get_section(config, "core", NULL, NULL);
+	ZUC_ASSERTG_EQ(core, section, out);
+
+	/* Removed and edited ones are replaced but stay readable. */
+	ZUC_ASSERTG_NULL(weston_config_get_section(config, "output",
+						   "name", "A"), out);
+	section = weston_config_get_section(config, "output", "name", "B");
+	ZUC_ASSERTG_NOT_NULL(section, out);
+	ZUC_ASSERTG_NE(b, section, out);
+	weston_config_section_get_int(section, "scale", &n, 0);
+	ZUC_ASSERTG_EQ(3, n, out);
+	weston_config_section_get_int(b, "scale", &n, 0);
+	ZUC_ASSERTG_EQ(2, n, out);
+	weston_config_section_get_int(a, "scale", &n, 0);
+	ZUC_ASSERTG_EQ(1, n, out);
+
+	section = weston_config_get_section(config, "output", "name", "C");
+	ZUC_ASSERTG_NOT_NULL(section, out);
+
+	/* A broken file leaves the config alone. */
+	rewrite_config(file, "[core\n");
+	ZUC_ASSERTG_EQ(-1, weston_config_reload(config), out);
+	section = weston_config_get_section(config, "output", "name", "C");
+	ZUC_ASSERTG_NOT_NULL(section, out);
+
+out:
+	weston_config_destroy(config);
+out_unlink:
+	unlink(file);
+}
@@ -0,0 +1,329 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <png.h>
+#include <pixman.h>
+
+#ifdef HAVE_JPEG
+#include <jpeglib.h>
+#endif
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "shared/image-loader.h"
+
+struct test_image {
+	char path[64];
+	int width, height;
+	unsigned char *rgba;
+};
+
+/* Every alpha value with some colors that aren't all 0 or 255. */
+static void
+test_image_fill(struct test_image *image, int width, int height,
+		unsigned int seed)
+{
+	unsigned char *p;
+	int i;
+
+	image->width = width;
+	image->height = height;
+	image->rgba = malloc(width * height * 4);
+	assert(image->rgba);
+
+	for (i = 0, p = image->rgba; i < width * height; i++, p += 4) {
+		seed = seed * 1103515245 + 12345;
+		p[0] = seed >> 24;
+		p[1] = seed >> 16;
+		p[2] = i;
+		p[3] = i * 7 + (seed >> 8);
+	}
+}
+
+static void
+test_image_write_png(struct test_image *image, int compression)
+{
+	png_struct *png;
+	png_info *info;
+	FILE *fp;
+	int fd, y;
+
+	snprintf(image->path, sizeof image->path,
+		 "/tmp/weston-image-loader-test-XXXXXX");
+	fd = mkstemp(image->path);
+	assert(fd >= 0);
+	fp = fdopen(fd, "wb");
+	assert(fp);
+
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	assert(png);
+	info = png_create_info_struct(png);
+	assert(info);
+
+	png_init_io(png, fp);
+	png_set_compression_level(png, compression);
+	png_set_IHDR(png, info, image->width, image->height, 8,
+		     PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+		     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png, info);
+	for (y = 0; y < image->height; y++)
+		png_write_row(png, image->rgba + y * image->width * 4);
+	png_write_end(png, info);
+	png_destroy_write_struct(&png, &info);
+
+	fclose(fp);
+}
+
+static void
+test_image_release(struct test_image *image)
+{
+	unlink(image->path);
+	free(image->rgba);
+}
+
+static uint32_t
+reference_premultiply(const unsigned char *p)
+{
+	uint32_t a = p[3], c[3];
+	int i, t;
+
+	for (i = 0; i < 3; i++) {
+		t = a * p[i] + 0x80;
+		c[i] = (t + (t >> 8)) >> 8;
+	}
+
+	return (a << 24) | (c[0] << 16) | (c[1] << 8) | c[2];
+}
+
+static void
+check_premultiplied(struct test_image *image, pixman_image_t *loaded)
+{
+	uint32_t *data = pixman_image_get_data(loaded);
+	int stride = pixman_image_get_stride(loaded) / 4;
+	int x, y;
+
+	assert(pixman_image_get_width(loaded) == image->width);
+	assert(pixman_image_get_height(loaded) == image->height);
+
+	for (y = 0; y < image->height; y++)
+		for (x = 0; x < image->width; x++)
+			assert(data[y * stride + x] ==
+			       reference_premultiply(image->rgba +
+					     (y * image->width + x) * 4));
+}
+
+TEST(png_premultiply)
+{
+	struct test_image image;
+	pixman_image_t *loaded;
+
+	/* An odd width covers the per pixel tail after the SIMD loop. */
+	test_image_fill(&image, 67, 13, 1);
+	test_image_write_png(&image, 1);
+
+	loaded = load_image(image.path);
+	assert(loaded);
+	check_premultiplied(&image, loaded);
+
+	pixman_image_unref(loaded);
+	test_image_release(&image);
+}
+
+#ifdef HAVE_JPEG
+
+TEST(jpeg_opaque)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_error_mgr jerr;
+	struct test_image image;
+	pixman_image_t *loaded;
+	unsigned char *rgb, *row;
+	uint32_t *data, expected;
+	FILE *fp;
+	int fd, x, y;
+
+	test_image_fill(&image, 45, 21, 2);
+	rgb = malloc(image.width * image.height * 3);
+	assert(rgb);
+	for (x = 0; x < image.width * image.height; x++)
+		memcpy(rgb + x * 3, image.rgba + x * 4, 3);
+
+	snprintf(image.path, sizeof image.path,
+		 "/tmp/weston-image-loader-test-XXXXXX");
+	fd = mkstemp(image.path);
+	assert(fd >= 0);
+	fp = fdopen(fd, "wb");
+	assert(fp);
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, fp);
+	cinfo.image_width = image.width;
+	cinfo.image_height = image.height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		row = rgb + cinfo.next_scanline * image.width * 3;
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	fclose(fp);
+
+	/* Decode it again as plain RGB for the expected pixels. */
+	fp = fopen(image.path, "rb");
+	assert(fp);
+	dinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_decompress(&dinfo);
+	jpeg_stdio_src(&dinfo, fp);
+	jpeg_read_header(&dinfo, TRUE);
+	dinfo.out_color_space = JCS_RGB;
+	jpeg_start_decompress(&dinfo);
+	while (dinfo.output_scanline < dinfo.output_height) {
+		row = rgb + dinfo.output_scanline * image.width * 3;
+		jpeg_read_scanlines(&dinfo, &row, 1);
+	}
+	jpeg_finish_decompress(&dinfo);
+	jpeg_destroy_decompress(&dinfo);
+	fclose(fp);
+
+	loaded = load_image(image.path);
+	assert(loaded);
+	data = pixman_image_get_data(loaded);
+	for (y = 0; y < image.height; y++) {
+		for (x = 0; x < image.width; x++) {
+			row = rgb + (y * image.width + x) * 3;
+			expected = 0xff000000 |
+				   (row[0] << 16) | (row[1] << 8) | row[2];
+			assert(data[y * image.width + x] == expected);
+		}
+	}
+
+	pixman_image_unref(loaded);
+	free(rgb);
+	test_image_release(&image);
+}
+
+#endif
+
+TEST(cache)
+{
+	struct test_image image;
+	struct timespec times[2] = { { 0, 0 }, { 0, 0 } };
+	pixman_image_t *a, *b;
+
+	test_image_fill(&image, 16, 16, 3);
+	test_image_write_png(&image, 1);
+
+	/* Without a cache every load decodes again. */
+	a = load_image(image.path);
+	b = load_image(image.path);
+	assert(a && b && a != b);
+	pixman_image_unref(a);
+	pixman_image_unref(b);
+
+	image_loader_set_cache_size(1024 * 1024);
+
+	a = load_image(image.path);
+	b = load_image(image.path);
+	assert(a && a == b);
+	pixman_image_unref(b);
+
+	/* Touching the file invalidates the entry. */
+	assert(utimensat(AT_FDCWD, image.path, times, 0) == 0);
+	b = load_image(image.path);
+	assert(b && b != a);
+	check_premultiplied(&image, b);
+	pixman_image_unref(a);
+	pixman_image_unref(b);
+
+	/* Images larger than the cache aren't kept. */
+	image_loader_set_cache_size(16 * 16 * 4 - 1);
+	a = load_image(image.path);
+	b = load_image(image.path);
+	assert(a && b && a != b);
+	pixman_image_unref(a);
+	pixman_image_unref(b);
+
+	image_loader_set_cache_size(0);
+	test_image_release(&image);
+}
+
+/* Prints the rate of decoding a 4K png, and of loading it again from the
+ * cache. */
+BENCH(load_throughput)
+{
+	const int width = 3840, height = 2160, n = 3;
+	struct test_image image;
+	struct timespec t0, t1;
+	pixman_image_t *loaded;
+	double pixels = (double) width * height * n;
+	int i;
+
+	test_image_fill(&image, width, height, 4);
+	test_image_write_png(&image, 1);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++) {
+		loaded = load_image(image.path);
+		assert(loaded);
+		pixman_image_unref(loaded);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	fprintf(stderr, "image-loader: png %.1f Mpixels/s\n",
+		pixels / timespec_sub_to_sec(&t1, &t0) / 1e6);
+
+	image_loader_set_cache_size(width * height * 4);
+	loaded = load_image(image.path);
+	assert(loaded);
+	pixman_image_unref(loaded);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++) {
+		loaded = load_image(image.path);
+		assert(loaded);
+		pixman_image_unref(loaded);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	fprintf(stderr, "image-loader: png cached %.1f Mpixels/s\n",
+		pixels / timespec_sub_to_sec(&t1, &t0) / 1e6);
+
+	image_loader_set_cache_size(0);
+	test_image_release(&image);
+}
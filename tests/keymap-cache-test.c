@@ -0,0 +1,218 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "keymap-cache.h"
+
+#ifdef ENABLE_XKBCOMMON
+
+static const char keymap[] = "xkb_keymap { xkb_keycodes \"test\" { }; };";
+
+static char *
+make_temp_dir(void)
+{
+	char *dir, *ret;
+
+	dir = strdup("/tmp/weston-keymap-cache-test-XXXXXX");
+	assert(dir);
+	ret = mkdtemp(dir);
+	assert(ret);
+
+	return dir;
+}
+
+static int
+remove_entry(const char *path, const struct stat *sb, int flag,
+	     struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static void
+remove_tree(const char *path)
+{
+	int ret;
+
+	ret = nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	assert(ret == 0);
+}
+
+/* The cache directory holds exactly one keymap file after a store. */
+static char *
+cache_file(const char *dir)
+{
+	struct dirent *de;
+	char *path = NULL;
+	DIR *d;
+	int ret;
+
+	d = opendir(dir);
+	assert(d);
+	while ((de = readdir(d))) {
+		if (strncmp(de->d_name, "keymap-", 7) != 0)
+			continue;
+		assert(path == NULL);
+		ret = asprintf(&path, "%s/%s", dir, de->d_name);
+		assert(ret >= 0);
+	}
+	closedir(d);
+
+	assert(path);
+
+	return path;
+}
+
+TEST(store_and_load)
+{
+	char *top, *dir, *path, *str;
+	size_t size;
+	int ret;
+
+	top = make_temp_dir();
+	ret = asprintf(&dir, "%s/cache/weston", top);
+	assert(ret >= 0);
+
+	str = keymap_cache_load(dir, "key", &size);
+	assert(str == NULL);
+
+	/* Creates the missing directories on the way. */
+	ret = keymap_cache_store(dir, "key", keymap, sizeof keymap);
+	assert(ret == 0);
+
+	str = keymap_cache_load(dir, "key", &size);
+	assert(str);
+	assert(size == sizeof keymap);
+	assert(strcmp(str, keymap) == 0);
+	free(str);
+
+	str = keymap_cache_load(dir, "other key", &size);
+	assert(str == NULL);
+
+	/* A truncated file is not used. */
+	path = cache_file(dir);
+	ret = truncate(path, strlen("key") + 1 + sizeof keymap / 2);
+	assert(ret == 0);
+	str = keymap_cache_load(dir, "key", &size);
+	assert(str == NULL);
+
+	free(path);
+	free(dir);
+	remove_tree(top);
+	free(top);
+}
+
+static void
+set_mtime(const char *dir, const char *name, time_t sec)
+{
+	struct timespec times[2] = { { sec, 0 }, { sec, 0 } };
+	char *path;
+	int ret;
+
+	ret = asprintf(&path, "%s/%s", dir, name);
+	assert(ret >= 0);
+	ret = utimensat(AT_FDCWD, path, times, 0);
+	assert(ret == 0);
+	free(path);
+}
+
+TEST(key_tracks_names_and_xkb_config)
+{
+	static const char *const dirs[] = {
+		"rules", "keycodes", "types", "compat", "symbols"
+	};
+	struct xkb_rule_names names = {
+		.rules = "evdev", .model = "pc105", .layout = "us"
+	};
+	struct xkb_context *context;
+	char *root, *path, *key, *other;
+	unsigned int i;
+	FILE *fp;
+	int ret;
+
+	root = make_temp_dir();
+	for (i = 0; i < ARRAY_LENGTH(dirs); i++) {
+		ret = asprintf(&path, "%s/%s", root, dirs[i]);
+		assert(ret >= 0);
+		ret = mkdir(path, 0700);
+		assert(ret == 0);
+		free(path);
+	}
+	ret = asprintf(&path, "%s/rules/evdev", root);
+	assert(ret >= 0);
+	fp = fopen(path, "w");
+	assert(fp);
+	fclose(fp);
+	free(path);
+	set_mtime(root, "symbols", 1000);
+	set_mtime(root, "rules/evdev", 1000);
+
+	context = xkb_context_new(XKB_CONTEXT_NO_DEFAULT_INCLUDES);
+	assert(context);
+	ret = xkb_context_include_path_append(context, root);
+	assert(ret);
+
+	key = keymap_cache_key(context, &names);
+	assert(key);
+	other = keymap_cache_key(context, &names);
+	assert(other && strcmp(key, other) == 0);
+	free(other);
+
+	names.layout = "de";
+	other = keymap_cache_key(context, &names);
+	assert(other && strcmp(key, other) != 0);
+	free(other);
+	names.layout = "us";
+
+	/* An updated xkeyboard-config package. */
+	set_mtime(root, "symbols", 2000);
+	other = keymap_cache_key(context, &names);
+	assert(other && strcmp(key, other) != 0);
+	free(other);
+	set_mtime(root, "symbols", 1000);
+
+	set_mtime(root, "rules/evdev", 2000);
+	other = keymap_cache_key(context, &names);
+	assert(other && strcmp(key, other) != 0);
+	free(other);
+
+	free(key);
+	xkb_context_unref(context);
+	remove_tree(root);
+	free(root);
+}
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "pick-index.h"
+
+#define N_BOXES 500
+#define N_PICKS 100000
+
+static const pixman_box32_t bounds = { 0, 0, 3840, 2160 };
+
+static bool
+box_contains(const pixman_box32_t *box, int32_t x, int32_t y)
+{
+	return x >= box->x1 && x < box->x2 && y >= box->y1 && y < box->y2;
+}
+
+/* Random boxes, some of them partially or entirely outside the bounds. */
+static void
+random_boxes(pixman_box32_t *boxes, void **items, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		boxes[i].x1 = rand() % 4400 - 300;
+		boxes[i].y1 = rand() % 2600 - 300;
+		boxes[i].x2 = boxes[i].x1 + 1 + rand() % (i % 10 ? 400 : 4000);
+		boxes[i].y2 = boxes[i].y1 + 1 + rand() % (i % 10 ? 300 : 2400);
+		items[i] = &boxes[i];
+	}
+}
+
+static pixman_box32_t *
+pick_linear(pixman_box32_t *boxes, int n, int32_t x, int32_t y)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (box_contains(&boxes[i], x, y))
+			return &boxes[i];
+
+	return NULL;
+}
+
+static pixman_box32_t *
+pick_indexed(struct weston_pick_index *index, int32_t x, int32_t y)
+{
+	pixman_box32_t **candidates;
+	int i, n;
+
+	candidates = (pixman_box32_t **)
+		weston_pick_index_lookup(index, x, y, &n);
+	assert(candidates);
+
+	for (i = 0; i < n; i++)
+		if (box_contains(candidates[i], x, y))
+			return candidates[i];
+
+	return NULL;
+}
+
+TEST(pick_index_matches_linear_search)
+{
+	static pixman_box32_t boxes[N_BOXES];
+	static void *items[N_BOXES];
+	struct weston_pick_index index;
+	int32_t x, y;
+	int i;
+
+	srand(1);
+	random_boxes(boxes, items, N_BOXES);
+
+	weston_pick_index_init(&index);
+	assert(weston_pick_index_build(&index, &bounds, boxes, items,
+				       N_BOXES) == 0);
+
+	for (i = 0; i < N_PICKS; i++) {
+		x = rand() % (bounds.x2 - bounds.x1) + bounds.x1;
+		y = rand() % (bounds.y2 - bounds.y1) + bounds.y1;
+
+		assert(pick_indexed(&index, x, y) ==
+		       pick_linear(boxes, N_BOXES, x, y));
+	}
+
+	/* Cell edges and the last pixel inside the bounds */
+	assert(pick_indexed(&index, 0, 0) == pick_linear(boxes, N_BOXES, 0, 0));
+	assert(pick_indexed(&index, 3839, 2159) ==
+	       pick_linear(boxes, N_BOXES, 3839, 2159));
+
+	weston_pick_index_release(&index);
+}
+
+TEST(pick_index_outside_bounds)
+{
+	pixman_box32_t box = { -100, -100, 100, 100 };
+	void *item = &box;
+	struct weston_pick_index index;
+	int n;
+
+	weston_pick_index_init(&index);
+
+	/* An unbuilt index covers nothing. */
+	assert(weston_pick_index_lookup(&index, 0, 0, &n) == NULL);
+
+	assert(weston_pick_index_build(&index, &bounds, &box, &item, 1) == 0);
+
+	assert(weston_pick_index_lookup(&index, -1, 0, &n) == NULL);
+	assert(weston_pick_index_lookup(&index, 0, -1, &n) == NULL);
+	assert(weston_pick_index_lookup(&index, 3840, 0, &n) == NULL);
+	assert(weston_pick_index_lookup(&index, 0, 2160, &n) == NULL);
+
+	assert(weston_pick_index_lookup(&index, 50, 50, &n) != NULL);
+	assert(n == 1);
+
+	/* Rebuilding without items empties every cell. */
+	assert(weston_pick_index_build(&index, &bounds, NULL, NULL, 0) == 0);
+	weston_pick_index_lookup(&index, 50, 50, &n);
+	assert(n == 0);
+
+	weston_pick_index_release(&index);
+}
+
+TEST(pick_index_keeps_order)
+{
+	pixman_box32_t boxes[3] = {
+		{ 10, 10, 20, 20 },
+		{ 0, 0, 1000, 1000 },
+		{ 15, 15, 30, 30 },
+	};
+	void *items[3] = { &boxes[0], &boxes[1], &boxes[2] };
+	struct weston_pick_index index;
+	void **candidates;
+	int n;
+
+	weston_pick_index_init(&index);
+	assert(weston_pick_index_build(&index, &bounds, boxes, items, 3) == 0);
+
+	candidates = weston_pick_index_lookup(&index, 16, 16, &n);
+	assert(n == 3);
+	assert(candidates[0] == &boxes[0]);
+	assert(candidates[1] == &boxes[1]);
+	assert(candidates[2] == &boxes[2]);
+
+	weston_pick_index_release(&index);
+}
+
+/* Prints the cost of a pick with and without the index for a scene with
+ * many views. */
+BENCH(pick_index_benchmark)
+{
+	static pixman_box32_t boxes[N_BOXES];
+	static void *items[N_BOXES];
+	static int32_t xs[N_PICKS], ys[N_PICKS];
+	struct weston_pick_index index;
+	struct timespec t0, t1, t2;
+	uintptr_t sum_linear = 0, sum_indexed = 0;
+	int i;
+
+	srand(2);
+	random_boxes(boxes, items, N_BOXES);
+	for (i = 0; i < N_PICKS; i++) {
+		xs[i] = rand() % (bounds.x2 - bounds.x1);
+		ys[i] = rand() % (bounds.y2 - bounds.y1);
+	}
+
+	weston_pick_index_init(&index);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	assert(weston_pick_index_build(&index, &bounds, boxes, items,
+				       N_BOXES) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	fprintf(stderr, "pick-index: build of %d boxes took %.1f us\n",
+		N_BOXES, timespec_sub_to_nsec(&t1, &t0) / 1000.0);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < N_PICKS; i++)
+		sum_linear += (uintptr_t)pick_linear(boxes, N_BOXES,
+						     xs[i], ys[i]);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < N_PICKS; i++)
+		sum_indexed += (uintptr_t)pick_indexed(&index, xs[i], ys[i]);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	fprintf(stderr, "pick-index: linear %.1f ns/pick, "
+		"indexed %.1f ns/pick\n",
+		timespec_sub_to_nsec(&t1, &t0) / (double) N_PICKS,
+		timespec_sub_to_nsec(&t2, &t1) / (double) N_PICKS);
+
+	assert(sum_linear == sum_indexed);
+
+	weston_pick_index_release(&index);
+}
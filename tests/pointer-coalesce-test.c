@@ -0,0 +1,103 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <linux/input.h>
+
+#include "weston-test-client-helper.h"
+
+/* Runs with tests/pointer-coalesce.ini, which enables
+ * coalesce-pointer-motion. */
+
+#define N_MOTIONS 20
+
+static struct client *
+create_client_with_pointer_inside(void)
+{
+	struct client *client;
+
+	client = create_client_and_test_surface(100, 100, 100, 100);
+	assert(client);
+
+	weston_test_move_pointer(client->test->weston_test, 150, 150);
+	/* The commit triggers a repaint, which delivers the motion. */
+	move_client(client, 100, 100);
+
+	assert(client->input->pointer->focus == client->surface);
+	assert(client->input->pointer->x == 50);
+	assert(client->input->pointer->y == 50);
+
+	return client;
+}
+
+TEST(motion_is_delivered_once_per_repaint)
+{
+	struct client *client;
+	struct pointer *pointer;
+	int i;
+
+	client = create_client_with_pointer_inside();
+	pointer = client->input->pointer;
+	pointer->motion_count = 0;
+
+	for (i = 1; i <= N_MOTIONS; i++)
+		weston_test_move_pointer(client->test->weston_test,
+					 150 + i, 150 + i / 2);
+	move_client(client, 100, 100);
+
+	fprintf(stderr, "pointer-coalesce: %d motion events sent as %d\n",
+		N_MOTIONS, pointer->motion_count);
+
+	assert(pointer->motion_count == 1);
+	assert(pointer->x == 50 + N_MOTIONS);
+	assert(pointer->y == 50 + N_MOTIONS / 2);
+}
+
+TEST(button_flushes_pending_motion)
+{
+	struct client *client;
+	struct pointer *pointer;
+
+	client = create_client_with_pointer_inside();
+	pointer = client->input->pointer;
+
+	weston_test_move_pointer(client->test->weston_test, 160, 155);
+	weston_test_move_pointer(client->test->weston_test, 170, 160);
+	weston_test_send_button(client->test->weston_test, BTN_LEFT,
+				WL_POINTER_BUTTON_STATE_PRESSED);
+	client_roundtrip(client);
+
+	/* The motion arrives before the button, without waiting for a
+	 * repaint. */
+	assert(pointer->x == 70);
+	assert(pointer->y == 60);
+	assert(pointer->button == BTN_LEFT);
+	assert(pointer->state == WL_POINTER_BUTTON_STATE_PRESSED);
+
+	weston_test_send_button(client->test->weston_test, BTN_LEFT,
+				WL_POINTER_BUTTON_STATE_RELEASED);
+	client_roundtrip(client);
+	assert(pointer->state == WL_POINTER_BUTTON_STATE_RELEASED);
+}
@@ -0,0 +1,193 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "rdp-raw.h"
+
+TEST(merge_covers_damage)
+{
+	pixman_region32_t region, covered, missing;
+	pixman_box32_t *rects, *merged;
+	int nrects, nmerged, i, round;
+
+	srand(1);
+
+	for (round = 0; round < 100; round++) {
+		pixman_region32_init(&region);
+		for (i = 0; i < 30; i++)
+			pixman_region32_union_rect(&region, &region,
+						   rand() % 1800, rand() % 1000,
+						   1 + rand() % 200,
+						   1 + rand() % 100);
+
+		rects = pixman_region32_rectangles(&region, &nrects);
+		merged = calloc(nrects, sizeof *merged);
+		assert(merged);
+
+		nmerged = rdp_raw_merge_rects(rects, nrects, merged);
+		assert(nmerged >= 1 && nmerged <= nrects);
+
+		pixman_region32_init_rects(&covered, merged, nmerged);
+		pixman_region32_init(&missing);
+		pixman_region32_subtract(&missing, &region, &covered);
+		assert(!pixman_region32_not_empty(&missing));
+
+		pixman_region32_fini(&missing);
+		pixman_region32_fini(&covered);
+		pixman_region32_fini(&region);
+		free(merged);
+	}
+}
+
+TEST(merge_adjacent_rects)
+{
+	/* Two rectangles a pixel apart become one, distant ones do not. */
+	pixman_box32_t rects[] = {
+		{ 0, 0, 100, 10 },
+		{ 101, 0, 200, 10 },
+		{ 1000, 0, 1100, 10 },
+	};
+	pixman_box32_t merged[ARRAY_LENGTH(rects)];
+
+	assert(rdp_raw_merge_rects(rects, 3, merged) == 2);
+	assert(merged[0].x1 == 0 && merged[0].x2 == 200);
+	assert(merged[1].x1 == 1000 && merged[1].x2 == 1100);
+
+	assert(rdp_raw_merge_rects(rects, 0, merged) == 0);
+}
+
+TEST(strip_fits_request)
+{
+	uint32_t max = 0x3f0000;
+	int width, height;
+
+	for (width = 1; width < 8192; width += 97) {
+		height = rdp_raw_strip_height(width, max);
+		assert(height >= 1);
+		assert((uint32_t)height * width * 4 <= max);
+	}
+
+	/* A row that does not fit still makes progress. */
+	assert(rdp_raw_strip_height(100000, 65535) == 1);
+}
+
+TEST(copy_is_flipped)
+{
+	uint32_t data[4 * 3];
+	uint32_t out[2 * 2];
+	pixman_image_t *image;
+	pixman_box32_t rect = { 1, 1, 3, 3 };
+	int i;
+
+	for (i = 0; i < 12; i++)
+		data[i] = i;
+
+	image = pixman_image_create_bits(PIXMAN_x8r8g8b8, 4, 3, data, 16);
+	rdp_raw_copy_flipped(image, &rect, (uint8_t *)out);
+	pixman_image_unref(image);
+
+	assert(out[0] == 9 && out[1] == 10);
+	assert(out[2] == 5 && out[3] == 6);
+}
+
+/* Prints the throughput of the raw path for full screen updates, with the
+ * pooled buffer and with a reallocation per strip as
+ * rdp_peer_refresh_raw() used to do. */
+BENCH(raw_throughput)
+{
+	const int width = 1920, height = 1080, frames = 60;
+	const uint32_t request_sizes[] = { 0xffff, 0x3f0000 };
+	pixman_image_t *image;
+	pixman_box32_t rect = { 0, 0, width, height }, strip;
+	struct timespec t0, t1;
+	uint8_t *buffer, *pooled;
+	uint64_t bytes;
+	int f, strip_height, top, r;
+
+	image = pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height,
+					 NULL, 0);
+	assert(image);
+
+	for (r = 0; r < (int)ARRAY_LENGTH(request_sizes); r++) {
+		strip_height = rdp_raw_strip_height(width, request_sizes[r]);
+		strip.x1 = rect.x1;
+		strip.x2 = rect.x2;
+
+		pooled = malloc(request_sizes[r]);
+		assert(pooled);
+
+		bytes = 0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (f = 0; f < frames; f++) {
+			for (top = 0; top < height; top += strip_height) {
+				strip.y1 = top;
+				strip.y2 = MIN(top + strip_height, height);
+				rdp_raw_copy_flipped(image, &strip, pooled);
+				bytes += (strip.y2 - strip.y1) * width * 4;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		fprintf(stderr, "rdp-raw: request size %u, pooled: "
+			"%.1f MB/s\n", request_sizes[r],
+			bytes / timespec_sub_to_sec(&t1, &t0) / 1e6);
+
+		bytes = 0;
+		buffer = NULL;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (f = 0; f < frames; f++) {
+			for (top = 0; top < height; top += strip_height) {
+				strip.y1 = top;
+				strip.y2 = MIN(top + strip_height, height);
+				free(buffer);
+				buffer = malloc((strip.y2 - strip.y1) *
+						width * 4);
+				assert(buffer);
+				rdp_raw_copy_flipped(image, &strip, buffer);
+				bytes += (strip.y2 - strip.y1) * width * 4;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		fprintf(stderr, "rdp-raw: request size %u, allocated per "
+			"strip: %.1f MB/s\n", request_sizes[r],
+			bytes / timespec_sub_to_sec(&t1, &t0) / 1e6);
+
+		free(buffer);
+		free(pooled);
+	}
+
+	pixman_image_unref(image);
+}
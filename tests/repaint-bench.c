@@ -0,0 +1,421 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shared/helpers.h"
+#include "shared/xalloc.h"
+#include "weston-test-client-helper.h"
+#include "weston-perf-client-protocol.h"
+
+/*
+ * Repaint benchmark. Every scene below is built from SHM clients and
+ * subsurfaces and then redrawn for a number of frames, as fast as the
+ * headless backend allows (--refresh-rate=0). The compositor's own
+ * per-frame counters from the weston_perf protocol give the repaint
+ * times; the results are printed as one "repaint-bench:" line per
+ * scene so runs of different commits can be compared.
+ *
+ * This is not part of "make check"; run it with "make bench". The
+ * BENCH_FRAMES, BENCH_CLIENTS and BENCH_SUBSURFACES environment variables
+ * override the frame count and the size of every scene.
+ */
+
+#ifndef BENCH_RENDERER
+#define BENCH_RENDERER "noop"
+#define BENCH_RENDERER_ARGS ""
+#else
+#define BENCH_RENDERER_ARGS " --use-pixman"
+#endif
+
+char *server_parameters = "--width=1280 --height=720 --refresh-rate=0"
+	" --shell=weston-test-desktop-shell.so" BENCH_RENDERER_ARGS;
+
+#define SURFACE_SIZE 256
+#define PARTIAL_DAMAGE_SIZE 64
+
+enum bench_damage {
+	DAMAGE_FULL,
+	DAMAGE_PARTIAL,
+	DAMAGE_NONE,
+};
+
+struct bench_scene {
+	const char *name;
+	int clients;
+	int subsurfaces;
+	enum bench_damage damage;
+	enum wl_output_transform transform;
+	bool opaque;
+};
+
+static const struct bench_scene scenes[] = {
+	{ "single-full", 1, 0, DAMAGE_FULL, WL_OUTPUT_TRANSFORM_NORMAL, true },
+	{ "clients-partial", 8, 0, DAMAGE_PARTIAL,
+	  WL_OUTPUT_TRANSFORM_NORMAL, true },
+	{ "subsurfaces", 1, 16, DAMAGE_PARTIAL,
+	  WL_OUTPUT_TRANSFORM_NORMAL, true },
+	{ "transformed", 4, 0, DAMAGE_FULL, WL_OUTPUT_TRANSFORM_90, true },
+	{ "translucent", 4, 0, DAMAGE_FULL, WL_OUTPUT_TRANSFORM_NORMAL, false },
+	{ "idle", 4, 0, DAMAGE_NONE, WL_OUTPUT_TRANSFORM_NORMAL, true },
+};
+
+struct bench_surface {
+	struct wl_surface *wl_surface;
+	struct wl_subsurface *wl_subsurface;
+	struct buffer *buffer;
+};
+
+struct bench_stats {
+	uint32_t *repaint_usec;
+	uint32_t frames;
+	uint32_t capacity;
+	uint32_t missed;
+	struct timespec first, last;
+};
+
+static int
+env_int(const char *name, int fallback)
+{
+	const char *value = getenv(name);
+
+	if (!value || atoi(value) <= 0)
+		return fallback;
+
+	return atoi(value);
+}
+
+static void
+perf_output_handle_frame(void *data,
+			 struct weston_perf_output *perf_output,
+			 uint32_t views,
+			 uint32_t views_primary,
+			 uint32_t views_planes,
+			 uint32_t damage_area,
+			 uint32_t upload_bytes,
+			 uint32_t repaint_usec,
+			 uint32_t latency_usec,
+			 uint32_t missed)
+{
+	struct bench_stats *stats = data;
+
+	if (stats->frames == stats->capacity) {
+		stats->capacity = stats->capacity ? stats->capacity * 2 : 256;
+		stats->repaint_usec = xrealloc(stats->repaint_usec,
+					       stats->capacity *
+					       sizeof *stats->repaint_usec);
+	}
+
+	if (stats->frames == 0)
+		clock_gettime(CLOCK_MONOTONIC, &stats->first);
+	clock_gettime(CLOCK_MONOTONIC, &stats->last);
+
+	stats->repaint_usec[stats->frames++] = repaint_usec;
+	stats->missed += missed;
+}
+
+static void
+perf_output_handle_output_removed(void *data,
+				  struct weston_perf_output *perf_output)
+{
+	assert(0 && "output removed during benchmark");
+}
+
+static const struct weston_perf_output_listener perf_output_listener = {
+	perf_output_handle_frame,
+	perf_output_handle_output_removed,
+};
+
+static struct weston_perf_output *
+subscribe_perf(struct client *client, struct bench_stats *stats)
+{
+	struct global *g;
+	struct weston_perf *perf = NULL;
+	struct weston_perf_output *perf_output;
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface, weston_perf_interface.name) == 0)
+			perf = wl_registry_bind(client->wl_registry, g->name,
+						&weston_perf_interface, 1);
+	}
+
+	assert(perf && "no weston_perf found");
+
+	perf_output = weston_perf_subscribe(perf, client->output->wl_output);
+	weston_perf_output_add_listener(perf_output, &perf_output_listener,
+					stats);
+	weston_perf_destroy(perf);
+
+	return perf_output;
+}
+
+static struct wl_subcompositor *
+get_subcompositor(struct client *client)
+{
+	struct global *g;
+	struct wl_subcompositor *sub = NULL;
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface, "wl_subcompositor") == 0)
+			sub = wl_registry_bind(client->wl_registry, g->name,
+					       &wl_subcompositor_interface, 1);
+	}
+
+	assert(sub && "no wl_subcompositor found");
+
+	return sub;
+}
+
+static void
+fill(pixman_image_t *image, int x, int y, int width, int height,
+     uint32_t frame, bool opaque)
+{
+	pixman_color_t color;
+	pixman_image_t *solid;
+
+	color.red = (frame * 0x1000) & 0xffff;
+	color.green = (frame * 0x0700) & 0xffff;
+	color.blue = 0x8000;
+	color.alpha = opaque ? 0xffff : 0x8000;
+
+	solid = pixman_image_create_solid_fill(&color);
+	pixman_image_composite32(PIXMAN_OP_SRC, solid, NULL, image,
+				 0, 0, 0, 0, x, y, width, height);
+	pixman_image_unref(solid);
+}
+
+static void
+surface_set_opaque(struct client *client, struct wl_surface *surface)
+{
+	struct wl_region *region;
+
+	region = wl_compositor_create_region(client->wl_compositor);
+	wl_region_add(region, 0, 0, SURFACE_SIZE, SURFACE_SIZE);
+	wl_surface_set_opaque_region(surface, region);
+	wl_region_destroy(region);
+}
+
+static void
+surface_draw(struct wl_surface *surface, struct buffer *buffer,
+	     const struct bench_scene *scene, uint32_t frame)
+{
+	int x, y, size;
+
+	switch (scene->damage) {
+	case DAMAGE_FULL:
+		fill(buffer->image, 0, 0, SURFACE_SIZE, SURFACE_SIZE,
+		     frame, scene->opaque);
+		wl_surface_attach(surface, buffer->proxy, 0, 0);
+		wl_surface_damage(surface, 0, 0, SURFACE_SIZE, SURFACE_SIZE);
+		break;
+	case DAMAGE_PARTIAL:
+		size = PARTIAL_DAMAGE_SIZE;
+		x = (frame * 16) % (SURFACE_SIZE - size);
+		y = (frame * 8) % (SURFACE_SIZE - size);
+		fill(buffer->image, x, y, size, size, frame, scene->opaque);
+		wl_surface_attach(surface, buffer->proxy, 0, 0);
+		wl_surface_damage(surface, x, y, size, size);
+		break;
+	case DAMAGE_NONE:
+		break;
+	}
+
+	wl_surface_commit(surface);
+}
+
+static long
+compositor_memory_kb(const char *key)
+{
+	char path[64], line[128];
+	long value = -1;
+	size_t len = strlen(key);
+	FILE *fp;
+
+	/* The test client is started by the compositor. */
+	snprintf(path, sizeof path, "/proc/%d/status", (int)getppid());
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	while (fgets(line, sizeof line, fp)) {
+		if (strncmp(line, key, len) == 0 && line[len] == ':') {
+			value = strtol(line + len + 1, NULL, 10);
+			break;
+		}
+	}
+
+	fclose(fp);
+
+	return value;
+}
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint32_t
+percentile(const struct bench_stats *stats, int p)
+{
+	if (stats->frames == 0)
+		return 0;
+
+	return stats->repaint_usec[(stats->frames - 1) * p / 100];
+}
+
+static void
+report(const struct bench_scene *scene, int n_clients, int n_subsurfaces,
+       struct bench_stats *stats)
+{
+	double seconds;
+
+	qsort(stats->repaint_usec, stats->frames, sizeof *stats->repaint_usec,
+	      compare_uint32);
+
+	seconds = (stats->last.tv_sec - stats->first.tv_sec) +
+		  (stats->last.tv_nsec - stats->first.tv_nsec) / 1e9;
+
+	printf("repaint-bench: renderer=%s scene=%s clients=%d "
+	       "subsurfaces=%d frames=%u fps=%.1f repaint_p50=%u "
+	       "repaint_p90=%u repaint_p99=%u repaint_max=%u missed=%u "
+	       "rss_kb=%ld hwm_kb=%ld\n",
+	       BENCH_RENDERER, scene->name, n_clients, n_subsurfaces,
+	       stats->frames,
+	       seconds > 0 ? (stats->frames - 1) / seconds : 0.0,
+	       percentile(stats, 50), percentile(stats, 90),
+	       percentile(stats, 99),
+	       stats->frames ? stats->repaint_usec[stats->frames - 1] : 0,
+	       stats->missed,
+	       compositor_memory_kb("VmRSS"), compositor_memory_kb("VmHWM"));
+	fflush(stdout);
+}
+
+TEST_P(repaint_bench, scenes)
+{
+	const struct bench_scene *scene = data;
+	int n_clients = env_int("BENCH_CLIENTS", scene->clients);
+	int n_subsurfaces = scene->subsurfaces ?
+		env_int("BENCH_SUBSURFACES", scene->subsurfaces) : 0;
+	int n_frames = env_int("BENCH_FRAMES", 300);
+	struct client **clients;
+	struct bench_surface *subs;
+	struct wl_subcompositor *subco = NULL;
+	struct weston_perf_output *perf_output;
+	struct bench_stats stats = { 0 };
+	struct client *main_client;
+	int i, frame, done;
+
+	clients = xzalloc(n_clients * sizeof *clients);
+	for (i = 0; i < n_clients; i++) {
+		clients[i] = create_client_and_test_surface(
+				(i * 97) % (1280 - SURFACE_SIZE),
+				(i * 61) % (720 - SURFACE_SIZE),
+				SURFACE_SIZE, SURFACE_SIZE);
+		wl_surface_set_buffer_transform(clients[i]->surface->wl_surface,
+						scene->transform);
+		if (scene->opaque)
+			surface_set_opaque(clients[i],
+					   clients[i]->surface->wl_surface);
+	}
+
+	main_client = clients[0];
+
+	subs = xzalloc((n_subsurfaces + 1) * sizeof *subs);
+	if (n_subsurfaces)
+		subco = get_subcompositor(main_client);
+
+	for (i = 0; i < n_subsurfaces; i++) {
+		subs[i].wl_surface =
+			wl_compositor_create_surface(main_client->wl_compositor);
+		subs[i].wl_subsurface =
+			wl_subcompositor_get_subsurface(subco,
+				subs[i].wl_surface,
+				main_client->surface->wl_surface);
+		wl_subsurface_set_desync(subs[i].wl_subsurface);
+		wl_subsurface_set_position(subs[i].wl_subsurface,
+					   (i % 8) * 32, (i / 8) * 32);
+		subs[i].buffer = create_shm_buffer_a8r8g8b8(main_client,
+							    SURFACE_SIZE,
+							    SURFACE_SIZE);
+		if (scene->opaque)
+			surface_set_opaque(main_client, subs[i].wl_surface);
+		fill(subs[i].buffer->image, 0, 0, SURFACE_SIZE, SURFACE_SIZE,
+		     i, scene->opaque);
+		wl_surface_attach(subs[i].wl_surface, subs[i].buffer->proxy,
+				  0, 0);
+		wl_surface_damage(subs[i].wl_surface, 0, 0,
+				  SURFACE_SIZE, SURFACE_SIZE);
+		wl_surface_commit(subs[i].wl_surface);
+	}
+
+	/* Let the scene settle before measuring. */
+	for (i = 0; i < n_clients; i++)
+		client_roundtrip(clients[i]);
+
+	perf_output = subscribe_perf(main_client, &stats);
+	client_roundtrip(main_client);
+
+	for (frame = 0; frame < n_frames; frame++) {
+		for (i = 1; i < n_clients; i++) {
+			surface_draw(clients[i]->surface->wl_surface,
+				     clients[i]->surface->buffer, scene, frame);
+			wl_display_flush(clients[i]->wl_display);
+		}
+
+		for (i = 0; i < n_subsurfaces; i++)
+			surface_draw(subs[i].wl_surface, subs[i].buffer,
+				     scene, frame);
+
+		frame_callback_set(main_client->surface->wl_surface, &done);
+		surface_draw(main_client->surface->wl_surface,
+			     main_client->surface->buffer, scene, frame);
+		frame_callback_wait(main_client, &done);
+
+		/* Keep the other clients' event queues short. */
+		if (frame % 16 == 15)
+			for (i = 1; i < n_clients; i++)
+				client_roundtrip(clients[i]);
+	}
+
+	client_roundtrip(main_client);
+	weston_perf_output_destroy(perf_output);
+
+	report(scene, n_clients, n_subsurfaces, &stats);
+
+	assert(stats.frames > 0);
+
+	free(stats.repaint_usec);
+	free(subs);
+	free(clients);
+}
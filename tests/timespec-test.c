@@ -164,3 +164,14 @@ ZUC_TEST(timespec_test, timespec_sub_to_msec)
 	b.tv_nsec = 1000000L;
 	ZUC_ASSERT_EQ((998 * 1000) + 1, timespec_sub_to_msec(&a, &b));
 }
+
+ZUC_TEST(timespec_test, timespec_sub_to_sec)
+{
+	struct timespec a, b;
+
+	a.tv_sec = 1000;
+	a.tv_nsec = 250000000L;
+	b.tv_sec = 1;
+	b.tv_nsec = 500000000L;
+	ZUC_ASSERT_TRUE(timespec_sub_to_sec(&a, &b) == 998.75);
+}
@@ -0,0 +1,478 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "wcap/wcap-decode.h"
+#include "wcap/wcap-convert.h"
+
+/* A synthetic capture: flat areas, gradients and noise, with a moving
+ * box damaged between keyframes. */
+struct capture {
+	FILE *file;
+	int width, height, nframes;
+	uint32_t **frames;
+	uint32_t *outbuf;
+	uint64_t offset;
+	struct wcap_index_entry *index;
+};
+
+static uint32_t
+component_delta(uint32_t next, uint32_t prev)
+{
+	unsigned char dr, dg, db;
+
+	dr = (next >> 16) - (prev >> 16);
+	dg = (next >>  8) - (prev >>  8);
+	db = (next >>  0) - (prev >>  0);
+
+	return (dr << 16) | (dg << 8) | (db << 0);
+}
+
+static uint32_t *
+output_run(uint32_t *p, uint32_t delta, int run)
+{
+	int i;
+
+	while (run > 0) {
+		if (run <= 0xe0) {
+			*p++ = delta | ((run - 1) << 24);
+			break;
+		}
+
+		i = 24 - __builtin_clz(run);
+		*p++ = delta | ((i + 0xe0) << 24);
+		run -= 1 << (7 + i);
+	}
+
+	return p;
+}
+
+static uint32_t
+pattern(int x, int y, int k)
+{
+	if ((x / 64 + y / 48) % 3 == 0)
+		return 0xff000000 | (0x102030 * (k % 5));
+	if ((x / 64 + y / 48) % 3 == 1)
+		return 0xff000000 | (((x + k) << 8) & 0xff00) | (y & 0xff);
+
+	return 0xff000000 | ((x * 2654435761u + y * 40503u + k) >> 8);
+}
+
+static uint32_t *
+encode_rect(struct capture *c, uint32_t *p, const uint32_t *next,
+	    const uint32_t *prev, const struct wcap_rectangle *r)
+{
+	uint32_t delta, run_delta = 0;
+	int x, y, run = 0;
+
+	for (y = r->y2 - 1; y >= r->y1; y--) {
+		for (x = r->x1; x < r->x2; x++) {
+			delta = component_delta(next[y * c->width + x],
+						prev[y * c->width + x]);
+			if (run > 0 && delta == run_delta) {
+				run++;
+			} else {
+				p = output_run(p, run_delta, run);
+				run_delta = delta;
+				run = 1;
+			}
+		}
+	}
+
+	return output_run(p, run_delta, run);
+}
+
+static void
+capture_add_frame(struct capture *c, int k, uint32_t msecs)
+{
+	struct wcap_frame_header_v2 header;
+	struct wcap_rectangle rect;
+	uint32_t *next, *prev, *black = NULL, *p;
+	int x, y, keyframe = k % 10 == 0;
+	size_t size;
+
+	next = malloc(c->width * c->height * 4);
+	assert(next);
+
+	if (keyframe) {
+		rect.x1 = 0;
+		rect.y1 = 0;
+		rect.x2 = c->width;
+		rect.y2 = c->height;
+		prev = black = calloc(c->width * c->height, 4);
+		assert(black);
+	} else {
+		rect.x1 = (k * 37) % (c->width / 2);
+		rect.y1 = (k * 23) % (c->height / 2);
+		rect.x2 = rect.x1 + c->width / 2;
+		rect.y2 = rect.y1 + c->height / 2;
+		prev = c->frames[k - 1];
+		memcpy(next, prev, c->width * c->height * 4);
+	}
+
+	for (y = rect.y1; y < rect.y2; y++)
+		for (x = rect.x1; x < rect.x2; x++)
+			next[y * c->width + x] = pattern(x, y, k);
+
+	p = encode_rect(c, c->outbuf, next, prev, &rect);
+	size = (p - c->outbuf) * 4;
+
+	header.msecs = msecs;
+	header.nrects = 1;
+	header.flags = keyframe ? WCAP_FRAME_KEYFRAME : 0;
+	header.size = sizeof rect + size;
+	fwrite(&header, sizeof header, 1, c->file);
+	fwrite(&rect, sizeof rect, 1, c->file);
+	fwrite(c->outbuf, size, 1, c->file);
+
+	c->index[k].offset = c->offset;
+	c->index[k].msecs = header.msecs;
+	c->index[k].flags = header.flags;
+	c->offset += sizeof header + header.size;
+
+	free(black);
+	c->frames[k] = next;
+}
+
+static void
+capture_create(struct capture *c, int width, int height, int nframes,
+	       int with_index)
+{
+	struct wcap_header header;
+	struct wcap_header_v2 header_v2;
+	struct wcap_frame_header_v2 marker;
+	struct wcap_index_trailer trailer;
+	int k;
+
+	c->width = width;
+	c->height = height;
+	c->nframes = nframes;
+	c->frames = calloc(nframes, sizeof *c->frames);
+	c->index = calloc(nframes, sizeof *c->index);
+	c->outbuf = malloc(width * height * 4);
+	c->file = tmpfile();
+	assert(c->frames && c->index && c->outbuf && c->file);
+
+	header.magic = WCAP_HEADER_MAGIC_V2;
+	header.format = WCAP_FORMAT_XRGB8888;
+	header.width = width;
+	header.height = height;
+	header_v2.keyframe_interval = 10 * 40;
+	header_v2.reserved = 0;
+	fwrite(&header, sizeof header, 1, c->file);
+	fwrite(&header_v2, sizeof header_v2, 1, c->file);
+	c->offset = sizeof header + sizeof header_v2;
+
+	for (k = 0; k < nframes; k++)
+		capture_add_frame(c, k, 1000 + k * 40);
+
+	if (with_index) {
+		marker.msecs = 0;
+		marker.nrects = 0;
+		marker.flags = WCAP_FRAME_INDEX;
+		marker.size = nframes * sizeof *c->index;
+		trailer.offset = c->offset + sizeof marker;
+		trailer.count = nframes;
+		trailer.magic = WCAP_INDEX_MAGIC;
+		fwrite(&marker, sizeof marker, 1, c->file);
+		fwrite(c->index, sizeof *c->index, nframes, c->file);
+		fwrite(&trailer, sizeof trailer, 1, c->file);
+	}
+
+	fflush(c->file);
+}
+
+static struct wcap_decoder *
+capture_open(struct capture *c)
+{
+	struct wcap_decoder *decoder;
+	int fd;
+
+	fd = dup(fileno(c->file));
+	assert(fd >= 0);
+	lseek(fd, 0, SEEK_SET);
+
+	decoder = wcap_decoder_create_from_fd(fd);
+	assert(decoder);
+	assert(decoder->width == c->width && decoder->height == c->height);
+
+	return decoder;
+}
+
+static void
+capture_release(struct capture *c)
+{
+	int k;
+
+	for (k = 0; k < c->nframes; k++)
+		free(c->frames[k]);
+	free(c->frames);
+	free(c->index);
+	free(c->outbuf);
+	fclose(c->file);
+}
+
+static int
+frame_equal(struct capture *c, struct wcap_decoder *decoder, int k)
+{
+	return memcmp(decoder->frame, c->frames[k],
+		      c->width * c->height * 4) == 0;
+}
+
+TEST(decode_sequential)
+{
+	struct capture c;
+	struct wcap_decoder *decoder;
+	int k;
+
+	capture_create(&c, 333, 200, 25, 1);
+	decoder = capture_open(&c);
+
+	for (k = 0; k < c.nframes; k++) {
+		assert(wcap_decoder_get_frame(decoder) == 1);
+		assert(decoder->msecs == c.index[k].msecs);
+		assert(frame_equal(&c, decoder, k));
+	}
+	assert(wcap_decoder_get_frame(decoder) == 0);
+
+	wcap_decoder_destroy(decoder);
+	capture_release(&c);
+}
+
+TEST(decode_seek)
+{
+	static const int order[] = { 17, 3, 24, 0, 11, 12, 10, 9, 21, 1 };
+	struct capture c;
+	struct wcap_decoder *decoder;
+	int i, with_index;
+
+	for (with_index = 0; with_index < 2; with_index++) {
+		capture_create(&c, 160, 120, 25, with_index);
+		decoder = capture_open(&c);
+
+		/* Without a trailer the index is rebuilt */
+		assert(wcap_decoder_get_frame_count(decoder) == 25);
+
+		for (i = 0; i < (int) ARRAY_LENGTH(order); i++) {
+			assert(wcap_decoder_seek_frame(decoder,
+						       order[i]) == 1);
+			assert(frame_equal(&c, decoder, order[i]));
+		}
+		assert(wcap_decoder_seek_frame(decoder, 25) == 0);
+
+		assert(wcap_decoder_seek_msecs(decoder,
+					       1000 + 14 * 40 + 5) == 1);
+		assert(frame_equal(&c, decoder, 14));
+		assert(wcap_decoder_seek_msecs(decoder, 999) == 0);
+
+		wcap_decoder_destroy(decoder);
+		capture_release(&c);
+	}
+}
+
+/* The conversion before it was vectorized */
+static inline int
+rgb_to_yuv(uint32_t format, uint32_t p, int *u, int *v)
+{
+	int r, g, b, y;
+
+	if (format == WCAP_FORMAT_XRGB8888) {
+		r = (p >> 16) & 0xff;
+		g = (p >> 8) & 0xff;
+		b = (p >> 0) & 0xff;
+	} else {
+		r = (p >> 0) & 0xff;
+		g = (p >> 8) & 0xff;
+		b = (p >> 16) & 0xff;
+	}
+
+	y = (19595 * r + 38469 * g + 7472 * b) >> 16;
+	if (y > 255)
+		y = 255;
+
+	*u += 46727 * (r - y);
+	*v += 36962 * (b - y);
+
+	return y;
+}
+
+static inline int
+clamp_uv(int u)
+{
+	int clamp = (u >> 18) + 128;
+
+	if (clamp < 0)
+		return 0;
+	else if (clamp > 255)
+		return 255;
+	else
+		return clamp;
+}
+
+static void
+reference_yv12(uint32_t format, const uint32_t *frame, int width, int height,
+	       unsigned char *out)
+{
+	unsigned char *y1, *y2, *u, *v;
+	const uint32_t *p1, *p2, *end;
+	int i, u_accum, v_accum, stride0 = width, stride1 = width / 2;
+
+	for (i = 0; i < height; i += 2) {
+		y1 = out + stride0 * i;
+		y2 = y1 + stride0;
+		v = out + stride0 * height + stride1 * i / 2;
+		u = v + stride1 * height / 2;
+		p1 = frame + width * i;
+		p2 = p1 + width;
+		end = p1 + width;
+
+		while (p1 < end) {
+			u_accum = 0;
+			v_accum = 0;
+			*y1++ = rgb_to_yuv(format, *p1++, &u_accum, &v_accum);
+			*y1++ = rgb_to_yuv(format, *p1++, &u_accum, &v_accum);
+			*y2++ = rgb_to_yuv(format, *p2++, &u_accum, &v_accum);
+			*y2++ = rgb_to_yuv(format, *p2++, &u_accum, &v_accum);
+			*u++ = clamp_uv(u_accum);
+			*v++ = clamp_uv(v_accum);
+		}
+	}
+}
+
+static void
+reference_yuv444(uint32_t format, const uint32_t *frame, int width,
+		 int height, unsigned char *out)
+{
+	int i, u, v, psize = width * height;
+
+	for (i = 0; i < psize; i++) {
+		u = 0;
+		v = 0;
+		out[i] = rgb_to_yuv(format, frame[i], &u, &v);
+		out[i + psize * 2] = clamp_uv(u/.3);
+		out[i + psize] = clamp_uv(v/.3);
+	}
+}
+
+TEST(convert_matches_reference)
+{
+	static const uint32_t formats[] = {
+		WCAP_FORMAT_XRGB8888, WCAP_FORMAT_XBGR8888
+	};
+	const int width = 198, height = 64, size = width * height;
+	unsigned char *expected, *out;
+	uint32_t *frame;
+	int i, f;
+
+	frame = malloc(size * 4);
+	expected = malloc(size * 3);
+	out = malloc(size * 3);
+	assert(frame && expected && out);
+
+	srand(1);
+	for (i = 0; i < size; i++) {
+		switch (i % 4) {
+		case 0:
+			frame[i] = 0xffffffff;
+			break;
+		case 1:
+			frame[i] = 0xff000000 | (0xff << (8 * (rand() % 3)));
+			break;
+		default:
+			frame[i] = ((uint32_t) rand() << 16) ^ rand();
+			break;
+		}
+	}
+
+	for (f = 0; f < (int) ARRAY_LENGTH(formats); f++) {
+		reference_yv12(formats[f], frame, width, height, expected);
+		wcap_convert_to_yv12(formats[f], frame, width, height, out);
+		assert(memcmp(expected, out, size * 3 / 2) == 0);
+
+		reference_yuv444(formats[f], frame, width, height, expected);
+		wcap_convert_to_yuv444(formats[f], frame, width, height, out);
+		assert(memcmp(expected, out, size * 3) == 0);
+	}
+
+	free(frame);
+	free(expected);
+	free(out);
+}
+
+/* Prints the decoding and yv12 conversion rates for a 720p capture, the
+ * latter also for the scalar code. */
+BENCH(decode_throughput)
+{
+	const int width = 1280, height = 720, nframes = 60;
+	struct capture c;
+	struct wcap_decoder *decoder;
+	struct timespec t0, t1;
+	unsigned char *out;
+	double pixels = (double) width * height * nframes;
+	int k;
+
+	capture_create(&c, width, height, nframes, 1);
+	out = malloc(width * height * 3 / 2);
+	assert(out);
+
+	decoder = capture_open(&c);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (wcap_decoder_get_frame(decoder) > 0)
+		;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	fprintf(stderr, "wcap-decode: decode %.1f Mpixels/s of output\n",
+		pixels / timespec_sub_to_sec(&t1, &t0) / 1e6);
+	wcap_decoder_destroy(decoder);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (k = 0; k < nframes; k++)
+		wcap_convert_to_yv12(WCAP_FORMAT_XRGB8888, c.frames[k],
+				     width, height, out);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	fprintf(stderr, "wcap-decode: yv12 %.1f Mpixels/s\n",
+		pixels / timespec_sub_to_sec(&t1, &t0) / 1e6);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (k = 0; k < nframes; k++)
+		reference_yv12(WCAP_FORMAT_XRGB8888, c.frames[k],
+			       width, height, out);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	fprintf(stderr, "wcap-decode: yv12 scalar %.1f Mpixels/s\n",
+		pixels / timespec_sub_to_sec(&t1, &t0) / 1e6);
+
+	free(out);
+	capture_release(&c);
+}
@@ -154,6 +154,7 @@ pointer_handle_motion(void *data, struct wl_pointer *wl_pointer,
 
 	pointer->x = wl_fixed_to_int(x);
 	pointer->y = wl_fixed_to_int(y);
+	pointer->motion_count++;
 
 	fprintf(stderr, "test-client: got pointer motion %d %d\n",
 		pointer->x, pointer->y);
@@ -88,6 +88,7 @@ struct pointer {
 	struct surface *focus;
 	int x;
 	int y;
+	int motion_count;
 	uint32_t button;
 	uint32_t state;
 };
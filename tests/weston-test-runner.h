@@ -75,10 +75,28 @@ struct weston_test {
 		    ARRAY_LENGTH(test_data))			\
 	TEST_BEGIN(name, void *data)				\
 
+#define UNUSED_TEST(name, arg)					\
+	static void name(arg) __attribute__ ((unused));		\
+	TEST_BEGIN(name, arg)
+
+/* Benchmarks print measurements instead of checking results, and are kept
+ * out of "make check": a source with BENCH() cases is built once as a
+ * test, which skips them, and once with WESTON_BENCH defined for
+ * "make bench", which runs only them.
+ */
+#ifdef WESTON_BENCH
+#define TEST(name) UNUSED_TEST(name, void)
+#define FAIL_TEST(name) UNUSED_TEST(name, void)
+#define TEST_P(name, data) UNUSED_TEST(name, void *data)
+#define FAIL_TEST_P(name, data) UNUSED_TEST(name, void *data)
+#define BENCH(name) NO_ARG_TEST(name, 0)
+#else
 #define TEST(name) NO_ARG_TEST(name, 0)
 #define FAIL_TEST(name) NO_ARG_TEST(name, 1)
 #define TEST_P(name, data) ARG_TEST(name, 0, data)
 #define FAIL_TEST_P(name, data) ARG_TEST(name, 1, data)
+#define BENCH(name) UNUSED_TEST(name, void)
+#endif
 
 /**
  * Get the test name string with counter
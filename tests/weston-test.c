@@ -151,11 +151,18 @@ move_pointer(struct wl_client *client, struct wl_resource *resource,
 	struct weston_seat *seat = get_seat(test);
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 	struct weston_pointer_motion_event event = { 0 };
+	wl_fixed_t px = pointer->x;
+	wl_fixed_t py = pointer->y;
+
+	/* Motion may still be held back if the compositor coalesces it. */
+	if (pointer->pending_motion.mask)
+		weston_pointer_motion_to_abs(pointer, &pointer->pending_motion,
+					     &px, &py);
 
 	event = (struct weston_pointer_motion_event) {
 		.mask = WESTON_POINTER_MOTION_REL,
-		.dx = wl_fixed_to_double(wl_fixed_from_int(x) - pointer->x),
-		.dy = wl_fixed_to_double(wl_fixed_from_int(y) - pointer->y),
+		.dx = wl_fixed_to_double(wl_fixed_from_int(x) - px),
+		.dy = wl_fixed_to_double(wl_fixed_from_int(y) - py),
 	};
 
 	notify_motion(seat, 100, &event);
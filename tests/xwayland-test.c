@@ -29,19 +29,33 @@
  *		  1) Confirm that the WL_SURFACE_ID atom exists
  *		  2) Confirm that the window manager's name is "Weston WM"
  *		  3) Make sure we can map a window
+ *
+ *		  xwayland_many_windows_test maps a burst of managed and
+ *		  override-redirect windows, destroying some of them before
+ *		  the window manager has heard back about them.
+ *
+ *		  xwayland_selection_test pulls a large Wayland selection
+ *		  into an X client through INCR and reports the throughput.
  */
 
 #include "config.h"
 
 #include <unistd.h>
 #include <assert.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
+#include <X11/Xutil.h>
 #include <string.h>
 
-#include "weston-test-runner.h"
+#include "weston-test-client-helper.h"
+#include "shared/timespec-util.h"
 
 TEST(xwayland_client_test)
 {
@@ -105,3 +119,293 @@ TEST(xwayland_client_test)
 	XCloseDisplay(display);
 	exit(EXIT_SUCCESS);
 }
+
+#define STRESS_WINDOWS 200
+
+TEST(xwayland_many_windows_test)
+{
+	Display *display;
+	Window root, windows[STRESS_WINDOWS];
+	XSetWindowAttributes attributes;
+	XEvent event;
+	bool exposed[STRESS_WINDOWS];
+	int screen, status, actual_format, i;
+	int expected = 0, seen = 0;
+	unsigned long nitems, bytes;
+	unsigned char *value;
+	Atom wm_state, actual_type;
+
+	if (access(XSERVER_PATH, X_OK) != 0)
+		exit(77);
+
+	display = XOpenDisplay(NULL);
+	if (!display)
+		exit(EXIT_FAILURE);
+
+	screen = DefaultScreen(display);
+	root = RootWindow(display, screen);
+
+	for (i = 0; i < STRESS_WINDOWS; i++) {
+		/* menus and tooltips are override-redirect */
+		attributes.override_redirect = i % 2;
+		attributes.event_mask = ExposureMask;
+		windows[i] = XCreateWindow(display, root,
+					   10 + i, 10 + i, 60, 30, 0,
+					   CopyFromParent, InputOutput,
+					   CopyFromParent,
+					   CWOverrideRedirect | CWEventMask,
+					   &attributes);
+		XStoreName(display, windows[i], "xwayland-stress");
+		XMapWindow(display, windows[i]);
+		exposed[i] = false;
+
+		if (i % 5 == 4) {
+			XDestroyWindow(display, windows[i]);
+			windows[i] = None;
+		} else {
+			expected++;
+		}
+	}
+	XFlush(display);
+
+	alarm(20);
+	while (seen < expected) {
+		XNextEvent(display, &event);
+		if (event.type != Expose)
+			continue;
+		for (i = 0; i < STRESS_WINDOWS; i++)
+			if (windows[i] == event.xexpose.window && !exposed[i]) {
+				exposed[i] = true;
+				seen++;
+			}
+	}
+
+	/* the window manager put the managed windows in normal state */
+	wm_state = XInternAtom(display, "WM_STATE", True);
+	assert(wm_state != None);
+	for (i = 0; i < STRESS_WINDOWS; i++) {
+		if (windows[i] == None || i % 2)
+			continue;
+
+		status = XGetWindowProperty(display, windows[i], wm_state,
+					    0L, 2L, False, wm_state,
+					    &actual_type, &actual_format,
+					    &nitems, &bytes, &value);
+		assert(status == Success);
+		assert(nitems >= 1);
+		assert(((long *) value)[0] == NormalState);
+		XFree(value);
+	}
+
+	for (i = 0; i < STRESS_WINDOWS; i++)
+		if (windows[i] != None)
+			XDestroyWindow(display, windows[i]);
+
+	XCloseDisplay(display);
+	exit(EXIT_SUCCESS);
+}
+
+#define SELECTION_SIZE (32 * 1024 * 1024)
+#define SELECTION_MIME_TYPE "text/plain;charset=utf-8"
+
+static char
+selection_byte(unsigned long i)
+{
+	/* not periodic in any power of two, so misordered or
+	 * duplicated chunks show up */
+	return 'a' + (i * 7 + (i >> 16)) % 26;
+}
+
+static void
+data_source_target(void *data, struct wl_data_source *source,
+		   const char *mime_type)
+{
+}
+
+static void
+data_source_send(void *data, struct wl_data_source *source,
+		 const char *mime_type, int32_t fd)
+{
+	char buffer[64 * 1024];
+	unsigned long i, offset = 0;
+	ssize_t len;
+
+	assert(strcmp(mime_type, SELECTION_MIME_TYPE) == 0);
+
+	/* weston hands out non-blocking pipes; this process has nothing
+	 * else to do, so just block on it */
+	fcntl(fd, F_SETFL, 0);
+
+	while (offset < SELECTION_SIZE) {
+		for (i = 0; i < sizeof buffer; i++)
+			buffer[i] = selection_byte(offset + i);
+		len = write(fd, buffer, sizeof buffer);
+		assert(len > 0);
+		offset += len;
+	}
+
+	close(fd);
+}
+
+static void
+data_source_cancelled(void *data, struct wl_data_source *source)
+{
+}
+
+static const struct wl_data_source_listener data_source_listener = {
+	data_source_target,
+	data_source_send,
+	data_source_cancelled,
+};
+
+static void
+run_selection_source(void)
+{
+	struct client *client;
+	struct global *g;
+	struct wl_data_device_manager *manager = NULL;
+	struct wl_data_device *device;
+	struct wl_data_source *source;
+
+	client = create_client();
+	assert(client);
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface, "wl_data_device_manager") == 0)
+			manager = wl_registry_bind(client->wl_registry, g->name,
+						   &wl_data_device_manager_interface,
+						   1);
+	}
+	assert(manager);
+
+	device = wl_data_device_manager_get_data_device(manager,
+							client->input->wl_seat);
+	source = wl_data_device_manager_create_data_source(manager);
+	wl_data_source_add_listener(source, &data_source_listener, NULL);
+	wl_data_source_offer(source, SELECTION_MIME_TYPE);
+	wl_data_device_set_selection(device, source, 0);
+
+	while (wl_display_dispatch(client->wl_display) >= 0)
+		;
+
+	exit(EXIT_FAILURE);
+}
+
+static void
+wait_for_property(Display *display, Window window, Atom property)
+{
+	XEvent event;
+
+	do
+		XNextEvent(display, &event);
+	while (event.type != PropertyNotify ||
+	       event.xproperty.window != window ||
+	       event.xproperty.atom != property ||
+	       event.xproperty.state != PropertyNewValue);
+}
+
+TEST(xwayland_selection_test)
+{
+	Display *display;
+	Window window;
+	XSetWindowAttributes attributes;
+	XEvent event;
+	Atom clipboard, utf8_string, incr, property, actual_type;
+	int actual_format, status;
+	unsigned long nitems, bytes, i, received = 0, first = 0;
+	unsigned char *value;
+	struct timespec begin, end;
+	double seconds;
+	pid_t pid;
+
+	if (access(XSERVER_PATH, X_OK) != 0)
+		exit(77);
+
+	display = XOpenDisplay(NULL);
+	if (!display)
+		exit(EXIT_FAILURE);
+
+	clipboard = XInternAtom(display, "CLIPBOARD", False);
+	utf8_string = XInternAtom(display, "UTF8_STRING", False);
+	incr = XInternAtom(display, "INCR", False);
+	property = XInternAtom(display, "XWAYLAND_TEST_SELECTION", False);
+
+	attributes.event_mask = PropertyChangeMask;
+	window = XCreateWindow(display, DefaultRootWindow(display),
+			       0, 0, 10, 10, 0,
+			       CopyFromParent, InputOnly, CopyFromParent,
+			       CWEventMask, &attributes);
+
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0)
+		run_selection_source();
+
+	/* wait for the window manager to claim the Wayland selection */
+	alarm(60);
+	while (XGetSelectionOwner(display, clipboard) == None)
+		usleep(10000);
+
+	XConvertSelection(display, clipboard, utf8_string, property,
+			  window, CurrentTime);
+	do
+		XNextEvent(display, &event);
+	while (event.type != SelectionNotify);
+	assert(event.xselection.property == property);
+
+	/* 32 MiB doesn't fit in one property, deleting the INCR
+	 * property starts the transfer */
+	status = XGetWindowProperty(display, window, property,
+				    0, 0x1fffffff, True, AnyPropertyType,
+				    &actual_type, &actual_format,
+				    &nitems, &bytes, &value);
+	assert(status == Success);
+	assert(actual_type == incr);
+	XFree(value);
+
+	while (1) {
+		wait_for_property(display, window, property);
+		status = XGetWindowProperty(display, window, property,
+					    0, 0x1fffffff, True,
+					    AnyPropertyType,
+					    &actual_type, &actual_format,
+					    &nitems, &bytes, &value);
+		assert(status == Success);
+		assert(bytes == 0);
+		if (nitems == 0) {
+			XFree(value);
+			break;
+		}
+
+		assert(actual_type == utf8_string);
+		assert(actual_format == 8);
+		assert(received + nitems <= SELECTION_SIZE);
+		for (i = 0; i < nitems; i++)
+			assert(value[i] == selection_byte(received + i));
+		received += nitems;
+		XFree(value);
+
+		/* weston's clipboard reads the whole selection from the
+		 * source before we get to, so only time the transfer
+		 * from the first chunk on */
+		if (first == 0) {
+			first = received;
+			clock_gettime(CLOCK_MONOTONIC, &begin);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	assert(received == SELECTION_SIZE);
+
+	seconds = timespec_sub_to_sec(&end, &begin);
+	printf("xwayland-selection: %lu bytes in %.3f s, %.1f MiB/s\n",
+	       received - first, seconds,
+	       (received - first) / seconds / (1024 * 1024));
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	XDestroyWindow(display, window);
+	XCloseDisplay(display);
+	exit(EXIT_SUCCESS);
+}
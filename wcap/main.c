@@ -35,162 +35,347 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
-#include <assert.h>
+#include <pthread.h>
 
 #include <cairo.h>
 
 #include "wcap-decode.h"
+#include "wcap-convert.h"
 
 static void
-write_png(struct wcap_decoder *decoder, const char *filename)
+write_png(uint32_t *frame, int width, int height, const char *filename)
 {
 	cairo_surface_t *surface;
 
-	surface = cairo_image_surface_create_for_data((unsigned char *) decoder->frame,
+	surface = cairo_image_surface_create_for_data((unsigned char *) frame,
 						      CAIRO_FORMAT_ARGB32,
-						      decoder->width,
-						      decoder->height,
-						      decoder->width * 4);
+						      width, height, width * 4);
 	cairo_surface_write_to_png(surface, filename);
 	cairo_surface_destroy(surface);
 }
 
-static inline int
-rgb_to_yuv(uint32_t format, uint32_t p, int *u, int *v)
+#define MAX_THREADS 16
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_DECODED,
+	SLOT_CONVERTING,
+	SLOT_CONVERTED
+};
+
+/* A decoded frame on its way through the pipeline, shown for repeat
+ * output frames starting at first. */
+struct output_slot {
+	enum slot_state state;
+	int first, repeat;
+	uint32_t *frame;
+	unsigned char *out;
+};
+
+/* The main thread decodes frames into slots, the converter threads
+ * turn them into yuv frames or png files in any order, and the writer
+ * thread outputs them in order.  Slot n % nslots holds frame n. */
+struct pipeline {
+	int width, height;
+	uint32_t format;
+	int yuv4mpeg2, all, output_frame;
+	size_t out_size;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct output_slot *slots;
+	int nslots;
+	unsigned int queued, converting, written;
+	int done;
+
+	pthread_t converters[MAX_THREADS];
+	int nconverters;
+	pthread_t writer;
+};
+
+static int
+should_write_png(struct pipeline *pipeline, int n)
 {
-	int r, g, b, y;
-
-	switch (format) {
-	case WCAP_FORMAT_XRGB8888:
-		r = (p >> 16) & 0xff;
-		g = (p >> 8) & 0xff;
-		b = (p >> 0) & 0xff;
-		break;
-	case WCAP_FORMAT_XBGR8888:
-		r = (p >> 0) & 0xff;
-		g = (p >> 8) & 0xff;
-		b = (p >> 16) & 0xff;
-		break;
-	default:
-		assert(0);
-	}
+	return pipeline->all || n == pipeline->output_frame;
+}
 
-	y = (19595 * r + 38469 * g + 7472 * b) >> 16;
-	if (y > 255)
-		y = 255;
+static void
+convert_slot(struct pipeline *pipeline, struct output_slot *slot)
+{
+	char filename[200];
+	int n;
+
+	if (pipeline->yuv4mpeg2 == 444) {
+		wcap_convert_to_yuv444(pipeline->format, slot->frame,
+				       pipeline->width, pipeline->height,
+				       slot->out);
+	} else if (pipeline->yuv4mpeg2) {
+		wcap_convert_to_yv12(pipeline->format, slot->frame,
+				     pipeline->width, pipeline->height,
+				     slot->out);
+	}
 
-	*u += 46727 * (r - y);
-	*v += 36962 * (b - y);
+	for (n = slot->first; n < slot->first + slot->repeat; n++) {
+		if (!should_write_png(pipeline, n))
+			continue;
 
-	return y;
+		snprintf(filename, sizeof filename, "wcap-frame-%d.png", n);
+		write_png(slot->frame, pipeline->width, pipeline->height,
+			  filename);
+	}
 }
 
-static inline
-int clamp_uv(int u)
+static void *
+converter_thread(void *data)
 {
-	int clamp = (u >> 18) + 128;
+	struct pipeline *pipeline = data;
+	struct output_slot *slot;
 
-	if (clamp < 0)
-		return 0;
-	else if (clamp > 255)
-		return 255;
-	else
-		return clamp;
+	pthread_mutex_lock(&pipeline->mutex);
+
+	for (;;) {
+		while (pipeline->converting == pipeline->queued &&
+		       !pipeline->done)
+			pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+
+		if (pipeline->converting == pipeline->queued)
+			break;
+
+		slot = &pipeline->slots[pipeline->converting %
+					pipeline->nslots];
+		pipeline->converting++;
+		slot->state = SLOT_CONVERTING;
+
+		pthread_mutex_unlock(&pipeline->mutex);
+		convert_slot(pipeline, slot);
+		pthread_mutex_lock(&pipeline->mutex);
+
+		slot->state = SLOT_CONVERTED;
+		pthread_cond_broadcast(&pipeline->cond);
+	}
+
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	return NULL;
 }
 
 static void
-convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
+write_slot(struct pipeline *pipeline, struct output_slot *slot)
 {
-	unsigned char *y1, *y2, *u, *v;
-	uint32_t *p1, *p2, *end;
-	int i, u_accum, v_accum, stride0, stride1;
-	uint32_t format = decoder->format;
-
-	stride0 = decoder->width;
-	stride1 = decoder->width / 2;
-	for (i = 0; i < decoder->height; i += 2) {
-		y1 = out + stride0 * i;
-		y2 = y1 + stride0;
-		v = out + stride0 * decoder->height + stride1 * i / 2;
-		u = v + stride1 * decoder->height / 2;
-		p1 = decoder->frame + decoder->width * i;
-		p2 = p1 + decoder->width;
-		end = p1 + decoder->width;
-
-		while (p1 < end) {
-			u_accum = 0;
-			v_accum = 0;
-			y1[0] = rgb_to_yuv(format, p1[0], &u_accum, &v_accum);
-			y1[1] = rgb_to_yuv(format, p1[1], &u_accum, &v_accum);
-			y2[0] = rgb_to_yuv(format, p2[0], &u_accum, &v_accum);
-			y2[1] = rgb_to_yuv(format, p2[1], &u_accum, &v_accum);
-			u[0] = clamp_uv(u_accum);
-			v[0] = clamp_uv(v_accum);
-
-			y1 += 2;
-			p1 += 2;
-			y2 += 2;
-			p2 += 2;
-			u++;
-			v++;
+	int n;
+
+	for (n = slot->first; n < slot->first + slot->repeat; n++) {
+		if (pipeline->yuv4mpeg2) {
+			printf("FRAME\n");
+			fwrite(slot->out, 1, pipeline->out_size, stdout);
 		}
+		if (should_write_png(pipeline, n))
+			fprintf(stderr, "wrote wcap-frame-%d.png\n", n);
+	}
+}
+
+static void *
+writer_thread(void *data)
+{
+	struct pipeline *pipeline = data;
+	struct output_slot *slot;
+
+	pthread_mutex_lock(&pipeline->mutex);
+
+	for (;;) {
+		slot = &pipeline->slots[pipeline->written % pipeline->nslots];
+		while (!(pipeline->written < pipeline->queued &&
+			 slot->state == SLOT_CONVERTED) &&
+		       !(pipeline->written == pipeline->queued &&
+			 pipeline->done))
+			pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+
+		if (pipeline->written == pipeline->queued)
+			break;
+
+		pthread_mutex_unlock(&pipeline->mutex);
+		write_slot(pipeline, slot);
+		pthread_mutex_lock(&pipeline->mutex);
+
+		slot->state = SLOT_FREE;
+		pipeline->written++;
+		pthread_cond_broadcast(&pipeline->cond);
 	}
+
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	fflush(stdout);
+
+	return NULL;
 }
 
 static void
-convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
+pipeline_release(struct pipeline *pipeline)
+{
+	int i;
+
+	for (i = 0; i < pipeline->nslots; i++) {
+		free(pipeline->slots[i].frame);
+		free(pipeline->slots[i].out);
+	}
+	free(pipeline->slots);
+}
+
+static int
+pipeline_init(struct pipeline *pipeline, struct wcap_decoder *decoder,
+	      int nthreads)
 {
+	size_t frame_size = decoder->width * decoder->height * 4;
+	int i;
 
-	unsigned char *yp, *up, *vp;
-	uint32_t *rp, *end;
-	int u, v;
-	int i, stride, psize;
-	uint32_t format = decoder->format;
-
-	stride = decoder->width;
-	psize = stride * decoder->height;
-	for (i = 0; i < decoder->height; i++) {
-		yp = out + stride * i;
-		up = yp + (psize * 2);
-		vp = yp + (psize * 1);
-		rp = decoder->frame + decoder->width * i;
-		end = rp + decoder->width;
-		while (rp < end) {
-			u = 0;
-			v = 0;
-			yp[0] = rgb_to_yuv(format, rp[0], &u, &v);
-			up[0] = clamp_uv(u/.3);
-			vp[0] = clamp_uv(v/.3);
-			up++;
-			vp++;
-			yp++;
-			rp++;
+	if (pipeline->yuv4mpeg2 == 444)
+		pipeline->out_size = decoder->width * decoder->height * 3;
+	else
+		pipeline->out_size = decoder->width * decoder->height * 3 / 2;
+
+	pipeline->width = decoder->width;
+	pipeline->height = decoder->height;
+	pipeline->format = decoder->format;
+
+	/* One slot per converter plus one each being decoded and
+	 * written */
+	pipeline->nslots = nthreads + 2;
+	pipeline->slots = calloc(pipeline->nslots, sizeof *pipeline->slots);
+	if (pipeline->slots == NULL)
+		return -1;
+
+	for (i = 0; i < pipeline->nslots; i++) {
+		pipeline->slots[i].frame = malloc(frame_size);
+		if (pipeline->slots[i].frame == NULL)
+			goto err;
+		if (pipeline->yuv4mpeg2) {
+			pipeline->slots[i].out = malloc(pipeline->out_size);
+			if (pipeline->slots[i].out == NULL)
+				goto err;
 		}
 	}
+
+	pthread_mutex_init(&pipeline->mutex, NULL);
+	pthread_cond_init(&pipeline->cond, NULL);
+
+	if (pthread_create(&pipeline->writer, NULL,
+			   writer_thread, pipeline) != 0)
+		goto err_threads;
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&pipeline->converters[i], NULL,
+				   converter_thread, pipeline) != 0)
+			break;
+		pipeline->nconverters++;
+	}
+
+	if (pipeline->nconverters > 0)
+		return 0;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	pipeline->done = 1;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->mutex);
+	pthread_join(pipeline->writer, NULL);
+
+err_threads:
+	pthread_cond_destroy(&pipeline->cond);
+	pthread_mutex_destroy(&pipeline->mutex);
+err:
+	pipeline_release(pipeline);
+	return -1;
+}
+
+/* Hands the current frame of the decoder to the converters, waiting
+ * for a free slot if all are in use. */
+static void
+pipeline_queue(struct pipeline *pipeline, struct wcap_decoder *decoder,
+	       int first, int repeat)
+{
+	struct output_slot *slot;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	slot = &pipeline->slots[pipeline->queued % pipeline->nslots];
+	while (slot->state != SLOT_FREE)
+		pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	memcpy(slot->frame, decoder->frame,
+	       decoder->width * decoder->height * 4);
+	slot->first = first;
+	slot->repeat = repeat;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	slot->state = SLOT_DECODED;
+	pipeline->queued++;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->mutex);
 }
 
 static void
-output_yuv_frame(struct wcap_decoder *decoder, int depth)
+pipeline_finish(struct pipeline *pipeline)
 {
-	static unsigned char *out;
-	int size;
+	int i;
 
-	if (depth == 444) {
-		size = decoder->width * decoder->height * 3;
-	} else {
-		size = decoder->width * decoder->height * 3 / 2;
+	pthread_mutex_lock(&pipeline->mutex);
+	pipeline->done = 1;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	for (i = 0; i < pipeline->nconverters; i++)
+		pthread_join(pipeline->converters[i], NULL);
+	pthread_join(pipeline->writer, NULL);
+
+	pthread_cond_destroy(&pipeline->cond);
+	pthread_mutex_destroy(&pipeline->mutex);
+	pipeline_release(pipeline);
+}
+
+static int
+default_thread_count(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* Decoding and writing are serial, more converters rarely help
+	 * and every one of them costs two frames of memory. */
+	if (n < 1)
+		return 1;
+	if (n > 4)
+		return 4;
+
+	return n;
+}
+
+/* Output frames are numbered at the replay rate, like in the sequential
+ * path of main(): frame n is the first one recorded at or after n frame
+ * times into the capture. */
+static void
+extract_frame(struct wcap_decoder *decoder, int n, uint32_t frame_time)
+{
+	char filename[200];
+	uint32_t msecs;
+	int ret;
+
+	ret = wcap_decoder_seek_frame(decoder, 0);
+	if (ret > 0) {
+		msecs = decoder->msecs + n * frame_time;
+		ret = wcap_decoder_seek_msecs(decoder, msecs);
+		if (ret > 0 && decoder->msecs < msecs)
+			ret = wcap_decoder_get_frame(decoder);
 	}
-	if (out == NULL)
-		out = malloc(size);
 
-	if (depth == 444) {
-		convert_to_yuv444(decoder, out);
-	} else {
-		convert_to_yv12(decoder, out);
+	if (ret > 0) {
+		snprintf(filename, sizeof filename, "wcap-frame-%d.png", n);
+		write_png(decoder->frame, decoder->width, decoder->height,
+			  filename);
+		fprintf(stderr, "wrote %s\n", filename);
+	} else if (ret < 0) {
+		fprintf(stderr, "failed to decode frame %d\n", n);
 	}
 
-	printf("FRAME\n");
-	fwrite(out, 1, size, stdout);
+	fprintf(stderr, "wcap file: size %dx%d, %d recorded frames\n",
+		decoder->width, decoder->height,
+		wcap_decoder_get_frame_count(decoder));
 }
 
 static void
@@ -198,14 +383,16 @@ usage(int exit_code)
 {
 	fprintf(stderr, "usage: wcap-decode "
 		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--all] \n"
-		"\t[--rate=<num:denom>] <wcap file>\n\n"
+		"\t[--rate=<num:denom>] [--threads=<n>] <wcap file>|-\n\n"
 		"\t--help\t\t\tthis help text\n"
 		"\t--yuv4mpeg2\t\tdump wcap file to stdout in yuv4mpeg2 format\n"
 		"\t--yuv4mpeg2-444\t\tdump wcap file to stdout in yuv4mpeg2 444 format\n"
 		"\t--frame=<frame>\t\twrite out the given frame number as png\n"
 		"\t--all\t\t\twrite all frames as pngs\n"
 		"\t--rate=<num:denom>\treplay frame rate for yuv4mpeg2,\n"
-		"\t\t\t\tspecified as an integer fraction\n\n");
+		"\t\t\t\tspecified as an integer fraction\n"
+		"\t--threads=<n>\t\tconvert frames on n threads\n"
+		"\t-\t\t\tread the wcap stream from stdin\n\n");
 
 	exit(exit_code);
 }
@@ -213,9 +400,9 @@ usage(int exit_code)
 int main(int argc, char *argv[])
 {
 	struct wcap_decoder *decoder;
+	struct pipeline pipeline = { 0 };
 	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, has_frame;
-	int num = 30, denom = 1;
-	char filename[200];
+	int num = 30, denom = 1, nthreads = default_thread_count(), repeat;
 	char *mode;
 	uint32_t msecs, frame_time;
 
@@ -234,9 +421,11 @@ int main(int argc, char *argv[])
 			;
 		} else if (sscanf(argv[i], "--rate=%d:%d", &num, &denom) == 2) {
 			;
+		} else if (sscanf(argv[i], "--threads=%d", &nthreads) == 1) {
+			;
 		} else if (strcmp(argv[i], "--") == 0) {
 			break;
-		} else if (argv[i][0] == '-') {
+		} else if (argv[i][0] == '-' && argv[i][1] != '\0') {
 			fprintf(stderr,
 				"unknown option or invalid argument: %s\n", argv[i]);
 			usage(EXIT_FAILURE);
@@ -252,8 +441,20 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "invalid rate, denom can not be 0\n");
 		exit(EXIT_FAILURE);
 	}
+	if (num <= 0 || denom < 0 || 1000 * denom / num == 0) {
+		fprintf(stderr, "invalid rate, frames must be at least 1ms\n");
+		exit(EXIT_FAILURE);
+	}
+	if (nthreads < 1 || nthreads > MAX_THREADS) {
+		fprintf(stderr, "invalid thread count, must be 1 to %d\n",
+			MAX_THREADS);
+		exit(EXIT_FAILURE);
+	}
 
-	decoder = wcap_decoder_create(argv[1]);
+	if (strcmp(argv[1], "-") == 0)
+		decoder = wcap_decoder_create_from_fd(dup(STDIN_FILENO));
+	else
+		decoder = wcap_decoder_create(argv[1]);
 	if (decoder == NULL) {
 		fprintf(stderr, "Creating wcap decoder failed\n");
 		exit(EXIT_FAILURE);
@@ -279,29 +480,54 @@ int main(int argc, char *argv[])
 		fflush(stdout);
 	}
 
+	frame_time = 1000 * denom / num;
+
+	/* A single frame from an indexed file does not need everything
+	 * before it decoded. */
+	if (output_frame >= 0 && !all && !yuv4mpeg2 &&
+	    wcap_decoder_get_frame_count(decoder) >= 0) {
+		extract_frame(decoder, output_frame, frame_time);
+		wcap_decoder_destroy(decoder);
+		return EXIT_SUCCESS;
+	}
+
+	pipeline.yuv4mpeg2 = yuv4mpeg2;
+	pipeline.all = all;
+	pipeline.output_frame = output_frame;
+	if (pipeline_init(&pipeline, decoder, nthreads) < 0) {
+		fprintf(stderr, "failed to set up the conversion threads\n");
+		exit(EXIT_FAILURE);
+	}
+
 	i = 0;
 	has_frame = wcap_decoder_get_frame(decoder);
 	msecs = decoder->msecs;
-	frame_time = 1000 * denom / num;
-	while (has_frame) {
-		if (all || i == output_frame) {
-			snprintf(filename, sizeof filename,
-				 "wcap-frame-%d.png", i);
-			write_png(decoder, filename);
-			fprintf(stderr, "wrote %s\n", filename);
-		}
-		if (yuv4mpeg2)
-			output_yuv_frame(decoder, yuv4mpeg2);
-		i++;
-		msecs += frame_time;
-		while (decoder->msecs < msecs && has_frame)
+	while (has_frame > 0) {
+		/* The frame is shown until the one after it is due */
+		repeat = 0;
+		do {
+			repeat++;
+			msecs += frame_time;
+		} while (decoder->msecs >= msecs);
+
+		if (yuv4mpeg2 || all ||
+		    (output_frame >= i && output_frame < i + repeat))
+			pipeline_queue(&pipeline, decoder, i, repeat);
+
+		i += repeat;
+		while (decoder->msecs < msecs && has_frame > 0)
 			has_frame = wcap_decoder_get_frame(decoder);
 	}
 
+	pipeline_finish(&pipeline);
+
 	fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
 		decoder->width, decoder->height, i);
 
+	if (has_frame < 0)
+		fprintf(stderr, "wcap file is corrupt after %d frames\n", i);
+
 	wcap_decoder_destroy(decoder);
 
-	return EXIT_SUCCESS;
+	return has_frame < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
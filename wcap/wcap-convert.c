@@ -0,0 +1,325 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "wcap-decode.h"
+#include "wcap-convert.h"
+
+static inline int
+rgb_to_yuv(uint32_t format, uint32_t p, int *u, int *v)
+{
+	int r, g, b, y;
+
+	switch (format) {
+	case WCAP_FORMAT_XRGB8888:
+		r = (p >> 16) & 0xff;
+		g = (p >> 8) & 0xff;
+		b = (p >> 0) & 0xff;
+		break;
+	case WCAP_FORMAT_XBGR8888:
+		r = (p >> 0) & 0xff;
+		g = (p >> 8) & 0xff;
+		b = (p >> 16) & 0xff;
+		break;
+	default:
+		assert(0);
+	}
+
+	y = (19595 * r + 38469 * g + 7472 * b) >> 16;
+	if (y > 255)
+		y = 255;
+
+	*u += 46727 * (r - y);
+	*v += 36962 * (b - y);
+
+	return y;
+}
+
+static inline
+int clamp_uv(int u)
+{
+	int clamp = (u >> 18) + 128;
+
+	if (clamp < 0)
+		return 0;
+	else if (clamp > 255)
+		return 255;
+	else
+		return clamp;
+}
+
+#if defined(__SSE2__)
+
+/* The kernels below produce the same bytes as rgb_to_yuv() and
+ * clamp_uv().  SSE2 has no 32 bit multiply, so the products are done
+ * with pmaddwd on pairs of 16 bit values: the luma coefficient of
+ * green is split between the (r, g) and (b, g) pairs, and the chroma
+ * factors multiply a difference stored in both halves of a lane. */
+
+struct yuv_pixels {
+	__m128i y, dr, db;
+};
+
+static inline struct yuv_pixels
+rgb_to_yuv_sse2(uint32_t format, __m128i p)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128i c_rg = _mm_set1_epi32(19595 | (22085 << 16));
+	const __m128i c_bg = _mm_set1_epi32(7472 | (16384 << 16));
+	struct yuv_pixels out;
+	__m128i r, g, b;
+
+	g = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+	if (format == WCAP_FORMAT_XRGB8888) {
+		r = _mm_and_si128(_mm_srli_epi32(p, 16), mask);
+		b = _mm_and_si128(p, mask);
+	} else {
+		r = _mm_and_si128(p, mask);
+		b = _mm_and_si128(_mm_srli_epi32(p, 16), mask);
+	}
+
+	g = _mm_slli_epi32(g, 16);
+	out.y = _mm_srli_epi32(
+		_mm_add_epi32(_mm_madd_epi16(_mm_or_si128(r, g), c_rg),
+			      _mm_madd_epi16(_mm_or_si128(b, g), c_bg)), 16);
+	out.dr = _mm_sub_epi32(r, out.y);
+	out.db = _mm_sub_epi32(b, out.y);
+
+	return out;
+}
+
+/* Multiplies the 16 bit values in each lane by c_lo + c_hi */
+static inline __m128i
+mul_split(__m128i x, int c_lo, int c_hi)
+{
+	x = _mm_or_si128(_mm_and_si128(x, _mm_set1_epi32(0xffff)),
+			 _mm_slli_epi32(x, 16));
+
+	return _mm_madd_epi16(x, _mm_set1_epi32(c_lo | (c_hi << 16)));
+}
+
+/* Packs four clamp_uv() results into the low bytes */
+static inline __m128i
+clamp_uv_sse2(__m128i u)
+{
+	__m128i zero = _mm_setzero_si128();
+
+	u = _mm_add_epi32(_mm_srai_epi32(u, 18), _mm_set1_epi32(128));
+
+	return _mm_packus_epi16(_mm_packs_epi32(u, zero), zero);
+}
+
+/* Sums of adjacent lanes: a0 + a1, a2 + a3, b0 + b1, b2 + b3 */
+static inline __m128i
+pair_sums(__m128i a, __m128i b)
+{
+	__m128 fa = _mm_castsi128_ps(a), fb = _mm_castsi128_ps(b);
+
+	return _mm_add_epi32(
+		_mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0))),
+		_mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+static inline void
+store4(unsigned char *dst, __m128i v)
+{
+	uint32_t x = _mm_cvtsi128_si32(v);
+
+	memcpy(dst, &x, 4);
+}
+
+/* Eight pixels of two rows, giving four chroma samples */
+static inline void
+yv12_block_sse2(uint32_t format, const uint32_t *p1, const uint32_t *p2,
+		unsigned char *y1, unsigned char *y2,
+		unsigned char *u, unsigned char *v)
+{
+	struct yuv_pixels a1, b1, a2, b2;
+	__m128i zero = _mm_setzero_si128(), dr, db;
+
+	a1 = rgb_to_yuv_sse2(format, _mm_loadu_si128((const __m128i *) p1));
+	b1 = rgb_to_yuv_sse2(format,
+			     _mm_loadu_si128((const __m128i *) (p1 + 4)));
+	a2 = rgb_to_yuv_sse2(format, _mm_loadu_si128((const __m128i *) p2));
+	b2 = rgb_to_yuv_sse2(format,
+			     _mm_loadu_si128((const __m128i *) (p2 + 4)));
+
+	_mm_storel_epi64((__m128i *) y1,
+			 _mm_packus_epi16(_mm_packs_epi32(a1.y, b1.y), zero));
+	_mm_storel_epi64((__m128i *) y2,
+			 _mm_packus_epi16(_mm_packs_epi32(a2.y, b2.y), zero));
+
+	dr = pair_sums(_mm_add_epi32(a1.dr, a2.dr),
+		       _mm_add_epi32(b1.dr, b2.dr));
+	db = pair_sums(_mm_add_epi32(a1.db, a2.db),
+		       _mm_add_epi32(b1.db, b2.db));
+
+	/* 46727 and 36962 */
+	store4(u, clamp_uv_sse2(mul_split(dr, 23364, 23363)));
+	store4(v, clamp_uv_sse2(mul_split(db, 18481, 18481)));
+}
+
+/* clamp_uv(u / .3) of four lanes, with the same double division */
+static inline __m128i
+clamp_uv_444_sse2(__m128i u)
+{
+	const __m128d k = _mm_set1_pd(.3);
+	__m128i lo, hi;
+
+	lo = _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(u), k));
+	hi = _mm_cvttpd_epi32(_mm_div_pd(
+			_mm_cvtepi32_pd(_mm_srli_si128(u, 8)), k));
+
+	return clamp_uv_sse2(_mm_unpacklo_epi64(lo, hi));
+}
+
+static inline void
+yuv444_block_sse2(uint32_t format, const uint32_t *p,
+		  unsigned char *y, unsigned char *u, unsigned char *v)
+{
+	struct yuv_pixels a;
+	__m128i zero = _mm_setzero_si128();
+
+	a = rgb_to_yuv_sse2(format, _mm_loadu_si128((const __m128i *) p));
+
+	store4(y, _mm_packus_epi16(_mm_packs_epi32(a.y, zero), zero));
+	store4(u, clamp_uv_444_sse2(mul_split(a.dr, 23364, 23363)));
+	store4(v, clamp_uv_444_sse2(mul_split(a.db, 18481, 18481)));
+}
+
+static inline int
+has_simd_format(uint32_t format)
+{
+	return format == WCAP_FORMAT_XRGB8888 ||
+		format == WCAP_FORMAT_XBGR8888;
+}
+
+#endif
+
+void
+wcap_convert_to_yv12(uint32_t format, const uint32_t *frame,
+		     int width, int height, unsigned char *out)
+{
+	unsigned char *y1, *y2, *u, *v;
+	const uint32_t *p1, *p2, *end;
+	int i, u_accum, v_accum, stride0, stride1;
+#if defined(__SSE2__)
+	int simd = has_simd_format(format);
+#endif
+
+	stride0 = width;
+	stride1 = width / 2;
+	for (i = 0; i < height; i += 2) {
+		y1 = out + stride0 * i;
+		y2 = y1 + stride0;
+		v = out + stride0 * height + stride1 * i / 2;
+		u = v + stride1 * height / 2;
+		p1 = frame + width * i;
+		p2 = p1 + width;
+		end = p1 + width;
+
+#if defined(__SSE2__)
+		while (simd && end - p1 >= 8) {
+			yv12_block_sse2(format, p1, p2, y1, y2, u, v);
+			y1 += 8;
+			p1 += 8;
+			y2 += 8;
+			p2 += 8;
+			u += 4;
+			v += 4;
+		}
+#endif
+
+		while (p1 < end) {
+			u_accum = 0;
+			v_accum = 0;
+			y1[0] = rgb_to_yuv(format, p1[0], &u_accum, &v_accum);
+			y1[1] = rgb_to_yuv(format, p1[1], &u_accum, &v_accum);
+			y2[0] = rgb_to_yuv(format, p2[0], &u_accum, &v_accum);
+			y2[1] = rgb_to_yuv(format, p2[1], &u_accum, &v_accum);
+			u[0] = clamp_uv(u_accum);
+			v[0] = clamp_uv(v_accum);
+
+			y1 += 2;
+			p1 += 2;
+			y2 += 2;
+			p2 += 2;
+			u++;
+			v++;
+		}
+	}
+}
+
+void
+wcap_convert_to_yuv444(uint32_t format, const uint32_t *frame,
+		       int width, int height, unsigned char *out)
+{
+	unsigned char *yp, *up, *vp;
+	const uint32_t *rp, *end;
+	int u, v;
+	int i, stride, psize;
+#if defined(__SSE2__)
+	int simd = has_simd_format(format);
+#endif
+
+	stride = width;
+	psize = stride * height;
+	for (i = 0; i < height; i++) {
+		yp = out + stride * i;
+		up = yp + (psize * 2);
+		vp = yp + (psize * 1);
+		rp = frame + width * i;
+		end = rp + width;
+
+#if defined(__SSE2__)
+		while (simd && end - rp >= 4) {
+			yuv444_block_sse2(format, rp, yp, up, vp);
+			up += 4;
+			vp += 4;
+			yp += 4;
+			rp += 4;
+		}
+#endif
+
+		while (rp < end) {
+			u = 0;
+			v = 0;
+			yp[0] = rgb_to_yuv(format, rp[0], &u, &v);
+			up[0] = clamp_uv(u/.3);
+			vp[0] = clamp_uv(v/.3);
+			up++;
+			vp++;
+			yp++;
+			rp++;
+		}
+	}
+}
@@ -28,31 +28,134 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
-#include <sys/mman.h>
-#include <sys/mman.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <cairo.h>
 
 #include "wcap-decode.h"
 
+static int
+wcap_decoder_read(struct wcap_decoder *decoder, void *data, size_t size)
+{
+	uint8_t *dst = data;
+	ssize_t len;
+	size_t n;
+
+	while (size > 0) {
+		if (decoder->in_pos == decoder->in_len) {
+			do {
+				len = read(decoder->fd, decoder->in,
+					   WCAP_READ_BUFFER_SIZE);
+			} while (len < 0 && errno == EINTR);
+
+			if (len <= 0)
+				return -1;
+
+			decoder->in_pos = 0;
+			decoder->in_len = len;
+		}
+
+		n = decoder->in_len - decoder->in_pos;
+		if (n > size)
+			n = size;
+
+		memcpy(dst, decoder->in + decoder->in_pos, n);
+		decoder->in_pos += n;
+		decoder->offset += n;
+		dst += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+/* Continue reading at the given offset; the file must be seekable. */
+static int
+wcap_decoder_reset(struct wcap_decoder *decoder, uint64_t offset)
+{
+	if (lseek(decoder->fd, offset, SEEK_SET) == (off_t) -1)
+		return -1;
+
+	decoder->in_pos = decoder->in_len = 0;
+	decoder->offset = offset;
+
+	return 0;
+}
+
+/* Grows the buffer to at least size bytes. It grows geometrically, since
+ * version 1 frames are read into it one run word at a time. */
+static int
+wcap_decoder_ensure_buffer(struct wcap_decoder *decoder, size_t size)
+{
+	uint32_t *buf;
+
+	if (size <= decoder->buf_size)
+		return 0;
+
+	if (size < decoder->buf_size * 2)
+		size = decoder->buf_size * 2;
+	if (size < 4096)
+		size = 4096;
+
+	buf = realloc(decoder->buf, size);
+	if (buf == NULL)
+		return -1;
+
+	decoder->buf = buf;
+	decoder->buf_size = size;
+
+	return 0;
+}
+
+/* Adds the delta to each color component modulo 256 */
+static inline uint32_t
+apply_delta(uint32_t prev, uint32_t delta)
+{
+	return 0xff000000 |
+		(((prev & 0x00ff00ff) + (delta & 0x00ff00ff)) & 0x00ff00ff) |
+		(((prev & 0x0000ff00) + (delta & 0x0000ff00)) & 0x0000ff00);
+}
+
 static void
+apply_run(uint32_t *d, int n, uint32_t delta)
+{
+#if defined(__SSE2__)
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	__m128i dv = _mm_set1_epi32(delta & 0x00ffffff), p;
+
+	for (; n >= 4; n -= 4, d += 4) {
+		p = _mm_loadu_si128((__m128i *) d);
+		p = _mm_or_si128(_mm_add_epi8(p, dv), alpha);
+		_mm_storeu_si128((__m128i *) d, p);
+	}
+#endif
+
+	for (; n > 0; n--, d++)
+		*d = apply_delta(*d, delta);
+}
+
+static uint32_t *
 wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
-			      struct wcap_rectangle *rect)
+			      struct wcap_rectangle *rect,
+			      uint32_t *p, uint32_t *end)
 {
-	uint32_t v, *p = decoder->p, *d;
+	uint32_t v, *d;
 	int width = rect->x2 - rect->x1, height = rect->y2 - rect->y1;
-	int x, i, j, k, l, count = width * height;
-	unsigned char r, g, b, dr, dg, db;
+	int x, i, j, l, n, count = width * height;
 
 	d = decoder->frame + (rect->y2 - 1) * decoder->width;
 	x = rect->x1;
 	i = 0;
-	while (i < count) {
+	while (i < count && p < end) {
 		v = *p++;
 		l = v >> 24;
 		if (l < 0xe0) {
@@ -61,106 +164,398 @@ wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 			j = 1 << (l - 0xe0 + 7);
 		}
 
-		dr = (v >> 16);
-		dg = (v >>  8);
-		db = (v >>  0);
-		for (k = 0; k < j; k++) {
-			r = (d[x] >> 16) + dr;
-			g = (d[x] >>  8) + dg;
-			b = (d[x] >>  0) + db;
-			d[x] = 0xff000000 | (r << 16) | (g << 8) | b;
-			x++;
+		if (j > count - i)
+			break;
+
+		/* Runs are applied a row segment at a time */
+		i += j;
+		while (j > 0) {
+			n = rect->x2 - x;
+			if (n > j)
+				n = j;
+			apply_run(d + x, n, v);
+			j -= n;
+			x += n;
 			if (x == rect->x2) {
 				x = rect->x1;
 				d -= decoder->width;
 			}
 		}
-		i += j;
 	}
 
 	if (i != count)
 		printf("rle encoding longer than expected (%d expected %d)\n",
 		       i, count);
 
-	decoder->p = p;
+	return p;
 }
 
-int
-wcap_decoder_get_frame(struct wcap_decoder *decoder)
+static int
+rectangle_is_valid(struct wcap_decoder *decoder, struct wcap_rectangle *rect)
+{
+	return rect->x1 >= 0 && rect->x1 < rect->x2 &&
+		rect->x2 <= decoder->width &&
+		rect->y1 >= 0 && rect->y1 < rect->y2 &&
+		rect->y2 <= decoder->height;
+}
+
+/* Version 1 frames do not store their size, so the run-length encoded
+ * pixels are read one run at a time. */
+static int
+wcap_decoder_read_frame_v1(struct wcap_decoder *decoder)
+{
+	struct wcap_frame_header header;
+	struct wcap_rectangle rect;
+	uint32_t i, *p, v;
+	size_t used;
+	int count, n, l;
+
+	if (wcap_decoder_read(decoder, &header, sizeof header) < 0)
+		return 0;
+
+	for (i = 0; i < header.nrects; i++) {
+		if (wcap_decoder_read(decoder, &rect, sizeof rect) < 0 ||
+		    !rectangle_is_valid(decoder, &rect))
+			return -1;
+
+		count = (rect.x2 - rect.x1) * (rect.y2 - rect.y1);
+		used = 0;
+		for (n = 0; n < count; ) {
+			if (wcap_decoder_read(decoder, &v, sizeof v) < 0 ||
+			    wcap_decoder_ensure_buffer(decoder,
+						       (used + 1) * 4) < 0)
+				return -1;
+			decoder->buf[used++] = v;
+
+			l = v >> 24;
+			n += l < 0xe0 ? l + 1 : 1 << (l - 0xe0 + 7);
+		}
+
+		p = decoder->buf;
+		wcap_decoder_decode_rectangle(decoder, &rect, p, p + used);
+	}
+
+	decoder->msecs = header.msecs;
+
+	return 1;
+}
+
+static int
+wcap_decoder_read_frame_v2(struct wcap_decoder *decoder)
 {
+	struct wcap_frame_header_v2 header;
 	struct wcap_rectangle *rects;
-	struct wcap_frame_header *header;
-	uint32_t i;
+	uint32_t i, *p, *end;
 
-	if (decoder->p == decoder->end)
+	if (decoder->offset >= decoder->data_end ||
+	    wcap_decoder_read(decoder, &header, sizeof header) < 0)
 		return 0;
 
-	header = decoder->p;
-	decoder->msecs = header->msecs;
-	decoder->count++;
+	/* The index follows the last frame */
+	if (header.flags & WCAP_FRAME_INDEX) {
+		decoder->data_end = decoder->offset - sizeof header;
+		return 0;
+	}
 
-	rects = (void *) (header + 1);
-	decoder->p = (uint32_t *) (rects + header->nrects);
-	for (i = 0; i < header->nrects; i++)
-		wcap_decoder_decode_rectangle(decoder, &rects[i]);
+	if (header.nrects > header.size / sizeof *rects ||
+	    wcap_decoder_ensure_buffer(decoder, header.size) < 0 ||
+	    wcap_decoder_read(decoder, decoder->buf, header.size) < 0)
+		return -1;
+
+	if (header.flags & WCAP_FRAME_KEYFRAME)
+		memset(decoder->frame, 0,
+		       decoder->width * decoder->height * 4);
+
+	rects = (struct wcap_rectangle *) decoder->buf;
+	p = (uint32_t *) (rects + header.nrects);
+	end = decoder->buf + header.size / 4;
+	for (i = 0; i < header.nrects; i++) {
+		if (!rectangle_is_valid(decoder, &rects[i]))
+			return -1;
+		p = wcap_decoder_decode_rectangle(decoder, &rects[i], p, end);
+	}
+
+	decoder->msecs = header.msecs;
 
 	return 1;
 }
 
+/** Decode the next frame
+ *
+ * Returns 1 if a frame was decoded, 0 at the end of the stream and -1 if
+ * the stream is corrupt. Works on pipes as well as files.
+ */
+int
+wcap_decoder_get_frame(struct wcap_decoder *decoder)
+{
+	int ret;
+
+	if (decoder->version == 1)
+		ret = wcap_decoder_read_frame_v1(decoder);
+	else
+		ret = wcap_decoder_read_frame_v2(decoder);
+
+	if (ret > 0)
+		decoder->count++;
+
+	return ret;
+}
+
+/** Decode the given frame, counting from 0
+ *
+ * Decoding starts at the closest keyframe before the frame, or continues
+ * from the current frame if that is closer. Files without an index are
+ * decoded from the start. Returns 1 on success, 0 if there is no such
+ * frame and -1 on errors, for example if the input is not seekable.
+ */
+int
+wcap_decoder_seek_frame(struct wcap_decoder *decoder, uint32_t frame)
+{
+	uint32_t key = 0;
+	uint64_t offset = decoder->data_offset;
+	int ret;
+
+	if (decoder->index) {
+		if (frame >= decoder->index_count)
+			return 0;
+
+		key = frame;
+		while (key > 0 &&
+		       !(decoder->index[key].flags & WCAP_FRAME_KEYFRAME))
+			key--;
+		offset = decoder->index[key].offset;
+	}
+
+	if (decoder->count <= key || decoder->count > frame + 1) {
+		if (wcap_decoder_reset(decoder, offset) < 0)
+			return -1;
+
+		if (key == 0)
+			memset(decoder->frame, 0,
+			       decoder->width * decoder->height * 4);
+		decoder->count = key;
+	}
+
+	while (decoder->count <= frame) {
+		ret = wcap_decoder_get_frame(decoder);
+		if (ret <= 0)
+			return ret;
+	}
+
+	return 1;
+}
+
+/** Decode the last frame shown at the given time
+ *
+ * Timestamps are those of the frames, not relative to the first one.
+ * Needs the index of a version 2 file; returns -1 without one, 0 if the
+ * time is before the first frame and 1 on success.
+ */
+int
+wcap_decoder_seek_msecs(struct wcap_decoder *decoder, uint32_t msecs)
+{
+	uint32_t lo = 0, hi, mid;
+
+	if (!decoder->index)
+		return -1;
+
+	if (decoder->index_count == 0 || decoder->index[0].msecs > msecs)
+		return 0;
+
+	/* Last entry at or before msecs */
+	hi = decoder->index_count;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (decoder->index[mid].msecs <= msecs)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return wcap_decoder_seek_frame(decoder, lo);
+}
+
+/** Number of frames, or -1 if the file has no index */
+int
+wcap_decoder_get_frame_count(struct wcap_decoder *decoder)
+{
+	return decoder->index ? (int) decoder->index_count : -1;
+}
+
+static int
+wcap_decoder_add_index_entry(struct wcap_decoder *decoder, uint32_t *alloc,
+			     const struct wcap_index_entry *entry)
+{
+	struct wcap_index_entry *index;
+
+	if (decoder->index_count == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 256;
+		index = realloc(decoder->index, *alloc * sizeof *index);
+		if (index == NULL)
+			return -1;
+		decoder->index = index;
+	}
+
+	decoder->index[decoder->index_count++] = *entry;
+
+	return 0;
+}
+
+/* Rebuild the index of a file that lacks one, for example because the
+ * recording did not finish, from the frame sizes. */
+static void
+wcap_decoder_scan_index(struct wcap_decoder *decoder, uint64_t file_size)
+{
+	struct wcap_frame_header_v2 header;
+	struct wcap_index_entry entry;
+	uint64_t offset = decoder->data_offset;
+	uint32_t alloc = 0;
+
+	while (offset + sizeof header <= file_size) {
+		if (pread(decoder->fd, &header, sizeof header, offset) !=
+		    sizeof header ||
+		    offset + sizeof header + header.size > file_size ||
+		    header.flags & WCAP_FRAME_INDEX)
+			break;
+
+		entry.offset = offset;
+		entry.msecs = header.msecs;
+		entry.flags = header.flags;
+		if (wcap_decoder_add_index_entry(decoder, &alloc, &entry) < 0)
+			break;
+
+		offset += sizeof header + header.size;
+	}
+
+	decoder->data_end = offset;
+}
+
+static void
+wcap_decoder_load_index(struct wcap_decoder *decoder)
+{
+	struct wcap_index_trailer trailer;
+	struct stat buf;
+	size_t size;
+
+	if (fstat(decoder->fd, &buf) < 0 || !S_ISREG(buf.st_mode))
+		return;
+
+	if ((uint64_t) buf.st_size < decoder->data_offset + sizeof trailer ||
+	    pread(decoder->fd, &trailer, sizeof trailer,
+		  buf.st_size - sizeof trailer) != sizeof trailer ||
+	    trailer.magic != WCAP_INDEX_MAGIC ||
+	    trailer.offset < decoder->data_offset +
+	    sizeof(struct wcap_frame_header_v2) ||
+	    trailer.offset + (uint64_t) trailer.count *
+	    sizeof *decoder->index + sizeof trailer != (uint64_t) buf.st_size) {
+		wcap_decoder_scan_index(decoder, buf.st_size);
+		return;
+	}
+
+	size = trailer.count * sizeof *decoder->index;
+	decoder->index = malloc(size ? size : 1);
+	if (decoder->index == NULL)
+		return;
+
+	if (pread(decoder->fd, decoder->index, size, trailer.offset) !=
+	    (ssize_t) size) {
+		free(decoder->index);
+		decoder->index = NULL;
+		wcap_decoder_scan_index(decoder, buf.st_size);
+		return;
+	}
+
+	decoder->index_count = trailer.count;
+	decoder->data_end = trailer.offset -
+		sizeof(struct wcap_frame_header_v2);
+}
+
+/** Create a decoder reading from a file descriptor
+ *
+ * The decoder takes ownership of fd. Pipes can be decoded frame by frame;
+ * seeking needs a regular file.
+ */
 struct wcap_decoder *
-wcap_decoder_create(const char *filename)
+wcap_decoder_create_from_fd(int fd)
 {
 	struct wcap_decoder *decoder;
-	struct wcap_header *header;
+	struct wcap_header header;
+	struct wcap_header_v2 header_v2;
 	int frame_size;
-	struct stat buf;
 
-	decoder = malloc(sizeof *decoder);
+	decoder = calloc(1, sizeof *decoder);
 	if (decoder == NULL)
-		return NULL;
+		goto err_fd;
 
-	decoder->fd = open(filename, O_RDONLY);
-	if (decoder->fd == -1) {
-		free(decoder);
-		return NULL;
-	}
+	decoder->fd = fd;
+	decoder->data_end = UINT64_MAX;
+	decoder->in = malloc(WCAP_READ_BUFFER_SIZE);
+	if (decoder->in == NULL)
+		goto err_decoder;
 
-	fstat(decoder->fd, &buf);
-	decoder->size = buf.st_size;
-	decoder->map = mmap(NULL, decoder->size,
-			    PROT_READ, MAP_PRIVATE, decoder->fd, 0);
-	if (decoder->map == MAP_FAILED) {
-		fprintf(stderr, "mmap failed\n");
-		close(decoder->fd);
-		free(decoder);
-		return NULL;
+	if (wcap_decoder_read(decoder, &header, sizeof header) < 0)
+		goto err_decoder;
+
+	switch (header.magic) {
+	case WCAP_HEADER_MAGIC:
+		decoder->version = 1;
+		break;
+	case WCAP_HEADER_MAGIC_V2:
+		decoder->version = 2;
+		if (wcap_decoder_read(decoder, &header_v2,
+				      sizeof header_v2) < 0)
+			goto err_decoder;
+		break;
+	default:
+		fprintf(stderr, "not a wcap file\n");
+		goto err_decoder;
 	}
 
-	header = decoder->map;
-	decoder->format = header->format;
+	decoder->format = header.format;
 	decoder->count = 0;
-	decoder->width = header->width;
-	decoder->height = header->height;
-	decoder->p = header + 1;
-	decoder->end = decoder->map + decoder->size;
+	decoder->width = header.width;
+	decoder->height = header.height;
+	decoder->data_offset = decoder->offset;
+
+	if (decoder->version == 2)
+		wcap_decoder_load_index(decoder);
 
-	frame_size = header->width * header->height * 4;
+	frame_size = header.width * header.height * 4;
 	decoder->frame = malloc(frame_size);
-	if (decoder->frame == NULL) {
-		close(decoder->fd);
-		free(decoder);
-		return NULL;
-	}
+	if (decoder->frame == NULL)
+		goto err_decoder;
 	memset(decoder->frame, 0, frame_size);
 
 	return decoder;
+
+err_decoder:
+	free(decoder->index);
+	free(decoder->in);
+	free(decoder);
+err_fd:
+	close(fd);
+	return NULL;
+}
+
+struct wcap_decoder *
+wcap_decoder_create(const char *filename)
+{
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+
+	return wcap_decoder_create_from_fd(fd);
 }
 
 void
 wcap_decoder_destroy(struct wcap_decoder *decoder)
 {
-	munmap(decoder->map, decoder->size);
 	close(decoder->fd);
+	free(decoder->index);
+	free(decoder->buf);
+	free(decoder->in);
 	free(decoder->frame);
 	free(decoder);
 }
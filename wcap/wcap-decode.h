@@ -29,6 +29,7 @@
 #include <stdint.h>
 
 #define WCAP_HEADER_MAGIC	0x57434150
+#define WCAP_HEADER_MAGIC_V2	0x57434132
 
 #define WCAP_FORMAT_XRGB8888	0x34325258
 #define WCAP_FORMAT_XBGR8888	0x34324258
@@ -41,28 +42,81 @@ struct wcap_header {
 	uint32_t width, height;
 };
 
+/* Follows struct wcap_header in version 2 files */
+struct wcap_header_v2 {
+	uint32_t keyframe_interval; /* in milliseconds */
+	uint32_t reserved;
+};
+
 struct wcap_frame_header {
 	uint32_t msecs;
 	uint32_t nrects;
 };
 
+/* Decoded against a frame of all zero pixels instead of the previous one */
+#define WCAP_FRAME_KEYFRAME	(1 << 0)
+/* Not a frame: the index entries follow and end the stream */
+#define WCAP_FRAME_INDEX	(1 << 1)
+
+struct wcap_frame_header_v2 {
+	uint32_t msecs;
+	uint32_t nrects;
+	uint32_t flags;
+	uint32_t size; /* bytes of rectangles and pixels that follow */
+};
+
 struct wcap_rectangle {
 	int32_t x1, y1, x2, y2;
 };
 
+#define WCAP_INDEX_MAGIC	0x57494458
+
+/* Version 2 files end with a WCAP_FRAME_INDEX header, an entry per
+ * frame and a trailer locating the entries. */
+struct wcap_index_entry {
+	uint64_t offset;
+	uint32_t msecs;
+	uint32_t flags;
+};
+
+struct wcap_index_trailer {
+	uint64_t offset;
+	uint32_t count;
+	uint32_t magic;
+};
+
+#define WCAP_READ_BUFFER_SIZE	65536
+
 struct wcap_decoder {
 	int fd;
-	size_t size;
-	void *map, *p, *end;
+	int version;
 	uint32_t *frame;
 	uint32_t format;
 	uint32_t msecs;
 	uint32_t count;
 	int width, height;
+
+	/* Buffered input; offset is the file offset of the next byte */
+	uint8_t *in;
+	size_t in_pos, in_len;
+	uint64_t offset;
+	uint64_t data_offset, data_end;
+
+	/* Payload of the current frame */
+	uint32_t *buf;
+	size_t buf_size;
+
+	/* Frame index of seekable version 2 files, or NULL */
+	struct wcap_index_entry *index;
+	uint32_t index_count;
 };
 
 int wcap_decoder_get_frame(struct wcap_decoder *decoder);
+int wcap_decoder_seek_frame(struct wcap_decoder *decoder, uint32_t frame);
+int wcap_decoder_seek_msecs(struct wcap_decoder *decoder, uint32_t msecs);
+int wcap_decoder_get_frame_count(struct wcap_decoder *decoder);
 struct wcap_decoder *wcap_decoder_create(const char *filename);
+struct wcap_decoder *wcap_decoder_create_from_fd(int fd);
 void wcap_decoder_destroy(struct wcap_decoder *decoder);
 
 #endif
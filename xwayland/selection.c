@@ -30,10 +30,16 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include "xwayland.h"
 #include "shared/helpers.h"
 
+/* The default /proc/sys/fs/pipe-max-size */
+#define INCR_CHUNK_SIZE_MAX (1024 * 1024)
+
+static void weston_wm_get_incr_chunk(struct weston_wm *wm);
+
 static int
 writable_callback(int fd, uint32_t mask, void *data)
 {
@@ -45,38 +51,54 @@ writable_callback(int fd, uint32_t mask, void *data)
 	remainder = xcb_get_property_value_length(wm->property_reply) -
 		wm->property_start;
 
-	len = write(fd, property + wm->property_start, remainder);
-	if (len == -1) {
-		free(wm->property_reply);
-		wm->property_reply = NULL;
-		if (wm->property_source)
-			wl_event_source_remove(wm->property_source);
-		wm->property_source = NULL;
-		close(fd);
-		weston_log("write error to target fd: %m\n");
-		return 1;
-	}
-
-	weston_log("wrote %d (chunk size %d) of %d bytes\n",
-		wm->property_start + len,
-		len, xcb_get_property_value_length(wm->property_reply));
-
-	wm->property_start += len;
-	if (len == remainder) {
-		free(wm->property_reply);
-		wm->property_reply = NULL;
-		if (wm->property_source)
-			wl_event_source_remove(wm->property_source);
-		wm->property_source = NULL;
+	while (remainder > 0) {
+		len = write(fd, property + wm->property_start, remainder);
+		if (len == -1 && errno == EINTR)
+			continue;
+
+		if (len == -1 && errno == EAGAIN) {
+			/* The target isn't draining as fast as the X
+			 * client is producing; wait for it before we
+			 * ask for more. */
+			if (!wm->property_source)
+				wm->property_source =
+					wl_event_loop_add_fd(wm->server->loop,
+							     fd,
+							     WL_EVENT_WRITABLE,
+							     writable_callback,
+							     wm);
+			return 1;
+		}
 
-		if (wm->incr) {
-			xcb_delete_property(wm->conn,
-					    wm->selection_window,
-					    wm->atom.wl_selection);
-		} else {
-			weston_log("transfer complete\n");
+		if (len == -1) {
+			free(wm->property_reply);
+			wm->property_reply = NULL;
+			if (wm->property_source)
+				wl_event_source_remove(wm->property_source);
+			wm->property_source = NULL;
 			close(fd);
+			weston_log("write error to target fd: %m\n");
+			return 1;
 		}
+
+		wm->property_start += len;
+		remainder -= len;
+	}
+
+	free(wm->property_reply);
+	wm->property_reply = NULL;
+	if (wm->property_source)
+		wl_event_source_remove(wm->property_source);
+	wm->property_source = NULL;
+
+	if (!wm->incr) {
+		weston_log("transfer complete\n");
+		close(fd);
+	} else if (wm->incr_chunk_pending) {
+		/* The owner already posted the next chunk while we were
+		 * writing this one out. */
+		wm->incr_chunk_pending = 0;
+		weston_wm_get_incr_chunk(wm);
 	}
 
 	return 1;
@@ -88,13 +110,6 @@ weston_wm_write_property(struct weston_wm *wm, xcb_get_property_reply_t *reply)
 	wm->property_start = 0;
 	wm->property_reply = reply;
 	writable_callback(wm->data_source_fd, WL_EVENT_WRITABLE, wm);
-
-	if (wm->property_reply)
-		wm->property_source =
-			wl_event_loop_add_fd(wm->server->loop,
-					     wm->data_source_fd,
-					     WL_EVENT_WRITABLE,
-					     writable_callback, wm);
 }
 
 static void
@@ -103,8 +118,12 @@ weston_wm_get_incr_chunk(struct weston_wm *wm)
 	xcb_get_property_cookie_t cookie;
 	xcb_get_property_reply_t *reply;
 
+	/* Deleting the property as we read it lets the owner prepare
+	 * the next chunk while this one is written to the target.  At
+	 * most one more chunk is ever posted before we fetch it, see
+	 * weston_wm_handle_selection_property_notify(). */
 	cookie = xcb_get_property(wm->conn,
-				  0, /* delete */
+				  1, /* delete */
 				  wm->selection_window,
 				  wm->atom.wl_selection,
 				  XCB_GET_PROPERTY_TYPE_ANY,
@@ -249,6 +268,7 @@ weston_wm_get_selection_data(struct weston_wm *wm)
 		return;
 	} else if (reply->type == wm->atom.incr) {
 		wm->incr = 1;
+		wm->incr_chunk_pending = 0;
 		free(reply);
 	} else {
 		wm->incr = 0;
@@ -274,8 +294,6 @@ weston_wm_handle_selection_notify(struct weston_wm *wm,
 	}
 }
 
-static const size_t incr_chunk_size = 64 * 1024;
-
 static void
 weston_wm_send_selection_notify(struct weston_wm *wm, xcb_atom_t property)
 {
@@ -356,34 +374,35 @@ static int
 weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 {
 	struct weston_wm *wm = data;
-	int len, current, available;
-	void *p;
-
-	current = wm->source_data.size;
-	if (wm->source_data.size < incr_chunk_size)
-		p = wl_array_add(&wm->source_data, incr_chunk_size);
-	else
-		p = (char *) wm->source_data.data + wm->source_data.size;
-	available = wm->source_data.alloc - current;
-
-	len = read(fd, p, available);
-	if (len == -1) {
+	size_t chunk_size = wm->incr_chunk_size;
+	ssize_t len;
+
+	/* source_data never holds more than one chunk.  Once it is full
+	 * we stop reading until the requestor has taken the chunk in
+	 * flight, which leaves the data source blocked on the pipe. */
+	do {
+		len = read(fd, (char *) wm->source_data.data +
+			   wm->source_data.size,
+			   chunk_size - wm->source_data.size);
+		if (len > 0)
+			wm->source_data.size += len;
+	} while (len > 0 && wm->source_data.size < chunk_size);
+
+	if (len == -1 && errno != EAGAIN && errno != EINTR) {
 		weston_log("read error from data source: %m\n");
 		weston_wm_send_selection_notify(wm, XCB_ATOM_NONE);
 		wl_event_source_remove(wm->property_source);
 		wm->property_source = NULL;
 		close(fd);
+		wm->data_source_fd = -1;
 		wl_array_release(&wm->source_data);
+		wl_array_init(&wm->source_data);
+		wm->selection_request.requestor = XCB_NONE;
+		return 1;
 	}
 
-	weston_log("read %d (available %d, mask 0x%x) bytes: \"%.*s\"\n",
-		len, available, mask, len, (char *) p);
-
-	wm->source_data.size = current + len;
-	if (wm->source_data.size >= incr_chunk_size) {
+	if (wm->source_data.size >= chunk_size) {
 		if (!wm->incr) {
-			weston_log("got %zu bytes, starting incr\n",
-				wm->source_data.size);
 			wm->incr = 1;
 			xcb_change_property(wm->conn,
 					    XCB_PROP_MODE_REPLACE,
@@ -391,25 +410,20 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 					    wm->selection_request.property,
 					    wm->atom.incr,
 					    32, /* format */
-					    1, &incr_chunk_size);
+					    1, &wm->incr_chunk_size);
 			wm->selection_property_set = 1;
 			wm->flush_property_on_delete = 1;
 			wl_event_source_remove(wm->property_source);
 			wm->property_source = NULL;
 			weston_wm_send_selection_notify(wm, wm->selection_request.property);
 		} else if (wm->selection_property_set) {
-			weston_log("got %zu bytes, waiting for "
-				"property delete\n", wm->source_data.size);
-
 			wm->flush_property_on_delete = 1;
 			wl_event_source_remove(wm->property_source);
 			wm->property_source = NULL;
 		} else {
-			weston_log("got %zu bytes, "
-				"property deleted, setting new property\n",
-				wm->source_data.size);
 			weston_wm_flush_source_data(wm);
 		}
+		xcb_flush(wm->conn);
 	} else if (len == 0 && !wm->incr) {
 		weston_log("non-incr transfer complete\n");
 		/* Non-incr transfer all done. */
@@ -425,23 +439,13 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 		weston_log("incr transfer complete\n");
 
 		wm->flush_property_on_delete = 1;
-		if (wm->selection_property_set) {
-			weston_log("got %zu bytes, waiting for "
-				"property delete\n", wm->source_data.size);
-		} else {
-			weston_log("got %zu bytes, "
-				"property deleted, setting new property\n",
-				wm->source_data.size);
+		if (!wm->selection_property_set)
 			weston_wm_flush_source_data(wm);
-		}
 		xcb_flush(wm->conn);
 		wl_event_source_remove(wm->property_source);
 		wm->property_source = NULL;
 		close(wm->data_source_fd);
 		wm->data_source_fd = -1;
-		close(fd);
-	} else {
-		weston_log("nothing happened, buffered the bytes\n");
 	}
 
 	return 1;
@@ -454,13 +458,29 @@ weston_wm_send_data(struct weston_wm *wm, xcb_atom_t target, const char *mime_ty
 	struct weston_seat *seat = weston_wm_pick_seat(wm);
 	int p[2];
 
+	/* The write end stays non-blocking too: the source may be the
+	 * in-process clipboard, which writes from our own event loop. */
 	if (pipe2(p, O_CLOEXEC | O_NONBLOCK) == -1) {
 		weston_log("pipe2 failed: %m\n");
 		weston_wm_send_selection_notify(wm, XCB_ATOM_NONE);
 		return;
 	}
+#ifdef F_SETPIPE_SZ
+	/* Let the source get a whole chunk ahead of us; failing that
+	 * we just do more, smaller reads. */
+	fcntl(p[0], F_SETPIPE_SZ, wm->incr_chunk_size);
+#endif
 
 	wl_array_init(&wm->source_data);
+	if (!wl_array_add(&wm->source_data, wm->incr_chunk_size)) {
+		weston_log("failed to allocate selection buffer\n");
+		weston_wm_send_selection_notify(wm, XCB_ATOM_NONE);
+		close(p[0]);
+		close(p[1]);
+		return;
+	}
+	wm->source_data.size = 0;
+
 	wm->selection_target = target;
 	wm->data_source_fd = p[0];
 	wm->property_source = wl_event_loop_add_fd(wm->server->loop,
@@ -479,12 +499,8 @@ weston_wm_send_incr_chunk(struct weston_wm *wm)
 {
 	int length;
 
-	weston_log("property deleted\n");
-
 	wm->selection_property_set = 0;
 	if (wm->flush_property_on_delete) {
-		weston_log("setting new property, %zu bytes\n",
-			wm->source_data.size);
 		wm->flush_property_on_delete = 0;
 		length = weston_wm_flush_source_data(wm);
 
@@ -516,9 +532,16 @@ weston_wm_handle_selection_property_notify(struct weston_wm *wm,
 		(xcb_property_notify_event_t *) event;
 
 	if (property_notify->window == wm->selection_window) {
-		if (property_notify->state == XCB_PROPERTY_NEW_VALUE &&
-		    property_notify->atom == wm->atom.wl_selection &&
-		    wm->incr)
+		if (property_notify->state != XCB_PROPERTY_NEW_VALUE ||
+		    property_notify->atom != wm->atom.wl_selection ||
+		    !wm->incr)
+			return 1;
+
+		/* Don't pull in another chunk until the previous one
+		 * has been written out. */
+		if (wm->property_reply)
+			wm->incr_chunk_pending = 1;
+		else
 			weston_wm_get_incr_chunk(wm);
 		return 1;
 	} else if (property_notify->window == wm->selection_request.requestor) {
@@ -679,10 +702,17 @@ void
 weston_wm_selection_init(struct weston_wm *wm)
 {
 	struct weston_seat *seat;
-	uint32_t values[1], mask;
+	uint32_t values[1], mask, max_request;
 
 	wm->selection_request.requestor = XCB_NONE;
 
+	/* Send INCR chunks as large as a single ChangeProperty request
+	 * (24 bytes of header) can carry, but no larger than we can size
+	 * the data source pipe to. */
+	max_request = xcb_get_maximum_request_length(wm->conn) * 4;
+	wm->incr_chunk_size = MIN(max_request - 24, INCR_CHUNK_SIZE_MAX);
+	wm->incr_chunk_size &= ~4095;
+
 	values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE;
 	wm->selection_window = xcb_generate_id(wm->conn);
 	xcb_create_window(wm->conn,
@@ -37,6 +37,7 @@
 #include <signal.h>
 #include <limits.h>
 #include <assert.h>
+#include <xcb/xcbext.h>
 #include <X11/Xcursor/Xcursor.h>
 #include <linux/input.h>
 
@@ -127,6 +128,9 @@ struct motif_wm_hints {
 #define _NET_WM_MOVERESIZE_MOVE_KEYBOARD    10   /* move via keyboard */
 #define _NET_WM_MOVERESIZE_CANCEL           11   /* cancel operation */
 
+/* Properties fetched by weston_wm_window_fetch_properties() */
+#define WM_WINDOW_PROPERTY_COUNT 11
+
 struct weston_output_weak_ref {
 	struct weston_output *output;
 	struct wl_listener destroy_listener;
@@ -145,6 +149,19 @@ struct weston_wm_window {
 	struct wl_event_source *repaint_source;
 	struct wl_event_source *configure_source;
 	int properties_dirty;
+
+	/* Requests are not waited for, their replies are picked up by
+	 * weston_wm_handle_replies() as they arrive. Mapping waits for
+	 * them to be in. */
+	struct wl_list pending_link;	/* weston_wm::pending_window_list */
+	bool geometry_pending;
+	xcb_get_geometry_cookie_t geometry_cookie;
+	int properties_pending;
+	xcb_get_property_cookie_t property_cookie[WM_WINDOW_PROPERTY_COUNT];
+	xcb_get_property_reply_t *property_reply[WM_WINDOW_PROPERTY_COUNT];
+	bool map_request_deferred;
+	bool map_surface_deferred;
+
 	int pid;
 	char *machine;
 	char *class;
@@ -190,6 +207,9 @@ static void
 xserver_map_shell_surface(struct weston_wm_window *window,
 			  struct weston_surface *surface);
 
+static void
+weston_wm_window_create_shell_surface(struct weston_wm_window *window);
+
 static int __attribute__ ((format (printf, 1, 2)))
 wm_log(const char *fmt, ...)
 {
@@ -385,6 +405,11 @@ dump_property(struct weston_wm *wm,
 	int width, len;
 	uint32_t i;
 
+#ifndef WM_DEBUG
+	/* nothing is logged, don't wait for the atom names */
+	return;
+#endif
+
 	width = wm_log_continue("%s: ", get_atom_name(wm->conn, property));
 	if (reply == NULL) {
 		wm_log_continue("(no reply)\n");
@@ -427,6 +452,7 @@ dump_property(struct weston_wm *wm,
 	}
 }
 
+#ifdef WM_DEBUG
 static void
 read_and_dump_property(struct weston_wm *wm,
 		       xcb_window_t window, xcb_atom_t property)
@@ -442,27 +468,31 @@ read_and_dump_property(struct weston_wm *wm,
 
 	free(reply);
 }
+#endif
 
 /* We reuse some predefined, but otherwise useles atoms
  * as local type placeholders that never touch the X11 server,
- * to make weston_wm_window_read_properties() less exceptional.
+ * to make weston_wm_window_apply_properties() less exceptional.
  */
 #define TYPE_WM_PROTOCOLS	XCB_ATOM_CUT_BUFFER0
 #define TYPE_MOTIF_WM_HINTS	XCB_ATOM_CUT_BUFFER1
 #define TYPE_NET_WM_STATE	XCB_ATOM_CUT_BUFFER2
 #define TYPE_WM_NORMAL_HINTS	XCB_ATOM_CUT_BUFFER3
 
+struct wm_window_property {
+	xcb_atom_t atom;
+	xcb_atom_t type;
+	void *ptr;
+};
+
 static void
-weston_wm_window_read_properties(struct weston_wm_window *window)
+weston_wm_window_get_property_table(struct weston_wm_window *window,
+				    struct wm_window_property *props)
 {
 	struct weston_wm *wm = window->wm;
 
 #define F(field) (&window->field)
-	const struct {
-		xcb_atom_t atom;
-		xcb_atom_t type;
-		void *ptr;
-	} props[] = {
+	const struct wm_window_property table[] = {
 		{ XCB_ATOM_WM_CLASS,           XCB_ATOM_STRING,            F(class) },
 		{ XCB_ATOM_WM_NAME,            XCB_ATOM_STRING,            F(name) },
 		{ XCB_ATOM_WM_TRANSIENT_FOR,   XCB_ATOM_WINDOW,            F(transient_for) },
@@ -477,24 +507,65 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	};
 #undef F
 
-	xcb_get_property_cookie_t cookie[ARRAY_LENGTH(props)];
-	xcb_get_property_reply_t *reply;
-	void *p;
-	uint32_t *xid;
-	xcb_atom_t *atom;
+	assert(ARRAY_LENGTH(table) == WM_WINDOW_PROPERTY_COUNT);
+	memcpy(props, table, sizeof table);
+}
+
+static void
+weston_wm_window_add_pending(struct weston_wm_window *window)
+{
+	if (wl_list_empty(&window->pending_link))
+		wl_list_insert(&window->wm->pending_window_list,
+			       &window->pending_link);
+}
+
+/*
+ * Ask for the properties again if they changed since they were last
+ * read. The replies are applied by weston_wm_handle_replies() once they
+ * are all in. Returns true while they are outstanding.
+ */
+static bool
+weston_wm_window_fetch_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct wm_window_property props[WM_WINDOW_PROPERTY_COUNT];
 	uint32_t i;
-	char name[1024];
 
+	if (window->properties_pending > 0)
+		return true;
 	if (!window->properties_dirty)
-		return;
+		return false;
 	window->properties_dirty = 0;
 
+	weston_wm_window_get_property_table(window, props);
 	for (i = 0; i < ARRAY_LENGTH(props); i++)
-		cookie[i] = xcb_get_property(wm->conn,
-					     0, /* delete */
-					     window->id,
-					     props[i].atom,
-					     XCB_ATOM_ANY, 0, 2048);
+		window->property_cookie[i] =
+			xcb_get_property(wm->conn,
+					 0, /* delete */
+					 window->id,
+					 props[i].atom,
+					 XCB_ATOM_ANY, 0, 2048);
+	window->properties_pending = WM_WINDOW_PROPERTY_COUNT;
+
+	weston_wm_window_add_pending(window);
+	xcb_flush(wm->conn);
+
+	return true;
+}
+
+static void
+weston_wm_window_apply_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct wm_window_property props[WM_WINDOW_PROPERTY_COUNT];
+	xcb_get_property_reply_t *reply;
+	void *p;
+	uint32_t *xid;
+	xcb_atom_t *atom;
+	uint32_t i, j;
+	char name[1024];
+
+	weston_wm_window_get_property_table(window, props);
 
 	window->decorate = window->override_redirect ? 0 : MWM_DECOR_EVERYTHING;
 	window->size_hints.flags = 0;
@@ -502,7 +573,8 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	window->delete_window = 0;
 
 	for (i = 0; i < ARRAY_LENGTH(props); i++)  {
-		reply = xcb_get_property_reply(wm->conn, cookie[i], NULL);
+		reply = window->property_reply[i];
+		window->property_reply[i] = NULL;
 		if (!reply)
 			/* Bad window, typically */
 			continue;
@@ -539,8 +611,8 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 			break;
 		case TYPE_WM_PROTOCOLS:
 			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++)
-				if (atom[i] == wm->atom.wm_delete_window) {
+			for (j = 0; j < reply->value_len; j++)
+				if (atom[j] == wm->atom.wm_delete_window) {
 					window->delete_window = 1;
 					break;
 				}
@@ -553,12 +625,12 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 		case TYPE_NET_WM_STATE:
 			window->fullscreen = 0;
 			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++) {
-				if (atom[i] == wm->atom.net_wm_state_fullscreen)
+			for (j = 0; j < reply->value_len; j++) {
+				if (atom[j] == wm->atom.net_wm_state_fullscreen)
 					window->fullscreen = 1;
-				if (atom[i] == wm->atom.net_wm_state_maximized_vert)
+				if (atom[j] == wm->atom.net_wm_state_maximized_vert)
 					window->maximized_vert = 1;
-				if (atom[i] == wm->atom.net_wm_state_maximized_horz)
+				if (atom[j] == wm->atom.net_wm_state_maximized_horz)
 					window->maximized_horz = 1;
 			}
 			break;
@@ -1036,24 +1108,11 @@ weston_wm_window_set_virtual_desktop(struct weston_wm_window *window,
 }
 
 static void
-weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
+weston_wm_window_map(struct weston_wm_window *window)
 {
-	xcb_map_request_event_t *map_request =
-		(xcb_map_request_event_t *) event;
-	struct weston_wm_window *window;
+	struct weston_wm *wm = window->wm;
 	struct weston_output *output;
 
-	if (our_resource(wm, map_request->window)) {
-		wm_log("XCB_MAP_REQUEST (window %d, ours)\n",
-		       map_request->window);
-		return;
-	}
-
-	if (!wm_lookup_window(wm, map_request->window, &window))
-		return;
-
-	weston_wm_window_read_properties(window);
-
 	/* For a new Window, MapRequest happens before the Window is realized
 	 * in Xwayland. We do the real xcb_map_window() here as a response to
 	 * MapRequest. The Window will get realized (wl_surface created in
@@ -1090,7 +1149,7 @@ weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
 					   output);
 	}
 
-	xcb_map_window(wm->conn, map_request->window);
+	xcb_map_window(wm->conn, window->id);
 	xcb_map_window(wm->conn, window->frame_id);
 
 	/* Mapped in the X server, we can draw immediately.
@@ -1099,6 +1158,35 @@ weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
 	weston_wm_window_schedule_repaint(window);
 }
 
+static void
+weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
+{
+	xcb_map_request_event_t *map_request =
+		(xcb_map_request_event_t *) event;
+	struct weston_wm_window *window;
+
+	if (our_resource(wm, map_request->window)) {
+		wm_log("XCB_MAP_REQUEST (window %d, ours)\n",
+		       map_request->window);
+		return;
+	}
+
+	if (!wm_lookup_window(wm, map_request->window, &window))
+		return;
+
+	/* The window is mapped once its geometry and properties are in,
+	 * see weston_wm_window_replies_done(). */
+	if (weston_wm_window_fetch_properties(window) ||
+	    window->geometry_pending) {
+		wm_log("XCB_MAP_REQUEST (window %d, waiting for replies)\n",
+		       window->id);
+		window->map_request_deferred = true;
+		return;
+	}
+
+	weston_wm_window_map(window);
+}
+
 static void
 weston_wm_handle_map_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 {
@@ -1151,6 +1239,7 @@ weston_wm_handle_unmap_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 		wl_list_remove(&window->surface_destroy_listener.link);
 	window->surface = NULL;
 	window->shsurf = NULL;
+	window->map_surface_deferred = false;
 
 	weston_wm_window_set_wm_state(window, ICCCM_WITHDRAWN_STATE);
 	weston_wm_window_set_virtual_desktop(window, -1);
@@ -1250,7 +1339,9 @@ weston_wm_window_do_repaint(void *data)
 
 	window->repaint_source = NULL;
 
-	weston_wm_window_read_properties(window);
+	/* Changed properties are drawn by another repaint when they
+	 * arrive. */
+	weston_wm_window_fetch_properties(window);
 
 	weston_wm_window_draw_decoration(window);
 	weston_wm_window_set_pending_state(window);
@@ -1314,6 +1405,8 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 
 	window->properties_dirty = 1;
 
+#ifdef WM_DEBUG
+	/* both of these wait for the X server */
 	wm_log("XCB_PROPERTY_NOTIFY: window %d, ", property_notify->window);
 	if (property_notify->state == XCB_PROPERTY_DELETE)
 		wm_log_continue("deleted %s\n",
@@ -1321,6 +1414,7 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 	else
 		read_and_dump_property(wm, property_notify->window,
 				       property_notify->atom);
+#endif
 
 	if (property_notify->atom == wm->atom.net_wm_name ||
 	    property_notify->atom == XCB_ATOM_WM_NAME)
@@ -1333,8 +1427,6 @@ weston_wm_window_create(struct weston_wm *wm,
 {
 	struct weston_wm_window *window;
 	uint32_t values[1];
-	xcb_get_geometry_cookie_t geometry_cookie;
-	xcb_get_geometry_reply_t *geometry_reply;
 
 	window = zalloc(sizeof *window);
 	if (window == NULL) {
@@ -1342,13 +1434,18 @@ weston_wm_window_create(struct weston_wm *wm,
 		return;
 	}
 
-	geometry_cookie = xcb_get_geometry(wm->conn, id);
+	window->wm = wm;
+
+	/* The depth is picked up by weston_wm_handle_replies() */
+	window->geometry_cookie = xcb_get_geometry(wm->conn, id);
+	window->geometry_pending = true;
+	wl_list_init(&window->pending_link);
+	weston_wm_window_add_pending(window);
 
 	values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE |
                     XCB_EVENT_MASK_FOCUS_CHANGE;
 	xcb_change_window_attributes(wm->conn, id, XCB_CW_EVENT_MASK, values);
 
-	window->wm = wm;
 	window->id = id;
 	window->properties_dirty = 1;
 	window->override_redirect = override;
@@ -1361,22 +1458,41 @@ weston_wm_window_create(struct weston_wm *wm,
 	window->map_request_y = INT_MIN; /* out of range for valid positions */
 	weston_output_weak_ref_init(&window->legacy_fullscreen_output);
 
-	geometry_reply = xcb_get_geometry_reply(wm->conn, geometry_cookie, NULL);
-	/* technically we should use XRender and check the visual format's
-	alpha_mask, but checking depth is simpler and works in all known cases */
-	if (geometry_reply != NULL)
-		window->has_alpha = geometry_reply->depth == 32;
-	free(geometry_reply);
-
 	hash_table_insert(wm->window_hash, id, window);
 }
 
+/* Drop the replies still to come for a window going away. */
+static void
+weston_wm_window_cancel_replies(struct weston_wm_window *window)
+{
+	xcb_connection_t *conn = window->wm->conn;
+	int i, first_pending;
+
+	if (window->geometry_pending)
+		xcb_discard_reply(conn, window->geometry_cookie.sequence);
+	window->geometry_pending = false;
+
+	first_pending = WM_WINDOW_PROPERTY_COUNT - window->properties_pending;
+	for (i = 0; i < WM_WINDOW_PROPERTY_COUNT; i++) {
+		if (i >= first_pending)
+			xcb_discard_reply(conn,
+					  window->property_cookie[i].sequence);
+		free(window->property_reply[i]);
+		window->property_reply[i] = NULL;
+	}
+	window->properties_pending = 0;
+
+	wl_list_remove(&window->pending_link);
+	wl_list_init(&window->pending_link);
+}
+
 static void
 weston_wm_window_destroy(struct weston_wm_window *window)
 {
 	struct weston_wm *wm = window->wm;
 
 	weston_output_weak_ref_clear(&window->legacy_fullscreen_output);
+	weston_wm_window_cancel_replies(window);
 
 	if (window->repaint_source)
 		wl_event_source_remove(window->repaint_source);
@@ -2061,6 +2177,93 @@ weston_wm_handle_focus_in(struct weston_wm *wm, xcb_generic_event_t *event)
 		weston_wm_send_focus_window(wm, wm->focus_window);
 }
 
+/*
+ * Collect the replies for a window that have arrived, in the order the
+ * requests were sent. Returns true once none are outstanding.
+ */
+static bool
+weston_wm_window_poll_replies(struct weston_wm_window *window)
+{
+	xcb_connection_t *conn = window->wm->conn;
+	xcb_get_geometry_reply_t *geometry_reply;
+	xcb_generic_error_t *error;
+	void *reply;
+	int i;
+
+	if (window->geometry_pending) {
+		if (!xcb_poll_for_reply(conn, window->geometry_cookie.sequence,
+					&reply, &error))
+			return false;
+		window->geometry_pending = false;
+		free(error);
+
+		/* technically we should use XRender and check the visual
+		 * format's alpha_mask, but checking depth is simpler and
+		 * works in all known cases */
+		geometry_reply = reply;
+		if (geometry_reply != NULL)
+			window->has_alpha = geometry_reply->depth == 32;
+		free(geometry_reply);
+	}
+
+	while (window->properties_pending > 0) {
+		i = WM_WINDOW_PROPERTY_COUNT - window->properties_pending;
+		if (!xcb_poll_for_reply(conn, window->property_cookie[i].sequence,
+					&reply, &error))
+			return false;
+		/* no reply, for a bad window typically */
+		free(error);
+		window->property_reply[i] = reply;
+		if (--window->properties_pending == 0)
+			weston_wm_window_apply_properties(window);
+	}
+
+	return true;
+}
+
+static void
+weston_wm_window_replies_done(struct weston_wm_window *window)
+{
+	/* Properties changed while the replies were on their way are
+	 * fetched again before mapping, as the blocking reads did. */
+	if ((window->map_request_deferred || window->map_surface_deferred) &&
+	    weston_wm_window_fetch_properties(window))
+		return;
+
+	if (window->map_request_deferred) {
+		window->map_request_deferred = false;
+		weston_wm_window_map(window);
+	}
+
+	if (window->map_surface_deferred) {
+		window->map_surface_deferred = false;
+		if (window->surface)
+			weston_wm_window_create_shell_surface(window);
+	}
+
+	weston_wm_window_schedule_repaint(window);
+}
+
+static bool
+weston_wm_handle_replies(struct weston_wm *wm)
+{
+	struct weston_wm_window *window, *next;
+	bool done = false;
+
+	wl_list_for_each_safe(window, next,
+			      &wm->pending_window_list, pending_link) {
+		if (!weston_wm_window_poll_replies(window))
+			continue;
+
+		wl_list_remove(&window->pending_link);
+		wl_list_init(&window->pending_link);
+		weston_wm_window_replies_done(window);
+		done = true;
+	}
+
+	return done;
+}
+
 static int
 weston_wm_handle_event(int fd, uint32_t mask, void *data)
 {
@@ -2137,7 +2340,8 @@ weston_wm_handle_event(int fd, uint32_t mask, void *data)
 		count++;
 	}
 
-	if (count != 0)
+	/* Replies that came in with the events don't wake us up again. */
+	if (weston_wm_handle_replies(wm) || count != 0)
 		xcb_flush(wm->conn);
 
 	return count;
@@ -2461,6 +2665,7 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 	wl_signal_add(&wxs->compositor->kill_signal,
 		      &wm->kill_listener);
 	wl_list_init(&wm->unpaired_window_list);
+	wl_list_init(&wm->pending_window_list);
 
 	weston_wm_create_cursors(wm);
 	weston_wm_window_set_cursor(wm, wm->screen->root, XWM_CURSOR_LEFT_PTR);
@@ -2682,8 +2887,7 @@ weston_wm_window_type_inactive(struct weston_wm_window *window)
 }
 
 static void
-xserver_map_shell_surface(struct weston_wm_window *window,
-			  struct weston_surface *surface)
+weston_wm_window_create_shell_surface(struct weston_wm_window *window)
 {
 	struct weston_wm *wm = window->wm;
 	struct weston_desktop_xwayland *xwayland =
@@ -2692,31 +2896,6 @@ xserver_map_shell_surface(struct weston_wm_window *window,
 		wm->server->compositor->xwayland_interface;
 	struct weston_wm_window *parent;
 
-	/* This should be necessary only for override-redirected windows,
-	 * because otherwise MapRequest handler would have already updated
-	 * the properties. However, if X11 clients set properties after
-	 * sending MapWindow, here we can still process them. The decorations
-	 * have already been drawn once with the old property values, so if the
-	 * app changes something affecting decor after MapWindow, we glitch.
-	 * We only hit xserver_map_shell_surface() once per MapWindow and
-	 * wl_surface, so better ensure we get the window type right.
-	 */
-	weston_wm_window_read_properties(window);
-
-	/* A weston_wm_window may have many different surfaces assigned
-	 * throughout its life, so we must make sure to remove the listener
-	 * from the old surface signal list. */
-	if (window->surface)
-		wl_list_remove(&window->surface_destroy_listener.link);
-
-	window->surface = surface;
-	window->surface_destroy_listener.notify = surface_destroy;
-	wl_signal_add(&window->surface->destroy_signal,
-		      &window->surface_destroy_listener);
-
-	if (!xwayland_interface)
-		return;
-
 	if (window->surface->committed) {
 		weston_log("warning, unexpected in %s: "
 			   "surface's configure hook is already set.\n",
@@ -2783,6 +2962,46 @@ xserver_map_shell_surface(struct weston_wm_window *window,
 	}
 }
 
+static void
+xserver_map_shell_surface(struct weston_wm_window *window,
+			  struct weston_surface *surface)
+{
+	const struct weston_desktop_xwayland_interface *xwayland_interface =
+		window->wm->server->compositor->xwayland_interface;
+
+	/* A weston_wm_window may have many different surfaces assigned
+	 * throughout its life, so we must make sure to remove the listener
+	 * from the old surface signal list. */
+	if (window->surface)
+		wl_list_remove(&window->surface_destroy_listener.link);
+
+	window->surface = surface;
+	window->surface_destroy_listener.notify = surface_destroy;
+	wl_signal_add(&window->surface->destroy_signal,
+		      &window->surface_destroy_listener);
+
+	if (!xwayland_interface)
+		return;
+
+	/* This should be necessary only for override-redirected windows,
+	 * because otherwise MapRequest handler would have already updated
+	 * the properties. However, if X11 clients set properties after
+	 * sending MapWindow, here we can still process them. The decorations
+	 * have already been drawn once with the old property values, so if the
+	 * app changes something affecting decor after MapWindow, we glitch.
+	 * We only hit xserver_map_shell_surface() once per MapWindow and
+	 * wl_surface, so better ensure we get the window type right: the
+	 * shell surface is created once the properties are in.
+	 */
+	if (weston_wm_window_fetch_properties(window) ||
+	    window->geometry_pending) {
+		window->map_surface_deferred = true;
+		return;
+	}
+
+	weston_wm_window_create_shell_surface(window);
+}
+
 const struct weston_xwayland_surface_api surface_api = {
 	is_wm_window,
 	send_position,
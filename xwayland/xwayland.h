@@ -72,10 +72,13 @@ struct weston_wm {
 	struct wl_listener activate_listener;
 	struct wl_listener kill_listener;
 	struct wl_list unpaired_window_list;
+	struct wl_list pending_window_list;
 
 	xcb_window_t selection_window;
 	xcb_window_t selection_owner;
 	int incr;
+	int incr_chunk_pending;
+	uint32_t incr_chunk_size;
 	int data_source_fd;
 	struct wl_event_source *property_source;
 	xcb_get_property_reply_t *property_reply;